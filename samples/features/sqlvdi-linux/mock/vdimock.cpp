@@ -0,0 +1,1127 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vdimock.cpp
+//
+// A stand-in for libsqlvdi.so that lets the VDI client samples run without
+// SQL Server. It implements the ClientVirtualDeviceSet/ClientVirtualDevice
+// ABI declared in ../vdi.h, and in place of the server it runs one thread
+// per virtual device which issues a synthetic stream of commands:
+//
+//  backup  : VDC_Write commands carrying generated data, with VDC_Flush
+//            commands at the configured interval and at the end.
+//  restore : VDC_Read commands; the data returned by the client is compared
+//            with the stream the backup generated, so a backup followed by
+//            a restore checks the round trip.
+//
+// The stream is configured through environment variables, read by Create():
+//
+//  VDIMOCK_OP          backup or restore                      (backup)
+//  VDIMOCK_SIZE        bytes per VDC_Write/VDC_Read           (1048576)
+//  VDIMOCK_COUNT       full-size transfers per device         (64)
+//  VDIMOCK_TAIL        bytes in a final short transfer        (0)
+//  VDIMOCK_DEPTH       buffers per device, i.e. maxIODepth    (4)
+//  VDIMOCK_FLUSH       issue VDC_Flush every N writes         (0: end only)
+//  VDIMOCK_PACE_US     delay before issuing each transfer     (0)
+//  VDIMOCK_ENTROPY     percent of each page that is random    (25)
+//  VDIMOCK_SEED        seed of the generated data             (1)
+//  VDIMOCK_CHANGE      percent of pages that differ by generation (0)
+//  VDIMOCK_GENERATION  generation used for those pages        (0)
+//  VDIMOCK_EOFPROBE    on restore, issue one extra read that must
+//                      complete with ERROR_HANDLE_EOF         (0)
+//  VDIMOCK_FAST        generate each buffer only once, and do not verify
+//                      restored data, so that the stand-in itself uses
+//                      little CPU when benchmarking the client (0)
+//
+// The device count, alignment and block size requested by the client in
+// Create() are honoured. Results are reported on stderr when the primary
+// closes the set; any problem is reported with the word FAILED. Like the
+// server, the stand-in aborts the set as soon as a command completes with
+// an error, so the client sees VD_E_ABORT from its next GetCommand.
+//
+// The shared state lives in POSIX shared memory named after the set, so
+// secondaries attached with OpenInSecondary() work as they do with the
+// real library. Its mutex is robust: if a process dies while holding it,
+// the set is aborted instead of leaving every other process blocked.
+//
+
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../vdi.h"      // interface declaration
+#include "../vdierror.h" // error constants
+
+using namespace std;
+
+#define MOCK_MAGIC          0x4b434f4d49445600ULL   // "\0VDIMOCK"
+#define MOCK_MAX_DEVICES    64
+#define MOCK_MAX_SLOTS      128
+#define MOCK_PAGE_SIZE      8192
+#define MOCK_HEADER_SIZE    96
+
+enum MockSlotState
+{
+    SLOT_FREE = 0,
+    SLOT_READY,     // issued, waiting for GetCommand
+    SLOT_TAKEN,     // owned by the client
+    SLOT_DONE       // completed by the client, not yet checked
+};
+
+struct MockSlot
+{
+    int32_t     state;
+    int32_t     commandCode;
+    int32_t     size;
+    int32_t     completionCode;
+    uint32_t    bytesTransferred;
+    uint32_t    sequence;
+    int64_t     streamOffset;
+    uint64_t    bufferOffset;   // from the start of the shared mapping
+};
+
+struct MockDevice
+{
+    pthread_cond_t  clientCond;
+    pthread_cond_t  serverCond;
+    int32_t         opened;
+    int32_t         finished;
+    uint32_t        readyHead;
+    uint32_t        readyCount;
+    uint32_t        ready[MOCK_MAX_SLOTS];
+    MockSlot        slots[MOCK_MAX_SLOTS];
+
+    // Results, reported by the primary at Close().
+    //
+    uint64_t        bytes;
+    uint32_t        transfers;
+    uint32_t        flushes;
+    uint32_t        errors;
+    int64_t         firstBadOffset;
+    double          seconds;
+};
+
+struct MockShared
+{
+    uint64_t        magic;
+    size_t          mappingSize;
+    pthread_mutex_t mutex;
+    int32_t         aborted;
+    int32_t         closed;
+    VDConfig        config;
+    MockDevice      devices[MOCK_MAX_DEVICES];
+};
+
+struct MockSettings
+{
+    bool        backup;
+    uint32_t    size;
+    uint32_t    count;
+    uint32_t    tail;
+    uint32_t    depth;
+    uint32_t    flushEvery;
+    uint32_t    paceUs;
+    uint32_t    entropy;
+    uint64_t    seed;
+    uint32_t    change;
+    uint32_t    generation;
+    bool        eofProbe;
+    bool        fast;
+};
+
+class CVDS;
+
+struct MockServerParms
+{
+    CVDS*   set;
+    int     device;
+};
+
+class CVDS
+{
+public:
+    string              shmName;
+    MockShared*         shared;
+    bool                primary;
+    MockSettings        settings;
+    vector<pthread_t>   threads;
+    MockServerParms     parms[MOCK_MAX_DEVICES];
+    ClientVirtualDevice devices[MOCK_MAX_DEVICES];
+};
+
+class CVD
+{
+public:
+    CVDS*           set;
+    int             device;
+    VDC_Command     commands[MOCK_MAX_SLOTS];
+};
+
+//----------------------------------------------------------------------------
+// Generated data
+//
+// The stream is a sequence of 8 KB pages, each with a 96 byte header,
+// a slot array at the end and row data which is partly random and partly
+// repeated text. Every page can be produced independently from its
+// position in the stream, so any range can be generated or verified.
+//
+
+static uint64_t splitmix(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static void generatePage(const MockSettings& s, int device, uint64_t pageId, uint8_t* page)
+{
+    static const char text[] =
+        "Order shipped to customer; invoice pending approval by regional manager. ";
+
+    uint64_t key = s.seed ^ ((uint64_t)device << 48) ^ pageId;
+    if (s.change > 0 && splitmix(key ^ 0x5a5a5a5aULL) % 100 < s.change)
+    {
+        key ^= (uint64_t)s.generation << 32;
+    }
+    uint64_t rng = splitmix(key);
+
+    // Header: type, slot count, page id and an LSN-like value.
+    //
+    uint16_t rows = 16 + (uint16_t)(rng % 32);
+    memset(page, 0, MOCK_HEADER_SIZE);
+    page[0] = 1;
+    page[1] = 1;
+    memcpy(page + 22, &rows, sizeof(rows));
+    memcpy(page + 32, &pageId, sizeof(pageId));
+    uint64_t lsn = key * 2654435761ULL;
+    memcpy(page + 64, &lsn, sizeof(lsn));
+
+    // Rows, then the slot array growing down from the end of the page.
+    //
+    size_t slotArray = MOCK_PAGE_SIZE - rows * sizeof(uint16_t);
+    size_t payload = slotArray - MOCK_HEADER_SIZE;
+    size_t randomBytes = payload * s.entropy / 100;
+    size_t pos = MOCK_HEADER_SIZE;
+
+    for (size_t ix = 0; ix < randomBytes; ix += 8)
+    {
+        rng = splitmix(rng);
+        size_t n = (randomBytes - ix < 8) ? randomBytes - ix : 8;
+        memcpy(page + pos + ix, &rng, n);
+    }
+    pos += randomBytes;
+
+    for (size_t ix = 0; pos < slotArray; ix++, pos++)
+    {
+        page[pos] = (uint8_t)text[ix % (sizeof(text) - 1)];
+    }
+
+    uint16_t rowSize = (uint16_t)(payload / rows);
+    for (uint16_t ix = 0; ix < rows; ix++)
+    {
+        uint16_t offset = (uint16_t)(MOCK_HEADER_SIZE + ix * rowSize);
+        memcpy(page + MOCK_PAGE_SIZE - (ix + 1) * sizeof(uint16_t), &offset, sizeof(offset));
+    }
+}
+
+// Fill 'buffer' with the stream bytes at [offset, offset + length), or
+// compare it with them. Returns the index of the first mismatch, or -1.
+//
+static int64_t streamBytes(const MockSettings& s, int device, int64_t offset,
+                           uint8_t* buffer, size_t length, bool verify)
+{
+    uint8_t page[MOCK_PAGE_SIZE];
+    size_t done = 0;
+
+    while (done < length)
+    {
+        uint64_t pageId = (uint64_t)(offset + done) / MOCK_PAGE_SIZE;
+        size_t inPage = (size_t)((offset + done) % MOCK_PAGE_SIZE);
+        size_t n = MOCK_PAGE_SIZE - inPage;
+        if (n > length - done)
+        {
+            n = length - done;
+        }
+
+        generatePage(s, device, pageId, page);
+        if (verify)
+        {
+            if (memcmp(buffer + done, page + inPage, n) != 0)
+            {
+                for (size_t ix = 0; ix < n; ix++)
+                {
+                    if (buffer[done + ix] != page[inPage + ix])
+                    {
+                        return (int64_t)(done + ix);
+                    }
+                }
+            }
+        }
+        else
+        {
+            memcpy(buffer + done, page + inPage, n);
+        }
+        done += n;
+    }
+
+    return -1;
+}
+
+//----------------------------------------------------------------------------
+// Helpers
+//
+
+static uint32_t envValue(const char* name, uint32_t defaultValue)
+{
+    const char* value = getenv(name);
+    return (value != NULL && *value != '\0') ? (uint32_t)strtoul(value, NULL, 0) : defaultValue;
+}
+
+static void readSettings(MockSettings* s)
+{
+    const char* op = getenv("VDIMOCK_OP");
+
+    s->backup = (op == NULL || toupper(op[0]) != 'R');
+    s->size = envValue("VDIMOCK_SIZE", 1048576);
+    s->count = envValue("VDIMOCK_COUNT", 64);
+    s->tail = envValue("VDIMOCK_TAIL", 0);
+    s->depth = envValue("VDIMOCK_DEPTH", 4);
+    s->flushEvery = envValue("VDIMOCK_FLUSH", 0);
+    s->paceUs = envValue("VDIMOCK_PACE_US", 0);
+    s->entropy = envValue("VDIMOCK_ENTROPY", 25);
+    s->seed = envValue("VDIMOCK_SEED", 1);
+    s->change = envValue("VDIMOCK_CHANGE", 0);
+    s->generation = envValue("VDIMOCK_GENERATION", 0);
+    s->eofProbe = envValue("VDIMOCK_EOFPROBE", 0) != 0;
+    s->fast = envValue("VDIMOCK_FAST", 0) != 0;
+
+    if (s->depth < 1)
+    {
+        s->depth = 1;
+    }
+    if (s->depth > MOCK_MAX_SLOTS - 1)
+    {
+        s->depth = MOCK_MAX_SLOTS - 1;
+    }
+    if (s->entropy > 100)
+    {
+        s->entropy = 100;
+    }
+    if (s->tail >= s->size)
+    {
+        s->tail = 0;
+    }
+}
+
+static size_t roundUp(size_t value, size_t unit)
+{
+    return (value + unit - 1) / unit * unit;
+}
+
+static double now()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Abort the set and wake everyone waiting on it. Called with the mutex
+// held.
+//
+static void abortShared(MockShared* shared)
+{
+    shared->aborted = 1;
+    for (int dev = 0; dev < MOCK_MAX_DEVICES; dev++)
+    {
+        pthread_cond_broadcast(&shared->devices[dev].serverCond);
+        pthread_cond_broadcast(&shared->devices[dev].clientCond);
+    }
+}
+
+// Called with the mutex held after its previous owner died. Whatever that
+// process was doing is lost, so the set cannot go on.
+//
+static void recoverShared(MockShared* shared)
+{
+    pthread_mutex_consistent(&shared->mutex);
+    fprintf(stderr, "vdimock: a process died holding the set lock; aborting\n");
+    abortShared(shared);
+}
+
+static void lockShared(MockShared* shared)
+{
+    if (pthread_mutex_lock(&shared->mutex) == EOWNERDEAD)
+    {
+        recoverShared(shared);
+    }
+}
+
+static void unlockShared(MockShared* shared)
+{
+    pthread_mutex_unlock(&shared->mutex);
+}
+
+// Wait on a condition for at most 'ms' milliseconds; a negative value
+// waits forever. Returns false on timeout.
+//
+static bool timedWait(pthread_cond_t* cond, MockShared* shared, int64_t ms)
+{
+    int rc;
+
+    if (ms < 0)
+    {
+        rc = pthread_cond_wait(cond, &shared->mutex);
+    }
+    else
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        ts.tv_sec += ms / 1000;
+        ts.tv_nsec += (ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000)
+        {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        rc = pthread_cond_timedwait(cond, &shared->mutex, &ts);
+    }
+
+    if (rc == EOWNERDEAD)
+    {
+        recoverShared(shared);
+    }
+    return rc != ETIMEDOUT;
+}
+
+static MockShared* mapShared(const string& shmName, size_t size, bool create)
+{
+    int fd = shm_open(shmName.c_str(), create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR, 0660);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    if (!create)
+    {
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            close(fd);
+            return NULL;
+        }
+        size = (size_t)st.st_size;
+    }
+    else if (ftruncate(fd, (off_t)size) != 0)
+    {
+        close(fd);
+        shm_unlink(shmName.c_str());
+        return NULL;
+    }
+
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return (p == MAP_FAILED) ? NULL : (MockShared*)p;
+}
+
+//----------------------------------------------------------------------------
+// The server side of one virtual device.
+//
+
+// Check a command the client has completed. A failed command aborts the
+// set, as it would abort the backup or restore on the server.
+//
+static void checkSlot(const MockSettings& s, MockShared* shared, int device, MockSlot* slot)
+{
+    MockDevice* dev = &shared->devices[device];
+    bool ok;
+
+    switch (slot->commandCode)
+    {
+    case VDC_Flush:
+        dev->flushes++;
+        ok = (slot->completionCode == ERROR_SUCCESS);
+        break;
+
+    case VDC_Read:
+        if (slot->streamOffset >= (int64_t)((uint64_t)s.size * s.count + s.tail))
+        {
+            // The end of media probe.
+            //
+            ok = (slot->completionCode == ERROR_HANDLE_EOF && slot->bytesTransferred == 0);
+            break;
+        }
+        ok = (slot->completionCode == ERROR_SUCCESS &&
+              slot->bytesTransferred == (uint32_t)slot->size);
+        if (ok && !s.fast)
+        {
+            int64_t bad = streamBytes(s, device, slot->streamOffset,
+                                      (uint8_t*)shared + slot->bufferOffset, slot->size, true);
+            if (bad >= 0)
+            {
+                ok = false;
+                if (dev->firstBadOffset < 0 || slot->streamOffset + bad < dev->firstBadOffset)
+                {
+                    dev->firstBadOffset = slot->streamOffset + bad;
+                }
+            }
+        }
+        dev->bytes += slot->bytesTransferred;
+        dev->transfers++;
+        break;
+
+    default:
+        ok = (slot->completionCode == ERROR_SUCCESS &&
+              slot->bytesTransferred == (uint32_t)slot->size);
+        dev->bytes += slot->bytesTransferred;
+        dev->transfers++;
+    }
+
+    if (!ok)
+    {
+        if (dev->errors == 0)
+        {
+            fprintf(stderr, "vdimock: device %d: command %d at offset %lld completed with %d, %u bytes\n",
+                    device, slot->commandCode, (long long)slot->streamOffset,
+                    slot->completionCode, slot->bytesTransferred);
+        }
+        dev->errors++;
+        if (!shared->aborted)
+        {
+            fprintf(stderr, "vdimock: device %d: aborting the set\n", device);
+            abortShared(shared);
+        }
+    }
+    slot->state = SLOT_FREE;
+}
+
+static void* serverThread(void* p)
+{
+    CVDS* set = ((MockServerParms*)p)->set;
+    int device = ((MockServerParms*)p)->device;
+    MockShared* shared = set->shared;
+    MockDevice* dev = &shared->devices[device];
+    const MockSettings& s = set->settings;
+
+    // The transfers to issue, in order, followed by the flushes.
+    //
+    uint32_t transfers = s.count + ((s.tail > 0) ? 1 : 0) + ((!s.backup && s.eofProbe) ? 1 : 0);
+    uint32_t issued = 0;
+    uint32_t sequence = 0;
+    uint32_t writesSinceFlush = 0;
+    bool finalFlush = s.backup;
+    bool pendingFlush = false;
+    int64_t streamOffset = 0;
+    vector<bool> generated(s.depth, false);
+    double start;
+
+    lockShared(shared);
+    while (!dev->opened && !shared->aborted && !shared->closed)
+    {
+        timedWait(&dev->serverCond, shared, -1);
+    }
+    start = now();
+
+    for (;;)
+    {
+        unsigned outstanding = 0;
+        int freeSlot = -1;
+
+        for (unsigned ix = 0; ix < s.depth + 1; ix++)
+        {
+            MockSlot* slot = &dev->slots[ix];
+            if (slot->state == SLOT_DONE)
+            {
+                checkSlot(s, shared, device, slot);
+            }
+            if (slot->state == SLOT_FREE)
+            {
+                // Slot 'depth' has no buffer; it carries the flushes.
+                //
+                if (ix < s.depth && freeSlot < 0)
+                {
+                    freeSlot = (int)ix;
+                }
+            }
+            else
+            {
+                outstanding++;
+            }
+        }
+
+        if (shared->aborted || shared->closed)
+        {
+            break;
+        }
+
+        if (pendingFlush || (issued == transfers && finalFlush && outstanding == 0))
+        {
+            MockSlot* slot = &dev->slots[s.depth];
+            if (slot->state == SLOT_FREE)
+            {
+                slot->state = SLOT_READY;
+                slot->commandCode = VDC_Flush;
+                slot->size = 0;
+                slot->streamOffset = streamOffset;
+                slot->sequence = sequence++;
+                dev->ready[(dev->readyHead + dev->readyCount++) % MOCK_MAX_SLOTS] = s.depth;
+                pthread_cond_broadcast(&dev->clientCond);
+
+                if (!pendingFlush)
+                {
+                    finalFlush = false;
+                }
+                pendingFlush = false;
+                continue;
+            }
+        }
+        else if (issued < transfers && freeSlot >= 0)
+        {
+            MockSlot* slot = &dev->slots[freeSlot];
+            int32_t size = (int32_t)s.size;
+
+            if (issued == s.count && s.tail > 0)
+            {
+                size = (int32_t)s.tail;
+            }
+
+            slot->state = SLOT_TAKEN;
+            slot->commandCode = (s.backup) ? VDC_Write : VDC_Read;
+            slot->size = size;
+            slot->streamOffset = streamOffset;
+            slot->sequence = sequence++;
+            slot->completionCode = -1;
+            slot->bytesTransferred = 0;
+            streamOffset += size;
+            issued++;
+
+            // Produce the data without holding the lock.
+            //
+            unlockShared(shared);
+            uint8_t* buffer = (uint8_t*)shared + slot->bufferOffset;
+            if (s.paceUs > 0)
+            {
+                usleep(s.paceUs);
+            }
+            if (s.backup)
+            {
+                if (!s.fast || !generated[freeSlot])
+                {
+                    streamBytes(s, device, slot->streamOffset, buffer, size, false);
+                    generated[freeSlot] = true;
+                }
+            }
+            else if (!s.fast)
+            {
+                memset(buffer, 0xcd, s.size);
+            }
+            lockShared(shared);
+
+            slot->state = SLOT_READY;
+            dev->ready[(dev->readyHead + dev->readyCount++) % MOCK_MAX_SLOTS] = freeSlot;
+            pthread_cond_broadcast(&dev->clientCond);
+
+            if (s.backup && s.flushEvery > 0 && ++writesSinceFlush == s.flushEvery)
+            {
+                writesSinceFlush = 0;
+                pendingFlush = true;
+            }
+            continue;
+        }
+        else if (issued == transfers && !finalFlush && outstanding == 0)
+        {
+            break;
+        }
+
+        timedWait(&dev->serverCond, shared, -1);
+    }
+
+    dev->seconds = now() - start;
+    dev->finished = 1;
+    pthread_cond_broadcast(&dev->clientCond);
+    unlockShared(shared);
+
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// ClientVirtualDevice
+//
+
+ClientVirtualDevice::ClientVirtualDevice()
+    : cvd(NULL)
+{
+}
+
+ClientVirtualDevice::~ClientVirtualDevice()
+{
+    delete cvd;
+}
+
+int
+ClientVirtualDevice::GetCommand(
+    time_t        timeOut,
+    VDC_Command** ppCmd)
+{
+    if (cvd == NULL)
+    {
+        return VD_E_NOTOPEN;
+    }
+
+    MockShared* shared = cvd->set->shared;
+    MockDevice* dev = &shared->devices[cvd->device];
+    int status = 0;
+
+    // The timeout is in seconds, as used by vdipipesample.
+    //
+    lockShared(shared);
+    for (;;)
+    {
+        if (shared->aborted)
+        {
+            status = VD_E_ABORT;
+            break;
+        }
+        if (dev->readyCount > 0)
+        {
+            uint32_t index = dev->ready[dev->readyHead];
+            MockSlot* slot = &dev->slots[index];
+            VDC_Command* cmd = &cvd->commands[index];
+
+            dev->readyHead = (dev->readyHead + 1) % MOCK_MAX_SLOTS;
+            dev->readyCount--;
+            slot->state = SLOT_TAKEN;
+
+            cmd->commandCode = slot->commandCode;
+            cmd->size = slot->size;
+            cmd->position = slot->streamOffset;
+            cmd->buffer = (slot->commandCode == VDC_Flush)
+                ? NULL
+                : (uint8_t*)shared + slot->bufferOffset;
+            *ppCmd = cmd;
+            break;
+        }
+        if (dev->finished || shared->closed)
+        {
+            status = VD_E_CLOSE;
+            break;
+        }
+        if (timeOut == 0 ||
+            !timedWait(&dev->clientCond, shared, (int64_t)timeOut * 1000))
+        {
+            status = VD_E_TIMEOUT;
+            break;
+        }
+    }
+    unlockShared(shared);
+
+    return status;
+}
+
+int
+ClientVirtualDevice::CompleteCommand(
+    VDC_Command*  pCmd,
+    int           completionCode,
+    unsigned long bytesTransferred,
+    int64_t       position)
+{
+    (void)position;
+
+    if (cvd == NULL)
+    {
+        return VD_E_NOTOPEN;
+    }
+    if (pCmd < &cvd->commands[0] || pCmd >= &cvd->commands[MOCK_MAX_SLOTS])
+    {
+        return VD_E_INVALID;
+    }
+
+    MockShared* shared = cvd->set->shared;
+    MockDevice* dev = &shared->devices[cvd->device];
+    MockSlot* slot = &dev->slots[pCmd - &cvd->commands[0]];
+    int status = 0;
+
+    lockShared(shared);
+    if (shared->aborted)
+    {
+        status = VD_E_ABORT;
+    }
+    else if (slot->state != SLOT_TAKEN)
+    {
+        status = VD_E_PROTOCOL;
+    }
+    else
+    {
+        slot->state = SLOT_DONE;
+        slot->completionCode = completionCode;
+        slot->bytesTransferred = (uint32_t)bytesTransferred;
+        pthread_cond_signal(&dev->serverCond);
+    }
+    unlockShared(shared);
+
+    return status;
+}
+
+//----------------------------------------------------------------------------
+// ClientVirtualDeviceSet
+//
+
+ClientVirtualDeviceSet::ClientVirtualDeviceSet()
+    : cvds(NULL)
+{
+}
+
+ClientVirtualDeviceSet::~ClientVirtualDeviceSet()
+{
+    if (cvds != NULL)
+    {
+        Close();
+    }
+}
+
+int
+ClientVirtualDeviceSet::Create(
+    char*     name,
+    VDConfig* cfg)
+{
+    if (cvds != NULL)
+    {
+        return VD_E_PROTOCOL;
+    }
+    if (name == NULL || cfg == NULL || cfg->deviceCount < 1 || cfg->deviceCount > MOCK_MAX_DEVICES)
+    {
+        return VD_E_INVALID;
+    }
+
+    CVDS* set = new CVDS();
+    set->shmName = string("/vdimock-") + name;
+    set->primary = true;
+    readSettings(&set->settings);
+
+    const MockSettings& s = set->settings;
+    size_t alignment = (cfg->alignment > 4096) ? cfg->alignment : 4096;
+    size_t bufferSize = roundUp(s.size, alignment);
+    size_t header = roundUp(sizeof(MockShared), alignment);
+    size_t mappingSize = header + bufferSize * s.depth * cfg->deviceCount;
+
+    set->shared = mapShared(set->shmName, mappingSize, true);
+    if (set->shared == NULL)
+    {
+        delete set;
+        return VD_E_MEMORY;
+    }
+
+    MockShared* shared = set->shared;
+    memset(shared, 0, sizeof(*shared));
+    shared->magic = MOCK_MAGIC;
+    shared->mappingSize = mappingSize;
+
+    pthread_mutexattr_t ma;
+    pthread_mutexattr_init(&ma);
+    pthread_mutexattr_setpshared(&ma, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&ma, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->mutex, &ma);
+    pthread_mutexattr_destroy(&ma);
+
+    pthread_condattr_t ca;
+    pthread_condattr_init(&ca);
+    pthread_condattr_setpshared(&ca, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+
+    for (uint32_t dev = 0; dev < cfg->deviceCount; dev++)
+    {
+        MockDevice* d = &shared->devices[dev];
+        pthread_cond_init(&d->clientCond, &ca);
+        pthread_cond_init(&d->serverCond, &ca);
+        d->firstBadOffset = -1;
+        for (uint32_t ix = 0; ix < s.depth; ix++)
+        {
+            d->slots[ix].bufferOffset = header + bufferSize * (dev * s.depth + ix);
+        }
+    }
+    pthread_condattr_destroy(&ca);
+
+    // What the server would report once it has connected.
+    //
+    shared->config = *cfg;
+    shared->config.features = (cfg->features & ~(VDF_WriteMedia | VDF_ReadMedia | VDF_RequestComplete)) |
+                              ((s.backup) ? VDF_WriteMedia : VDF_ReadMedia);
+    shared->config.maxIODepth = s.depth;
+    shared->config.maxTransferSize = s.size;
+    shared->config.bufferAreaSize = (uint32_t)(bufferSize * s.depth * cfg->deviceCount);
+    if (shared->config.alignment == 0)
+    {
+        shared->config.alignment = 4096;
+    }
+
+    cvds = set;
+
+    for (uint32_t dev = 0; dev < cfg->deviceCount; dev++)
+    {
+        pthread_t thread;
+        set->parms[dev].set = set;
+        set->parms[dev].device = (int)dev;
+        if (pthread_create(&thread, NULL, serverThread, &set->parms[dev]) != 0)
+        {
+            Close();
+            return VD_E_MEMORY;
+        }
+        set->threads.push_back(thread);
+    }
+
+    return 0;
+}
+
+int
+ClientVirtualDeviceSet::GetConfiguration(
+    time_t    timeout,
+    VDConfig* cfg)
+{
+    (void)timeout;
+
+    if (cvds == NULL)
+    {
+        return VD_E_NOTOPEN;
+    }
+    if (cvds->shared->aborted)
+    {
+        return VD_E_ABORT;
+    }
+
+    *cfg = cvds->shared->config;
+    return 0;
+}
+
+int
+ClientVirtualDeviceSet::OpenDevice(
+    char*                 name,
+    ClientVirtualDevice** ppVirtualDevice)
+{
+    if (cvds == NULL)
+    {
+        return VD_E_NOTOPEN;
+    }
+
+    // The first device has the same name as the set, the others
+    // append their index, as the samples do.
+    //
+    const char* setName = cvds->shmName.c_str() + strlen("/vdimock-");
+    size_t setLength = strlen(setName);
+    int device = -1;
+
+    if (strncmp(name, setName, setLength) == 0)
+    {
+        if (name[setLength] == '\0')
+        {
+            device = 0;
+        }
+        else
+        {
+            device = atoi(name + setLength);
+        }
+    }
+    if (device < 0 || device >= (int)cvds->shared->config.deviceCount)
+    {
+        return VD_E_INVALID;
+    }
+
+    MockShared* shared = cvds->shared;
+    int status = 0;
+
+    lockShared(shared);
+    if (shared->devices[device].opened)
+    {
+        status = VD_E_OPEN;
+    }
+    else
+    {
+        shared->devices[device].opened = 1;
+        pthread_cond_broadcast(&shared->devices[device].serverCond);
+    }
+    unlockShared(shared);
+
+    if (status != 0)
+    {
+        return status;
+    }
+
+    ClientVirtualDevice* vd = &cvds->devices[device];
+    vd->cvd = new CVD();
+    vd->cvd->set = cvds;
+    vd->cvd->device = device;
+    *ppVirtualDevice = vd;
+
+    return 0;
+}
+
+int
+ClientVirtualDeviceSet::Close()
+{
+    if (cvds == NULL)
+    {
+        return VD_E_NOTOPEN;
+    }
+
+    CVDS* set = cvds;
+    MockShared* shared = set->shared;
+
+    if (set->primary)
+    {
+        lockShared(shared);
+        shared->closed = 1;
+        for (uint32_t dev = 0; dev < shared->config.deviceCount; dev++)
+        {
+            pthread_cond_broadcast(&shared->devices[dev].serverCond);
+            pthread_cond_broadcast(&shared->devices[dev].clientCond);
+        }
+        unlockShared(shared);
+
+        for (size_t ix = 0; ix < set->threads.size(); ix++)
+        {
+            pthread_join(set->threads[ix], NULL);
+        }
+
+        // Report what each device did.
+        //
+        const MockSettings& s = set->settings;
+        uint64_t expected = (uint64_t)s.size * s.count + s.tail;
+        bool failed = false;
+
+        for (uint32_t dev = 0; dev < shared->config.deviceCount; dev++)
+        {
+            MockDevice* d = &shared->devices[dev];
+            bool ok = (d->errors == 0 && d->bytes == expected && !shared->aborted);
+
+            fprintf(stderr, "vdimock: device %u: %s %llu bytes, %u transfers, %u flushes, "
+                    "%.3f s (%.1f MB/s)%s\n",
+                    dev, (s.backup) ? "backup" : "restore",
+                    (unsigned long long)d->bytes, d->transfers, d->flushes, d->seconds,
+                    (d->seconds > 0) ? d->bytes / d->seconds / 1048576 : 0.0,
+                    (ok) ? ((s.backup || s.fast) ? "" : ", data verified") : ", FAILED");
+            if (d->firstBadOffset >= 0)
+            {
+                fprintf(stderr, "vdimock: device %u: data differs at stream offset %lld\n",
+                        dev, (long long)d->firstBadOffset);
+            }
+            failed = failed || !ok;
+        }
+        fprintf(stderr, "vdimock: %s\n", (failed) ? "FAILED" : "ok");
+
+        shm_unlink(set->shmName.c_str());
+    }
+
+    for (int dev = 0; dev < MOCK_MAX_DEVICES; dev++)
+    {
+        delete set->devices[dev].cvd;
+        set->devices[dev].cvd = NULL;
+    }
+
+    munmap(shared, shared->mappingSize);
+    delete set;
+    cvds = NULL;
+
+    return 0;
+}
+
+int
+ClientVirtualDeviceSet::SignalAbort()
+{
+    if (cvds == NULL)
+    {
+        return VD_E_NOTOPEN;
+    }
+
+    MockShared* shared = cvds->shared;
+
+    lockShared(shared);
+    abortShared(shared);
+    unlockShared(shared);
+
+    return 0;
+}
+
+int
+ClientVirtualDeviceSet::OpenInSecondary(
+    char* setName)
+{
+    if (cvds != NULL)
+    {
+        return VD_E_PROTOCOL;
+    }
+
+    CVDS* set = new CVDS();
+    set->shmName = string("/vdimock-") + setName;
+    set->primary = false;
+    readSettings(&set->settings);
+
+    set->shared = mapShared(set->shmName, 0, false);
+    if (set->shared == NULL || set->shared->magic != MOCK_MAGIC)
+    {
+        delete set;
+        return VD_E_NOTOPEN;
+    }
+
+    cvds = set;
+    return 0;
+}
+
+int
+ClientVirtualDeviceSet::GetBufferHandle(
+    uint8_t*      pBuffer,
+    unsigned int* pBufferHandle)
+{
+    if (cvds == NULL)
+    {
+        return VD_E_NOTOPEN;
+    }
+
+    uint8_t* base = (uint8_t*)cvds->shared;
+    if (pBuffer < base || pBuffer >= base + cvds->shared->mappingSize)
+    {
+        return VD_E_INVALID;
+    }
+
+    *pBufferHandle = (unsigned int)(pBuffer - base);
+    return 0;
+}
+
+int
+ClientVirtualDeviceSet::MapBufferHandle(
+    int       dwBuffer,
+    uint8_t** ppBuffer)
+{
+    if (cvds == NULL)
+    {
+        return VD_E_NOTOPEN;
+    }
+    if (dwBuffer < 0 || (size_t)dwBuffer >= cvds->shared->mappingSize)
+    {
+        return VD_E_INVALID;
+    }
+
+    *ppBuffer = (uint8_t*)cvds->shared + dwBuffer;
+    return 0;
+}
+
+void
+ClientVirtualDeviceSet::RegisterDeviceClosed()
+{
+}
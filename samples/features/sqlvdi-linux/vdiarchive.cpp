@@ -0,0 +1,880 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vdiarchive.cpp
+//
+// Restore from a backup file compressed afterwards by gzip, zstd or xz.
+//
+// The format is recognized from the first bytes of the file. A reader
+// thread cuts the compressed stream into units that can be decoded on
+// their own, and hands batches of them to a pool of worker threads:
+//
+//  zstd    every frame whose decompressed size is recorded in its header,
+//          as written by zstd -T, pzstd or zstd --patch-from
+//  gzip    every BGZF block, a gzip member holding its own compressed
+//          size, as written by bgzip
+//
+// Anything else, a plain gzip member, a zstd frame of unknown or very
+// large size, or an xz stream, is decoded by the reader thread itself as
+// it arrives. For xz that uses the multi-threaded decoder of liblzma,
+// which decodes the blocks of files written by xz -T in parallel.
+//
+// The ring of batches keeps the decoded data ahead of the VDC_Read
+// commands, so the archive never has to be decompressed to disk first.
+//
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <lzma.h>
+#include <zlib.h>
+#include <zstd.h>
+
+#include "vdi.h"      // completion codes
+#include "vdile.h"
+#include "vdimedia.h"
+
+using namespace std;
+
+// Compressed data is read from the media ARCHIVE_READ_SIZE bytes at a time.
+// A batch holds up to ARCHIVE_BATCH_SIZE bytes of compressed units, or of
+// data decoded by the reader. zstd frames larger than ARCHIVE_MAX_UNIT are
+// not buffered whole, but decoded by the reader.
+//
+#define ARCHIVE_READ_SIZE       (1024 * 1024)
+#define ARCHIVE_BATCH_SIZE      (4 * 1024 * 1024)
+#define ARCHIVE_MAX_UNIT        (64 * 1024 * 1024)
+
+// Results of unitSize() other than the size of a unit.
+//
+#define UNIT_NEED_MORE          0
+#define UNIT_SERIAL             ((size_t)-1)
+
+// Enough bytes to parse a zstd frame header, or the header of a BGZF block.
+//
+#define ZSTD_HEADER_MAX         18
+#define BGZF_HEADER_SIZE        18
+
+// The frames vdipipesample --compress wraps in skippable frames for
+// --codec=lz4|auto and --page-transform, which only --compress knows how
+// to decode.
+//
+#define STORED_FRAME_MAGIC      0x184D2A51
+#define LZ4_FRAME_MAGIC         0x184D2A52
+#define TRANSFORM_FRAME_MAGIC   0x184D2A53
+
+enum ArchiveFormat
+{
+    ARCHIVE_NONE = 0,
+    ARCHIVE_GZIP,
+    ARCHIVE_ZSTD,
+    ARCHIVE_XZ
+};
+
+static const char* formatNames[] = { "none", "gzip", "zstd", "xz" };
+
+enum BatchState
+{
+    BATCH_FREE = 0,
+    BATCH_FILLING,      // being decoded by the reader
+    BATCH_READY,        // waiting for a worker
+    BATCH_BUSY,         // being decoded by a worker
+    BATCH_DONE          // decoded data in 'output'
+};
+
+// One batch in flight: either compressed units in 'input' for a worker,
+// or data the reader decoded itself.
+//
+struct ArchiveBatch
+{
+    BatchState      state;
+    bool            serial;         // decoded by the reader
+    vector<uint8_t> input;
+    size_t          inputLength;
+    vector<uint8_t> output;
+    size_t          outputLength;
+    size_t          outputOffset;   // bytes already returned by Read()
+};
+
+// The size of the unit at the start of 'data', which holds 'length' bytes
+// of the compressed stream, or all the rest of it if 'eof'.
+// Returns UNIT_NEED_MORE if more data is needed to tell, or UNIT_SERIAL if
+// the unit must be decoded as a stream.
+//
+static size_t unitSize(ArchiveFormat format, const uint8_t* data, size_t length, bool eof)
+{
+    switch (format)
+    {
+    case ARCHIVE_ZSTD:
+    {
+        if (length < ZSTD_HEADER_MAX && !eof)
+        {
+            return UNIT_NEED_MORE;
+        }
+
+        // Skippable frames carry no data, but are still units to step over.
+        //
+        bool skippable = length >= 4 && (getLE32(data) & 0xFFFFFFF0) == ZSTD_MAGIC_SKIPPABLE_START;
+        unsigned long long contentSize = ZSTD_getFrameContentSize(data, length);
+        if (!skippable &&
+            (contentSize == ZSTD_CONTENTSIZE_UNKNOWN ||
+             contentSize == ZSTD_CONTENTSIZE_ERROR ||
+             contentSize > ARCHIVE_MAX_UNIT))
+        {
+            return UNIT_SERIAL;
+        }
+
+        size_t size = ZSTD_findFrameCompressedSize(data, length);
+        if (!ZSTD_isError(size))
+        {
+            return size;
+        }
+        return (eof || length > 2 * ARCHIVE_MAX_UNIT) ? UNIT_SERIAL : UNIT_NEED_MORE;
+    }
+
+    case ARCHIVE_GZIP:
+        if (length < BGZF_HEADER_SIZE)
+        {
+            return (eof) ? UNIT_SERIAL : UNIT_NEED_MORE;
+        }
+
+        // A gzip member with a single 'BC' extra subfield: the total size
+        // of the member minus one.
+        //
+        if (data[0] == 0x1F && data[1] == 0x8B && data[2] == 8 && (data[3] & 4) &&
+            getLE16(data + 10) == 6 && data[12] == 'B' && data[13] == 'C' &&
+            getLE16(data + 14) == 2)
+        {
+            size_t size = getLE16(data + 16) + 1;
+            if (size <= length)
+            {
+                return size;
+            }
+            return (eof) ? UNIT_SERIAL : UNIT_NEED_MORE;
+        }
+        return UNIT_SERIAL;
+
+    default:
+        return UNIT_SERIAL;
+    }
+}
+
+// Decode the complete units of 'batch->input' into 'batch->output'.
+// Returns NULL, or the reason it failed.
+//
+static const char* decodeBatch(ArchiveFormat format, ZSTD_DCtx* dctx, z_stream* inflater,
+                               ArchiveBatch* batch)
+{
+    const uint8_t* input = &batch->input[0];
+    size_t pos = 0;
+
+    batch->outputLength = 0;
+    while (pos < batch->inputLength)
+    {
+        size_t size = unitSize(format, input + pos, batch->inputLength - pos, true);
+        size_t expected;
+
+        if (format == ARCHIVE_ZSTD)
+        {
+            uint32_t magic = getLE32(input + pos);
+            if (magic == STORED_FRAME_MAGIC || magic == LZ4_FRAME_MAGIC ||
+                magic == TRANSFORM_FRAME_MAGIC)
+            {
+                return "written by vdipipesample --compress, restore with --compress";
+            }
+
+            unsigned long long contentSize = ZSTD_getFrameContentSize(input + pos, size);
+            expected = (contentSize == ZSTD_CONTENTSIZE_ERROR) ? 0 : (size_t)contentSize;
+        }
+        else
+        {
+            // ISIZE, the last field of the member.
+            //
+            expected = getLE32(input + pos + size - 4);
+        }
+
+        if (batch->output.size() < batch->outputLength + expected)
+        {
+            batch->output.resize(batch->outputLength + expected);
+        }
+        uint8_t* output = batch->output.data() + batch->outputLength;
+
+        if (format == ARCHIVE_ZSTD)
+        {
+            size_t result = ZSTD_decompressDCtx(dctx, output, expected, input + pos, size);
+            if (ZSTD_isError(result))
+            {
+                return ZSTD_getErrorName(result);
+            }
+            if (result != expected)
+            {
+                return "wrong size";
+            }
+        }
+        else
+        {
+            inflateReset(inflater);
+            inflater->next_in = (Bytef*)(input + pos);
+            inflater->avail_in = (uInt)size;
+            inflater->next_out = output;
+            inflater->avail_out = (uInt)expected;
+
+            // A zero size output buffer still needs a valid pointer.
+            //
+            uint8_t dummy;
+            if (expected == 0)
+            {
+                inflater->next_out = &dummy;
+            }
+            if (inflate(inflater, Z_FINISH) != Z_STREAM_END || inflater->avail_out != 0)
+            {
+                return (inflater->msg != NULL) ? inflater->msg : "corrupt deflate data";
+            }
+        }
+
+        batch->outputLength += expected;
+        pos += size;
+    }
+    return NULL;
+}
+
+//----------------------------------------------------------------------------
+// NAME: ArchiveMedia
+//
+// PURPOSE:
+//
+// Decode an archive read from another media, ahead of Read().
+//
+class ArchiveMedia : public BackupMedia
+{
+public:
+    ArchiveMedia(BackupMedia* source, ArchiveFormat format, int threads)
+        : source(source), format(format), threads(threads), pendingStart(0),
+          pendingEnd(0), eof(false), batches(2 * threads), readIndex(0), jobIndex(0),
+          fillIndex(0), finished(false), closing(false), error(ERROR_SUCCESS),
+          parallelUnits(0), serialUnits(0), bytesIn(0), bytesOut(0)
+    {
+        for (size_t ix = 0; ix < batches.size(); ix++)
+        {
+            batches[ix].state = BATCH_FREE;
+            batches[ix].serial = false;
+        }
+        for (int ix = 0; ix < threads; ix++)
+        {
+            workers.push_back(thread(&ArchiveMedia::WorkerThread, this));
+        }
+        reader = thread(&ArchiveMedia::ReaderThread, this);
+    }
+
+    ~ArchiveMedia()
+    {
+        if (reader.joinable())
+        {
+            Stop();
+        }
+        delete source;
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred);
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred)
+    {
+        return source->Write(buffer, size, bytesTransferred);
+    }
+
+    int
+    Flush()
+    {
+        return source->Flush();
+    }
+
+    int
+    Close();
+
+private:
+    void
+    ReaderThread();
+
+    void
+    WorkerThread();
+
+    bool
+    Fill(
+        size_t minimum);
+
+    ArchiveBatch*
+    NextBatch();
+
+    void
+    Publish(
+        ArchiveBatch* batch,
+        BatchState    state);
+
+    bool
+    DecodeSerial();
+
+    void
+    Fail(
+        int         completionCode,
+        const char* reason);
+
+    void
+    Stop();
+
+    BackupMedia*            source;
+    ArchiveFormat           format;
+    int                     threads;
+
+    // Compressed data read but not yet handed out, used by the reader only.
+    //
+    vector<uint8_t>         pending;
+    size_t                  pendingStart;
+    size_t                  pendingEnd;
+    bool                    eof;
+
+    mutex                   lock;
+    condition_variable      jobReady;   // a batch was read
+    condition_variable      batchDone;  // a batch was decoded
+    condition_variable      batchFree;  // a batch was consumed by Read()
+    vector<ArchiveBatch>    batches;
+    vector<thread>          workers;
+    thread                  reader;
+    uint64_t                readIndex;  // next batch for Read()
+    uint64_t                jobIndex;   // next batch for a worker
+    uint64_t                fillIndex;  // next batch for the reader
+    bool                    finished;   // the reader reached the end
+    bool                    closing;
+    int                     error;
+    uint64_t                parallelUnits;
+    uint64_t                serialUnits;
+    uint64_t                bytesIn;
+    uint64_t                bytesOut;
+};
+
+// Make at least 'minimum' bytes pending, unless the media ends first.
+// Returns false on a read error.
+//
+bool ArchiveMedia::Fill(size_t minimum)
+{
+    if (pendingStart > 0)
+    {
+        memmove(pending.data(), pending.data() + pendingStart, pendingEnd - pendingStart);
+        pendingEnd -= pendingStart;
+        pendingStart = 0;
+    }
+
+    while (pendingEnd < minimum && !eof)
+    {
+        if (pending.size() < pendingEnd + ARCHIVE_READ_SIZE)
+        {
+            pending.resize(pendingEnd + ARCHIVE_READ_SIZE);
+        }
+
+        uint32_t length;
+        int completionCode = source->Read(&pending[pendingEnd], ARCHIVE_READ_SIZE, &length);
+        if (completionCode != ERROR_SUCCESS && completionCode != ERROR_HANDLE_EOF)
+        {
+            Fail(completionCode, "read error");
+            return false;
+        }
+        pendingEnd += length;
+        bytesIn += length;
+        eof = (completionCode == ERROR_HANDLE_EOF);
+    }
+    return true;
+}
+
+// Wait for the next batch of the ring to be free. Returns NULL if closing.
+//
+ArchiveBatch* ArchiveMedia::NextBatch()
+{
+    unique_lock<mutex> guard(lock);
+    ArchiveBatch* batch = &batches[fillIndex % batches.size()];
+
+    while (batch->state != BATCH_FREE && !closing)
+    {
+        batchFree.wait(guard);
+    }
+    if (closing || error != ERROR_SUCCESS)
+    {
+        return NULL;
+    }
+
+    batch->state = BATCH_FILLING;
+    batch->inputLength = 0;
+    batch->outputLength = 0;
+    batch->outputOffset = 0;
+    return batch;
+}
+
+// Hand a batch filled by the reader to the workers, or to Read() if the
+// reader decoded it itself.
+//
+void ArchiveMedia::Publish(ArchiveBatch* batch, BatchState state)
+{
+    lock_guard<mutex> guard(lock);
+
+    batch->serial = (state == BATCH_DONE);
+    batch->state = state;
+    if (batch->serial)
+    {
+        bytesOut += batch->outputLength;
+    }
+
+    // Workers never see decoded batches: jobIndex always designates a
+    // batch ready for them, or the one the reader fills next.
+    //
+    if (batch->serial && jobIndex == fillIndex)
+    {
+        jobIndex++;
+    }
+    fillIndex++;
+
+    if (batch->serial)
+    {
+        batchDone.notify_all();
+    }
+    else
+    {
+        jobReady.notify_one();
+    }
+}
+
+void ArchiveMedia::Fail(int completionCode, const char* reason)
+{
+    lock_guard<mutex> guard(lock);
+
+    if (error == ERROR_SUCCESS)
+    {
+        printf("Restore from %s archive fails: %s\n", formatNames[format], reason);
+        error = completionCode;
+    }
+    batchDone.notify_all();
+}
+
+void ArchiveMedia::ReaderThread()
+{
+    ArchiveBatch* batch = NULL;
+
+    for (;;)
+    {
+        if (pendingEnd - pendingStart < ARCHIVE_READ_SIZE && !Fill(ARCHIVE_READ_SIZE))
+        {
+            break;
+        }
+
+        size_t available = pendingEnd - pendingStart;
+        size_t size = (available == 0)
+            ? 0
+            : unitSize(format, &pending[pendingStart], available, eof);
+
+        // Hand the units collected so far to a worker before the batch
+        // overflows, the stream has to be decoded here, or it ends.
+        //
+        if (batch != NULL &&
+            (available == 0 || size == UNIT_SERIAL ||
+             (size != UNIT_NEED_MORE && batch->inputLength + size > ARCHIVE_BATCH_SIZE)))
+        {
+            Publish(batch, BATCH_READY);
+            batch = NULL;
+        }
+
+        if (available == 0)
+        {
+            break;
+        }
+        if (size == UNIT_NEED_MORE)
+        {
+            if (!Fill(available + ARCHIVE_READ_SIZE))
+            {
+                break;
+            }
+            continue;
+        }
+        if (size == UNIT_SERIAL)
+        {
+            if (!DecodeSerial())
+            {
+                break;
+            }
+            continue;
+        }
+
+        if (batch == NULL && (batch = NextBatch()) == NULL)
+        {
+            break;
+        }
+        if (batch->input.size() < batch->inputLength + size)
+        {
+            batch->input.resize(batch->inputLength + size < ARCHIVE_BATCH_SIZE
+                                ? ARCHIVE_BATCH_SIZE
+                                : batch->inputLength + size);
+        }
+        memcpy(&batch->input[batch->inputLength], &pending[pendingStart], size);
+        batch->inputLength += size;
+        pendingStart += size;
+        parallelUnits++;
+    }
+
+    if (batch != NULL)
+    {
+        // Stopped early: the batch will never be decoded.
+        //
+        lock_guard<mutex> guard(lock);
+        batch->state = BATCH_FREE;
+    }
+
+    lock_guard<mutex> guard(lock);
+    finished = true;
+    batchDone.notify_all();
+}
+
+// Decode one unit, or for xz the rest of the file, as a stream, straight
+// into batches for Read().
+// Returns false if the reader must stop.
+//
+bool ArchiveMedia::DecodeSerial()
+{
+    z_stream inflater;
+    ZSTD_DCtx* dctx = NULL;
+    lzma_stream xz = LZMA_STREAM_INIT;
+    bool ok = true;
+    bool ended = false;
+    const char* failure = NULL;
+
+    memset(&inflater, 0, sizeof(inflater));
+    if (format == ARCHIVE_GZIP)
+    {
+        ok = inflateInit2(&inflater, 16 + MAX_WBITS) == Z_OK;
+    }
+    else if (format == ARCHIVE_ZSTD)
+    {
+        ok = (dctx = ZSTD_createDCtx()) != NULL;
+    }
+    else
+    {
+        lzma_mt mt;
+        memset(&mt, 0, sizeof(mt));
+        mt.flags = LZMA_CONCATENATED;
+        mt.threads = threads;
+        mt.memlimit_threading = lzma_physmem() / 4;
+        mt.memlimit_stop = UINT64_MAX;
+        ok = lzma_stream_decoder_mt(&xz, &mt) == LZMA_OK;
+    }
+    if (!ok)
+    {
+        Fail(ERROR_OPERATION_ABORTED, "out of memory");
+        return false;
+    }
+    serialUnits++;
+
+    ArchiveBatch* batch = NULL;
+    while (!ended && failure == NULL)
+    {
+        if (pendingStart == pendingEnd && !Fill(ARCHIVE_READ_SIZE))
+        {
+            ok = false;
+            break;
+        }
+        if (batch == NULL)
+        {
+            if ((batch = NextBatch()) == NULL)
+            {
+                ok = false;
+                break;
+            }
+            if (batch->output.size() < ARCHIVE_BATCH_SIZE)
+            {
+                batch->output.resize(ARCHIVE_BATCH_SIZE);
+            }
+        }
+
+        const uint8_t* in = pending.data() + pendingStart;
+        size_t inLength = pendingEnd - pendingStart;
+        uint8_t* out = &batch->output[batch->outputLength];
+        size_t outLength = ARCHIVE_BATCH_SIZE - batch->outputLength;
+        size_t consumed = 0;
+        size_t produced = 0;
+
+        if (format == ARCHIVE_GZIP)
+        {
+            inflater.next_in = (Bytef*)in;
+            inflater.avail_in = (uInt)inLength;
+            inflater.next_out = out;
+            inflater.avail_out = (uInt)outLength;
+            int result = inflate(&inflater, Z_NO_FLUSH);
+            consumed = inLength - inflater.avail_in;
+            produced = outLength - inflater.avail_out;
+            ended = (result == Z_STREAM_END);
+            if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+            {
+                failure = (inflater.msg != NULL) ? inflater.msg : "corrupt deflate data";
+            }
+        }
+        else if (format == ARCHIVE_ZSTD)
+        {
+            ZSTD_inBuffer inBuffer = { in, inLength, 0 };
+            ZSTD_outBuffer outBuffer = { out, outLength, 0 };
+            size_t result = ZSTD_decompressStream(dctx, &outBuffer, &inBuffer);
+            consumed = inBuffer.pos;
+            produced = outBuffer.pos;
+            ended = (result == 0);
+            if (ZSTD_isError(result))
+            {
+                failure = ZSTD_getErrorName(result);
+            }
+        }
+        else
+        {
+            xz.next_in = in;
+            xz.avail_in = inLength;
+            xz.next_out = out;
+            xz.avail_out = outLength;
+            lzma_ret result = lzma_code(&xz, (eof) ? LZMA_FINISH : LZMA_RUN);
+            consumed = inLength - xz.avail_in;
+            produced = outLength - xz.avail_out;
+            ended = (result == LZMA_STREAM_END);
+            if (result != LZMA_OK && result != LZMA_STREAM_END &&
+                !(result == LZMA_BUF_ERROR && !eof))
+            {
+                failure = (result == LZMA_DATA_ERROR) ? "corrupt xz data"
+                        : (result == LZMA_FORMAT_ERROR) ? "not an xz stream"
+                        : (result == LZMA_MEM_ERROR) ? "out of memory"
+                        : "truncated or invalid xz data";
+            }
+        }
+
+        pendingStart += consumed;
+        batch->outputLength += produced;
+
+        if (!ended && failure == NULL && consumed == 0 && produced == 0 &&
+            eof && pendingStart == pendingEnd)
+        {
+            failure = "truncated";
+        }
+
+        if (batch->outputLength == ARCHIVE_BATCH_SIZE || ended)
+        {
+            Publish(batch, BATCH_DONE);
+            batch = NULL;
+        }
+    }
+
+    if (batch != NULL)
+    {
+        lock_guard<mutex> guard(lock);
+        batch->state = BATCH_FREE;
+    }
+    if (failure != NULL)
+    {
+        Fail(ERROR_OPERATION_ABORTED, failure);
+        ok = false;
+    }
+
+    if (format == ARCHIVE_GZIP)
+    {
+        inflateEnd(&inflater);
+    }
+    ZSTD_freeDCtx(dctx);
+    lzma_end(&xz);
+    return ok;
+}
+
+void ArchiveMedia::WorkerThread()
+{
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    z_stream inflater;
+
+    memset(&inflater, 0, sizeof(inflater));
+    bool ok = dctx != NULL && inflateInit2(&inflater, 16 + MAX_WBITS) == Z_OK;
+
+    unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        while (!closing && jobIndex == fillIndex)
+        {
+            jobReady.wait(guard);
+        }
+        if (closing)
+        {
+            break;
+        }
+
+        uint64_t index = jobIndex++;
+        ArchiveBatch* batch = &batches[index % batches.size()];
+        batch->state = BATCH_BUSY;
+
+        // Step over the batches the reader decoded itself.
+        //
+        while (jobIndex < fillIndex && batches[jobIndex % batches.size()].serial)
+        {
+            jobIndex++;
+        }
+
+        guard.unlock();
+        const char* failure = (!ok)
+            ? "out of memory"
+            : decodeBatch(format, dctx, &inflater, batch);
+        guard.lock();
+
+        if (failure != NULL)
+        {
+            printf("Restore from %s archive fails: %s\n", formatNames[format], failure);
+            if (error == ERROR_SUCCESS)
+            {
+                error = ERROR_OPERATION_ABORTED;
+            }
+        }
+        bytesOut += batch->outputLength;
+        batch->outputOffset = 0;
+        batch->state = BATCH_DONE;
+        batchDone.notify_all();
+    }
+
+    inflateEnd(&inflater);
+    ZSTD_freeDCtx(dctx);
+}
+
+int ArchiveMedia::Read(uint8_t* buffer, uint32_t size, uint32_t* bytesTransferred)
+{
+    uint32_t done = 0;
+
+    *bytesTransferred = 0;
+
+    unique_lock<mutex> guard(lock);
+    while (done < size)
+    {
+        ArchiveBatch* batch = &batches[readIndex % batches.size()];
+
+        while (error == ERROR_SUCCESS && batch->state != BATCH_DONE &&
+               !(finished && readIndex == fillIndex))
+        {
+            batchDone.wait(guard);
+        }
+        if (error != ERROR_SUCCESS)
+        {
+            return error;
+        }
+        if (batch->state != BATCH_DONE)
+        {
+            break;
+        }
+
+        uint32_t n = (uint32_t)(batch->outputLength - batch->outputOffset);
+        if (n > size - done)
+        {
+            n = size - done;
+        }
+
+        guard.unlock();
+        memcpy(buffer + done, &batch->output[batch->outputOffset], n);
+        guard.lock();
+
+        batch->outputOffset += n;
+        done += n;
+        if (batch->outputOffset == batch->outputLength)
+        {
+            batch->state = BATCH_FREE;
+            batch->serial = false;
+            readIndex++;
+            batchFree.notify_one();
+        }
+    }
+
+    *bytesTransferred = done;
+    return (done == size) ? ERROR_SUCCESS : ERROR_HANDLE_EOF;
+}
+
+void ArchiveMedia::Stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        closing = true;
+    }
+    jobReady.notify_all();
+    batchFree.notify_all();
+    for (size_t ix = 0; ix < workers.size(); ix++)
+    {
+        workers[ix].join();
+    }
+    reader.join();
+}
+
+int ArchiveMedia::Close()
+{
+    Stop();
+
+    printf("Archive: %s, %llu unit(s) decoded in parallel, %llu as a stream, "
+           "%.1f MB in, %.1f MB out\n",
+           formatNames[format], (unsigned long long)parallelUnits,
+           (unsigned long long)serialUnits, bytesIn / 1048576.0, bytesOut / 1048576.0);
+
+    return source->Close();
+}
+
+// Recognize the format of 'fname' from its first bytes.
+//
+static ArchiveFormat archiveFormat(const char* fname)
+{
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+    {
+        return ARCHIVE_NONE;
+    }
+
+    uint8_t magic[6];
+    ssize_t length = pread(fd, magic, sizeof(magic), 0);
+    close(fd);
+
+    if (length >= 2 && magic[0] == 0x1F && magic[1] == 0x8B)
+    {
+        return ARCHIVE_GZIP;
+    }
+    if (length >= 4 && (getLE32(magic) == ZSTD_MAGICNUMBER ||
+                        (getLE32(magic) & 0xFFFFFFF0) == ZSTD_MAGIC_SKIPPABLE_START))
+    {
+        return ARCHIVE_ZSTD;
+    }
+    if (length >= 6 && memcmp(magic, "\xFD" "7zXZ\0", 6) == 0)
+    {
+        return ARCHIVE_XZ;
+    }
+    return ARCHIVE_NONE;
+}
+
+BackupMedia* openArchiveMedia(
+    BackupMedia* media,
+    const char*  fname,
+    int          threads)
+{
+    ArchiveFormat format = archiveFormat(fname);
+
+    if (format == ARCHIVE_NONE)
+    {
+        return media;
+    }
+
+    printf("Restoring from %s archive: %s\n", formatNames[format], fname);
+    return new ArchiveMedia(media, format, threads);
+}
@@ -0,0 +1,446 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vdibench.cpp
+//
+// Throughput benchmark for the vdipipesample transfer loop.
+//
+// Runs vdipipesample against the stand-in libsqlvdi in the mock directory,
+// backing up and then restoring synthetic data, for every combination of
+// transfer size, stream count and I/O backend requested. One CSV line is
+// printed per run:
+//
+//  op,io,size_kb,streams,run,bytes,seconds,gb_per_s,cpu_s_per_gb,
+//  io_p50_us,io_p99_us,io_p999_us,io_max_us,status
+//
+// 'seconds' is the wall clock time of the whole vdipipesample process and
+// 'cpu_s_per_gb' its user plus system time per GB transferred. The I/O
+// latency percentiles are the largest reported by any of the streams.
+// The stand-in runs with VDIMOCK_FAST so that it adds little CPU of its
+// own, which also means restored data is not verified.
+//
+// Restores read files that were just written, so unless --io=direct is
+// used they mostly measure the page cache.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <getopt.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+// The benchmark settings chosen on the command line.
+//
+struct BenchOptions
+{
+    string          client;
+    string          mockDir;
+    string          fileDir;
+    int             mbPerStream;
+    int             runs;
+    bool            restore;
+    vector<int>     sizesKB;
+    vector<int>     streams;
+    vector<string>  backends;
+};
+
+// The outcome of one vdipipesample run.
+//
+struct BenchResult
+{
+    double      seconds;
+    double      cpuSeconds;
+    double      p50;
+    double      p99;
+    double      p999;
+    double      max;
+    bool        ok;
+};
+
+static vector<string> splitList(const char* list)
+{
+    vector<string> items;
+    string item;
+
+    for (const char* p = list; ; p++)
+    {
+        if (*p == ',' || *p == '\0')
+        {
+            if (!item.empty())
+            {
+                items.push_back(item);
+            }
+            item.clear();
+            if (*p == '\0')
+            {
+                break;
+            }
+        }
+        else
+        {
+            item += *p;
+        }
+    }
+    return items;
+}
+
+static bool parseNumbers(const char* list, vector<int>* numbers)
+{
+    vector<string> items = splitList(list);
+
+    numbers->clear();
+    for (size_t ix = 0; ix < items.size(); ix++)
+    {
+        int value = atoi(items[ix].c_str());
+        if (value <= 0)
+        {
+            return false;
+        }
+        numbers->push_back(value);
+    }
+    return !numbers->empty();
+}
+
+static double wallClock()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Pick the I/O percentiles out of the 'latency,' lines printed by the
+// streams, keeping the largest value of each.
+//
+static void parseOutput(const string& output, const char* command, BenchResult* result)
+{
+    size_t pos = 0;
+
+    while (pos < output.size())
+    {
+        size_t end = output.find('\n', pos);
+        if (end == string::npos)
+        {
+            end = output.size();
+        }
+        string line = output.substr(pos, end - pos);
+        pos = end + 1;
+
+        int device;
+        char phase[16];
+        char cmd[16];
+        unsigned long long count;
+        double p50, p99, p999, max;
+
+        if (sscanf(line.c_str(), "latency,%d,%15[^,],%15[^,],%llu,%lf,%lf,%lf,%lf",
+                   &device, phase, cmd, &count, &p50, &p99, &p999, &max) == 8)
+        {
+            if (strcmp(phase, "io") == 0 && strcmp(cmd, command) == 0)
+            {
+                result->p50 = (p50 > result->p50) ? p50 : result->p50;
+                result->p99 = (p99 > result->p99) ? p99 : result->p99;
+                result->p999 = (p999 > result->p999) ? p999 : result->p999;
+                result->max = (max > result->max) ? max : result->max;
+            }
+        }
+        else if (line == "vdimock: FAILED")
+        {
+            result->ok = false;
+        }
+    }
+}
+
+// Run vdipipesample once, with the stand-in configured through the
+// environment, and collect its output and resource usage.
+//
+static bool runClient(
+    const BenchOptions& options,
+    bool                backup,
+    const string&       backend,
+    int                 sizeKB,
+    int                 streams,
+    BenchResult*        result)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+    {
+        perror("pipe");
+        return false;
+    }
+
+    string file = options.fileDir + "/vdibench.bak";
+    string io = "--io=" + backend;
+    string streamOption = "--streams=" + to_string(streams);
+    uint64_t count = ((uint64_t)options.mbPerStream << 20) / ((uint64_t)sizeKB << 10);
+
+    double start = wallClock();
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+    if (pid == 0)
+    {
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+
+        const char* path = getenv("LD_LIBRARY_PATH");
+        string libraryPath = options.mockDir;
+        if (path != NULL && *path != '\0')
+        {
+            libraryPath += string(":") + path;
+        }
+        setenv("LD_LIBRARY_PATH", libraryPath.c_str(), 1);
+        setenv("VDIMOCK_OP", (backup) ? "backup" : "restore", 1);
+        setenv("VDIMOCK_SIZE", to_string((uint64_t)sizeKB << 10).c_str(), 1);
+        setenv("VDIMOCK_COUNT", to_string(count).c_str(), 1);
+        setenv("VDIMOCK_FAST", "1", 1);
+
+        execl(options.client.c_str(), options.client.c_str(), "--no-sql",
+              io.c_str(), streamOption.c_str(), (backup) ? "B" : "R", "D",
+              "vdibench", "sa", "none", file.c_str(), (char*)NULL);
+        printf("Failed to run %s\n", options.client.c_str());
+        _exit(127);
+    }
+    close(fds[1]);
+
+    string output;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fds[0], buffer, sizeof(buffer))) > 0)
+    {
+        output.append(buffer, (size_t)n);
+    }
+    close(fds[0]);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0)
+    {
+        perror("wait4");
+        return false;
+    }
+
+    result->seconds = wallClock() - start;
+    result->cpuSeconds = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    result->p50 = result->p99 = result->p999 = result->max = 0;
+    result->ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    parseOutput(output, (backup) ? "write" : "read", result);
+
+    if (!result->ok)
+    {
+        fprintf(stderr, "%s", output.c_str());
+    }
+    return true;
+}
+
+static void removeFiles(const BenchOptions& options, int streams)
+{
+    string file = options.fileDir + "/vdibench.bak";
+
+    unlink(file.c_str());
+    for (int ix = 1; ix < streams; ix++)
+    {
+        unlink((file + "." + to_string(ix)).c_str());
+    }
+}
+
+static void report(
+    const char*         op,
+    const string&       backend,
+    int                 sizeKB,
+    int                 streams,
+    int                 run,
+    uint64_t            bytes,
+    const BenchResult&  result)
+{
+    double gb = bytes / 1e9;
+
+    printf("%s,%s,%d,%d,%d,%llu,%.3f,%.3f,%.3f,%.1f,%.1f,%.1f,%.1f,%s\n",
+           op, backend.c_str(), sizeKB, streams, run, (unsigned long long)bytes,
+           result.seconds, gb / result.seconds, result.cpuSeconds / gb,
+           result.p50, result.p99, result.p999, result.max,
+           (result.ok) ? "ok" : "failed");
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[])
+{
+    BenchOptions options;
+    bool badParm = false;
+
+    options.client = "./vdipipesample";
+    options.mockDir = "mock";
+    options.fileDir = "/tmp";
+    options.mbPerStream = 256;
+    options.runs = 1;
+    options.restore = true;
+    options.sizesKB = { 64, 256, 1024, 4096 };
+    options.streams = { 1, 2, 4 };
+    options.backends = { "stdio", "fd", "direct" };
+
+    static const struct option longOptions[] =
+    {
+        { "client",      required_argument, NULL, 'c' },
+        { "mock",        required_argument, NULL, 'm' },
+        { "dir",         required_argument, NULL, 'd' },
+        { "mb",          required_argument, NULL, 'b' },
+        { "runs",        required_argument, NULL, 'r' },
+        { "sizes",       required_argument, NULL, 'z' },
+        { "streams",     required_argument, NULL, 's' },
+        { "io",          required_argument, NULL, 'i' },
+        { "backup-only", no_argument,       NULL, 'o' },
+        { NULL,          0,                 NULL, 0   }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            options.client = optarg;
+            break;
+
+        case 'm':
+            options.mockDir = optarg;
+            break;
+
+        case 'd':
+            options.fileDir = optarg;
+            break;
+
+        case 'b':
+            options.mbPerStream = atoi(optarg);
+            badParm = badParm || options.mbPerStream < 1;
+            break;
+
+        case 'r':
+            options.runs = atoi(optarg);
+            badParm = badParm || options.runs < 1;
+            break;
+
+        case 'z':
+            badParm = badParm || !parseNumbers(optarg, &options.sizesKB);
+            break;
+
+        case 's':
+            badParm = badParm || !parseNumbers(optarg, &options.streams);
+            break;
+
+        case 'i':
+            options.backends = splitList(optarg);
+            badParm = badParm || options.backends.empty();
+            break;
+
+        case 'o':
+            options.restore = false;
+            break;
+
+        default:
+            badParm = true;
+        }
+    }
+
+    // Every run moves at least one transfer of each size per stream.
+    //
+    for (size_t iz = 0; iz < options.sizesKB.size() && !badParm; iz++)
+    {
+        if ((uint64_t)options.sizesKB[iz] > (uint64_t)options.mbPerStream * 1024)
+        {
+            printf("--mb=%d is less than a transfer of %d KB\n", options.mbPerStream,
+                   options.sizesKB[iz]);
+            badParm = true;
+        }
+    }
+
+    if (badParm || optind != argc)
+    {
+        printf("usage: vdibench [--client=PATH] [--mock=DIR] [--dir=DIR] [--mb=N] [--runs=N]\n"
+               "                [--sizes=KB,...] [--streams=N,...] [--io=stdio|fd|direct|uring,...]\n"
+               "                [--backup-only]\n"
+               "Measure vdipipesample against the stand-in libsqlvdi\n");
+        return 1;
+    }
+
+    // The stand-in library must be found by its path, not the default.
+    //
+    if (options.mockDir[0] != '/')
+    {
+        char cwd[4096];
+        if (getcwd(cwd, sizeof(cwd)) != NULL)
+        {
+            options.mockDir = string(cwd) + "/" + options.mockDir;
+        }
+    }
+
+    printf("op,io,size_kb,streams,run,bytes,seconds,gb_per_s,cpu_s_per_gb,"
+           "io_p50_us,io_p99_us,io_p999_us,io_max_us,status\n");
+
+    int termCode = 0;
+    for (size_t ib = 0; ib < options.backends.size(); ib++)
+    {
+        for (size_t iz = 0; iz < options.sizesKB.size(); iz++)
+        {
+            for (size_t is = 0; is < options.streams.size(); is++)
+            {
+                const string& backend = options.backends[ib];
+                int sizeKB = options.sizesKB[iz];
+                int streams = options.streams[is];
+                uint64_t count = ((uint64_t)options.mbPerStream << 20) / ((uint64_t)sizeKB << 10);
+                uint64_t bytes = count * ((uint64_t)sizeKB << 10) * streams;
+
+                for (int run = 1; run <= options.runs; run++)
+                {
+                    BenchResult result;
+
+                    if (!runClient(options, true, backend, sizeKB, streams, &result))
+                    {
+                        return 1;
+                    }
+                    report("backup", backend, sizeKB, streams, run, bytes, result);
+
+                    if (result.ok && options.restore)
+                    {
+                        if (!runClient(options, false, backend, sizeKB, streams, &result))
+                        {
+                            return 1;
+                        }
+                        report("restore", backend, sizeKB, streams, run, bytes, result);
+                    }
+                    if (!result.ok)
+                    {
+                        termCode = 1;
+                    }
+                }
+
+                removeFiles(options, streams);
+            }
+        }
+    }
+
+    return termCode;
+}
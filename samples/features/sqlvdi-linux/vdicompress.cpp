@@ -0,0 +1,1295 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vdicompress.cpp
+//
+// Client side compression of the backup stream.
+//
+// The data of the VDC_Write commands is cut into frames of a fixed size,
+// which are compressed independently by a pool of worker threads and
+// written in order as zstd frames. A seek table listing the compressed and
+// uncompressed size of every frame is appended at the end, following the
+// zstd seekable format, so the file is both a plain .zst stream and can
+// be split back into its frames without decompressing it.
+//
+// Backup streams mix compressible pages with data that is already
+// compressed, on which zstd only burns CPU. With the automatic codec, a
+// worker first estimates the entropy of the frame from byte histograms of
+// a sample of it, and stores the frame as it is, compresses it with LZ4,
+// or compresses it with zstd accordingly. LZ4 and stored frames are
+// written inside zstd skippable frames whose magic number names the codec,
+// so the restore can tell how to decode every frame. A file holding such
+// frames can only be restored by this sample.
+//
+// Small backups, such as frequent log backups, compress poorly because a
+// frame starts without any history. A zstd dictionary trained from earlier
+// backups of the same database supplies that history. Trained dictionaries
+// are kept in a directory, one file per dictionary id, and the id is
+// recorded in every frame, so a restore finds the dictionary a backup was
+// made with even after newer ones were trained.
+//
+// The page transform reorders the 8 KB database pages of a frame before it
+// is compressed, see vdipage.cpp. Such frames are kept in a skippable frame
+// of their own, which also makes the file unreadable by zstd -d.
+//
+// On restore the seek table is read first. A reader thread then hands the
+// frames to the worker pool, which decompresses them ahead of the
+// VDC_Read commands.
+//
+
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <lz4.h>
+#include <zdict.h>
+#include <zstd.h>
+
+#include "vdi.h"      // completion codes
+#include "vdile.h"
+#include "vdimedia.h"
+#include "vdipage.h"
+
+using namespace std;
+
+// The zstd seekable format: a skippable frame holding one entry per frame,
+// followed by the number of frames, a descriptor byte and this magic.
+//
+#define SEEK_TABLE_MAGIC        0x184D2A5E
+#define SEEKABLE_MAGIC          0x8F92EAB1
+#define SEEK_TABLE_FOOTER_SIZE  9
+#define SEEK_ENTRY_SIZE         8
+#define SEEK_CHECKSUM_FLAG      0x80
+
+// Skippable frames wrapping frames that are not compressed with zstd: the
+// magic number and the payload size, followed by the payload.
+//
+#define STORED_FRAME_MAGIC      0x184D2A51
+#define LZ4_FRAME_MAGIC         0x184D2A52
+#define WRAPPED_HEADER_SIZE     8
+
+// A frame of page transformed data: the skippable frame header, the length
+// of the transformed data, then a frame of any of the codecs holding it.
+//
+#define TRANSFORM_FRAME_MAGIC   0x184D2A53
+#define TRANSFORM_HEADER_SIZE   (WRAPPED_HEADER_SIZE + 4)
+
+// The entropy estimate looks at this many evenly spaced samples of a
+// frame, one database page each, and averages the entropy of their blocks,
+// half a page each. Frames above STORE_ENTROPY bits per byte are stored,
+// frames above LZ4_ENTROPY use LZ4.
+// The entropy measured on a block of N bytes falls short of the true one by
+// about 255 / (2 N ln 2) bits: random data measures 7.95 bits per byte in
+// 4 KB blocks, where 1 KB blocks only gave 7.82, too close to the entropy
+// of data that still compresses. The spread of the average over the 32
+// blocks of a frame is below 0.001 bits, so STORE_ENTROPY, 0.1 bits short
+// of random data, stores random and already compressed frames every time.
+// Pages that are 90% random measure 7.8 and still shrink by 12% with zstd;
+// at 95% random they measure 7.9 and shrink by 6%. Between LZ4_ENTROPY and
+// STORE_ENTROPY, zstd gains no more than 2% over LZ4.
+//
+#define ENTROPY_SAMPLES         16
+#define ENTROPY_SAMPLE_SIZE     8192
+#define ENTROPY_BLOCK_SIZE      4096
+#define ENTROPY_TABLES          4
+#define STORE_ENTROPY           7.85
+#define LZ4_ENTROPY             7.0
+
+// Dictionaries are named DICT_PREFIX<id>DICT_SUFFIX in their directory,
+// and DICT_CURRENT links to the one used by new backups. Training cuts the
+// sample backups into DICT_SAMPLE_SIZE pieces and reads at most
+// DICT_TRAINING_MAX bytes of them.
+//
+#define DICT_PREFIX             "vdipipe-"
+#define DICT_SUFFIX             ".dict"
+#define DICT_CURRENT            "vdipipe-current.dict"
+#define DICT_CAPACITY           (112 * 1024)
+#define DICT_SAMPLE_SIZE        (64 * 1024)
+#define DICT_TRAINING_MAX       (256 * 1024 * 1024)
+
+enum FrameCodec
+{
+    FRAME_ZSTD = 0,
+    FRAME_LZ4,
+    FRAME_STORED,
+    FRAME_CODECS
+};
+
+enum FrameState
+{
+    FRAME_FREE = 0,
+    FRAME_FILLING,      // backup: receiving data from Write()
+    FRAME_READY,        // waiting for a worker
+    FRAME_BUSY,         // being compressed or decompressed
+    FRAME_DONE          // output ready, in 'output'
+};
+
+// One frame in flight. 'input' holds the data handed to the workers,
+// 'output' what they produced from it.
+//
+struct CompressFrame
+{
+    FrameState      state;
+    vector<uint8_t> input;
+    size_t          inputLength;
+    vector<uint8_t> output;
+    size_t          outputLength;
+    size_t          outputOffset;   // restore: bytes already returned by Read()
+    FrameCodec      codec;          // backup: how 'output' was produced
+};
+
+// Read the whole of 'path' into 'data'.
+//
+static bool loadFile(const string& path, vector<uint8_t>* data)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    bool ok = false;
+    struct stat st;
+    if (fstat(fd, &st) == 0)
+    {
+        data->resize(st.st_size);
+        size_t done = 0;
+        ssize_t n = 1;
+        while (done < data->size() && (n = read(fd, &(*data)[done], data->size() - done)) > 0)
+        {
+            done += n;
+        }
+        ok = (done == data->size());
+    }
+    close(fd);
+    return ok;
+}
+
+static string dictionaryPath(const string& dictDir, unsigned id)
+{
+    return dictDir + "/" DICT_PREFIX + to_string(id) + DICT_SUFFIX;
+}
+
+// c * log2(c) for every count a block can hold, so that the entropy of a
+// block costs no logarithm.
+//
+struct EntropyTable
+{
+    float values[ENTROPY_BLOCK_SIZE + 1];
+
+    EntropyTable()
+    {
+        values[0] = 0;
+        for (int count = 1; count <= ENTROPY_BLOCK_SIZE; count++)
+        {
+            values[count] = (float)(count * log2((double)count));
+        }
+    }
+};
+
+static const EntropyTable entropyTable;
+
+// Estimate the entropy of 'data' in bits per byte, as the average of the
+// order-0 entropy of small blocks of it. A page is often part compressible
+// rows and part random, and a histogram of the whole sample would hide the
+// former behind the latter.
+//
+// The histogram of a block is counted into ENTROPY_TABLES tables in turn,
+// so that consecutive bytes with the same value do not wait for each
+// other's increments, and the tables are summed at the end in a loop the
+// compiler vectorizes. With the counts c of a block of N bytes, the entropy
+// is log2(N) - sum(c * log2(c)) / N, read from entropyTable.
+//
+static double estimateEntropy(const uint8_t* data, size_t length)
+{
+    size_t samples = ENTROPY_SAMPLES;
+    size_t sampleSize = ENTROPY_SAMPLE_SIZE;
+    double entropy = 0;
+    size_t blocks = 0;
+
+    if (length <= samples * sampleSize)
+    {
+        samples = 1;
+        sampleSize = length;
+    }
+
+    for (size_t sample = 0; sample < samples; sample++)
+    {
+        const uint8_t* p = data + sample * (length / samples);
+
+        for (size_t offset = 0; offset < sampleSize; offset += ENTROPY_BLOCK_SIZE)
+        {
+            size_t blockSize = (sampleSize - offset < ENTROPY_BLOCK_SIZE)
+                ? sampleSize - offset
+                : ENTROPY_BLOCK_SIZE;
+            const uint8_t* block = p + offset;
+            uint32_t tables[ENTROPY_TABLES][256];
+            uint32_t counts[256];
+
+            memset(tables, 0, sizeof(tables));
+            size_t ix = 0;
+            for (; ix + ENTROPY_TABLES <= blockSize; ix += ENTROPY_TABLES)
+            {
+                tables[0][block[ix]]++;
+                tables[1][block[ix + 1]]++;
+                tables[2][block[ix + 2]]++;
+                tables[3][block[ix + 3]]++;
+            }
+            for (; ix < blockSize; ix++)
+            {
+                tables[0][block[ix]]++;
+            }
+            for (int value = 0; value < 256; value++)
+            {
+                counts[value] = tables[0][value] + tables[1][value] + tables[2][value] +
+                                tables[3][value];
+            }
+
+            float sum = 0;
+            for (int value = 0; value < 256; value++)
+            {
+                sum += entropyTable.values[counts[value]];
+            }
+            entropy += log2((double)blockSize) - sum / blockSize;
+            blocks++;
+        }
+    }
+    return (blocks > 0) ? entropy / blocks : 0;
+}
+
+// Fill in the header of a skippable frame whose 'payload' bytes are
+// already in place after it. Returns the size of the frame.
+//
+static size_t wrapFrame(uint8_t* output, uint32_t magic, size_t payload)
+{
+    putLE32(output, magic);
+    putLE32(output + 4, (uint32_t)payload);
+    return WRAPPED_HEADER_SIZE + payload;
+}
+
+// Compress 'length' bytes of 'input' into a frame in 'output', of
+// 'capacity' bytes, with 'codec', falling back to storing them when that
+// does not make them smaller. '*used' is set to the codec of the frame.
+// Returns the size of the frame, or 0, after printing the reason, on
+// failure.
+//
+static size_t compressFrame(ZSTD_CCtx* cctx, const ZSTD_CDict* cdict, const uint8_t* input,
+                            size_t length, uint8_t* output, size_t capacity,
+                            CompressCodec codec, int level, FrameCodec* used)
+{
+    *used = (codec == CompressLz4) ? FRAME_LZ4 : FRAME_ZSTD;
+    if (codec == CompressAuto)
+    {
+        double entropy = estimateEntropy(input, length);
+        *used = (entropy > STORE_ENTROPY) ? FRAME_STORED
+              : (entropy > LZ4_ENTROPY) ? FRAME_LZ4
+              : FRAME_ZSTD;
+    }
+
+    if (*used == FRAME_ZSTD)
+    {
+        size_t result = (cdict != NULL)
+            ? ZSTD_compress_usingCDict(cctx, output, capacity, input, length, cdict)
+            : ZSTD_compressCCtx(cctx, output, capacity, input, length, level);
+        if (ZSTD_isError(result))
+        {
+            printf("Compression fails: %s\n", ZSTD_getErrorName(result));
+            return 0;
+        }
+        if (result < length)
+        {
+            return result;
+        }
+    }
+    else if (*used == FRAME_LZ4)
+    {
+        int result = LZ4_compress_default((const char*)input,
+                                          (char*)output + WRAPPED_HEADER_SIZE,
+                                          (int)length, (int)(capacity - WRAPPED_HEADER_SIZE));
+        if (result > 0 && (size_t)result < length)
+        {
+            return wrapFrame(output, LZ4_FRAME_MAGIC, result);
+        }
+    }
+
+    *used = FRAME_STORED;
+    memcpy(output + WRAPPED_HEADER_SIZE, input, length);
+    return wrapFrame(output, STORED_FRAME_MAGIC, length);
+}
+
+// The id of the dictionary the zstd frame in 'input' was compressed with,
+// looking inside a page transform frame, or 0.
+//
+static unsigned frameDictID(const uint8_t* input, size_t length)
+{
+    if (length > TRANSFORM_HEADER_SIZE && getLE32(input) == TRANSFORM_FRAME_MAGIC)
+    {
+        input += TRANSFORM_HEADER_SIZE;
+        length -= TRANSFORM_HEADER_SIZE;
+    }
+    return ZSTD_getDictID_fromFrame(input, length);
+}
+
+// Decode the frame of 'length' bytes in 'input' into 'expected' bytes of
+// 'output', according to its magic number, using 'ddict' if it is not
+// NULL. A page transform frame is decoded into 'scratch' first.
+// Returns NULL, or the reason it failed.
+//
+static const char* decompressFrame(ZSTD_DCtx* dctx, const ZSTD_DDict* ddict,
+                                   const uint8_t* input, size_t length,
+                                   uint8_t* output, size_t expected, vector<uint8_t>* scratch)
+{
+    if (length < 4)
+    {
+        return "frame too short";
+    }
+
+    uint32_t magic = getLE32(input);
+    if (magic == TRANSFORM_FRAME_MAGIC && scratch != NULL)
+    {
+        if (length < TRANSFORM_HEADER_SIZE ||
+            getLE32(input + 4) != length - WRAPPED_HEADER_SIZE)
+        {
+            return "bad frame header";
+        }
+
+        size_t transformed = getLE32(input + WRAPPED_HEADER_SIZE);
+        if (scratch->size() < transformed)
+        {
+            scratch->resize(transformed);
+        }
+        const char* failure = decompressFrame(dctx, ddict, input + TRANSFORM_HEADER_SIZE,
+                                              length - TRANSFORM_HEADER_SIZE,
+                                              scratch->data(), transformed, NULL);
+        if (failure == NULL && !pageRestore(scratch->data(), transformed, output, expected))
+        {
+            failure = "corrupt page transform";
+        }
+        return failure;
+    }
+
+    if (magic == STORED_FRAME_MAGIC || magic == LZ4_FRAME_MAGIC)
+    {
+        if (length < WRAPPED_HEADER_SIZE ||
+            getLE32(input + 4) != length - WRAPPED_HEADER_SIZE)
+        {
+            return "bad frame header";
+        }
+        input += WRAPPED_HEADER_SIZE;
+        length -= WRAPPED_HEADER_SIZE;
+
+        if (magic == STORED_FRAME_MAGIC)
+        {
+            if (length != expected)
+            {
+                return "wrong size";
+            }
+            memcpy(output, input, length);
+        }
+        else if (LZ4_decompress_safe((const char*)input, (char*)output,
+                                     (int)length, (int)expected) != (int)expected)
+        {
+            return "corrupt LZ4 data";
+        }
+        return NULL;
+    }
+
+    size_t result = (ddict != NULL)
+        ? ZSTD_decompress_usingDDict(dctx, output, expected, input, length, ddict)
+        : ZSTD_decompressDCtx(dctx, output, expected, input, length);
+    if (ZSTD_isError(result))
+    {
+        return ZSTD_getErrorName(result);
+    }
+    return (result == expected) ? NULL : "wrong size";
+}
+
+//----------------------------------------------------------------------------
+// NAME: CompressMedia
+//
+// PURPOSE:
+//
+// Compress backup data written to the target media. Frames are filled by
+// Write() in order, compressed by whichever worker is free, and written to
+// the target in order by the writer thread. A failure of a worker or of
+// the target is kept and returned by the next command, as with staging.
+//
+class CompressMedia : public BackupMedia
+{
+public:
+    CompressMedia(BackupMedia* target, uint32_t frameSize, CompressCodec codec, int level,
+                  ZSTD_CDict* cdict, bool pageTransform, int threads)
+        : target(target), frameSize(frameSize), codec(codec), level(level), cdict(cdict),
+          pageTransform(pageTransform), frames(2 * threads), fillIndex(0), jobIndex(0), writeIndex(0), closing(false),
+          error(ERROR_SUCCESS), bytesIn(0), bytesOut(0)
+    {
+        // Room for the worst case of any codec, after the transform.
+        //
+        size_t inputSize = (pageTransform) ? pageTransformBound(frameSize) : frameSize;
+        size_t outputSize = WRAPPED_HEADER_SIZE + inputSize;
+        if (outputSize < ZSTD_compressBound(inputSize))
+        {
+            outputSize = ZSTD_compressBound(inputSize);
+        }
+        if (outputSize < WRAPPED_HEADER_SIZE + (size_t)LZ4_compressBound(inputSize))
+        {
+            outputSize = WRAPPED_HEADER_SIZE + LZ4_compressBound(inputSize);
+        }
+        if (pageTransform)
+        {
+            outputSize += TRANSFORM_HEADER_SIZE;
+        }
+
+        for (size_t ix = 0; ix < frames.size(); ix++)
+        {
+            frames[ix].state = FRAME_FREE;
+            frames[ix].input.resize(frameSize);
+            frames[ix].output.resize(outputSize);
+            frames[ix].inputLength = 0;
+        }
+        for (int ix = 0; ix < FRAME_CODECS; ix++)
+        {
+            framesByCodec[ix] = 0;
+        }
+        for (int ix = 0; ix < threads; ix++)
+        {
+            workers.push_back(thread(&CompressMedia::WorkerThread, this));
+        }
+        writer = thread(&CompressMedia::WriterThread, this);
+    }
+
+    ~CompressMedia()
+    {
+        if (writer.joinable())
+        {
+            Stop();
+        }
+        ZSTD_freeCDict(cdict);
+        delete target;
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred)
+    {
+        return target->Read(buffer, size, bytesTransferred);
+    }
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred);
+
+    int
+    Flush();
+
+    int
+    Close();
+
+private:
+    void
+    WorkerThread();
+
+    void
+    WriterThread();
+
+    void
+    Submit();
+
+    void
+    Stop();
+
+    BackupMedia*            target;
+    uint32_t                frameSize;
+    CompressCodec           codec;
+    int                     level;
+    ZSTD_CDict*             cdict;      // trained dictionary, or NULL
+    bool                    pageTransform;
+
+    mutex                   lock;
+    condition_variable      jobReady;   // a frame is ready to compress
+    condition_variable      frameDone;  // a frame was compressed
+    condition_variable      frameFree;  // a frame was written
+    vector<CompressFrame>   frames;
+    vector<thread>          workers;
+    thread                  writer;
+    uint64_t                fillIndex;  // frame receiving data
+    uint64_t                jobIndex;   // next frame for a worker
+    uint64_t                writeIndex; // next frame to write
+    bool                    closing;
+    int                     error;
+
+    vector<uint32_t>        seekTable;  // compressed, uncompressed size pairs
+    uint64_t                bytesIn;
+    uint64_t                bytesOut;
+    uint64_t                framesByCodec[FRAME_CODECS];
+};
+
+// Hand the frame being filled to the workers. Called with the lock held.
+//
+void CompressMedia::Submit()
+{
+    frames[fillIndex % frames.size()].state = FRAME_READY;
+    fillIndex++;
+    jobReady.notify_one();
+}
+
+int CompressMedia::Write(const uint8_t* buffer, uint32_t size, uint32_t* bytesTransferred)
+{
+    uint32_t done = 0;
+
+    *bytesTransferred = 0;
+
+    unique_lock<mutex> guard(lock);
+    while (done < size)
+    {
+        CompressFrame* frame = &frames[fillIndex % frames.size()];
+
+        while (frame->state != FRAME_FREE && frame->state != FRAME_FILLING &&
+               error == ERROR_SUCCESS)
+        {
+            frameFree.wait(guard);
+        }
+        if (error != ERROR_SUCCESS)
+        {
+            return error;
+        }
+        frame->state = FRAME_FILLING;
+
+        // The frame being filled belongs to this thread.
+        //
+        uint32_t n = frameSize - (uint32_t)frame->inputLength;
+        if (n > size - done)
+        {
+            n = size - done;
+        }
+
+        guard.unlock();
+        memcpy(&frame->input[frame->inputLength], buffer + done, n);
+        guard.lock();
+
+        frame->inputLength += n;
+        done += n;
+        if (frame->inputLength == frameSize)
+        {
+            Submit();
+        }
+    }
+
+    *bytesTransferred = size;
+    return ERROR_SUCCESS;
+}
+
+void CompressMedia::WorkerThread()
+{
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    vector<uint8_t> scratch((pageTransform) ? pageTransformBound(frameSize) : 0);
+
+    unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        while (!closing && (jobIndex == fillIndex ||
+               frames[jobIndex % frames.size()].state != FRAME_READY))
+        {
+            jobReady.wait(guard);
+        }
+        if (closing)
+        {
+            break;
+        }
+
+        CompressFrame* frame = &frames[jobIndex % frames.size()];
+        frame->state = FRAME_BUSY;
+        jobIndex++;
+
+        guard.unlock();
+        const uint8_t* input = &frame->input[0];
+        size_t length = frame->inputLength;
+        uint8_t* output = &frame->output[0];
+        size_t capacity = frame->output.size();
+        size_t size = 0;
+
+        if (pageTransform)
+        {
+            length = ::pageTransform(input, length, &scratch[0]);
+            input = &scratch[0];
+            output += TRANSFORM_HEADER_SIZE;
+            capacity -= TRANSFORM_HEADER_SIZE;
+        }
+        if (cctx != NULL)
+        {
+            size = compressFrame(cctx, cdict, input, length, output, capacity, codec, level,
+                                 &frame->codec);
+        }
+        if (size > 0 && pageTransform)
+        {
+            putLE32(&frame->output[WRAPPED_HEADER_SIZE], (uint32_t)length);
+            size = wrapFrame(&frame->output[0], TRANSFORM_FRAME_MAGIC, size + 4);
+        }
+        frame->outputLength = size;
+        guard.lock();
+
+        if (size == 0)
+        {
+            if (cctx == NULL)
+            {
+                printf("Compression fails: out of memory\n");
+            }
+            if (error == ERROR_SUCCESS)
+            {
+                error = ERROR_OPERATION_ABORTED;
+            }
+        }
+        frame->state = FRAME_DONE;
+        frameDone.notify_all();
+    }
+
+    ZSTD_freeCCtx(cctx);
+}
+
+void CompressMedia::WriterThread()
+{
+    unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        CompressFrame* frame = &frames[writeIndex % frames.size()];
+
+        while (frame->state != FRAME_DONE && !closing)
+        {
+            frameDone.wait(guard);
+        }
+        if (frame->state != FRAME_DONE)
+        {
+            break;
+        }
+
+        int completionCode = error;
+        if (completionCode == ERROR_SUCCESS)
+        {
+            guard.unlock();
+            uint32_t written;
+            completionCode = target->Write(&frame->output[0], (uint32_t)frame->outputLength,
+                                           &written);
+            guard.lock();
+        }
+
+        if (completionCode != ERROR_SUCCESS)
+        {
+            if (error == ERROR_SUCCESS)
+            {
+                error = completionCode;
+            }
+        }
+        else
+        {
+            seekTable.push_back((uint32_t)frame->outputLength);
+            seekTable.push_back((uint32_t)frame->inputLength);
+            bytesIn += frame->inputLength;
+            bytesOut += frame->outputLength;
+            framesByCodec[frame->codec]++;
+        }
+
+        frame->inputLength = 0;
+        frame->state = FRAME_FREE;
+        writeIndex++;
+        frameFree.notify_all();
+    }
+}
+
+int CompressMedia::Flush()
+{
+    unique_lock<mutex> guard(lock);
+
+    // Cut the frame short, so that everything received so far is written.
+    //
+    if (frames[fillIndex % frames.size()].state == FRAME_FILLING)
+    {
+        Submit();
+    }
+
+    while (writeIndex != fillIndex && error == ERROR_SUCCESS)
+    {
+        frameFree.wait(guard);
+    }
+    if (error != ERROR_SUCCESS)
+    {
+        return error;
+    }
+
+    guard.unlock();
+    return target->Flush();
+}
+
+void CompressMedia::Stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        closing = true;
+    }
+    jobReady.notify_all();
+    frameDone.notify_all();
+    for (size_t ix = 0; ix < workers.size(); ix++)
+    {
+        workers[ix].join();
+    }
+    writer.join();
+}
+
+int CompressMedia::Close()
+{
+    int completionCode = Flush();
+
+    Stop();
+
+    // Append the seek table.
+    //
+    if (completionCode == ERROR_SUCCESS)
+    {
+        uint32_t nFrames = (uint32_t)(seekTable.size() / 2);
+        vector<uint8_t> table(8 + nFrames * SEEK_ENTRY_SIZE + SEEK_TABLE_FOOTER_SIZE);
+        uint8_t* p = &table[0];
+
+        putLE32(p, SEEK_TABLE_MAGIC);
+        putLE32(p + 4, (uint32_t)(table.size() - 8));
+        p += 8;
+        for (size_t ix = 0; ix < seekTable.size(); ix++, p += 4)
+        {
+            putLE32(p, seekTable[ix]);
+        }
+        putLE32(p, nFrames);
+        p[4] = 0;
+        putLE32(p + 5, SEEKABLE_MAGIC);
+
+        uint32_t written;
+        completionCode = target->Write(&table[0], (uint32_t)table.size(), &written);
+        if (completionCode == ERROR_SUCCESS)
+        {
+            completionCode = target->Flush();
+        }
+    }
+
+    int closeCode = target->Close();
+    if (completionCode == ERROR_SUCCESS)
+    {
+        completionCode = closeCode;
+    }
+
+    printf("Compression: %zu frames (%llu zstd, %llu lz4, %llu stored), "
+           "%.1f MB in, %.1f MB out, ratio %.2f\n",
+           seekTable.size() / 2, (unsigned long long)framesByCodec[FRAME_ZSTD],
+           (unsigned long long)framesByCodec[FRAME_LZ4],
+           (unsigned long long)framesByCodec[FRAME_STORED],
+           bytesIn / 1048576.0, bytesOut / 1048576.0,
+           (bytesOut > 0) ? (double)bytesIn / bytesOut : 0.0);
+
+    return completionCode;
+}
+
+//----------------------------------------------------------------------------
+// NAME: DecompressMedia
+//
+// PURPOSE:
+//
+// Restore data compressed by CompressMedia. The reader thread reads the
+// frames listed in the seek table from the source media, in order, the
+// workers decompress them, and Read() returns their contents in order.
+//
+class DecompressMedia : public BackupMedia
+{
+public:
+    DecompressMedia(BackupMedia* source, const vector<uint32_t>& seekTable, const char* dictDir,
+                    int threads)
+        : source(source), seekTable(seekTable), dictDir((dictDir != NULL) ? dictDir : ""),
+          frames(2 * threads), readIndex(0),
+          jobIndex(0), fillIndex(0), closing(false), error(ERROR_SUCCESS)
+    {
+        for (size_t ix = 0; ix < frames.size(); ix++)
+        {
+            frames[ix].state = FRAME_FREE;
+        }
+        for (int ix = 0; ix < threads; ix++)
+        {
+            workers.push_back(thread(&DecompressMedia::WorkerThread, this));
+        }
+        reader = thread(&DecompressMedia::ReaderThread, this);
+    }
+
+    ~DecompressMedia()
+    {
+        if (reader.joinable())
+        {
+            Stop();
+        }
+        for (map<unsigned, ZSTD_DDict*>::iterator it = dictionaries.begin();
+             it != dictionaries.end(); ++it)
+        {
+            ZSTD_freeDDict(it->second);
+        }
+        delete source;
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred);
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred)
+    {
+        return source->Write(buffer, size, bytesTransferred);
+    }
+
+    int
+    Flush()
+    {
+        return source->Flush();
+    }
+
+    int
+    Close();
+
+private:
+    void
+    ReaderThread();
+
+    void
+    WorkerThread();
+
+    void
+    Stop();
+
+    const ZSTD_DDict*
+    Dictionary(
+        unsigned     id,
+        const char** failure);
+
+    BackupMedia*            source;
+    vector<uint32_t>        seekTable;  // compressed, uncompressed size pairs
+    string                  dictDir;
+
+    mutex                   dictLock;
+    map<unsigned, ZSTD_DDict*> dictionaries;
+
+    mutex                   lock;
+    condition_variable      jobReady;   // a frame was read
+    condition_variable      frameDone;  // a frame was decompressed
+    condition_variable      frameFree;  // a frame was consumed by Read()
+    vector<CompressFrame>   frames;
+    vector<thread>          workers;
+    thread                  reader;
+    uint64_t                readIndex;  // next frame for Read()
+    uint64_t                jobIndex;   // next frame for a worker
+    uint64_t                fillIndex;  // next frame for the reader
+    bool                    closing;
+    int                     error;
+};
+
+void DecompressMedia::ReaderThread()
+{
+    uint64_t nFrames = seekTable.size() / 2;
+
+    unique_lock<mutex> guard(lock);
+    while (fillIndex < nFrames && !closing && error == ERROR_SUCCESS)
+    {
+        CompressFrame* frame = &frames[fillIndex % frames.size()];
+
+        while (frame->state != FRAME_FREE && !closing)
+        {
+            frameFree.wait(guard);
+        }
+        if (closing)
+        {
+            break;
+        }
+
+        uint32_t compressedSize = seekTable[2 * fillIndex];
+
+        guard.unlock();
+        if (frame->input.size() < compressedSize)
+        {
+            frame->input.resize(compressedSize);
+        }
+        uint32_t length;
+        int completionCode = source->Read(&frame->input[0], compressedSize, &length);
+        guard.lock();
+
+        if (completionCode != ERROR_SUCCESS)
+        {
+            // The file is shorter than its seek table says.
+            //
+            printf("Compressed frame %llu is truncated\n", (unsigned long long)fillIndex);
+            error = ERROR_HANDLE_EOF;
+            frameDone.notify_all();
+            break;
+        }
+
+        frame->inputLength = compressedSize;
+        frame->state = FRAME_READY;
+        fillIndex++;
+        jobReady.notify_one();
+    }
+}
+
+void DecompressMedia::WorkerThread()
+{
+    ZSTD_DCtx* dctx = ZSTD_createDCtx();
+    vector<uint8_t> scratch;
+
+    unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        while (!closing && (jobIndex == fillIndex ||
+               frames[jobIndex % frames.size()].state != FRAME_READY))
+        {
+            jobReady.wait(guard);
+        }
+        if (closing)
+        {
+            break;
+        }
+
+        uint64_t index = jobIndex++;
+        CompressFrame* frame = &frames[index % frames.size()];
+        uint32_t expected = seekTable[2 * index + 1];
+        frame->state = FRAME_BUSY;
+
+        guard.unlock();
+        if (frame->output.size() < expected)
+        {
+            frame->output.resize(expected);
+        }
+        const char* failure = (dctx == NULL) ? "out of memory" : NULL;
+        unsigned dictId = frameDictID(&frame->input[0], frame->inputLength);
+        const ZSTD_DDict* ddict = (dictId != 0) ? Dictionary(dictId, &failure) : NULL;
+        if (failure == NULL)
+        {
+            failure = decompressFrame(dctx, ddict, &frame->input[0], frame->inputLength,
+                                      &frame->output[0], expected, &scratch);
+        }
+        guard.lock();
+
+        if (failure != NULL)
+        {
+            printf("Decompression of frame %llu fails: %s\n", (unsigned long long)index,
+                   failure);
+            if (error == ERROR_SUCCESS)
+            {
+                error = ERROR_OPERATION_ABORTED;
+            }
+        }
+        frame->outputLength = expected;
+        frame->outputOffset = 0;
+        frame->state = FRAME_DONE;
+        frameDone.notify_all();
+    }
+
+    ZSTD_freeDCtx(dctx);
+}
+
+// The dictionary 'id', loaded from the dictionary directory the first
+// time a frame needs it. Returns NULL, and the reason, if it is missing.
+//
+const ZSTD_DDict* DecompressMedia::Dictionary(unsigned id, const char** failure)
+{
+    lock_guard<mutex> guard(dictLock);
+
+    map<unsigned, ZSTD_DDict*>::iterator it = dictionaries.find(id);
+    if (it != dictionaries.end())
+    {
+        return it->second;
+    }
+
+    vector<uint8_t> data;
+    ZSTD_DDict* ddict = NULL;
+    if (!dictDir.empty() && loadFile(dictionaryPath(dictDir, id), &data))
+    {
+        ddict = ZSTD_createDDict(data.data(), data.size());
+    }
+    if (ddict == NULL)
+    {
+        *failure = (dictDir.empty())
+            ? "compressed with a dictionary, restore with --dict"
+            : "its dictionary is not in the --dict directory";
+        return NULL;
+    }
+
+    dictionaries[id] = ddict;
+    return ddict;
+}
+
+int DecompressMedia::Read(uint8_t* buffer, uint32_t size, uint32_t* bytesTransferred)
+{
+    uint64_t nFrames = seekTable.size() / 2;
+    uint32_t done = 0;
+
+    *bytesTransferred = 0;
+
+    unique_lock<mutex> guard(lock);
+    while (done < size && readIndex < nFrames)
+    {
+        CompressFrame* frame = &frames[readIndex % frames.size()];
+
+        while (frame->state != FRAME_DONE && error == ERROR_SUCCESS)
+        {
+            frameDone.wait(guard);
+        }
+        if (error != ERROR_SUCCESS)
+        {
+            return error;
+        }
+
+        uint32_t n = (uint32_t)(frame->outputLength - frame->outputOffset);
+        if (n > size - done)
+        {
+            n = size - done;
+        }
+
+        guard.unlock();
+        memcpy(buffer + done, &frame->output[frame->outputOffset], n);
+        guard.lock();
+
+        frame->outputOffset += n;
+        done += n;
+        if (frame->outputOffset == frame->outputLength)
+        {
+            frame->state = FRAME_FREE;
+            readIndex++;
+            frameFree.notify_one();
+        }
+    }
+
+    *bytesTransferred = done;
+    return (done == size) ? ERROR_SUCCESS : ERROR_HANDLE_EOF;
+}
+
+void DecompressMedia::Stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        closing = true;
+    }
+    jobReady.notify_all();
+    frameFree.notify_all();
+    for (size_t ix = 0; ix < workers.size(); ix++)
+    {
+        workers[ix].join();
+    }
+    reader.join();
+}
+
+int DecompressMedia::Close()
+{
+    Stop();
+    return source->Close();
+}
+
+// Read the last 'size' bytes of the data in 'fname', decrypting them with
+// the key in 'keyFile' if it is not NULL.
+//
+static bool readTail(const char* fname, const char* keyFile, uint8_t* tail, size_t size)
+{
+    if (keyFile != NULL)
+    {
+        return readDecryptedTail(fname, keyFile, tail, size);
+    }
+
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Failed to open: %s\n", fname);
+        return false;
+    }
+
+    off_t fileSize = lseek(fd, 0, SEEK_END);
+    bool ok = fileSize >= (off_t)size &&
+              pread(fd, tail, size, fileSize - size) == (ssize_t)size;
+    close(fd);
+    return ok;
+}
+
+// Read the seek table at the end of 'fname'.
+//
+static bool readSeekTable(const char* fname, const char* keyFile, vector<uint32_t>* seekTable)
+{
+    bool ok = false;
+    uint8_t footer[SEEK_TABLE_FOOTER_SIZE];
+
+    if (readTail(fname, keyFile, footer, sizeof(footer)) &&
+        getLE32(footer + 5) == SEEKABLE_MAGIC)
+    {
+        uint32_t nFrames = getLE32(footer);
+        uint32_t entrySize = SEEK_ENTRY_SIZE + ((footer[4] & SEEK_CHECKSUM_FLAG) ? 4 : 0);
+        size_t tableSize = 8 + (size_t)nFrames * entrySize + SEEK_TABLE_FOOTER_SIZE;
+        vector<uint8_t> table(tableSize);
+
+        if (readTail(fname, keyFile, &table[0], tableSize) &&
+            getLE32(&table[0]) == SEEK_TABLE_MAGIC)
+        {
+            for (uint32_t ix = 0; ix < nFrames; ix++)
+            {
+                const uint8_t* entry = &table[8 + ix * entrySize];
+                seekTable->push_back(getLE32(entry));
+                seekTable->push_back(getLE32(entry + 4));
+            }
+            ok = true;
+        }
+    }
+
+    if (!ok)
+    {
+        printf("%s is not a compressed backup: no seek table\n", fname);
+    }
+    return ok;
+}
+
+BackupMedia* openCompressMedia(
+    BackupMedia*  media,
+    const char*   fname,
+    int           backup,
+    uint32_t      frameSize,
+    CompressCodec codec,
+    int           level,
+    const char*   dictDir,
+    bool          pageTransform,
+    const char*   keyFile,
+    int           threads)
+{
+    if (backup)
+    {
+        ZSTD_CDict* cdict = NULL;
+
+        if (dictDir != NULL)
+        {
+            string path = string(dictDir) + "/" DICT_CURRENT;
+            vector<uint8_t> data;
+
+            if (!loadFile(path, &data) ||
+                (cdict = ZSTD_createCDict(data.data(), data.size(), level)) == NULL)
+            {
+                printf("Failed to load dictionary: %s\n", path.c_str());
+                media->Close();
+                delete media;
+                return NULL;
+            }
+            printf("Compressing with dictionary %u\n",
+                   ZSTD_getDictID_fromDict(data.data(), data.size()));
+        }
+        return new CompressMedia(media, frameSize, codec, level, cdict, pageTransform, threads);
+    }
+
+    vector<uint32_t> seekTable;
+    if (!readSeekTable(fname, keyFile, &seekTable))
+    {
+        media->Close();
+        delete media;
+        return NULL;
+    }
+
+    return new DecompressMedia(media, seekTable, dictDir, threads);
+}
+
+bool trainDictionary(
+    const char* dictDir,
+    int         nFiles,
+    char*       files[])
+{
+    vector<uint8_t> samples;
+    vector<size_t> sampleSizes;
+
+    for (int ix = 0; ix < nFiles && samples.size() < DICT_TRAINING_MAX; ix++)
+    {
+        vector<uint8_t> data;
+        if (!loadFile(files[ix], &data))
+        {
+            printf("Failed to read: %s\n", files[ix]);
+            return false;
+        }
+
+        // A compressed backup teaches the dictionary nothing.
+        //
+        if (data.size() >= 4 && (getLE32(&data[0]) == ZSTD_MAGICNUMBER ||
+            (getLE32(&data[0]) & 0xFFFFFFF0) == ZSTD_MAGIC_SKIPPABLE_START))
+        {
+            printf("%s is compressed, train from backups made without --compress\n", files[ix]);
+            return false;
+        }
+
+        for (size_t offset = 0; offset < data.size() && samples.size() < DICT_TRAINING_MAX;
+             offset += DICT_SAMPLE_SIZE)
+        {
+            size_t size = (data.size() - offset < DICT_SAMPLE_SIZE)
+                ? data.size() - offset
+                : DICT_SAMPLE_SIZE;
+            samples.insert(samples.end(), data.begin() + offset, data.begin() + offset + size);
+            sampleSizes.push_back(size);
+        }
+    }
+
+    vector<uint8_t> dictionary(DICT_CAPACITY);
+    size_t size = (sampleSizes.empty())
+        ? 0
+        : ZDICT_trainFromBuffer(&dictionary[0], dictionary.size(), samples.data(),
+                                sampleSizes.data(), (unsigned)sampleSizes.size());
+    if (sampleSizes.empty() || ZDICT_isError(size))
+    {
+        printf("Dictionary training fails: %s\n",
+               (sampleSizes.empty()) ? "no samples" : ZDICT_getErrorName(size));
+        return false;
+    }
+
+    // Write the dictionary under its id, then point DICT_CURRENT at it.
+    // Both steps go through a rename, so a backup starting meanwhile sees
+    // either the old dictionary or the new one.
+    //
+    unsigned id = ZDICT_getDictID(&dictionary[0], size);
+    string path = dictionaryPath(dictDir, id);
+    string temp = path + ".tmp";
+    string name = DICT_PREFIX + to_string(id) + DICT_SUFFIX;
+    string current = string(dictDir) + "/" DICT_CURRENT;
+    string currentTemp = current + ".tmp";
+
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0 && write(fd, &dictionary[0], size) == (ssize_t)size && fsync(fd) == 0;
+    if (fd >= 0)
+    {
+        ok = (close(fd) == 0) && ok;
+    }
+    ok = ok && rename(temp.c_str(), path.c_str()) == 0;
+
+    unlink(currentTemp.c_str());
+    ok = ok && symlink(name.c_str(), currentTemp.c_str()) == 0 &&
+         rename(currentTemp.c_str(), current.c_str()) == 0;
+    if (!ok)
+    {
+        printf("Failed to write dictionary: %s\n", path.c_str());
+        unlink(temp.c_str());
+        return false;
+    }
+
+    printf("Dictionary %u: %zu bytes from %zu samples (%.1f MB), written to %s\n",
+           id, size, sampleSizes.size(), samples.size() / 1048576.0, path.c_str());
+    return true;
+}
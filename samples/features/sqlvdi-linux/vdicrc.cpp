@@ -0,0 +1,312 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vdicrc.cpp
+//
+// CRC32C (Castagnoli).
+//
+// The SSE4.2 crc32 instruction has a latency of three cycles but can start
+// every cycle, so one dependent chain of them runs at a third of its
+// speed. The data is cut into three parts processed by independent chains,
+// and the three CRCs are then combined by shifting the first two over the
+// length of the parts that follow them, using tables of the effect of
+// appending zeros to a CRC. Without SSE4.2, a slicing-by-8 table is used.
+//
+
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <nmmintrin.h>
+#endif
+
+#include "vdicrc.h"
+#include "vdile.h"
+
+using namespace std;
+
+#define CRC32C_POLY     0x82F63B78
+
+// Part lengths for the three interleaved chains.
+//
+#define CRC_LONG        8192
+#define CRC_SHORT       256
+
+static uint32_t crcTable[8][256];
+static uint32_t crcLong[4][256];
+static uint32_t crcShort[4][256];
+static bool crcHardware;
+static once_flag crcInitOnce;
+
+static uint32_t gf2MatrixTimes(const uint32_t* mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+
+    while (vec)
+    {
+        if (vec & 1)
+        {
+            sum ^= *mat;
+        }
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2MatrixSquare(uint32_t* square, const uint32_t* mat)
+{
+    for (int n = 0; n < 32; n++)
+    {
+        square[n] = gf2MatrixTimes(mat, mat[n]);
+    }
+}
+
+// The operator that appends 'length' zero bytes to a CRC.
+//
+static void zerosOperator(uint32_t* even, size_t length)
+{
+    uint32_t odd[32];
+    uint32_t row = 1;
+
+    odd[0] = CRC32C_POLY;
+    for (int n = 1; n < 32; n++)
+    {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    gf2MatrixSquare(even, odd);     // two zero bits
+    gf2MatrixSquare(odd, even);     // four zero bits
+    do
+    {
+        gf2MatrixSquare(even, odd);
+        length >>= 1;
+        if (length == 0)
+        {
+            return;
+        }
+        gf2MatrixSquare(odd, even);
+        length >>= 1;
+    } while (length);
+
+    memcpy(even, odd, sizeof(odd));
+}
+
+static void zerosTable(uint32_t zeros[][256], size_t length)
+{
+    uint32_t op[32];
+
+    zerosOperator(op, length);
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        zeros[0][n] = gf2MatrixTimes(op, n);
+        zeros[1][n] = gf2MatrixTimes(op, n << 8);
+        zeros[2][n] = gf2MatrixTimes(op, n << 16);
+        zeros[3][n] = gf2MatrixTimes(op, n << 24);
+    }
+}
+
+static uint32_t crcShift(uint32_t zeros[][256], uint32_t crc)
+{
+    return zeros[0][crc & 0xFF] ^ zeros[1][(crc >> 8) & 0xFF] ^
+           zeros[2][(crc >> 16) & 0xFF] ^ zeros[3][crc >> 24];
+}
+
+static void crcInit()
+{
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++)
+        {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crcTable[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++)
+    {
+        uint32_t crc = crcTable[0][n];
+        for (int k = 1; k < 8; k++)
+        {
+            crc = crcTable[0][crc & 0xFF] ^ (crc >> 8);
+            crcTable[k][n] = crc;
+        }
+    }
+
+    zerosTable(crcLong, CRC_LONG);
+    zerosTable(crcShort, CRC_SHORT);
+
+#if defined(__x86_64__)
+    unsigned int eax, ebx, ecx, edx;
+    crcHardware = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2);
+#endif
+}
+
+static uint64_t load64(const uint8_t* p)
+{
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t crcSoftware(uint32_t crc, const uint8_t* next, size_t length)
+{
+    while (length > 0 && ((uintptr_t)next & 7) != 0)
+    {
+        crc = crcTable[0][(crc ^ *next++) & 0xFF] ^ (crc >> 8);
+        length--;
+    }
+    while (length >= 8)
+    {
+        uint64_t word = crc ^ load64(next);
+        crc = crcTable[7][word & 0xFF] ^ crcTable[6][(word >> 8) & 0xFF] ^
+              crcTable[5][(word >> 16) & 0xFF] ^ crcTable[4][(word >> 24) & 0xFF] ^
+              crcTable[3][(word >> 32) & 0xFF] ^ crcTable[2][(word >> 40) & 0xFF] ^
+              crcTable[1][(word >> 48) & 0xFF] ^ crcTable[0][word >> 56];
+        next += 8;
+        length -= 8;
+    }
+    while (length > 0)
+    {
+        crc = crcTable[0][(crc ^ *next++) & 0xFF] ^ (crc >> 8);
+        length--;
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+
+// Process parts of 'part' bytes three at a time while at least three are
+// left, then combine the three CRCs with 'zeros', the table for 'part'.
+//
+__attribute__((target("sse4.2")))
+static uint64_t crcInterleaved(uint64_t crc0, const uint8_t** next, size_t* length,
+                               size_t part, uint32_t zeros[][256])
+{
+    while (*length >= 3 * part)
+    {
+        const uint8_t* p = *next;
+        const uint8_t* end = p + part;
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+
+        do
+        {
+            crc0 = _mm_crc32_u64(crc0, load64(p));
+            crc1 = _mm_crc32_u64(crc1, load64(p + part));
+            crc2 = _mm_crc32_u64(crc2, load64(p + 2 * part));
+            p += 8;
+        } while (p < end);
+
+        crc0 = crcShift(zeros, (uint32_t)crc0) ^ crc1;
+        crc0 = crcShift(zeros, (uint32_t)crc0) ^ crc2;
+        *next += 3 * part;
+        *length -= 3 * part;
+    }
+    return crc0;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crcHardwarePath(uint32_t crc, const uint8_t* next, size_t length)
+{
+    uint64_t crc0 = crc;
+
+    while (length > 0 && ((uintptr_t)next & 7) != 0)
+    {
+        crc0 = _mm_crc32_u8((uint32_t)crc0, *next++);
+        length--;
+    }
+
+    crc0 = crcInterleaved(crc0, &next, &length, CRC_LONG, crcLong);
+    crc0 = crcInterleaved(crc0, &next, &length, CRC_SHORT, crcShort);
+
+    while (length >= 8)
+    {
+        crc0 = _mm_crc32_u64(crc0, load64(next));
+        next += 8;
+        length -= 8;
+    }
+    while (length > 0)
+    {
+        crc0 = _mm_crc32_u8((uint32_t)crc0, *next++);
+        length--;
+    }
+    return (uint32_t)crc0;
+}
+
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length)
+{
+    call_once(crcInitOnce, crcInit);
+
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crcHardware)
+    {
+        return ~crcHardwarePath(crc, (const uint8_t*)data, length);
+    }
+#endif
+    return ~crcSoftware(crc, (const uint8_t*)data, length);
+}
+
+bool loadManifest(const char* fname, vector<uint32_t>* crcs, uint64_t* length)
+{
+    string manifestName = string(fname) + CRC_MANIFEST_SUFFIX;
+    FILE* manifest = fopen(manifestName.c_str(), "rb");
+
+    if (manifest == NULL)
+    {
+        printf("Failed to open the manifest: %s\n", manifestName.c_str());
+        return false;
+    }
+
+    vector<uint8_t> contents;
+    uint8_t chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), manifest)) > 0)
+    {
+        contents.insert(contents.end(), chunk, chunk + n);
+    }
+    fclose(manifest);
+
+    // Check that the manifest is complete and intact before trusting it.
+    //
+    size_t size = contents.size();
+    bool ok = size >= CRC_MANIFEST_HEADER_SIZE + CRC_MANIFEST_TRAILER_SIZE &&
+              memcmp(&contents[0], CRC_MANIFEST_MAGIC, 8) == 0 &&
+              getLE32(&contents[8]) == CRC_MANIFEST_VERSION &&
+              getLE32(&contents[12]) == CRC_BLOCK_SIZE;
+    if (ok)
+    {
+        const uint8_t* trailer = &contents[size - CRC_MANIFEST_TRAILER_SIZE];
+        *length = getLE32(trailer) | ((uint64_t)getLE32(trailer + 4) << 32);
+        ok = crc32c(0, &contents[0], size - CRC_MANIFEST_TRAILER_SIZE) == getLE32(trailer + 8) &&
+             size == CRC_MANIFEST_HEADER_SIZE + CRC_MANIFEST_TRAILER_SIZE +
+                     4 * ((*length + CRC_BLOCK_SIZE - 1) / CRC_BLOCK_SIZE);
+    }
+    if (!ok)
+    {
+        printf("The manifest is incomplete or damaged: %s\n", manifestName.c_str());
+        return false;
+    }
+
+    crcs->clear();
+    for (size_t offset = CRC_MANIFEST_HEADER_SIZE; offset < size - CRC_MANIFEST_TRAILER_SIZE;
+         offset += 4)
+    {
+        crcs->push_back(getLE32(&contents[offset]));
+    }
+    return true;
+}
@@ -0,0 +1,55 @@
+//*********************************************************************
+//                 Copyright (C) Microsoft Corporation.
+//
+// @File: vdicrc.h
+//
+// Purpose:
+//   CRC32C of backup data, and the layout of the block manifest that
+//   records the CRC32C of every block of a backup file.
+//
+// Notes:
+//   The manifest of 'file' is 'file.crc':
+//
+//    header    CRC_MANIFEST_MAGIC, u32 version, u32 block size
+//    entries   u32 CRC32C of each block of the backup data, the last one
+//              possibly short
+//    trailer   u64 length of the backup data, u32 CRC32C of the header
+//              and entries, u32 zero
+//
+//   All integers are little endian. The CRCs are of the data exchanged
+//   with the server, before compression or any other transformation.
+//
+//*********************************************************************
+#ifndef VDICRC_H_
+#define VDICRC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#define CRC_MANIFEST_MAGIC          "VDICRC32"
+#define CRC_MANIFEST_VERSION        1
+#define CRC_MANIFEST_SUFFIX         ".crc"
+#define CRC_MANIFEST_HEADER_SIZE    16
+#define CRC_MANIFEST_TRAILER_SIZE   16
+#define CRC_BLOCK_SIZE              (64 * 1024)
+
+// Extend 'crc', the CRC32C of earlier data or 0, with 'length' bytes of
+// 'data'. Uses the SSE4.2 crc32 instruction when the processor has it.
+//
+uint32_t crc32c(
+    uint32_t    crc,
+    const void* data,
+    size_t      length);
+
+// Read the manifest of the backup file 'fname' into 'crcs', one entry per
+// block, and the length of the backup data into 'length'.
+// Returns false, after printing the reason, if the manifest is missing,
+// incomplete or damaged.
+//
+bool loadManifest(
+    const char*            fname,
+    std::vector<uint32_t>* crcs,
+    uint64_t*              length);
+
+#endif
@@ -0,0 +1,887 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vdidedup.cpp
+//
+// Deduplicating backup store.
+//
+// Successive full backups of a database are mostly the same pages. Instead
+// of writing the backup file, the stream of VDC_Write data is cut into
+// chunks at positions chosen by its content, so that an insertion or a
+// deletion only changes the chunks around it, and every chunk is stored
+// once in a chunk store shared by all backups:
+//
+//  <store>/chunks/ab/abcd...   one file per chunk, named by its SHA-256
+//
+// The backup file itself becomes a recipe: a header, then the hash and
+// length of every chunk of the stream, in order. A backup hashes and
+// stores the chunks on a pool of threads; a restore reads the recipe and
+// prefetches the chunks on a pool of threads, checking their hashes, ahead
+// of the VDC_Read commands.
+//
+// Chunk boundaries come from a gear rolling hash, as in FastCDC: no cut in
+// the first DEDUP_MIN_CHUNK bytes, a strict mask up to the average size,
+// then a looser one, and a forced cut at DEDUP_MAX_CHUNK.
+//
+// Chunks are never removed from the store; that needs a separate pass
+// that knows which recipes are still kept.
+//
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+
+#include "vdi.h"      // completion codes
+#include "vdile.h"
+#include "vdimedia.h"
+
+using namespace std;
+
+#define DEDUP_MIN_CHUNK         (16 * 1024)
+#define DEDUP_AVG_CHUNK         (64 * 1024)
+#define DEDUP_MAX_CHUNK         (256 * 1024)
+
+// Masks of the top bits of the gear hash: two bits more than the average
+// chunk size before it, two bits fewer after it.
+//
+#define DEDUP_AVG_BITS          16
+#define DEDUP_MASK_STRICT       (((1ULL << (DEDUP_AVG_BITS + 2)) - 1) << (64 - DEDUP_AVG_BITS - 2))
+#define DEDUP_MASK_LOOSE        (((1ULL << (DEDUP_AVG_BITS - 2)) - 1) << (64 - DEDUP_AVG_BITS + 2))
+
+#define DEDUP_HASH_SIZE         32
+
+// The recipe: a header of RECIPE_MAGIC and a version, then one entry per
+// chunk, the hash and the length.
+//
+#define RECIPE_MAGIC            "VDIDEDUP"
+#define RECIPE_VERSION          1
+#define RECIPE_HEADER_SIZE      16
+#define RECIPE_ENTRY_SIZE       (DEDUP_HASH_SIZE + 4)
+
+// Recipe entries are written RECIPE_BUFFER_SIZE bytes at a time.
+//
+#define RECIPE_BUFFER_SIZE      (64 * 1024)
+
+static uint64_t gearTable[256];
+static once_flag gearTableOnce;
+
+// The gear table must be the same for every backup, or the chunks would
+// never match: fill it from a fixed seed. Streams open their media at the
+// same time, so it is filled once, by the first of them.
+//
+static void initGearTable()
+{
+    uint64_t state = 0x5D1D5EED;
+
+    for (int ix = 0; ix < 256; ix++)
+    {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gearTable[ix] = z ^ (z >> 31);
+    }
+}
+
+// The length of the chunk at the start of 'data'. The caller makes sure
+// 'length' is at least DEDUP_MAX_CHUNK, unless this is the end of the data.
+//
+static size_t findCut(const uint8_t* data, size_t length)
+{
+    if (length <= DEDUP_MIN_CHUNK)
+    {
+        return length;
+    }
+
+    size_t end = (length < DEDUP_MAX_CHUNK) ? length : DEDUP_MAX_CHUNK;
+    size_t normal = (end < DEDUP_AVG_CHUNK) ? end : DEDUP_AVG_CHUNK;
+    uint64_t hash = 0;
+    size_t ix = DEDUP_MIN_CHUNK;
+
+    for (; ix < normal; ix++)
+    {
+        hash = (hash << 1) + gearTable[data[ix]];
+        if ((hash & DEDUP_MASK_STRICT) == 0)
+        {
+            return ix + 1;
+        }
+    }
+    for (; ix < end; ix++)
+    {
+        hash = (hash << 1) + gearTable[data[ix]];
+        if ((hash & DEDUP_MASK_LOOSE) == 0)
+        {
+            return ix + 1;
+        }
+    }
+    return end;
+}
+
+static void hashChunk(const uint8_t* data, size_t length, uint8_t* hash)
+{
+    EVP_Digest(data, length, hash, NULL, EVP_sha256(), NULL);
+}
+
+static string chunkPath(const string& storeDir, const uint8_t* hash)
+{
+    static const char digits[] = "0123456789abcdef";
+    string name;
+
+    for (int ix = 0; ix < DEDUP_HASH_SIZE; ix++)
+    {
+        name += digits[hash[ix] >> 4];
+        name += digits[hash[ix] & 15];
+    }
+    return storeDir + "/chunks/" + name.substr(0, 2) + "/" + name;
+}
+
+static bool writeAll(int fd, const uint8_t* data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+static bool readAll(int fd, uint8_t* data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = read(fd, data, length);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+// A chunk file is only ever created under a temporary name and renamed into
+// place, so the names of files being written never collide, even between
+// streams of the same process.
+//
+static atomic<uint64_t> tempSequence(0);
+
+// One chunk being hashed and stored for a backup.
+//
+enum StoreState
+{
+    STORE_FREE = 0,
+    STORE_QUEUED,
+    STORE_BUSY,
+    STORE_DONE
+};
+
+struct StoreSlot
+{
+    StoreState      state;
+    vector<uint8_t> data;
+    uint8_t         hash[DEDUP_HASH_SIZE];
+    bool            isNew;      // not found in the store
+};
+
+//----------------------------------------------------------------------------
+// NAME: DedupMedia
+//
+// PURPOSE:
+//
+// Back up into the chunk store, writing the recipe to the backup file.
+// Data is held until DEDUP_MAX_CHUNK bytes are pending, so that a chunk is
+// only cut where its content says. Cutting needs the end of the previous
+// chunk and is done by Write(); the chunks are then hashed and stored by a
+// pool of threads, in a ring of slots, and their recipe entries added in
+// order as they complete. A flush cuts the pending data where it ends,
+// waits for every chunk, and makes the new chunks and the recipe durable.
+//
+class DedupMedia : public BackupMedia
+{
+public:
+    DedupMedia(const string& storeDir, int storeFd, int recipeFd, int threads)
+        : storeDir(storeDir), storeFd(storeFd), recipeFd(recipeFd), pendingStart(0),
+          slots(4 * threads), submitIndex(0), storeIndex(0), retireIndex(0), closing(false),
+          error(ERROR_SUCCESS), chunks(0), newChunks(0), bytesIn(0), bytesStored(0)
+    {
+        recipe.resize(RECIPE_HEADER_SIZE);
+        memcpy(&recipe[0], RECIPE_MAGIC, 8);
+        putLE32(&recipe[8], RECIPE_VERSION);
+        putLE32(&recipe[12], 0);
+
+        for (size_t ix = 0; ix < slots.size(); ix++)
+        {
+            slots[ix].state = STORE_FREE;
+        }
+        for (int ix = 0; ix < threads; ix++)
+        {
+            workers.push_back(thread(&DedupMedia::StoreThread, this));
+        }
+    }
+
+    ~DedupMedia()
+    {
+        if (!workers.empty())
+        {
+            Stop();
+        }
+        if (recipeFd >= 0)
+        {
+            close(recipeFd);
+        }
+        if (storeFd >= 0)
+        {
+            close(storeFd);
+        }
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred)
+    {
+        *bytesTransferred = 0;
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred);
+
+    int
+    Flush();
+
+    int
+    Close();
+
+private:
+    void
+    CutChunks(
+        bool all);
+
+    void
+    Submit(
+        unique_lock<mutex>& guard,
+        const uint8_t*      data,
+        size_t              length);
+
+    void
+    Retire();
+
+    void
+    StoreThread();
+
+    bool
+    StoreChunk(
+        StoreSlot* slot);
+
+    bool
+    WriteRecipe();
+
+    void
+    Stop();
+
+    string                  storeDir;
+    int                     storeFd;
+    int                     recipeFd;
+    vector<uint8_t>         pending;
+    size_t                  pendingStart;
+    vector<uint8_t>         recipe;     // entries not yet written
+
+    mutex                   lock;
+    condition_variable      chunkQueued;    // a chunk was submitted
+    condition_variable      chunkDone;      // a chunk was stored
+    vector<StoreSlot>       slots;
+    vector<thread>          workers;
+    uint64_t                submitIndex;    // next chunk cut
+    uint64_t                storeIndex;     // next chunk to store
+    uint64_t                retireIndex;    // next chunk for the recipe
+    bool                    closing;
+    int                     error;
+
+    uint64_t                chunks;
+    uint64_t                newChunks;
+    uint64_t                bytesIn;
+    uint64_t                bytesStored;
+};
+
+// Hash the chunk in 'slot' and store it, unless the store already has it.
+// A chunk is written under a temporary name and synced before it is
+// renamed into place, so a file of the right name and size always holds
+// the chunk, even after a crash, and is reused without reading it; a
+// restore still checks the hash of every chunk it reads.
+// Returns false if the chunk could not be stored.
+//
+bool DedupMedia::StoreChunk(StoreSlot* slot)
+{
+    size_t length = slot->data.size();
+    hashChunk(slot->data.data(), length, slot->hash);
+
+    string path = chunkPath(storeDir, slot->hash);
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && (size_t)st.st_size == length)
+    {
+        slot->isNew = false;
+        return true;
+    }
+
+    string temp = path + "." + to_string(getpid()) + "." + to_string(tempSequence++);
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0 && writeAll(fd, slot->data.data(), length) && fdatasync(fd) == 0;
+    if (fd >= 0)
+    {
+        ok = (close(fd) == 0) && ok;
+    }
+    ok = ok && rename(temp.c_str(), path.c_str()) == 0;
+    if (!ok)
+    {
+        printf("Failed to store chunk: %s\n", path.c_str());
+        unlink(temp.c_str());
+        return false;
+    }
+    slot->isNew = true;
+    return true;
+}
+
+void DedupMedia::StoreThread()
+{
+    unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        while (!closing && storeIndex == submitIndex)
+        {
+            chunkQueued.wait(guard);
+        }
+        if (closing)
+        {
+            break;
+        }
+
+        StoreSlot* slot = &slots[storeIndex++ % slots.size()];
+        slot->state = STORE_BUSY;
+
+        guard.unlock();
+        bool ok = StoreChunk(slot);
+        guard.lock();
+
+        if (!ok && error == ERROR_SUCCESS)
+        {
+            error = ERROR_DISK_FULL;
+        }
+        slot->state = STORE_DONE;
+        chunkDone.notify_all();
+    }
+}
+
+// Add the chunks stored so far to the recipe, in order, and free their
+// slots. Called with the lock held.
+//
+void DedupMedia::Retire()
+{
+    while (retireIndex < submitIndex)
+    {
+        StoreSlot* slot = &slots[retireIndex % slots.size()];
+        if (slot->state != STORE_DONE)
+        {
+            break;
+        }
+
+        size_t length = slot->data.size();
+        size_t entry = recipe.size();
+        recipe.resize(entry + RECIPE_ENTRY_SIZE);
+        memcpy(&recipe[entry], slot->hash, DEDUP_HASH_SIZE);
+        putLE32(&recipe[entry + DEDUP_HASH_SIZE], (uint32_t)length);
+        chunks++;
+        if (slot->isNew)
+        {
+            newChunks++;
+            bytesStored += length;
+        }
+
+        slot->state = STORE_FREE;
+        retireIndex++;
+    }
+
+    if (recipe.size() >= RECIPE_BUFFER_SIZE && !WriteRecipe() && error == ERROR_SUCCESS)
+    {
+        error = ERROR_DISK_FULL;
+    }
+}
+
+// Queue one chunk for the store threads, once its slot is free.
+//
+void DedupMedia::Submit(unique_lock<mutex>& guard, const uint8_t* data, size_t length)
+{
+    StoreSlot* slot = &slots[submitIndex % slots.size()];
+
+    for (;;)
+    {
+        Retire();
+        if (slot->state == STORE_FREE || error != ERROR_SUCCESS)
+        {
+            break;
+        }
+        chunkDone.wait(guard);
+    }
+    if (error != ERROR_SUCCESS)
+    {
+        return;
+    }
+
+    // The copy is made under the lock, but a chunk is small and the store
+    // threads only need the lock between chunks.
+    //
+    slot->data.assign(data, data + length);
+    slot->state = STORE_QUEUED;
+    submitIndex++;
+    chunkQueued.notify_one();
+}
+
+bool DedupMedia::WriteRecipe()
+{
+    bool ok = writeAll(recipeFd, recipe.data(), recipe.size());
+    recipe.clear();
+    return ok;
+}
+
+// Queue the complete chunks of the pending data, or all of it.
+//
+void DedupMedia::CutChunks(bool all)
+{
+    unique_lock<mutex> guard(lock);
+    while (error == ERROR_SUCCESS)
+    {
+        size_t available = pending.size() - pendingStart;
+        if (available == 0 || (!all && available < DEDUP_MAX_CHUNK))
+        {
+            break;
+        }
+
+        guard.unlock();
+        size_t length = findCut(&pending[pendingStart], available);
+        guard.lock();
+
+        Submit(guard, &pending[pendingStart], length);
+        pendingStart += length;
+    }
+    guard.unlock();
+
+    pending.erase(pending.begin(), pending.begin() + pendingStart);
+    pendingStart = 0;
+}
+
+int DedupMedia::Write(const uint8_t* buffer, uint32_t size, uint32_t* bytesTransferred)
+{
+    *bytesTransferred = 0;
+    {
+        lock_guard<mutex> guard(lock);
+        if (error != ERROR_SUCCESS)
+        {
+            return error;
+        }
+    }
+
+    pending.insert(pending.end(), buffer, buffer + size);
+    bytesIn += size;
+    if (pending.size() >= 2 * DEDUP_MAX_CHUNK)
+    {
+        CutChunks(false);
+    }
+
+    lock_guard<mutex> guard(lock);
+    *bytesTransferred = size;
+    return error;
+}
+
+int DedupMedia::Flush()
+{
+    CutChunks(true);
+
+    unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        Retire();
+        if (retireIndex == submitIndex || error != ERROR_SUCCESS)
+        {
+            break;
+        }
+        chunkDone.wait(guard);
+    }
+
+    // The names of the new chunks first, their data is already synced, so
+    // the recipe never refers to a chunk that could be lost.
+    //
+    if (error == ERROR_SUCCESS &&
+        (syncfs(storeFd) != 0 || !WriteRecipe() || fdatasync(recipeFd) != 0))
+    {
+        error = ERROR_DISK_FULL;
+    }
+    return error;
+}
+
+int DedupMedia::Close()
+{
+    int completionCode = Flush();
+    Stop();
+
+    if (close(recipeFd) != 0 && completionCode == ERROR_SUCCESS)
+    {
+        completionCode = ERROR_DISK_FULL;
+    }
+    recipeFd = -1;
+
+    printf("Dedup: %llu chunks, %llu new, %.1f MB in, %.1f MB stored, ratio %.2f\n",
+           (unsigned long long)chunks, (unsigned long long)newChunks,
+           bytesIn / 1048576.0, bytesStored / 1048576.0,
+           (bytesStored > 0) ? (double)bytesIn / bytesStored : 0.0);
+
+    return completionCode;
+}
+
+// Stop the store threads once they are done with their chunks.
+//
+void DedupMedia::Stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        closing = true;
+    }
+    chunkQueued.notify_all();
+    for (size_t ix = 0; ix < workers.size(); ix++)
+    {
+        workers[ix].join();
+    }
+    workers.clear();
+}
+
+// One chunk being prefetched for a restore.
+//
+enum ChunkState
+{
+    CHUNK_FREE = 0,
+    CHUNK_LOADING,
+    CHUNK_DONE
+};
+
+struct ChunkSlot
+{
+    ChunkState      state;
+    vector<uint8_t> data;
+    size_t          offset;     // bytes already returned by Read()
+};
+
+//----------------------------------------------------------------------------
+// NAME: DedupRestoreMedia
+//
+// PURPOSE:
+//
+// Restore from the chunk store, following a recipe. The prefetch threads
+// load chunks in recipe order into a ring of slots, each taking the next
+// chunk as soon as its slot is free, and Read() consumes them in order.
+//
+class DedupRestoreMedia : public BackupMedia
+{
+public:
+    DedupRestoreMedia(const string& storeDir, const vector<uint8_t>& recipe, int threads)
+        : storeDir(storeDir), recipe(recipe),
+          nChunks((recipe.size() - RECIPE_HEADER_SIZE) / RECIPE_ENTRY_SIZE),
+          slots(4 * threads), readIndex(0), fetchIndex(0), closing(false),
+          error(ERROR_SUCCESS)
+    {
+        for (size_t ix = 0; ix < slots.size(); ix++)
+        {
+            slots[ix].state = CHUNK_FREE;
+        }
+        for (int ix = 0; ix < threads; ix++)
+        {
+            workers.push_back(thread(&DedupRestoreMedia::PrefetchThread, this));
+        }
+    }
+
+    ~DedupRestoreMedia()
+    {
+        if (!workers.empty())
+        {
+            Stop();
+        }
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred);
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred)
+    {
+        *bytesTransferred = 0;
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    int
+    Flush()
+    {
+        return ERROR_SUCCESS;
+    }
+
+    int
+    Close()
+    {
+        Stop();
+        return ERROR_SUCCESS;
+    }
+
+private:
+    void
+    PrefetchThread();
+
+    const char*
+    LoadChunk(
+        uint64_t   index,
+        ChunkSlot* slot);
+
+    void
+    Stop();
+
+    string                  storeDir;
+    vector<uint8_t>         recipe;
+    uint64_t                nChunks;
+
+    mutex                   lock;
+    condition_variable      chunkDone;  // a chunk was loaded
+    condition_variable      slotFree;   // a chunk was consumed by Read()
+    vector<ChunkSlot>       slots;
+    vector<thread>          workers;
+    uint64_t                readIndex;  // next chunk for Read()
+    uint64_t                fetchIndex; // next chunk to prefetch
+    bool                    closing;
+    int                     error;
+};
+
+// Load chunk 'index' of the recipe into 'slot' and check its hash.
+// Returns NULL, or the reason it failed.
+//
+const char* DedupRestoreMedia::LoadChunk(uint64_t index, ChunkSlot* slot)
+{
+    const uint8_t* entry = &recipe[RECIPE_HEADER_SIZE + index * RECIPE_ENTRY_SIZE];
+    uint32_t length = getLE32(entry + DEDUP_HASH_SIZE);
+    string path = chunkPath(storeDir, entry);
+
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return "missing";
+    }
+    slot->data.resize(length);
+    bool ok = readAll(fd, slot->data.data(), length);
+    close(fd);
+    if (!ok)
+    {
+        return "truncated";
+    }
+
+    uint8_t hash[DEDUP_HASH_SIZE];
+    hashChunk(slot->data.data(), length, hash);
+    return (memcmp(hash, entry, DEDUP_HASH_SIZE) == 0) ? NULL : "corrupt";
+}
+
+void DedupRestoreMedia::PrefetchThread()
+{
+    unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        while (!closing && fetchIndex < nChunks &&
+               slots[fetchIndex % slots.size()].state != CHUNK_FREE)
+        {
+            slotFree.wait(guard);
+        }
+        if (closing || fetchIndex == nChunks || error != ERROR_SUCCESS)
+        {
+            break;
+        }
+
+        uint64_t index = fetchIndex++;
+        ChunkSlot* slot = &slots[index % slots.size()];
+        slot->state = CHUNK_LOADING;
+
+        guard.unlock();
+        const char* failure = LoadChunk(index, slot);
+        guard.lock();
+
+        if (failure != NULL)
+        {
+            printf("Chunk %llu of the recipe is %s: %s\n", (unsigned long long)index, failure,
+                   chunkPath(storeDir, &recipe[RECIPE_HEADER_SIZE + index * RECIPE_ENTRY_SIZE]).c_str());
+            if (error == ERROR_SUCCESS)
+            {
+                error = ERROR_OPERATION_ABORTED;
+            }
+        }
+        slot->offset = 0;
+        slot->state = CHUNK_DONE;
+        chunkDone.notify_all();
+    }
+}
+
+int DedupRestoreMedia::Read(uint8_t* buffer, uint32_t size, uint32_t* bytesTransferred)
+{
+    uint32_t done = 0;
+
+    *bytesTransferred = 0;
+
+    unique_lock<mutex> guard(lock);
+    while (done < size && readIndex < nChunks)
+    {
+        ChunkSlot* slot = &slots[readIndex % slots.size()];
+
+        while (slot->state != CHUNK_DONE && error == ERROR_SUCCESS)
+        {
+            chunkDone.wait(guard);
+        }
+        if (error != ERROR_SUCCESS)
+        {
+            return error;
+        }
+
+        uint32_t n = (uint32_t)(slot->data.size() - slot->offset);
+        if (n > size - done)
+        {
+            n = size - done;
+        }
+
+        guard.unlock();
+        memcpy(buffer + done, &slot->data[slot->offset], n);
+        guard.lock();
+
+        slot->offset += n;
+        done += n;
+        if (slot->offset == slot->data.size())
+        {
+            slot->state = CHUNK_FREE;
+            readIndex++;
+            slotFree.notify_all();
+        }
+    }
+
+    *bytesTransferred = done;
+    return (done == size) ? ERROR_SUCCESS : ERROR_HANDLE_EOF;
+}
+
+void DedupRestoreMedia::Stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        closing = true;
+    }
+    slotFree.notify_all();
+    for (size_t ix = 0; ix < workers.size(); ix++)
+    {
+        workers[ix].join();
+    }
+    workers.clear();
+}
+
+BackupMedia* openDedupMedia(
+    const char* fname,
+    int         backup,
+    const char* storeDir,
+    int         threads)
+{
+    string store = storeDir;
+
+    call_once(gearTableOnce, initGearTable);
+
+    if (backup)
+    {
+        // The store and its 256 fan-out directories are created on first use.
+        //
+        mkdir(store.c_str(), 0777);
+        mkdir((store + "/chunks").c_str(), 0777);
+        for (int ix = 0; ix < 256; ix++)
+        {
+            char name[4];
+            sprintf(name, "%02x", ix);
+            mkdir((store + "/chunks/" + name).c_str(), 0777);
+        }
+
+        int storeFd = open(store.c_str(), O_RDONLY | O_DIRECTORY);
+        if (storeFd < 0)
+        {
+            printf("Failed to open chunk store: %s\n", storeDir);
+            return NULL;
+        }
+        int recipeFd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (recipeFd < 0)
+        {
+            printf("Failed to open: %s\n", fname);
+            close(storeFd);
+            return NULL;
+        }
+        return new DedupMedia(store, storeFd, recipeFd, threads);
+    }
+
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Failed to open: %s\n", fname);
+        return NULL;
+    }
+
+    vector<uint8_t> recipe;
+    struct stat st;
+    bool ok = fstat(fd, &st) == 0 && st.st_size >= RECIPE_HEADER_SIZE;
+    if (ok)
+    {
+        recipe.resize(st.st_size);
+        ok = readAll(fd, recipe.data(), recipe.size()) &&
+             memcmp(&recipe[0], RECIPE_MAGIC, 8) == 0 &&
+             getLE32(&recipe[8]) == RECIPE_VERSION &&
+             (recipe.size() - RECIPE_HEADER_SIZE) % RECIPE_ENTRY_SIZE == 0;
+    }
+    close(fd);
+
+    if (!ok)
+    {
+        printf("%s is not a deduplicated backup recipe\n", fname);
+        return NULL;
+    }
+    return new DedupRestoreMedia(store, recipe, threads);
+}
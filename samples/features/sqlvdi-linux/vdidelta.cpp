@@ -0,0 +1,795 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vdidelta.cpp
+//
+// Delta backups against a previous full backup.
+//
+// Like rsync, the previous backup, the base, is indexed by a weak checksum
+// and a strong hash of each of its DELTA_BLOCK_SIZE blocks. The checksum of
+// a window of the new backup is rolled one byte at a time, and where it
+// finds a block of the base with the same strong hash, the delta records a
+// copy of that block instead of its data. Blocks are found at any offset,
+// so data shifted by an insertion still matches. The delta is:
+//
+//  header      DELTA_MAGIC, version, block size and size of the base
+//  records     'C' u64 offset, u32 length: copy a range of the base
+//              'D' u32 length, data: data of the new backup
+//              'E' u64 length: the end, and the length of the backup
+//
+// A restore reads the records and rebuilds the backup on the fly, reading
+// the copied ranges from the base. It only works with the same base, whose
+// size is checked.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+
+#include "vdi.h"      // completion codes
+#include "vdile.h"
+#include "vdimedia.h"
+
+using namespace std;
+
+#define DELTA_BLOCK_SIZE        8192
+#define DELTA_STRONG_SIZE       16
+
+#define DELTA_MAGIC             "VDIDELTA"
+#define DELTA_VERSION           1
+#define DELTA_HEADER_SIZE       24
+
+#define DELTA_RECORD_COPY       'C'
+#define DELTA_RECORD_DATA       'D'
+#define DELTA_RECORD_END        'E'
+
+// Data records hold at most DELTA_DATA_MAX bytes, and records are written
+// to the target DELTA_OUTPUT_SIZE bytes at a time.
+//
+#define DELTA_DATA_MAX          (1024 * 1024)
+#define DELTA_OUTPUT_SIZE       (1024 * 1024)
+
+// Blocks of the base are looked up by a 16 bit tag of their weak checksum.
+//
+#define DELTA_TAG_COUNT         65536
+
+// The rsync weak checksum of 'length' bytes: the sum of the bytes, and the
+// sum of the running sums, each modulo 2^16.
+//
+static void weakSums(const uint8_t* data, size_t length, uint32_t* a, uint32_t* b)
+{
+    uint32_t s1 = 0;
+    uint32_t s2 = 0;
+
+    for (size_t ix = 0; ix < length; ix++)
+    {
+        s1 += data[ix];
+        s2 += s1;
+    }
+    *a = s1 & 0xFFFF;
+    *b = s2 & 0xFFFF;
+}
+
+static uint32_t weakChecksum(uint32_t a, uint32_t b)
+{
+    return a | (b << 16);
+}
+
+static uint32_t weakTag(uint32_t weak)
+{
+    return (weak ^ (weak >> 16)) & (DELTA_TAG_COUNT - 1);
+}
+
+static void strongHash(const uint8_t* data, size_t length, uint8_t* hash)
+{
+    uint8_t digest[EVP_MAX_MD_SIZE];
+
+    EVP_Digest(data, length, digest, NULL, EVP_sha256(), NULL);
+    memcpy(hash, digest, DELTA_STRONG_SIZE);
+}
+
+// The checksums of one block of the base.
+//
+struct BlockSum
+{
+    uint32_t weak;
+    uint8_t  strong[DELTA_STRONG_SIZE];
+};
+
+// A block of the base in the lookup table.
+//
+struct BlockRef
+{
+    uint32_t weak;
+    uint32_t block;
+};
+
+//----------------------------------------------------------------------------
+// NAME: DeltaMedia
+//
+// PURPOSE:
+//
+// Write the delta of the backup against the base to 'target'. Data is
+// held in 'pending' until a whole block can be looked up at every offset:
+// bytes before 'literalStart' are written, bytes from 'literalStart' to
+// 'scan' did not start a match, and the window at 'scan' is next.
+// Consecutive matching blocks of the base are merged into one copy.
+//
+class DeltaMedia : public BackupMedia
+{
+public:
+    DeltaMedia(BackupMedia* target, uint64_t baseSize, vector<BlockSum>& sums)
+        : target(target), baseSize(baseSize), literalStart(0), scan(0), windowValid(false),
+          runOffset(0), runLength(0), error(ERROR_SUCCESS), bytesIn(0), bytesCopied(0),
+          bytesLiteral(0)
+    {
+        blockSums.swap(sums);
+        BuildLookup();
+
+        output.resize(DELTA_HEADER_SIZE);
+        memcpy(&output[0], DELTA_MAGIC, 8);
+        putLE32(&output[8], DELTA_VERSION);
+        putLE32(&output[12], DELTA_BLOCK_SIZE);
+        putLE64(&output[16], baseSize);
+    }
+
+    ~DeltaMedia()
+    {
+        delete target;
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred)
+    {
+        *bytesTransferred = 0;
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred);
+
+    int
+    Flush();
+
+    int
+    Close();
+
+private:
+    void
+    BuildLookup();
+
+    bool
+    FindBlock(
+        const uint8_t* window,
+        uint32_t       weak,
+        uint32_t*      block);
+
+    void
+    Scan(
+        bool all);
+
+    void
+    EmitRun();
+
+    void
+    EmitData(
+        size_t end);
+
+    void
+    WriteOutput();
+
+    BackupMedia*            target;
+    uint64_t                baseSize;
+    vector<BlockSum>        blockSums;  // by block of the base
+    vector<BlockRef>        lookup;     // sorted by tag, then weak checksum
+    vector<uint32_t>        tagStart;   // first entry of each tag in 'lookup'
+
+    vector<uint8_t>         pending;
+    size_t                  literalStart;
+    size_t                  scan;
+    bool                    windowValid;
+    uint32_t                sumA;       // weak sums of the window at 'scan'
+    uint32_t                sumB;
+    uint64_t                runOffset;  // copy not yet written
+    uint64_t                runLength;
+
+    vector<uint8_t>         output;
+    int                     error;
+    uint64_t                bytesIn;
+    uint64_t                bytesCopied;
+    uint64_t                bytesLiteral;
+};
+
+// Only the first of identical blocks of the base is kept in the lookup
+// table; a run of copies finds the others through blockSums.
+//
+void DeltaMedia::BuildLookup()
+{
+    lookup.reserve(blockSums.size());
+    for (uint32_t block = 0; block < blockSums.size(); block++)
+    {
+        BlockRef ref = { blockSums[block].weak, block };
+        lookup.push_back(ref);
+    }
+
+    const vector<BlockSum>& sums = blockSums;
+    sort(lookup.begin(), lookup.end(), [&sums](const BlockRef& x, const BlockRef& y)
+    {
+        uint32_t tx = weakTag(x.weak);
+        uint32_t ty = weakTag(y.weak);
+        if (tx != ty)
+        {
+            return tx < ty;
+        }
+        if (x.weak != y.weak)
+        {
+            return x.weak < y.weak;
+        }
+        int order = memcmp(sums[x.block].strong, sums[y.block].strong, DELTA_STRONG_SIZE);
+        return (order != 0) ? order < 0 : x.block < y.block;
+    });
+    lookup.erase(unique(lookup.begin(), lookup.end(), [&sums](const BlockRef& x, const BlockRef& y)
+    {
+        return x.weak == y.weak &&
+               memcmp(sums[x.block].strong, sums[y.block].strong, DELTA_STRONG_SIZE) == 0;
+    }), lookup.end());
+
+    tagStart.assign(DELTA_TAG_COUNT + 1, 0);
+    for (size_t ix = 0; ix < lookup.size(); ix++)
+    {
+        tagStart[weakTag(lookup[ix].weak) + 1]++;
+    }
+    for (uint32_t tag = 0; tag < DELTA_TAG_COUNT; tag++)
+    {
+        tagStart[tag + 1] += tagStart[tag];
+    }
+}
+
+// Find a block of the base equal to 'window', preferring the one that
+// continues the current run of copies.
+//
+bool DeltaMedia::FindBlock(const uint8_t* window, uint32_t weak, uint32_t* block)
+{
+    uint8_t strong[DELTA_STRONG_SIZE];
+    bool hashed = false;
+
+    if (runLength > 0 && literalStart == scan)
+    {
+        uint64_t next = (runOffset + runLength) / DELTA_BLOCK_SIZE;
+        if ((runOffset + runLength) % DELTA_BLOCK_SIZE == 0 && next < blockSums.size() &&
+            blockSums[next].weak == weak)
+        {
+            strongHash(window, DELTA_BLOCK_SIZE, strong);
+            hashed = true;
+            if (memcmp(strong, blockSums[next].strong, DELTA_STRONG_SIZE) == 0)
+            {
+                *block = (uint32_t)next;
+                return true;
+            }
+        }
+    }
+
+    uint32_t tag = weakTag(weak);
+    for (uint32_t ix = tagStart[tag]; ix < tagStart[tag + 1]; ix++)
+    {
+        if (lookup[ix].weak != weak)
+        {
+            continue;
+        }
+        if (!hashed)
+        {
+            strongHash(window, DELTA_BLOCK_SIZE, strong);
+            hashed = true;
+        }
+        if (memcmp(strong, blockSums[lookup[ix].block].strong, DELTA_STRONG_SIZE) == 0)
+        {
+            *block = lookup[ix].block;
+            return true;
+        }
+    }
+    return false;
+}
+
+void DeltaMedia::EmitRun()
+{
+    if (runLength == 0)
+    {
+        return;
+    }
+
+    uint8_t record[13];
+    record[0] = DELTA_RECORD_COPY;
+    putLE64(record + 1, runOffset);
+    putLE32(record + 9, (uint32_t)runLength);
+    output.insert(output.end(), record, record + sizeof(record));
+    bytesCopied += runLength;
+    runLength = 0;
+    WriteOutput();
+}
+
+// Write the pending bytes from 'literalStart' to 'end' as data.
+//
+void DeltaMedia::EmitData(size_t end)
+{
+    if (end == literalStart)
+    {
+        return;
+    }
+
+    EmitRun();
+
+    uint8_t record[5];
+    record[0] = DELTA_RECORD_DATA;
+    putLE32(record + 1, (uint32_t)(end - literalStart));
+    output.insert(output.end(), record, record + sizeof(record));
+    output.insert(output.end(), pending.begin() + literalStart, pending.begin() + end);
+    bytesLiteral += end - literalStart;
+    literalStart = end;
+    WriteOutput();
+}
+
+void DeltaMedia::WriteOutput()
+{
+    if (output.size() < DELTA_OUTPUT_SIZE || error != ERROR_SUCCESS)
+    {
+        return;
+    }
+
+    uint32_t bytes;
+    error = target->Write(output.data(), (uint32_t)output.size(), &bytes);
+    output.clear();
+}
+
+// Look up every window of the pending data that is followed by a whole
+// block, or, with 'all', write out all the pending data.
+//
+void DeltaMedia::Scan(bool all)
+{
+    while (!blockSums.empty())
+    {
+        if (!windowValid)
+        {
+            if (scan + DELTA_BLOCK_SIZE > pending.size())
+            {
+                break;
+            }
+            weakSums(&pending[scan], DELTA_BLOCK_SIZE, &sumA, &sumB);
+            windowValid = true;
+        }
+
+        uint32_t block;
+        if (FindBlock(&pending[scan], weakChecksum(sumA, sumB), &block))
+        {
+            uint64_t offset = (uint64_t)block * DELTA_BLOCK_SIZE;
+
+            EmitData(scan);
+            if (runLength == 0 || runOffset + runLength != offset ||
+                runLength + DELTA_BLOCK_SIZE > UINT32_MAX)
+            {
+                EmitRun();
+                runOffset = offset;
+            }
+            runLength += DELTA_BLOCK_SIZE;
+            scan += DELTA_BLOCK_SIZE;
+            literalStart = scan;
+            windowValid = false;
+            continue;
+        }
+
+        if (scan + DELTA_BLOCK_SIZE >= pending.size())
+        {
+            break;
+        }
+
+        // Roll the window one byte forward.
+        //
+        uint32_t out = pending[scan];
+        uint32_t in = pending[scan + DELTA_BLOCK_SIZE];
+        sumA = (sumA - out + in) & 0xFFFF;
+        sumB = (sumB - DELTA_BLOCK_SIZE * out + sumA) & 0xFFFF;
+        scan++;
+
+        if (scan - literalStart >= DELTA_DATA_MAX)
+        {
+            EmitData(scan);
+        }
+    }
+
+    if (all || blockSums.empty())
+    {
+        EmitData(pending.size());
+        EmitRun();
+        scan = pending.size();
+        windowValid = false;
+    }
+
+    pending.erase(pending.begin(), pending.begin() + literalStart);
+    scan -= literalStart;
+    literalStart = 0;
+}
+
+int DeltaMedia::Write(const uint8_t* buffer, uint32_t size, uint32_t* bytesTransferred)
+{
+    *bytesTransferred = 0;
+    if (error != ERROR_SUCCESS)
+    {
+        return error;
+    }
+
+    pending.insert(pending.end(), buffer, buffer + size);
+    bytesIn += size;
+    if (pending.size() >= DELTA_DATA_MAX + DELTA_BLOCK_SIZE)
+    {
+        Scan(false);
+    }
+
+    *bytesTransferred = size;
+    return error;
+}
+
+// A flush writes out all the pending data, so a match can be missed across
+// it.
+//
+int DeltaMedia::Flush()
+{
+    Scan(true);
+    if (error == ERROR_SUCCESS && !output.empty())
+    {
+        uint32_t bytes;
+        error = target->Write(output.data(), (uint32_t)output.size(), &bytes);
+        output.clear();
+    }
+    if (error == ERROR_SUCCESS)
+    {
+        error = target->Flush();
+    }
+    return error;
+}
+
+int DeltaMedia::Close()
+{
+    Scan(true);
+
+    uint8_t record[9];
+    record[0] = DELTA_RECORD_END;
+    putLE64(record + 1, bytesIn);
+    output.insert(output.end(), record, record + sizeof(record));
+
+    int completionCode = error;
+    if (completionCode == ERROR_SUCCESS)
+    {
+        uint32_t bytes;
+        completionCode = target->Write(output.data(), (uint32_t)output.size(), &bytes);
+    }
+    output.clear();
+
+    int closeCode = target->Close();
+    if (completionCode == ERROR_SUCCESS)
+    {
+        completionCode = closeCode;
+    }
+
+    printf("Delta: %.1f MB in, %.1f MB copied from the base, %.1f MB of new data\n",
+           bytesIn / 1048576.0, bytesCopied / 1048576.0, bytesLiteral / 1048576.0);
+
+    return completionCode;
+}
+
+//----------------------------------------------------------------------------
+// NAME: DeltaRestoreMedia
+//
+// PURPOSE:
+//
+// Rebuild the backup from the delta read from 'source' and the base. The
+// range of each copy record is announced to the kernel as soon as the
+// record is read, so that the base is read ahead of the copy.
+//
+class DeltaRestoreMedia : public BackupMedia
+{
+public:
+    DeltaRestoreMedia(BackupMedia* source, int baseFd, uint64_t baseSize)
+        : source(source), baseFd(baseFd), baseSize(baseSize), recordType(0),
+          remaining(0), copyOffset(0), finished(false), error(ERROR_SUCCESS), bytesOut(0)
+    {
+    }
+
+    ~DeltaRestoreMedia()
+    {
+        delete source;
+        close(baseFd);
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred);
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred)
+    {
+        *bytesTransferred = 0;
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    int
+    Flush()
+    {
+        return ERROR_SUCCESS;
+    }
+
+    int
+    Close()
+    {
+        return source->Close();
+    }
+
+private:
+    bool
+    ReadSource(
+        uint8_t* buffer,
+        uint32_t size);
+
+    bool
+    NextRecord();
+
+    BackupMedia*            source;
+    int                     baseFd;
+    uint64_t                baseSize;
+    uint8_t                 recordType;
+    uint64_t                remaining;  // bytes left in the current record
+    uint64_t                copyOffset;
+    bool                    finished;
+    int                     error;
+    uint64_t                bytesOut;
+};
+
+bool DeltaRestoreMedia::ReadSource(uint8_t* buffer, uint32_t size)
+{
+    uint32_t bytes = 0;
+
+    source->Read(buffer, size, &bytes);
+    return bytes == size;
+}
+
+bool DeltaRestoreMedia::NextRecord()
+{
+    uint8_t record[12];
+
+    if (!ReadSource(&recordType, 1))
+    {
+        printf("The delta ends without an end record\n");
+        return false;
+    }
+
+    switch (recordType)
+    {
+    case DELTA_RECORD_COPY:
+        if (!ReadSource(record, 12))
+        {
+            break;
+        }
+        copyOffset = getLE64(record);
+        remaining = getLE32(record + 8);
+        if (copyOffset > baseSize || remaining > baseSize - copyOffset)
+        {
+            printf("The delta copies beyond the end of the base\n");
+            return false;
+        }
+        posix_fadvise(baseFd, copyOffset, remaining, POSIX_FADV_WILLNEED);
+        return true;
+
+    case DELTA_RECORD_DATA:
+        if (!ReadSource(record, 4))
+        {
+            break;
+        }
+        remaining = getLE32(record);
+        return true;
+
+    case DELTA_RECORD_END:
+        if (!ReadSource(record, 8))
+        {
+            break;
+        }
+        if (getLE64(record) != bytesOut)
+        {
+            printf("The delta rebuilt %llu bytes instead of %llu\n",
+                   (unsigned long long)bytesOut, (unsigned long long)getLE64(record));
+            return false;
+        }
+        finished = true;
+        return true;
+    }
+
+    printf("The delta is corrupt\n");
+    return false;
+}
+
+int DeltaRestoreMedia::Read(uint8_t* buffer, uint32_t size, uint32_t* bytesTransferred)
+{
+    uint32_t done = 0;
+
+    while (done < size && !finished && error == ERROR_SUCCESS)
+    {
+        if (remaining == 0)
+        {
+            if (!NextRecord())
+            {
+                error = ERROR_OPERATION_ABORTED;
+            }
+            continue;
+        }
+
+        uint32_t n = (remaining < size - done) ? (uint32_t)remaining : size - done;
+        if (recordType == DELTA_RECORD_COPY)
+        {
+            ssize_t bytes = pread(baseFd, buffer + done, n, copyOffset);
+            if (bytes <= 0)
+            {
+                printf("Failed to read the base at %llu\n", (unsigned long long)copyOffset);
+                error = ERROR_OPERATION_ABORTED;
+                break;
+            }
+            n = (uint32_t)bytes;
+            copyOffset += n;
+        }
+        else if (!ReadSource(buffer + done, n))
+        {
+            printf("The delta is truncated\n");
+            error = ERROR_OPERATION_ABORTED;
+            break;
+        }
+
+        remaining -= n;
+        done += n;
+        bytesOut += n;
+    }
+
+    *bytesTransferred = done;
+    if (error != ERROR_SUCCESS)
+    {
+        return error;
+    }
+    return (done == size) ? ERROR_SUCCESS : ERROR_HANDLE_EOF;
+}
+
+// Compute the checksums of every whole block of the base.
+//
+static bool indexBase(int fd, vector<BlockSum>* sums)
+{
+    vector<uint8_t> buffer(1024 * DELTA_BLOCK_SIZE);
+
+    for (;;)
+    {
+        size_t length = 0;
+        while (length < buffer.size())
+        {
+            ssize_t n = read(fd, &buffer[length], buffer.size() - length);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0)
+            {
+                return false;
+            }
+            if (n == 0)
+            {
+                break;
+            }
+            length += n;
+        }
+
+        for (size_t offset = 0; offset + DELTA_BLOCK_SIZE <= length; offset += DELTA_BLOCK_SIZE)
+        {
+            BlockSum sum;
+            uint32_t a, b;
+
+            weakSums(&buffer[offset], DELTA_BLOCK_SIZE, &a, &b);
+            sum.weak = weakChecksum(a, b);
+            strongHash(&buffer[offset], DELTA_BLOCK_SIZE, sum.strong);
+            sums->push_back(sum);
+        }
+        if (length < buffer.size())
+        {
+            return true;
+        }
+    }
+}
+
+BackupMedia* openDeltaMedia(
+    BackupMedia* media,
+    const char*  baseName,
+    int          backup)
+{
+    int fd = open(baseName, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        printf("Failed to open the delta base: %s\n", baseName);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        media->Close();
+        delete media;
+        return NULL;
+    }
+
+    if (!backup)
+    {
+        uint8_t header[DELTA_HEADER_SIZE];
+        uint32_t bytes = 0;
+
+        media->Read(header, DELTA_HEADER_SIZE, &bytes);
+        if (bytes != DELTA_HEADER_SIZE || memcmp(header, DELTA_MAGIC, 8) != 0 ||
+            getLE32(header + 8) != DELTA_VERSION || getLE32(header + 12) != DELTA_BLOCK_SIZE)
+        {
+            printf("The backup file is not a delta\n");
+        }
+        else if (getLE64(header + 16) != (uint64_t)st.st_size)
+        {
+            printf("The delta was made against a base of %llu bytes, %s has %llu\n",
+                   (unsigned long long)getLE64(header + 16), baseName,
+                   (unsigned long long)st.st_size);
+        }
+        else
+        {
+            return new DeltaRestoreMedia(media, fd, st.st_size);
+        }
+        close(fd);
+        media->Close();
+        delete media;
+        return NULL;
+    }
+
+    // The base is read sequentially once, to index it.
+    //
+    auto start = chrono::steady_clock::now();
+    vector<BlockSum> sums;
+    sums.reserve(st.st_size / DELTA_BLOCK_SIZE);
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    bool ok = indexBase(fd, &sums);
+    close(fd);
+    if (!ok || sums.size() > UINT32_MAX)
+    {
+        printf("Failed to read the delta base: %s\n", baseName);
+        media->Close();
+        delete media;
+        return NULL;
+    }
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    printf("Delta: indexed %llu blocks of %s in %.2f s\n",
+           (unsigned long long)sums.size(), baseName, seconds);
+
+    return new DeltaMedia(media, st.st_size, sums);
+}
@@ -0,0 +1,1101 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vdiencrypt.cpp
+//
+// AES-256-GCM encryption of backup files.
+//
+// The backup data is cut into chunks of ENCRYPT_CHUNK_SIZE bytes that are
+// encrypted and authenticated independently, on a pool of worker threads,
+// with the AES-NI code of OpenSSL. The file is:
+//
+//  header      ENCRYPT_MAGIC, u32 version, u32 chunk size, 16 byte salt,
+//              16 byte key check
+//  records     u32 length, u32 flags, ciphertext, 16 byte tag
+//  index       a last record, flagged RECORD_INDEX, holding the file offset
+//              and data offset of every record as u64 pairs, then the total
+//              length of the data
+//  footer      u64 offset of the index record, ENCRYPT_INDEX_MAGIC
+//
+// The key of the file is derived from the key in the key file and the
+// random salt, so no two files share a key, and the nonce of a record is
+// its number. The header, the number, length and flags of a record are
+// authenticated with it, so records cannot be swapped, cut or moved to
+// another file unnoticed, and the index record marks the real end of the
+// file. The index lets the end of the data be read without decrypting the
+// whole file, as a compressed restore needs for its seek table.
+//
+
+#include <cctype>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+#include "vdi.h"      // completion codes
+#include "vdile.h"
+#include "vdimedia.h"
+
+using namespace std;
+
+#define ENCRYPT_CHUNK_SIZE      (1024 * 1024)
+#define ENCRYPT_KEY_SIZE        32
+#define ENCRYPT_SALT_SIZE       16
+#define ENCRYPT_CHECK_SIZE      16
+#define ENCRYPT_TAG_SIZE        16
+#define ENCRYPT_NONCE_SIZE      12
+
+#define ENCRYPT_MAGIC           "VDIAESGC"
+#define ENCRYPT_VERSION         1
+#define ENCRYPT_HEADER_SIZE     (16 + ENCRYPT_SALT_SIZE + ENCRYPT_CHECK_SIZE)
+#define RECORD_HEADER_SIZE      8
+#define ENCRYPT_INDEX_MAGIC     "VDIAESIX"
+#define ENCRYPT_FOOTER_SIZE     16
+
+#define RECORD_DATA             0
+#define RECORD_INDEX            1
+
+// Read a key file: 32 bytes, or 64 hexadecimal digits and an optional
+// newline.
+//
+static bool loadKey(const char* keyFile, uint8_t* key)
+{
+    FILE* file = fopen(keyFile, "rb");
+    if (file == NULL)
+    {
+        printf("Failed to open the key file: %s\n", keyFile);
+        return false;
+    }
+
+    uint8_t data[2 * ENCRYPT_KEY_SIZE + 2];
+    size_t length = fread(data, 1, sizeof(data), file);
+    fclose(file);
+
+    // A raw key can end in any byte, only the hexadecimal form may be
+    // followed by a line end.
+    //
+    if (length == ENCRYPT_KEY_SIZE)
+    {
+        memcpy(key, data, ENCRYPT_KEY_SIZE);
+        return true;
+    }
+    while (length > 0 && (data[length - 1] == '\n' || data[length - 1] == '\r'))
+    {
+        length--;
+    }
+    if (length == 2 * ENCRYPT_KEY_SIZE)
+    {
+        for (int ix = 0; ix < ENCRYPT_KEY_SIZE; ix++)
+        {
+            unsigned value;
+            char digits[3] = { (char)data[2 * ix], (char)data[2 * ix + 1], 0 };
+            if (!isxdigit(digits[0]) || !isxdigit(digits[1]) || sscanf(digits, "%x", &value) != 1)
+            {
+                break;
+            }
+            key[ix] = (uint8_t)value;
+            if (ix == ENCRYPT_KEY_SIZE - 1)
+            {
+                return true;
+            }
+        }
+    }
+
+    printf("%s does not hold a 256 bit key: 32 bytes, or 64 hexadecimal digits\n", keyFile);
+    return false;
+}
+
+// Derive the key of a file, and the check stored in its header, from the
+// key in the key file and the salt of the file.
+//
+static void deriveKeys(const uint8_t* masterKey, const uint8_t* salt, uint8_t* fileKey,
+                       uint8_t* check)
+{
+    uint8_t input[ENCRYPT_SALT_SIZE + 1];
+    uint8_t digest[EVP_MAX_MD_SIZE];
+    unsigned int length;
+
+    memcpy(input, salt, ENCRYPT_SALT_SIZE);
+    input[ENCRYPT_SALT_SIZE] = 1;
+    HMAC(EVP_sha256(), masterKey, ENCRYPT_KEY_SIZE, input, sizeof(input), digest, &length);
+    memcpy(fileKey, digest, ENCRYPT_KEY_SIZE);
+
+    input[ENCRYPT_SALT_SIZE] = 2;
+    HMAC(EVP_sha256(), masterKey, ENCRYPT_KEY_SIZE, input, sizeof(input), digest, &length);
+    memcpy(check, digest, ENCRYPT_CHECK_SIZE);
+}
+
+// The nonce of record 'index', and the data authenticated with it besides
+// its contents: the file header, the record number and the record header.
+//
+static void recordNonce(uint64_t index, uint8_t* nonce)
+{
+    memset(nonce, 0, ENCRYPT_NONCE_SIZE);
+    putLE64(nonce + 4, index);
+}
+
+static void recordAad(const uint8_t* header, uint64_t index, const uint8_t* recordHeader,
+                      uint8_t* aad)
+{
+    memcpy(aad, header, ENCRYPT_HEADER_SIZE);
+    putLE64(aad + ENCRYPT_HEADER_SIZE, index);
+    memcpy(aad + ENCRYPT_HEADER_SIZE + 8, recordHeader, RECORD_HEADER_SIZE);
+}
+
+#define RECORD_AAD_SIZE         (ENCRYPT_HEADER_SIZE + 8 + RECORD_HEADER_SIZE)
+
+// Encrypt 'length' bytes of 'input' into record 'index' in 'output', which
+// must hold RECORD_HEADER_SIZE + length + ENCRYPT_TAG_SIZE bytes.
+//
+static bool sealRecord(EVP_CIPHER_CTX* ctx, const uint8_t* key, const uint8_t* header,
+                       uint64_t index, uint32_t flags, const uint8_t* input, size_t length,
+                       uint8_t* output)
+{
+    uint8_t nonce[ENCRYPT_NONCE_SIZE];
+    uint8_t aad[RECORD_AAD_SIZE];
+    int n;
+
+    putLE32(output, (uint32_t)length);
+    putLE32(output + 4, flags);
+    recordNonce(index, nonce);
+    recordAad(header, index, output, aad);
+
+    uint8_t* ciphertext = output + RECORD_HEADER_SIZE;
+    return EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, nonce) == 1 &&
+           EVP_EncryptUpdate(ctx, NULL, &n, aad, sizeof(aad)) == 1 &&
+           EVP_EncryptUpdate(ctx, ciphertext, &n, input, (int)length) == 1 &&
+           EVP_EncryptFinal_ex(ctx, ciphertext + n, &n) == 1 &&
+           EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, ENCRYPT_TAG_SIZE,
+                               ciphertext + length) == 1;
+}
+
+// Decrypt and authenticate record 'index', whose header is 'recordHeader'
+// and whose ciphertext and tag are in 'input', into 'output'.
+//
+static bool openRecord(EVP_CIPHER_CTX* ctx, const uint8_t* key, const uint8_t* header,
+                       uint64_t index, const uint8_t* recordHeader, const uint8_t* input,
+                       uint8_t* output)
+{
+    uint8_t nonce[ENCRYPT_NONCE_SIZE];
+    uint8_t aad[RECORD_AAD_SIZE];
+    size_t length = getLE32(recordHeader);
+    int n;
+
+    recordNonce(index, nonce);
+    recordAad(header, index, recordHeader, aad);
+
+    return EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, nonce) == 1 &&
+           EVP_DecryptUpdate(ctx, NULL, &n, aad, sizeof(aad)) == 1 &&
+           EVP_DecryptUpdate(ctx, output, &n, input, (int)length) == 1 &&
+           EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, ENCRYPT_TAG_SIZE,
+                               (void*)(input + length)) == 1 &&
+           EVP_DecryptFinal_ex(ctx, output + n, &n) == 1;
+}
+
+enum ChunkState
+{
+    CHUNK_FREE = 0,
+    CHUNK_FILLING,      // backup: receiving data from Write()
+    CHUNK_READY,        // waiting for a worker
+    CHUNK_BUSY,         // being encrypted or decrypted
+    CHUNK_DONE          // output ready, in 'output'
+};
+
+// One chunk in flight. On backup 'input' is data and 'output' a record, on
+// restore the other way round.
+//
+struct CryptChunk
+{
+    ChunkState      state;
+    uint64_t        index;
+    uint8_t         recordHeader[RECORD_HEADER_SIZE];
+    vector<uint8_t> input;
+    size_t          inputLength;
+    vector<uint8_t> output;
+    size_t          outputLength;
+    size_t          outputOffset;   // restore: bytes already returned by Read()
+};
+
+//----------------------------------------------------------------------------
+// NAME: EncryptMedia
+//
+// PURPOSE:
+//
+// Encrypt backup data written to the target media. Chunks are filled by
+// Write() in order, encrypted by whichever worker is free, and written to
+// the target in order by the writer thread, which records where each one
+// went for the index. A failure is kept and returned by the next command.
+//
+class EncryptMedia : public BackupMedia
+{
+public:
+    EncryptMedia(BackupMedia* target, const uint8_t* key, const uint8_t* header, int threads)
+        : target(target), chunks(2 * threads), fillIndex(0), jobIndex(0), writeIndex(0),
+          closing(false), error(ERROR_SUCCESS), fileOffset(ENCRYPT_HEADER_SIZE), dataOffset(0)
+    {
+        memcpy(this->key, key, ENCRYPT_KEY_SIZE);
+        memcpy(this->header, header, ENCRYPT_HEADER_SIZE);
+
+        for (size_t ix = 0; ix < chunks.size(); ix++)
+        {
+            chunks[ix].state = CHUNK_FREE;
+            chunks[ix].input.resize(ENCRYPT_CHUNK_SIZE);
+            chunks[ix].output.resize(RECORD_HEADER_SIZE + ENCRYPT_CHUNK_SIZE + ENCRYPT_TAG_SIZE);
+            chunks[ix].inputLength = 0;
+        }
+        for (int ix = 0; ix < threads; ix++)
+        {
+            workers.push_back(thread(&EncryptMedia::WorkerThread, this));
+        }
+        writer = thread(&EncryptMedia::WriterThread, this);
+    }
+
+    ~EncryptMedia()
+    {
+        if (writer.joinable())
+        {
+            Stop();
+        }
+        OPENSSL_cleanse(key, sizeof(key));
+        delete target;
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred)
+    {
+        *bytesTransferred = 0;
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred);
+
+    int
+    Flush();
+
+    int
+    Close();
+
+private:
+    void
+    WorkerThread();
+
+    void
+    WriterThread();
+
+    void
+    Submit();
+
+    void
+    Stop();
+
+    BackupMedia*            target;
+    uint8_t                 key[ENCRYPT_KEY_SIZE];
+    uint8_t                 header[ENCRYPT_HEADER_SIZE];
+
+    mutex                   lock;
+    condition_variable      jobReady;   // a chunk is ready to encrypt
+    condition_variable      chunkDone;  // a chunk was encrypted
+    condition_variable      chunkFree;  // a chunk was written
+    vector<CryptChunk>      chunks;
+    vector<thread>          workers;
+    thread                  writer;
+    uint64_t                fillIndex;  // chunk receiving data
+    uint64_t                jobIndex;   // next chunk for a worker
+    uint64_t                writeIndex; // next chunk to write
+    bool                    closing;
+    int                     error;
+
+    vector<uint64_t>        index;      // file offset, data offset pairs
+    uint64_t                fileOffset;
+    uint64_t                dataOffset;
+};
+
+// Hand the chunk being filled to the workers. Called with the lock held.
+//
+void EncryptMedia::Submit()
+{
+    CryptChunk* chunk = &chunks[fillIndex % chunks.size()];
+    chunk->state = CHUNK_READY;
+    chunk->index = fillIndex;
+    fillIndex++;
+    jobReady.notify_one();
+}
+
+int EncryptMedia::Write(const uint8_t* buffer, uint32_t size, uint32_t* bytesTransferred)
+{
+    uint32_t done = 0;
+
+    *bytesTransferred = 0;
+
+    unique_lock<mutex> guard(lock);
+    while (done < size)
+    {
+        CryptChunk* chunk = &chunks[fillIndex % chunks.size()];
+
+        while (chunk->state != CHUNK_FREE && chunk->state != CHUNK_FILLING &&
+               error == ERROR_SUCCESS)
+        {
+            chunkFree.wait(guard);
+        }
+        if (error != ERROR_SUCCESS)
+        {
+            return error;
+        }
+        chunk->state = CHUNK_FILLING;
+
+        // The chunk being filled belongs to this thread.
+        //
+        uint32_t n = ENCRYPT_CHUNK_SIZE - (uint32_t)chunk->inputLength;
+        if (n > size - done)
+        {
+            n = size - done;
+        }
+
+        guard.unlock();
+        memcpy(&chunk->input[chunk->inputLength], buffer + done, n);
+        guard.lock();
+
+        chunk->inputLength += n;
+        done += n;
+        if (chunk->inputLength == ENCRYPT_CHUNK_SIZE)
+        {
+            Submit();
+        }
+    }
+
+    *bytesTransferred = size;
+    return ERROR_SUCCESS;
+}
+
+void EncryptMedia::WorkerThread()
+{
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+
+    unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        while (!closing && (jobIndex == fillIndex ||
+               chunks[jobIndex % chunks.size()].state != CHUNK_READY))
+        {
+            jobReady.wait(guard);
+        }
+        if (closing)
+        {
+            break;
+        }
+
+        CryptChunk* chunk = &chunks[jobIndex % chunks.size()];
+        chunk->state = CHUNK_BUSY;
+        jobIndex++;
+
+        guard.unlock();
+        bool ok = ctx != NULL &&
+                  sealRecord(ctx, key, header, chunk->index, RECORD_DATA, &chunk->input[0],
+                             chunk->inputLength, &chunk->output[0]);
+        chunk->outputLength = RECORD_HEADER_SIZE + chunk->inputLength + ENCRYPT_TAG_SIZE;
+        guard.lock();
+
+        if (!ok)
+        {
+            printf("Encryption of chunk %llu fails\n", (unsigned long long)chunk->index);
+            if (error == ERROR_SUCCESS)
+            {
+                error = ERROR_OPERATION_ABORTED;
+            }
+        }
+        chunk->state = CHUNK_DONE;
+        chunkDone.notify_all();
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+void EncryptMedia::WriterThread()
+{
+    unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        CryptChunk* chunk = &chunks[writeIndex % chunks.size()];
+
+        while (chunk->state != CHUNK_DONE && !closing)
+        {
+            chunkDone.wait(guard);
+        }
+        if (chunk->state != CHUNK_DONE)
+        {
+            break;
+        }
+
+        int completionCode = error;
+        if (completionCode == ERROR_SUCCESS)
+        {
+            guard.unlock();
+            uint32_t written;
+            completionCode = target->Write(&chunk->output[0], (uint32_t)chunk->outputLength,
+                                           &written);
+            guard.lock();
+        }
+
+        if (completionCode != ERROR_SUCCESS)
+        {
+            if (error == ERROR_SUCCESS)
+            {
+                error = completionCode;
+            }
+        }
+        else
+        {
+            index.push_back(fileOffset);
+            index.push_back(dataOffset);
+            fileOffset += chunk->outputLength;
+            dataOffset += chunk->inputLength;
+        }
+
+        chunk->inputLength = 0;
+        chunk->state = CHUNK_FREE;
+        writeIndex++;
+        chunkFree.notify_all();
+    }
+}
+
+int EncryptMedia::Flush()
+{
+    unique_lock<mutex> guard(lock);
+
+    // Cut the chunk short, so that everything received so far is written.
+    //
+    if (chunks[fillIndex % chunks.size()].state == CHUNK_FILLING)
+    {
+        Submit();
+    }
+
+    while (writeIndex != fillIndex && error == ERROR_SUCCESS)
+    {
+        chunkFree.wait(guard);
+    }
+    if (error != ERROR_SUCCESS)
+    {
+        return error;
+    }
+
+    guard.unlock();
+    return target->Flush();
+}
+
+void EncryptMedia::Stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        closing = true;
+    }
+    jobReady.notify_all();
+    chunkDone.notify_all();
+    for (size_t ix = 0; ix < workers.size(); ix++)
+    {
+        workers[ix].join();
+    }
+    writer.join();
+}
+
+int EncryptMedia::Close()
+{
+    int completionCode = Flush();
+
+    Stop();
+
+    // Append the index record and the footer that points to it.
+    //
+    uint64_t nRecords = index.size() / 2;
+    if (completionCode == ERROR_SUCCESS)
+    {
+        vector<uint8_t> plain(8 * index.size() + 8);
+        for (size_t ix = 0; ix < index.size(); ix++)
+        {
+            putLE64(&plain[8 * ix], index[ix]);
+        }
+        putLE64(&plain[8 * index.size()], dataOffset);
+
+        vector<uint8_t> record(RECORD_HEADER_SIZE + plain.size() + ENCRYPT_TAG_SIZE +
+                               ENCRYPT_FOOTER_SIZE);
+        EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+        bool ok = ctx != NULL &&
+                  sealRecord(ctx, key, header, nRecords, RECORD_INDEX, &plain[0], plain.size(),
+                             &record[0]);
+        EVP_CIPHER_CTX_free(ctx);
+
+        uint8_t* footer = &record[record.size() - ENCRYPT_FOOTER_SIZE];
+        putLE64(footer, fileOffset);
+        memcpy(footer + 8, ENCRYPT_INDEX_MAGIC, 8);
+
+        uint32_t written;
+        completionCode = (ok) ? target->Write(&record[0], (uint32_t)record.size(), &written)
+                              : ERROR_OPERATION_ABORTED;
+        if (completionCode == ERROR_SUCCESS)
+        {
+            completionCode = target->Flush();
+        }
+    }
+
+    int closeCode = target->Close();
+    if (completionCode == ERROR_SUCCESS)
+    {
+        completionCode = closeCode;
+    }
+
+    printf("Encryption: %llu chunks, %.1f MB, AES-256-GCM\n",
+           (unsigned long long)nRecords, dataOffset / 1048576.0);
+
+    return completionCode;
+}
+
+//----------------------------------------------------------------------------
+// NAME: DecryptMedia
+//
+// PURPOSE:
+//
+// Restore data encrypted by EncryptMedia. The reader thread reads records
+// from the source media, in order, the workers decrypt and authenticate
+// them, and Read() returns their contents in order. The index record ends
+// the data; a file that ends before it was cut short.
+//
+class DecryptMedia : public BackupMedia
+{
+public:
+    DecryptMedia(BackupMedia* source, const uint8_t* key, const uint8_t* header, int threads)
+        : source(source), chunks(2 * threads), readIndex(0), jobIndex(0), fillIndex(0),
+          readerDone(false), closing(false), error(ERROR_SUCCESS)
+    {
+        memcpy(this->key, key, ENCRYPT_KEY_SIZE);
+        memcpy(this->header, header, ENCRYPT_HEADER_SIZE);
+
+        for (size_t ix = 0; ix < chunks.size(); ix++)
+        {
+            chunks[ix].state = CHUNK_FREE;
+        }
+        for (int ix = 0; ix < threads; ix++)
+        {
+            workers.push_back(thread(&DecryptMedia::WorkerThread, this));
+        }
+        reader = thread(&DecryptMedia::ReaderThread, this);
+    }
+
+    ~DecryptMedia()
+    {
+        if (reader.joinable())
+        {
+            Stop();
+        }
+        OPENSSL_cleanse(key, sizeof(key));
+        delete source;
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred);
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred)
+    {
+        *bytesTransferred = 0;
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    int
+    Flush()
+    {
+        return ERROR_SUCCESS;
+    }
+
+    int
+    Close()
+    {
+        Stop();
+        return source->Close();
+    }
+
+private:
+    void
+    ReaderThread();
+
+    void
+    WorkerThread();
+
+    void
+    Stop();
+
+    BackupMedia*            source;
+    uint8_t                 key[ENCRYPT_KEY_SIZE];
+    uint8_t                 header[ENCRYPT_HEADER_SIZE];
+
+    mutex                   lock;
+    condition_variable      jobReady;   // a record was read
+    condition_variable      chunkDone;  // a record was decrypted, or the reader stopped
+    condition_variable      chunkFree;  // a chunk was consumed by Read()
+    vector<CryptChunk>      chunks;
+    vector<thread>          workers;
+    thread                  reader;
+    uint64_t                readIndex;  // next chunk for Read()
+    uint64_t                jobIndex;   // next chunk for a worker
+    uint64_t                fillIndex;  // next chunk for the reader
+    bool                    readerDone; // the index record was read, or the reader failed
+    bool                    closing;
+    int                     error;
+};
+
+void DecryptMedia::ReaderThread()
+{
+    unique_lock<mutex> guard(lock);
+    while (!closing && !readerDone)
+    {
+        CryptChunk* chunk = &chunks[fillIndex % chunks.size()];
+
+        while (chunk->state != CHUNK_FREE && !closing)
+        {
+            chunkFree.wait(guard);
+        }
+        if (closing)
+        {
+            break;
+        }
+
+        guard.unlock();
+        const char* failure = NULL;
+        uint32_t bytes = 0;
+        source->Read(chunk->recordHeader, RECORD_HEADER_SIZE, &bytes);
+
+        uint32_t length = getLE32(chunk->recordHeader);
+        uint32_t flags = getLE32(chunk->recordHeader + 4);
+        if (bytes != RECORD_HEADER_SIZE)
+        {
+            failure = "the file ends before its index";
+        }
+        else if ((flags == RECORD_DATA && length > ENCRYPT_CHUNK_SIZE) ||
+                 (flags == RECORD_INDEX && length != 16 * fillIndex + 8) ||
+                 flags > RECORD_INDEX)
+        {
+            failure = "bad record header";
+        }
+        else
+        {
+            chunk->inputLength = length + ENCRYPT_TAG_SIZE;
+            if (chunk->input.size() < chunk->inputLength)
+            {
+                chunk->input.resize(chunk->inputLength);
+            }
+            source->Read(&chunk->input[0], (uint32_t)chunk->inputLength, &bytes);
+            if (bytes != chunk->inputLength)
+            {
+                failure = "the file ends before its index";
+            }
+        }
+        guard.lock();
+
+        if (failure != NULL)
+        {
+            printf("Encrypted record %llu: %s\n", (unsigned long long)fillIndex, failure);
+            if (error == ERROR_SUCCESS)
+            {
+                error = ERROR_OPERATION_ABORTED;
+            }
+            readerDone = true;
+            chunkDone.notify_all();
+            break;
+        }
+
+        chunk->index = fillIndex;
+        chunk->state = CHUNK_READY;
+        fillIndex++;
+        readerDone = (flags == RECORD_INDEX);
+        jobReady.notify_one();
+    }
+}
+
+void DecryptMedia::WorkerThread()
+{
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+
+    unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        while (!closing && (jobIndex == fillIndex ||
+               chunks[jobIndex % chunks.size()].state != CHUNK_READY))
+        {
+            jobReady.wait(guard);
+        }
+        if (closing)
+        {
+            break;
+        }
+
+        CryptChunk* chunk = &chunks[jobIndex % chunks.size()];
+        chunk->state = CHUNK_BUSY;
+        jobIndex++;
+
+        guard.unlock();
+        size_t length = chunk->inputLength - ENCRYPT_TAG_SIZE;
+        if (chunk->output.size() < length)
+        {
+            chunk->output.resize(length);
+        }
+        bool ok = ctx != NULL &&
+                  openRecord(ctx, key, header, chunk->index, chunk->recordHeader,
+                             &chunk->input[0], &chunk->output[0]);
+
+        // The index record authenticates the end; it holds no data.
+        //
+        bool last = getLE32(chunk->recordHeader + 4) == RECORD_INDEX;
+        chunk->outputLength = (last) ? 0 : length;
+        chunk->outputOffset = 0;
+        guard.lock();
+
+        if (!ok)
+        {
+            printf("Encrypted record %llu fails authentication: wrong key, or damaged\n",
+                   (unsigned long long)chunk->index);
+            if (error == ERROR_SUCCESS)
+            {
+                error = ERROR_OPERATION_ABORTED;
+            }
+        }
+        chunk->state = CHUNK_DONE;
+        chunkDone.notify_all();
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+int DecryptMedia::Read(uint8_t* buffer, uint32_t size, uint32_t* bytesTransferred)
+{
+    uint32_t done = 0;
+
+    *bytesTransferred = 0;
+
+    unique_lock<mutex> guard(lock);
+    while (done < size)
+    {
+        CryptChunk* chunk = &chunks[readIndex % chunks.size()];
+
+        while (chunk->state != CHUNK_DONE && error == ERROR_SUCCESS &&
+               !(readerDone && readIndex == fillIndex))
+        {
+            chunkDone.wait(guard);
+        }
+        if (error != ERROR_SUCCESS)
+        {
+            return error;
+        }
+        if (chunk->state != CHUNK_DONE)
+        {
+            break;
+        }
+
+        uint32_t n = (uint32_t)(chunk->outputLength - chunk->outputOffset);
+        if (n > size - done)
+        {
+            n = size - done;
+        }
+
+        guard.unlock();
+        memcpy(buffer + done, &chunk->output[chunk->outputOffset], n);
+        guard.lock();
+
+        chunk->outputOffset += n;
+        done += n;
+        if (chunk->outputOffset == chunk->outputLength)
+        {
+            chunk->state = CHUNK_FREE;
+            readIndex++;
+            chunkFree.notify_one();
+        }
+    }
+
+    *bytesTransferred = done;
+    return (done == size) ? ERROR_SUCCESS : ERROR_HANDLE_EOF;
+}
+
+void DecryptMedia::Stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        closing = true;
+    }
+    jobReady.notify_all();
+    chunkFree.notify_all();
+    for (size_t ix = 0; ix < workers.size(); ix++)
+    {
+        workers[ix].join();
+    }
+    reader.join();
+}
+
+// Check the header of an encrypted file against the key, and derive the
+// key of the file.
+//
+static bool checkHeader(const uint8_t* header, const uint8_t* masterKey, uint8_t* fileKey,
+                        const char* fname)
+{
+    uint8_t check[ENCRYPT_CHECK_SIZE];
+
+    if (memcmp(header, ENCRYPT_MAGIC, 8) != 0 || getLE32(header + 8) != ENCRYPT_VERSION ||
+        getLE32(header + 12) != ENCRYPT_CHUNK_SIZE)
+    {
+        printf("%s is not an encrypted backup\n", fname);
+        return false;
+    }
+
+    deriveKeys(masterKey, header + 16, fileKey, check);
+    if (CRYPTO_memcmp(check, header + 16 + ENCRYPT_SALT_SIZE, ENCRYPT_CHECK_SIZE) != 0)
+    {
+        printf("%s was encrypted with another key\n", fname);
+        return false;
+    }
+    return true;
+}
+
+BackupMedia* openEncryptMedia(
+    BackupMedia* media,
+    const char*  fname,
+    const char*  keyFile,
+    int          backup,
+    int          threads)
+{
+    uint8_t masterKey[ENCRYPT_KEY_SIZE];
+    uint8_t fileKey[ENCRYPT_KEY_SIZE];
+    uint8_t header[ENCRYPT_HEADER_SIZE];
+    BackupMedia* result = NULL;
+
+    if (!loadKey(keyFile, masterKey))
+    {
+        media->Close();
+        delete media;
+        return NULL;
+    }
+
+    if (backup)
+    {
+        memcpy(header, ENCRYPT_MAGIC, 8);
+        putLE32(header + 8, ENCRYPT_VERSION);
+        putLE32(header + 12, ENCRYPT_CHUNK_SIZE);
+
+        uint32_t written;
+        if (RAND_bytes(header + 16, ENCRYPT_SALT_SIZE) != 1)
+        {
+            printf("Failed to generate a salt\n");
+        }
+        else
+        {
+            deriveKeys(masterKey, header + 16, fileKey, header + 16 + ENCRYPT_SALT_SIZE);
+            if (media->Write(header, ENCRYPT_HEADER_SIZE, &written) == ERROR_SUCCESS)
+            {
+                result = new EncryptMedia(media, fileKey, header, threads);
+            }
+        }
+    }
+    else
+    {
+        uint32_t bytes = 0;
+        media->Read(header, ENCRYPT_HEADER_SIZE, &bytes);
+        if (bytes != ENCRYPT_HEADER_SIZE)
+        {
+            printf("%s is not an encrypted backup\n", fname);
+        }
+        else if (checkHeader(header, masterKey, fileKey, fname))
+        {
+            result = new DecryptMedia(media, fileKey, header, threads);
+        }
+    }
+
+    OPENSSL_cleanse(masterKey, sizeof(masterKey));
+    OPENSSL_cleanse(fileKey, sizeof(fileKey));
+    if (result == NULL)
+    {
+        media->Close();
+        delete media;
+    }
+    return result;
+}
+
+static bool readAt(int fd, uint8_t* buffer, size_t size, uint64_t offset)
+{
+    return pread(fd, buffer, size, offset) == (ssize_t)size;
+}
+
+bool readDecryptedTail(
+    const char* fname,
+    const char* keyFile,
+    uint8_t*    tail,
+    size_t      size)
+{
+    uint8_t masterKey[ENCRYPT_KEY_SIZE];
+    uint8_t fileKey[ENCRYPT_KEY_SIZE];
+    uint8_t header[ENCRYPT_HEADER_SIZE];
+    uint8_t footer[ENCRYPT_FOOTER_SIZE];
+
+    if (!loadKey(keyFile, masterKey))
+    {
+        return false;
+    }
+
+    int fd = open(fname, O_RDONLY);
+    if (fd < 0)
+    {
+        printf("Failed to open: %s\n", fname);
+        return false;
+    }
+
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    const char* failure = "no index";
+    off_t fileSize = lseek(fd, 0, SEEK_END);
+    bool ok = ctx != NULL && fileSize >= ENCRYPT_HEADER_SIZE + ENCRYPT_FOOTER_SIZE &&
+              readAt(fd, header, sizeof(header), 0) &&
+              readAt(fd, footer, sizeof(footer), fileSize - ENCRYPT_FOOTER_SIZE) &&
+              memcmp(footer + 8, ENCRYPT_INDEX_MAGIC, 8) == 0;
+    if (ok && !checkHeader(header, masterKey, fileKey, fname))
+    {
+        failure = NULL;
+        ok = false;
+    }
+
+    // The index record, then the records that hold the last 'size' bytes.
+    //
+    vector<uint8_t> index;
+    uint64_t indexOffset = getLE64(footer);
+    uint8_t recordHeader[RECORD_HEADER_SIZE];
+    if (ok)
+    {
+        ok = indexOffset + RECORD_HEADER_SIZE + ENCRYPT_FOOTER_SIZE <= (uint64_t)fileSize &&
+             readAt(fd, recordHeader, RECORD_HEADER_SIZE, indexOffset);
+    }
+    uint64_t nRecords = (getLE32(recordHeader) - 8) / 16;
+    if (ok)
+    {
+        uint32_t length = getLE32(recordHeader);
+        ok = getLE32(recordHeader + 4) == RECORD_INDEX && length % 16 == 8 &&
+             indexOffset + RECORD_HEADER_SIZE + length + ENCRYPT_TAG_SIZE + ENCRYPT_FOOTER_SIZE ==
+             (uint64_t)fileSize;
+    }
+    if (ok)
+    {
+        uint32_t length = getLE32(recordHeader);
+        vector<uint8_t> sealed(length + ENCRYPT_TAG_SIZE);
+        index.resize(length);
+        ok = readAt(fd, &sealed[0], sealed.size(), indexOffset + RECORD_HEADER_SIZE) &&
+             openRecord(ctx, fileKey, header, nRecords, recordHeader, &sealed[0], &index[0]);
+        failure = (ok) ? NULL : "the index fails authentication";
+    }
+
+    uint64_t total = (ok) ? getLE64(&index[16 * nRecords]) : 0;
+    if (ok && total < size)
+    {
+        failure = "shorter than the data asked for";
+        ok = false;
+    }
+
+    uint64_t start = total - size;
+    for (uint64_t record = 0; ok && record < nRecords; record++)
+    {
+        uint64_t recordStart = getLE64(&index[16 * record + 8]);
+        uint64_t recordEnd = (record + 1 < nRecords) ? getLE64(&index[16 * record + 24]) : total;
+        if (recordEnd <= start)
+        {
+            continue;
+        }
+
+        uint64_t offset = getLE64(&index[16 * record]);
+        vector<uint8_t> sealed(recordEnd - recordStart + ENCRYPT_TAG_SIZE);
+        vector<uint8_t> plain(recordEnd - recordStart);
+        ok = readAt(fd, recordHeader, RECORD_HEADER_SIZE, offset) &&
+             getLE32(recordHeader) == plain.size() &&
+             readAt(fd, &sealed[0], sealed.size(), offset + RECORD_HEADER_SIZE) &&
+             openRecord(ctx, fileKey, header, record, recordHeader, &sealed[0], &plain[0]);
+        if (!ok)
+        {
+            failure = "a record fails authentication";
+            break;
+        }
+
+        uint64_t from = (recordStart < start) ? start - recordStart : 0;
+        memcpy(tail + (recordStart + from - start), &plain[from], plain.size() - from);
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    close(fd);
+    OPENSSL_cleanse(masterKey, sizeof(masterKey));
+    OPENSSL_cleanse(fileKey, sizeof(fileKey));
+
+    if (!ok && failure != NULL)
+    {
+        printf("Failed to read the end of encrypted backup %s: %s\n", fname, failure);
+    }
+    return ok;
+}
+
+bool createKey(
+    const char* keyFile)
+{
+    uint8_t key[ENCRYPT_KEY_SIZE];
+    char hex[2 * ENCRYPT_KEY_SIZE + 2];
+
+    if (RAND_bytes(key, sizeof(key)) != 1)
+    {
+        printf("Failed to generate a key\n");
+        return false;
+    }
+    for (int ix = 0; ix < ENCRYPT_KEY_SIZE; ix++)
+    {
+        sprintf(hex + 2 * ix, "%02x", key[ix]);
+    }
+    strcat(hex, "\n");
+    OPENSSL_cleanse(key, sizeof(key));
+
+    // Never overwrite a key: the backups made with it would be lost.
+    //
+    int fd = open(keyFile, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+    {
+        printf("Failed to create the key file %s: %s\n", keyFile, strerror(errno));
+        return false;
+    }
+    bool ok = write(fd, hex, strlen(hex)) == (ssize_t)strlen(hex);
+    ok = (fsync(fd) == 0) && ok;
+    ok = (close(fd) == 0) && ok;
+    OPENSSL_cleanse(hex, sizeof(hex));
+
+    if (!ok)
+    {
+        printf("Failed to write the key file: %s\n", keyFile);
+        unlink(keyFile);
+        return false;
+    }
+    printf("Created key file %s\n", keyFile);
+    return true;
+}
@@ -0,0 +1,49 @@
+//*********************************************************************
+//                 Copyright (C) Microsoft Corporation.
+//
+// @File: vdile.h
+//
+// Purpose:
+//   Little endian integers in the headers, trailers and indexes of the
+//   backup file formats.
+//
+// Notes:
+//   The formats are read and written a byte at a time, so they do not
+//   depend on the byte order or the alignment of the host.
+//
+//*********************************************************************
+#ifndef VDILE_H_
+#define VDILE_H_
+
+#include <stdint.h>
+
+inline void putLE32(uint8_t* p, uint32_t value)
+{
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+}
+
+inline void putLE64(uint8_t* p, uint64_t value)
+{
+    putLE32(p, (uint32_t)value);
+    putLE32(p + 4, (uint32_t)(value >> 32));
+}
+
+inline uint32_t getLE16(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+inline uint32_t getLE32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+inline uint64_t getLE64(const uint8_t* p)
+{
+    return getLE32(p) | ((uint64_t)getLE32(p + 4) << 32);
+}
+
+#endif
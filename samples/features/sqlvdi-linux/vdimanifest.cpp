@@ -0,0 +1,404 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vdimanifest.cpp
+//
+// Block manifest of a backup.
+//
+// On backup, the CRC32C of every CRC_BLOCK_SIZE block of the data written
+// by the server is computed as it passes, and written to a manifest next
+// to the backup file, laid out as described in vdicrc.h. On restore, every
+// block is checked against the manifest before any of it is returned to
+// the server, so a damaged backup fails the restore at the first bad
+// block instead of handing the server corrupt pages.
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "vdi.h"      // completion codes
+#include "vdicrc.h"
+#include "vdile.h"
+#include "vdimedia.h"
+
+using namespace std;
+
+//----------------------------------------------------------------------------
+// NAME: ManifestMedia
+//
+// PURPOSE:
+//
+// Compute the CRC32C of every block written to 'target', and append it to
+// the manifest. 'blockCrc' covers the 'blockFill' bytes of the current
+// block seen so far.
+//
+class ManifestMedia : public BackupMedia
+{
+public:
+    ManifestMedia(BackupMedia* target, FILE* manifest, const string& manifestName)
+        : target(target), manifest(manifest), manifestName(manifestName), blockCrc(0),
+          blockFill(0), manifestCrc(0), length(0), error(ERROR_SUCCESS)
+    {
+        uint8_t header[CRC_MANIFEST_HEADER_SIZE];
+
+        memcpy(header, CRC_MANIFEST_MAGIC, 8);
+        putLE32(header + 8, CRC_MANIFEST_VERSION);
+        putLE32(header + 12, CRC_BLOCK_SIZE);
+        Append(header, sizeof(header));
+    }
+
+    ~ManifestMedia()
+    {
+        if (manifest != NULL)
+        {
+            fclose(manifest);
+        }
+        delete target;
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred)
+    {
+        *bytesTransferred = 0;
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred);
+
+    int
+    Flush();
+
+    int
+    Close();
+
+private:
+    void
+    Append(
+        const uint8_t* data,
+        size_t         size);
+
+    void
+    EndBlock();
+
+    BackupMedia*            target;
+    FILE*                   manifest;
+    string                  manifestName;
+    uint32_t                blockCrc;
+    uint32_t                blockFill;
+    uint32_t                manifestCrc;    // of everything appended so far
+    uint64_t                length;
+    int                     error;
+};
+
+void ManifestMedia::Append(const uint8_t* data, size_t size)
+{
+    manifestCrc = crc32c(manifestCrc, data, size);
+    if (fwrite(data, 1, size, manifest) != size && error == ERROR_SUCCESS)
+    {
+        printf("Failed to write the manifest: %s\n", manifestName.c_str());
+        error = ERROR_DISK_FULL;
+    }
+}
+
+void ManifestMedia::EndBlock()
+{
+    uint8_t entry[4];
+
+    putLE32(entry, blockCrc);
+    Append(entry, sizeof(entry));
+    blockCrc = 0;
+    blockFill = 0;
+}
+
+int ManifestMedia::Write(const uint8_t* buffer, uint32_t size, uint32_t* bytesTransferred)
+{
+    *bytesTransferred = 0;
+    if (error != ERROR_SUCCESS)
+    {
+        return error;
+    }
+
+    int completionCode = target->Write(buffer, size, bytesTransferred);
+    if (completionCode != ERROR_SUCCESS)
+    {
+        return completionCode;
+    }
+
+    const uint8_t* next = buffer;
+    uint32_t left = size;
+    while (left > 0)
+    {
+        uint32_t n = CRC_BLOCK_SIZE - blockFill;
+        if (n > left)
+        {
+            n = left;
+        }
+        blockCrc = crc32c(blockCrc, next, n);
+        blockFill += n;
+        next += n;
+        left -= n;
+        if (blockFill == CRC_BLOCK_SIZE)
+        {
+            EndBlock();
+        }
+    }
+    length += size;
+
+    return error;
+}
+
+// The entries of the blocks completed so far are made durable with the
+// backup data.
+//
+int ManifestMedia::Flush()
+{
+    int completionCode = target->Flush();
+
+    if (error == ERROR_SUCCESS &&
+        (fflush(manifest) != 0 || fdatasync(fileno(manifest)) != 0))
+    {
+        printf("Failed to write the manifest: %s\n", manifestName.c_str());
+        error = ERROR_DISK_FULL;
+    }
+    return (completionCode != ERROR_SUCCESS) ? completionCode : error;
+}
+
+int ManifestMedia::Close()
+{
+    if (blockFill > 0)
+    {
+        EndBlock();
+    }
+
+    uint8_t trailer[CRC_MANIFEST_TRAILER_SIZE];
+    for (int ix = 0; ix < 8; ix++)
+    {
+        trailer[ix] = (uint8_t)(length >> (8 * ix));
+    }
+    putLE32(trailer + 8, manifestCrc);
+    putLE32(trailer + 12, 0);
+    if (fwrite(trailer, 1, sizeof(trailer), manifest) != sizeof(trailer) ||
+        fflush(manifest) != 0 || fdatasync(fileno(manifest)) != 0)
+    {
+        error = ERROR_DISK_FULL;
+    }
+    if (fclose(manifest) != 0)
+    {
+        error = ERROR_DISK_FULL;
+    }
+    manifest = NULL;
+
+    int completionCode = target->Close();
+    if (error != ERROR_SUCCESS)
+    {
+        printf("Failed to write the manifest: %s\n", manifestName.c_str());
+        return error;
+    }
+    return completionCode;
+}
+
+//----------------------------------------------------------------------------
+// NAME: VerifyMedia
+//
+// PURPOSE:
+//
+// Check every block read from 'source' against the manifest before
+// returning any of it. Whole blocks that fit in a Read() are read and
+// checked in place; a block that does not is read into 'block' and
+// returned from there.
+//
+class VerifyMedia : public BackupMedia
+{
+public:
+    VerifyMedia(BackupMedia* source, const string& fname, vector<uint32_t>& entries,
+                uint64_t length)
+        : source(source), fname(fname), length(length), position(0), blockOffset(0),
+          blockLength(0), error(ERROR_SUCCESS)
+    {
+        crcs.swap(entries);
+        block.resize(CRC_BLOCK_SIZE);
+    }
+
+    ~VerifyMedia()
+    {
+        delete source;
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred);
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred)
+    {
+        *bytesTransferred = 0;
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    int
+    Flush()
+    {
+        return ERROR_SUCCESS;
+    }
+
+    int
+    Close()
+    {
+        return source->Close();
+    }
+
+private:
+    bool
+    ReadBlock(
+        uint8_t*  buffer,
+        uint32_t* size);
+
+    BackupMedia*            source;
+    string                  fname;
+    vector<uint32_t>        crcs;       // the manifest entries
+    uint64_t                length;
+    uint64_t                position;   // start of the next block to read
+    vector<uint8_t>         block;
+    uint32_t                blockOffset;
+    uint32_t                blockLength;
+    int                     error;
+};
+
+// Read the block at 'position' into 'buffer' and check it. Returns its
+// length in 'size', 0 at the end of the backup.
+//
+bool VerifyMedia::ReadBlock(uint8_t* buffer, uint32_t* size)
+{
+    uint64_t index = position / CRC_BLOCK_SIZE;
+    uint32_t want = (length - position < CRC_BLOCK_SIZE) ? (uint32_t)(length - position)
+                                                         : CRC_BLOCK_SIZE;
+    uint32_t bytes = 0;
+
+    *size = 0;
+    if (want == 0)
+    {
+        return true;
+    }
+
+    source->Read(buffer, want, &bytes);
+    if (bytes != want)
+    {
+        printf("%s ends at %llu bytes, the manifest lists %llu\n", fname.c_str(),
+               (unsigned long long)(position + bytes), (unsigned long long)length);
+        return false;
+    }
+    if (crc32c(0, buffer, want) != crcs[index])
+    {
+        printf("Block %llu of %s (offset %llu) fails its CRC32C check\n",
+               (unsigned long long)index, fname.c_str(), (unsigned long long)position);
+        return false;
+    }
+
+    position += want;
+    *size = want;
+    return true;
+}
+
+int VerifyMedia::Read(uint8_t* buffer, uint32_t size, uint32_t* bytesTransferred)
+{
+    uint32_t done = 0;
+
+    while (done < size && error == ERROR_SUCCESS)
+    {
+        if (blockOffset < blockLength)
+        {
+            uint32_t n = blockLength - blockOffset;
+            if (n > size - done)
+            {
+                n = size - done;
+            }
+            memcpy(buffer + done, &block[blockOffset], n);
+            blockOffset += n;
+            done += n;
+            continue;
+        }
+
+        uint32_t n;
+        if (size - done >= CRC_BLOCK_SIZE)
+        {
+            if (!ReadBlock(buffer + done, &n))
+            {
+                error = ERROR_OPERATION_ABORTED;
+            }
+            done += n;
+        }
+        else
+        {
+            if (!ReadBlock(block.data(), &n))
+            {
+                error = ERROR_OPERATION_ABORTED;
+            }
+            blockOffset = 0;
+            blockLength = n;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+    }
+
+    *bytesTransferred = done;
+    if (error != ERROR_SUCCESS)
+    {
+        return error;
+    }
+    return (done == size) ? ERROR_SUCCESS : ERROR_HANDLE_EOF;
+}
+
+BackupMedia* openManifestMedia(
+    BackupMedia* media,
+    const char*  fname,
+    int          backup)
+{
+    if (!backup)
+    {
+        vector<uint32_t> crcs;
+        uint64_t length;
+        if (!loadManifest(fname, &crcs, &length))
+        {
+            media->Close();
+            delete media;
+            return NULL;
+        }
+        return new VerifyMedia(media, fname, crcs, length);
+    }
+
+    string manifestName = string(fname) + CRC_MANIFEST_SUFFIX;
+    FILE* manifest = fopen(manifestName.c_str(), "wb");
+    if (manifest == NULL)
+    {
+        printf("Failed to open the manifest: %s\n", manifestName.c_str());
+        media->Close();
+        delete media;
+        return NULL;
+    }
+    return new ManifestMedia(media, manifest, manifestName);
+}
@@ -0,0 +1,499 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vdimedia.cpp
+//
+// The backup media implementations used by vdipipesample.
+//
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "vdi.h"      // completion codes
+#include "vdimedia.h"
+
+// Size of the bounce buffer used for unaligned direct I/O.
+//
+#define BOUNCE_BUFFER_SIZE (1024 * 1024)
+
+//----------------------------------------------------------------------------
+// NAME: StdioMedia
+//
+// PURPOSE:
+//
+// Buffered I/O through a stdio FILE.
+//
+class StdioMedia : public BackupMedia
+{
+public:
+    StdioMedia(FILE* fh) : fh(fh) {}
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred)
+    {
+        *bytesTransferred = (uint32_t)fread(buffer, 1, size, fh);
+
+        // assume failure is eof
+        return (*bytesTransferred == size) ? ERROR_SUCCESS : ERROR_HANDLE_EOF;
+    }
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred)
+    {
+        *bytesTransferred = (uint32_t)fwrite(buffer, 1, size, fh);
+
+        // assume failure is disk full
+        return (*bytesTransferred == size) ? ERROR_SUCCESS : ERROR_DISK_FULL;
+    }
+
+    int
+    Flush()
+    {
+        if (fflush(fh) != 0 || fdatasync(fileno(fh)) != 0)
+        {
+            return ERROR_DISK_FULL;
+        }
+        return ERROR_SUCCESS;
+    }
+
+    int
+    Close()
+    {
+        return (fclose(fh) == 0) ? ERROR_SUCCESS : ERROR_DISK_FULL;
+    }
+
+private:
+    FILE*   fh;
+};
+
+BackupMedia* openStdioMedia(
+    const char* fname,
+    int         backup)
+{
+    FILE* fh = fopen(fname, (backup) ? "wb" : "rb");
+    if (fh == NULL)
+    {
+        printf("Failed to open: %s\n", fname);
+        return NULL;
+    }
+
+    return new StdioMedia(fh);
+}
+
+//----------------------------------------------------------------------------
+// NAME: FdMedia
+//
+// PURPOSE:
+//
+// read/write system calls on a file descriptor, straight from the server's
+// buffer to the page cache, without the copy through a stdio buffer.
+//
+class FdMedia : public BackupMedia
+{
+public:
+    FdMedia(int fd) : fd(fd) {}
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred)
+    {
+        uint32_t done = 0;
+
+        while (done < size)
+        {
+            ssize_t n = read(fd, buffer + done, size - done);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                break;
+            }
+            done += (uint32_t)n;
+        }
+        *bytesTransferred = done;
+
+        // assume failure is eof
+        return (done == size) ? ERROR_SUCCESS : ERROR_HANDLE_EOF;
+    }
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred)
+    {
+        uint32_t done = 0;
+
+        while (done < size)
+        {
+            ssize_t n = write(fd, buffer + done, size - done);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                break;
+            }
+            done += (uint32_t)n;
+        }
+        *bytesTransferred = done;
+
+        // assume failure is disk full
+        return (done == size) ? ERROR_SUCCESS : ERROR_DISK_FULL;
+    }
+
+    int
+    Flush()
+    {
+        return (fdatasync(fd) == 0) ? ERROR_SUCCESS : ERROR_DISK_FULL;
+    }
+
+    int
+    Close()
+    {
+        return (close(fd) == 0) ? ERROR_SUCCESS : ERROR_DISK_FULL;
+    }
+
+private:
+    int     fd;
+};
+
+BackupMedia* openFdMedia(
+    const char* fname,
+    int         backup)
+{
+    int fd = open(fname, (backup) ? (O_WRONLY | O_CREAT | O_TRUNC) : O_RDONLY, 0666);
+    if (fd < 0)
+    {
+        printf("Failed to open: %s\n", fname);
+        return NULL;
+    }
+
+    return new FdMedia(fd);
+}
+
+//----------------------------------------------------------------------------
+// NAME: DirectMedia
+//
+// PURPOSE:
+//
+// Unbuffered I/O on a file opened with O_DIRECT. Every transfer to the file
+// starts at an aligned offset, from an aligned buffer, for a whole number
+// of blocks.
+//
+// When writing, a trailing partial block is held in 'block' until the next
+// write completes it. A flush or close writes it padded with zeros; the
+// padding is overwritten by later data or truncated by Close().
+//
+class DirectMedia : public BackupMedia
+{
+public:
+    DirectMedia(int fd, uint32_t alignment, uint8_t* bounce, uint8_t* block)
+        : fd(fd), alignment(alignment), bounce(bounce), block(block),
+          fileOffset(0), carry(0)
+    {
+    }
+
+    ~DirectMedia()
+    {
+        free(bounce);
+        free(block);
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred);
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred);
+
+    int
+    Flush();
+
+    int
+    Close();
+
+private:
+    bool
+    IsAligned(
+        const void* p)
+    {
+        return ((uintptr_t)p & (alignment - 1)) == 0;
+    }
+
+    bool
+    WriteAt(
+        const uint8_t* buffer,
+        size_t         length,
+        int64_t        offset);
+
+    ssize_t
+    ReadAt(
+        uint8_t* buffer,
+        size_t   length,
+        int64_t  offset);
+
+    int         fd;
+    uint32_t    alignment;
+    uint8_t*    bounce;     // BOUNCE_BUFFER_SIZE bytes
+    uint8_t*    block;      // one block
+    int64_t     fileOffset; // backup: bytes written as whole blocks; restore: bytes read
+    uint32_t    carry;      // bytes of a partial block held in 'block'
+};
+
+bool DirectMedia::WriteAt(const uint8_t* buffer, size_t length, int64_t offset)
+{
+    while (length > 0)
+    {
+        ssize_t n = pwrite(fd, buffer, length, offset);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        buffer += n;
+        length -= (size_t)n;
+        offset += n;
+    }
+    return true;
+}
+
+// A direct read only comes back short at the end of the file, and can
+// not be continued from the unaligned offset it stopped at.
+//
+ssize_t DirectMedia::ReadAt(uint8_t* buffer, size_t length, int64_t offset)
+{
+    ssize_t n;
+    do
+    {
+        n = pread(fd, buffer, length, offset);
+    } while (n < 0 && errno == EINTR);
+
+    return n;
+}
+
+int DirectMedia::Write(const uint8_t* buffer, uint32_t size, uint32_t* bytesTransferred)
+{
+    uint32_t done = 0;
+
+    *bytesTransferred = 0;
+
+    // Complete a partial block left by the previous write.
+    //
+    if (carry > 0)
+    {
+        uint32_t n = alignment - carry;
+        if (n > size)
+        {
+            n = size;
+        }
+        memcpy(block + carry, buffer, n);
+        carry += n;
+        done += n;
+
+        if (carry < alignment)
+        {
+            *bytesTransferred = done;
+            return ERROR_SUCCESS;
+        }
+        if (!WriteAt(block, alignment, fileOffset))
+        {
+            carry -= n;
+            return ERROR_DISK_FULL;
+        }
+        fileOffset += alignment;
+        carry = 0;
+    }
+
+    // Whole blocks go straight from the server's buffer when it is
+    // aligned, otherwise through the bounce buffer.
+    //
+    while (size - done >= alignment)
+    {
+        const uint8_t* src = buffer + done;
+        size_t n = (size - done) & ~(size_t)(alignment - 1);
+
+        if (!IsAligned(src))
+        {
+            if (n > BOUNCE_BUFFER_SIZE)
+            {
+                n = BOUNCE_BUFFER_SIZE;
+            }
+            memcpy(bounce, src, n);
+            src = bounce;
+        }
+
+        if (!WriteAt(src, n, fileOffset))
+        {
+            *bytesTransferred = done;
+            return ERROR_DISK_FULL;
+        }
+        fileOffset += n;
+        done += (uint32_t)n;
+    }
+
+    // Keep the short final block until it is completed or flushed.
+    //
+    carry = size - done;
+    memcpy(block, buffer + done, carry);
+
+    *bytesTransferred = size;
+    return ERROR_SUCCESS;
+}
+
+int DirectMedia::Read(uint8_t* buffer, uint32_t size, uint32_t* bytesTransferred)
+{
+    uint32_t done = 0;
+
+    while (done < size)
+    {
+        uint32_t want = size - done;
+        ssize_t n;
+        bool eof;
+
+        if ((fileOffset & (alignment - 1)) == 0 && IsAligned(buffer + done) && want >= alignment)
+        {
+            want &= ~(alignment - 1);
+            n = ReadAt(buffer + done, want, fileOffset);
+            if (n < 0)
+            {
+                break;
+            }
+            done += (uint32_t)n;
+            fileOffset += n;
+            eof = ((size_t)n < want);
+        }
+        else
+        {
+            // Read the blocks covering the request into the bounce
+            // buffer and copy out the part that was asked for.
+            //
+            int64_t blockStart = fileOffset & ~(int64_t)(alignment - 1);
+            uint32_t skip = (uint32_t)(fileOffset - blockStart);
+            size_t span = ((size_t)skip + want + alignment - 1) & ~(size_t)(alignment - 1);
+            if (span > BOUNCE_BUFFER_SIZE)
+            {
+                span = BOUNCE_BUFFER_SIZE;
+            }
+
+            n = ReadAt(bounce, span, blockStart);
+            if (n <= (ssize_t)skip)
+            {
+                break;
+            }
+
+            uint32_t copy = (uint32_t)(n - skip);
+            if (copy > want)
+            {
+                copy = want;
+            }
+            memcpy(buffer + done, bounce + skip, copy);
+            done += copy;
+            fileOffset += copy;
+            eof = ((size_t)n < span);
+        }
+
+        if (eof)
+        {
+            break;
+        }
+    }
+
+    *bytesTransferred = done;
+
+    // assume failure is eof
+    return (done == size) ? ERROR_SUCCESS : ERROR_HANDLE_EOF;
+}
+
+int DirectMedia::Flush()
+{
+    // Write the partial block, padded, without moving past it.
+    //
+    if (carry > 0)
+    {
+        memset(block + carry, 0, alignment - carry);
+        if (!WriteAt(block, alignment, fileOffset))
+        {
+            return ERROR_DISK_FULL;
+        }
+    }
+
+    return (fdatasync(fd) == 0) ? ERROR_SUCCESS : ERROR_DISK_FULL;
+}
+
+int DirectMedia::Close()
+{
+    int completionCode = ERROR_SUCCESS;
+
+    // Trim the padding of a short final block.
+    //
+    if (carry > 0)
+    {
+        completionCode = Flush();
+        if (completionCode == ERROR_SUCCESS &&
+            (ftruncate(fd, fileOffset + carry) != 0 || fdatasync(fd) != 0))
+        {
+            completionCode = ERROR_DISK_FULL;
+        }
+    }
+
+    close(fd);
+    return completionCode;
+}
+
+BackupMedia* openDirectMedia(
+    const char* fname,
+    int         backup,
+    uint32_t    alignment)
+{
+    void* bounce = NULL;
+    void* block = NULL;
+
+    int fd = open(fname, (backup) ? (O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT) : (O_RDONLY | O_DIRECT), 0666);
+    if (fd < 0)
+    {
+        printf("Failed to open: %s (%s)\n", fname, strerror(errno));
+        return NULL;
+    }
+
+    if (posix_memalign(&bounce, alignment, BOUNCE_BUFFER_SIZE) != 0 ||
+        posix_memalign(&block, alignment, alignment) != 0)
+    {
+        printf("Failed to allocate aligned buffers\n");
+        free(bounce);
+        close(fd);
+        return NULL;
+    }
+
+    return new DirectMedia(fd, alignment, (uint8_t*)bounce, (uint8_t*)block);
+}
@@ -0,0 +1,319 @@
+//*********************************************************************
+//                 Copyright (C) Microsoft Corporation.
+//
+// @File: vdimedia.h
+//
+// Purpose:
+//   The backup media used by the vdipipesample transfer loop: the place
+//   the data of VDC_Write commands goes to, and VDC_Read commands come
+//   from.
+//
+// Notes:
+//   Every operation returns the completion code to hand back to SQL
+//   Server through ClientVirtualDevice::CompleteCommand.
+//
+//*********************************************************************
+#ifndef VDIMEDIA_H_
+#define VDIMEDIA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The alignment requested from the server, and used for the file offsets
+// and lengths of unbuffered I/O. 4 KB covers both 512 byte and 4 KB
+// sector devices.
+//
+#define DIRECT_IO_ALIGNMENT 4096
+
+//----------------------------------------------------------------------------
+// NAME: BackupMedia
+//
+// PURPOSE:
+//
+// A sequential stream of backup data.
+//
+class BackupMedia
+{
+public:
+    virtual ~BackupMedia() {}
+
+    // Read the next 'size' bytes. A short read means the end of the media
+    // was reached and returns ERROR_HANDLE_EOF.
+    //
+    virtual int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred) = 0;
+
+    virtual int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred) = 0;
+
+    // Make everything written so far durable.
+    //
+    virtual int
+    Flush() = 0;
+
+    // Finish the media. Must be called before the object is deleted.
+    //
+    virtual int
+    Close() = 0;
+};
+
+// Open 'fname' through a stdio FILE.
+// Returns NULL, after printing the reason, on failure.
+//
+BackupMedia* openStdioMedia(
+    const char* fname,
+    int         backup);
+
+// Open 'fname' as a plain file descriptor, using read and write.
+// Returns NULL, after printing the reason, on failure.
+//
+BackupMedia* openFdMedia(
+    const char* fname,
+    int         backup);
+
+// Open 'fname' with O_DIRECT, bypassing the page cache. Buffers, lengths
+// or positions that are not aligned to 'alignment' go through an aligned
+// bounce buffer, and a short final block is padded on disk and trimmed
+// again when the media is closed.
+// Returns NULL, after printing the reason, on failure.
+//
+BackupMedia* openDirectMedia(
+    const char* fname,
+    int         backup,
+    uint32_t    alignment);
+
+// Stripe the backup data of 'fname' across files in the comma separated
+// list of directories 'stripeDirs', in units dealt round robin and written
+// or read by one thread per stripe, and keep the stripe map in 'fname'
+// itself. The stripes are opened with O_DIRECT if 'directIO'. On backup,
+// if 'preallocate' is not 0, space for that many bytes of data is
+// reserved across the stripes, and buffered stripes are written back
+// progressively in windows of 'writeback' bytes if that is not 0.
+// Returns NULL, after printing the reason, on failure.
+//
+BackupMedia* openStripeMedia(
+    const char* fname,
+    int         backup,
+    const char* stripeDirs,
+    bool        directIO,
+    uint64_t    preallocate,
+    uint64_t    writeback);
+
+// Split the backup data of 'fname' into volume files of 'volumeSize'
+// bytes next to it, 'fname.vol0000' and so on, written and closed by a
+// small pool of writer threads, and keep the manifest of the volumes, with
+// their CRC32C, in 'fname' itself. Volumes are listed as soon as they are
+// durable. On restore, the next volume is opened ahead of time, and every
+// volume is checked against the manifest. The volumes are opened with
+// O_DIRECT if 'directIO'; on backup, each one is preallocated if
+// 'preallocate', and buffered ones are written back progressively in
+// windows of 'writeback' bytes if that is not 0.
+// Returns NULL, after printing the reason, on failure.
+//
+BackupMedia* openVolumeMedia(
+    const char* fname,
+    int         backup,
+    uint64_t    volumeSize,
+    bool        directIO,
+    bool        preallocate,
+    uint64_t    writeback);
+
+// On backup, write the data written to 'media', the backup file 'fname',
+// to a copy of it in each directory of the comma separated list
+// 'mirrorDirs' as well, every copy from its own queue and writer thread.
+// Commands complete once 'quorum' copies have done them, or all of them
+// if 'quorum' is 0; the others catch up before Close() returns. The
+// backup fails if 'media' fails, whatever the quorum. A copy that failed,
+// or every copy if the backup failed, is renamed with the suffix
+// ".failed". The copies are opened with O_DIRECT if 'directIO', and
+// 'preallocate' bytes are reserved for each of them if it is not 0.
+// Buffered copies are written back progressively in windows of
+// 'writeback' bytes if that is not 0.
+// The mirror media owns 'media'.
+// Returns NULL, after printing the reason, on failure.
+//
+BackupMedia* openMirrorMedia(
+    BackupMedia* media,
+    const char*  fname,
+    const char*  mirrorDirs,
+    int          quorum,
+    bool         directIO,
+    uint64_t     preallocate,
+    uint64_t     writeback);
+
+// Reserve space for the first 'size' bytes of the backup file 'fname',
+// written through 'media', before they are written, extend the
+// reservation in large steps if the data outgrows it, and give back what
+// is left unused when the media is closed.
+// The preallocation media owns 'media'.
+// Returns NULL, after printing the reason, on failure.
+//
+BackupMedia* openPreallocateMedia(
+    BackupMedia* media,
+    const char*  fname,
+    uint64_t     size);
+
+// Start the writeback of the buffered backup file 'fname', written through
+// 'media', every 'window' bytes, wait for the window before to reach the
+// disk and drop it from the page cache, so that dirty data never piles up.
+// The writeback media owns 'media'.
+// Returns NULL, after printing the reason, on failure.
+//
+BackupMedia* openWritebackMedia(
+    BackupMedia* media,
+    const char*  fname,
+    uint64_t     window);
+
+// Stage backup data written to 'target' in a ring of 'ringSize' bytes,
+// drained by a writer thread, so that writes complete as soon as the data
+// is copied. Flush() and Close() wait until all staged data is durable.
+// The staging media owns 'target'.
+// Returns NULL, after printing the reason, on failure.
+//
+BackupMedia* openStagingMedia(
+    BackupMedia* target,
+    size_t       ringSize);
+
+// Read 'source' ahead of the server into 'bufferCount' buffers of
+// 'bufferSize' bytes, filled by a reader thread.
+// The read-ahead media owns 'source'.
+// Returns NULL, after printing the reason, on failure.
+//
+BackupMedia* openReadAheadMedia(
+    BackupMedia* source,
+    uint32_t     bufferSize,
+    int          bufferCount);
+
+// The codecs used by openCompressMedia(). CompressAuto picks one for every
+// frame from an estimate of the entropy of its data: frames that look
+// random are stored as they are, frames in between use LZ4, and the
+// others zstd.
+//
+enum CompressCodec
+{
+    CompressZstd,
+    CompressLz4,
+    CompressAuto
+};
+
+// On backup, compress the data written to 'media' in independent frames of
+// 'frameSize' bytes with 'codec', zstd at 'level', on 'threads' worker
+// threads, and append a seek table in the zstd seekable format when it is
+// closed.
+// If 'dictDir' is not NULL, zstd frames are compressed with the dictionary
+// linked to by vdipipe-current.dict in that directory. If 'pageTransform',
+// the pages of every frame are rearranged before it is compressed.
+// On restore, read the seek table at the end of 'fname' and decompress the
+// frames read from 'media' on 'threads' worker threads, ahead of Read().
+// Each frame records its codec and dictionary, so 'codec' and 'level' are
+// not used, and dictionaries are looked up by id in 'dictDir'.
+// If 'keyFile' is not NULL, 'fname' is encrypted with that key and the
+// seek table is read through readDecryptedTail().
+// The compression media owns 'media'.
+// Returns NULL, after printing the reason, on failure.
+//
+BackupMedia* openCompressMedia(
+    BackupMedia*  media,
+    const char*   fname,
+    int           backup,
+    uint32_t      frameSize,
+    CompressCodec codec,
+    int           level,
+    const char*   dictDir,
+    bool          pageTransform,
+    const char*   keyFile,
+    int           threads);
+
+// Train a zstd dictionary from the uncompressed backups 'files', write it
+// to 'dictDir' under its id, and make it the one new backups use.
+// Returns false, after printing the reason, on failure.
+//
+bool trainDictionary(
+    const char* dictDir,
+    int         nFiles,
+    char*       files[]);
+
+// On restore, if 'fname' is compressed with gzip, zstd or xz, decode the
+// data read from 'media' ahead of Read(), on 'threads' worker threads
+// where the format allows decoding parts of it independently.
+// The archive media owns 'media'.
+// Returns 'media' itself if 'fname' is not compressed.
+//
+BackupMedia* openArchiveMedia(
+    BackupMedia* media,
+    const char*  fname,
+    int          threads);
+
+// Back up into the deduplicating chunk store 'storeDir', writing the
+// recipe of the backup to 'fname' and storing chunks on 'threads' threads,
+// or restore from the recipe in 'fname', prefetching chunks on 'threads'
+// threads.
+// Returns NULL, after printing the reason, on failure.
+//
+BackupMedia* openDedupMedia(
+    const char* fname,
+    int         backup,
+    const char* storeDir,
+    int         threads);
+
+// On backup, write to 'media' only the differences of the data from the
+// earlier backup 'baseName', and copies of its blocks. On restore, rebuild
+// the data from the differences read from 'media' and from 'baseName'.
+// The delta media owns 'media'.
+// Returns NULL, after printing the reason, on failure.
+//
+BackupMedia* openDeltaMedia(
+    BackupMedia* media,
+    const char*  baseName,
+    int          backup);
+
+// On backup, write the CRC32C of every block of the data written to
+// 'media' to the manifest 'fname.crc'. On restore, check every block read
+// from 'media' against that manifest before returning it.
+// The manifest media owns 'media'.
+// Returns NULL, after printing the reason, on failure.
+//
+BackupMedia* openManifestMedia(
+    BackupMedia* media,
+    const char*  fname,
+    int          backup);
+
+// On backup, encrypt the data written to 'media' with AES-256-GCM in
+// independent chunks on 'threads' worker threads, with a key derived from
+// the key in 'keyFile' and a random salt. On restore, decrypt and
+// authenticate the chunks read from 'media' on 'threads' worker threads,
+// ahead of Read(); 'fname' names the file in messages.
+// The encryption media owns 'media'.
+// Returns NULL, after printing the reason, on failure.
+//
+BackupMedia* openEncryptMedia(
+    BackupMedia* media,
+    const char*  fname,
+    const char*  keyFile,
+    int          backup,
+    int          threads);
+
+// Decrypt and authenticate the last 'size' bytes of the data in the
+// encrypted backup 'fname' into 'tail', without reading the rest.
+// Returns false, after printing the reason, on failure.
+//
+bool readDecryptedTail(
+    const char* fname,
+    const char* keyFile,
+    uint8_t*    tail,
+    size_t      size);
+
+// Write a new random 256 bit key to 'keyFile', which must not exist,
+// readable by its owner only.
+// Returns false, after printing the reason, on failure.
+//
+bool createKey(
+    const char* keyFile);
+
+#endif
@@ -0,0 +1,563 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vdimirror.cpp
+//
+// Mirrored backups.
+//
+// Every buffer written by the server is copied once into a block shared by
+// all the copies of the backup, and queued to each of them; each copy has
+// its own writer thread, so a slow copy does not hold up the others. A
+// command completes once a quorum of the copies has written its data, and
+// a VDC_Flush once a quorum has made everything durable. With a quorum of
+// all the copies, every copy is as current as the server believes; with a
+// smaller one, the lagging copies catch up in the background, up to
+// MIRROR_QUEUE_SIZE bytes behind, and Close() waits for them. A copy that
+// fails is dropped, and the backup fails when too few are left for the
+// quorum. The backup file itself, copy 0, is the one a restore opens, so
+// the backup also fails when it does. A mirror copy that failed, or every
+// mirror copy of a backup that failed, is renamed to 'name.failed' when it
+// is closed, so that it cannot be restored from by mistake.
+//
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+
+#include "vdi.h"      // completion codes
+#include "vdimedia.h"
+
+using namespace std;
+
+#define MIRROR_MAX          16
+
+#define MIRROR_FAILED_SUFFIX    ".failed"
+
+// Most data queued and not yet written by every copy.
+//
+#define MIRROR_QUEUE_SIZE   (256 * 1024 * 1024)
+
+typedef chrono::steady_clock Clock;
+
+// A buffer of backup data, written by every copy in turn.
+//
+struct MirrorBlock
+{
+    vector<uint8_t> data;
+    uint32_t        length;
+};
+
+// One copy of the backup, and its statistics.
+//
+struct MirrorCopy
+{
+    BackupMedia*    media;
+    string          name;
+    uint64_t        next;           // sequence number of the next block to write
+    uint64_t        flushed;        // last flush request done
+    bool            failed;
+    uint64_t        bytes;
+    double          writeSeconds;
+    double          flushSeconds;
+    uint64_t        passed;         // bytes of the blocks written or skipped
+    uint64_t        maxLag;         // most bytes queued for this copy at once
+};
+
+//----------------------------------------------------------------------------
+// NAME: MirrorMedia
+//
+// PURPOSE:
+//
+// Write the backup data to every copy. Block n of the queue has sequence
+// number 'first' + n; a block is released once every copy is past it.
+//
+class MirrorMedia : public BackupMedia
+{
+public:
+    MirrorMedia(vector<MirrorCopy>& mirrorCopies, int quorum)
+        : quorum(quorum), first(0), produced(0), queued(0), producedBytes(0), flushRequest(0),
+          flushMark(0), closing(false), error(ERROR_SUCCESS)
+    {
+        copies.swap(mirrorCopies);
+        for (size_t ix = 0; ix < copies.size(); ix++)
+        {
+            writers.push_back(thread(&MirrorMedia::WriterThread, this, ix));
+        }
+    }
+
+    ~MirrorMedia()
+    {
+        if (!writers.empty())
+        {
+            Stop();
+        }
+        for (size_t ix = 0; ix < copies.size(); ix++)
+        {
+            delete copies[ix].media;
+        }
+        for (size_t ix = 0; ix < queue.size(); ix++)
+        {
+            delete queue[ix];
+        }
+        for (size_t ix = 0; ix < spare.size(); ix++)
+        {
+            delete spare[ix];
+        }
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred)
+    {
+        *bytesTransferred = 0;
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred);
+
+    int
+    Flush();
+
+    int
+    Close();
+
+private:
+    void
+    WriterThread(
+        size_t copy);
+
+    void
+    Release();
+
+    int
+    WaitForCopies(
+        unique_lock<mutex>& guard,
+        uint64_t            blocks,
+        uint64_t            request,
+        int                 needed,
+        const char*         what);
+
+    void
+    Stop();
+
+    vector<MirrorCopy>      copies;
+    int                     quorum;
+
+    mutex                   lock;
+    condition_variable      blockReady; // a block, or a flush, is waiting for the writers
+    condition_variable      copyDone;   // a copy wrote a block, flushed, or failed
+    deque<MirrorBlock*>     queue;
+    vector<MirrorBlock*>    spare;
+    vector<thread>          writers;
+    uint64_t                first;      // sequence number of queue.front()
+    uint64_t                produced;   // blocks queued so far
+    uint64_t                queued;     // bytes in the queue
+    uint64_t                producedBytes;
+    uint64_t                flushRequest;
+    uint64_t                flushMark;  // blocks to write before the flush
+    bool                    closing;
+    int                     error;      // set once the quorum is lost
+};
+
+// Drop the blocks every copy is past. Called with the lock held.
+//
+void MirrorMedia::Release()
+{
+    uint64_t oldest = produced;
+
+    for (size_t ix = 0; ix < copies.size(); ix++)
+    {
+        if (copies[ix].next < oldest)
+        {
+            oldest = copies[ix].next;
+        }
+    }
+    while (first < oldest)
+    {
+        queued -= queue.front()->length;
+        spare.push_back(queue.front());
+        queue.pop_front();
+        first++;
+    }
+}
+
+void MirrorMedia::WriterThread(size_t copy)
+{
+    MirrorCopy& target = copies[copy];
+
+    unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        while (target.next == produced &&
+               !(target.flushed < flushRequest && target.next >= flushMark) && !closing)
+        {
+            blockReady.wait(guard);
+        }
+
+        // A flush goes first once the blocks before it are written.
+        //
+        if (target.flushed < flushRequest && target.next >= flushMark)
+        {
+            uint64_t request = flushRequest;
+            if (!target.failed)
+            {
+                guard.unlock();
+                Clock::time_point start = Clock::now();
+                int completionCode = target.media->Flush();
+                double seconds = chrono::duration<double>(Clock::now() - start).count();
+                guard.lock();
+
+                target.flushSeconds += seconds;
+                if (completionCode != ERROR_SUCCESS)
+                {
+                    printf("Copy %s fails to flush: x%X\n", target.name.c_str(), completionCode);
+                    target.failed = true;
+                }
+            }
+            target.flushed = request;
+            copyDone.notify_all();
+        }
+        else if (target.next < produced)
+        {
+            MirrorBlock* block = queue[target.next - first];
+            if (!target.failed)
+            {
+                if (producedBytes - target.passed > target.maxLag)
+                {
+                    target.maxLag = producedBytes - target.passed;
+                }
+
+                // The block stays queued until this copy is past it.
+                //
+                guard.unlock();
+                uint32_t bytes;
+                Clock::time_point start = Clock::now();
+                int completionCode = target.media->Write(&block->data[0], block->length, &bytes);
+                double seconds = chrono::duration<double>(Clock::now() - start).count();
+                guard.lock();
+
+                target.writeSeconds += seconds;
+                if (completionCode != ERROR_SUCCESS)
+                {
+                    printf("Copy %s fails to write: x%X\n", target.name.c_str(), completionCode);
+                    target.failed = true;
+                }
+                else
+                {
+                    target.bytes += block->length;
+                }
+            }
+            target.passed += block->length;
+            target.next++;
+            Release();
+            copyDone.notify_all();
+        }
+        else
+        {
+            break;
+        }
+    }
+}
+
+// Wait until 'needed' copies, or all the copies left if 'needed' is 0,
+// have written the first 'blocks' blocks and done flush 'request'. Fails,
+// for good, as soon as too few copies are left or the backup file fails.
+//
+int MirrorMedia::WaitForCopies(unique_lock<mutex>& guard, uint64_t blocks, uint64_t request,
+                               int needed, const char* what)
+{
+    for (;;)
+    {
+        if (copies[0].failed)
+        {
+            printf("The backup file %s failed, unable to %s\n", copies[0].name.c_str(), what);
+            error = ERROR_OPERATION_ABORTED;
+            return error;
+        }
+
+        int done = 0;
+        int alive = 0;
+        for (size_t ix = 0; ix < copies.size(); ix++)
+        {
+            if (!copies[ix].failed)
+            {
+                alive++;
+                if (copies[ix].next >= blocks && copies[ix].flushed >= request)
+                {
+                    done++;
+                }
+            }
+        }
+        if (done >= ((needed > 0) ? needed : alive))
+        {
+            return ERROR_SUCCESS;
+        }
+        if (alive < needed)
+        {
+            printf("Only %d of %zu copies are left, %d are needed to %s\n", alive, copies.size(),
+                   needed, what);
+            error = ERROR_OPERATION_ABORTED;
+            return error;
+        }
+        copyDone.wait(guard);
+    }
+}
+
+int MirrorMedia::Write(const uint8_t* buffer, uint32_t size, uint32_t* bytesTransferred)
+{
+    *bytesTransferred = 0;
+    if (size == 0)
+    {
+        return ERROR_SUCCESS;
+    }
+
+    unique_lock<mutex> guard(lock);
+    if (error != ERROR_SUCCESS)
+    {
+        return error;
+    }
+
+    // Bound how far the slowest copy can fall behind.
+    //
+    while (queued > 0 && queued + size > MIRROR_QUEUE_SIZE)
+    {
+        copyDone.wait(guard);
+    }
+
+    MirrorBlock* block;
+    if (spare.empty())
+    {
+        block = new MirrorBlock;
+    }
+    else
+    {
+        block = spare.back();
+        spare.pop_back();
+    }
+    guard.unlock();
+
+    if (block->data.size() < size)
+    {
+        block->data.resize(size);
+    }
+    memcpy(&block->data[0], buffer, size);
+    block->length = size;
+
+    guard.lock();
+    queue.push_back(block);
+    queued += size;
+    produced++;
+    producedBytes += size;
+    blockReady.notify_all();
+
+    int completionCode = WaitForCopies(guard, produced, 0, quorum, "complete a write");
+    if (completionCode == ERROR_SUCCESS)
+    {
+        *bytesTransferred = size;
+    }
+    return completionCode;
+}
+
+int MirrorMedia::Flush()
+{
+    unique_lock<mutex> guard(lock);
+    if (error != ERROR_SUCCESS)
+    {
+        return error;
+    }
+
+    uint64_t request = ++flushRequest;
+    flushMark = produced;
+    blockReady.notify_all();
+
+    return WaitForCopies(guard, produced, request, quorum, "flush");
+}
+
+void MirrorMedia::Stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        closing = true;
+    }
+    blockReady.notify_all();
+    for (size_t ix = 0; ix < writers.size(); ix++)
+    {
+        writers[ix].join();
+    }
+    writers.clear();
+}
+
+int MirrorMedia::Close()
+{
+    // Every copy still alive catches up before the backup completes.
+    //
+    {
+        unique_lock<mutex> guard(lock);
+
+        uint64_t request = ++flushRequest;
+        flushMark = produced;
+        blockReady.notify_all();
+        WaitForCopies(guard, produced, request, 0, "close");
+    }
+
+    Stop();
+
+    for (size_t ix = 0; ix < copies.size(); ix++)
+    {
+        MirrorCopy& copy = copies[ix];
+        int closeCode = copy.media->Close();
+        if (closeCode != ERROR_SUCCESS && !copy.failed)
+        {
+            printf("Copy %s fails to close: x%X\n", copy.name.c_str(), closeCode);
+            copy.failed = true;
+        }
+
+        printf("Copy %zu (%s): %s, %.1f MB, %.2f s writing (%.1f MB/s), %.2f s flushing, "
+               "up to %.1f MB behind\n",
+               ix, copy.name.c_str(), (copy.failed) ? "FAILED" : "ok", copy.bytes / 1048576.0,
+               copy.writeSeconds,
+               (copy.writeSeconds > 0) ? copy.bytes / 1048576.0 / copy.writeSeconds : 0.0,
+               copy.flushSeconds, copy.maxLag / 1048576.0);
+    }
+
+    int alive = 0;
+    for (size_t ix = 0; ix < copies.size(); ix++)
+    {
+        alive += (copies[ix].failed) ? 0 : 1;
+    }
+    int completionCode = error;
+    if (completionCode == ERROR_SUCCESS && copies[0].failed)
+    {
+        printf("The backup file %s is not complete\n", copies[0].name.c_str());
+        completionCode = ERROR_OPERATION_ABORTED;
+    }
+    if (completionCode == ERROR_SUCCESS && alive < quorum)
+    {
+        printf("Only %d of %zu copies are complete, %d are needed\n", alive, copies.size(),
+               quorum);
+        completionCode = ERROR_OPERATION_ABORTED;
+    }
+
+    // A mirror copy that failed, or that a failed backup left incomplete,
+    // must not be restored from. The backup file is left to the caller, as
+    // for any failed backup.
+    //
+    for (size_t ix = 1; ix < copies.size(); ix++)
+    {
+        if (copies[ix].failed || completionCode != ERROR_SUCCESS)
+        {
+            string failedName = copies[ix].name + MIRROR_FAILED_SUFFIX;
+            if (rename(copies[ix].name.c_str(), failedName.c_str()) != 0)
+            {
+                printf("Failed to rename copy %s: %s\n", copies[ix].name.c_str(),
+                       strerror(errno));
+            }
+            else
+            {
+                printf("Copy %s is incomplete, renamed to %s\n", copies[ix].name.c_str(),
+                       failedName.c_str());
+            }
+        }
+    }
+    return completionCode;
+}
+
+BackupMedia* openMirrorMedia(
+    BackupMedia* media,
+    const char*  fname,
+    const char*  mirrorDirs,
+    int          quorum,
+    bool         directIO,
+    uint64_t     preallocate,
+    uint64_t     writeback)
+{
+    vector<MirrorCopy> copies;
+    MirrorCopy copy = { media, fname, 0, 0, false, 0, 0, 0, 0, 0 };
+    copies.push_back(copy);
+
+    string base = fname;
+    size_t slash = base.rfind('/');
+    if (slash != string::npos)
+    {
+        base = base.substr(slash + 1);
+    }
+
+    // The copies go to 'dir/name', one per directory in the list.
+    //
+    string list = mirrorDirs;
+    size_t start = 0;
+    bool ok = true;
+    while (ok)
+    {
+        size_t comma = list.find(',', start);
+        string dir = list.substr(start, (comma == string::npos) ? string::npos : comma - start);
+        if (dir.empty() || copies.size() > MIRROR_MAX)
+        {
+            printf("Bad mirror directory list: %s\n", mirrorDirs);
+            ok = false;
+            break;
+        }
+
+        copy.name = dir + "/" + base;
+        copy.media = (directIO) ? openDirectMedia(copy.name.c_str(), true, DIRECT_IO_ALIGNMENT)
+                                : openFdMedia(copy.name.c_str(), true);
+        if (copy.media != NULL && preallocate > 0)
+        {
+            copy.media = openPreallocateMedia(copy.media, copy.name.c_str(), preallocate);
+        }
+        if (copy.media != NULL && writeback > 0 && !directIO)
+        {
+            copy.media = openWritebackMedia(copy.media, copy.name.c_str(), writeback);
+        }
+        if (copy.media == NULL)
+        {
+            ok = false;
+            break;
+        }
+        copies.push_back(copy);
+
+        if (comma == string::npos)
+        {
+            break;
+        }
+        start = comma + 1;
+    }
+
+    if (ok && quorum > (int)copies.size())
+    {
+        printf("A quorum of %d copies was asked for, there are %zu\n", quorum, copies.size());
+        ok = false;
+    }
+    if (!ok)
+    {
+        for (size_t ix = 0; ix < copies.size(); ix++)
+        {
+            copies[ix].media->Close();
+            delete copies[ix].media;
+        }
+        return NULL;
+    }
+
+    return new MirrorMedia(copies, (quorum > 0) ? quorum : (int)copies.size());
+}
@@ -0,0 +1,278 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vdipage.cpp
+//
+// Page aware transform of backup data, applied before compression.
+//
+// Most of a database backup is a copy of its 8 KB pages. Each starts with
+// a 96 byte header whose fields change little from one page to the next,
+// and ends with a slot array of 2 byte row offsets that mostly grow by the
+// row size. Interleaved with the rows, both look like noise to a
+// compressor with a limited window. The transform finds the 8 KB aligned
+// blocks of a buffer that look like pages and writes, in order:
+//
+//  phase       u32, offset of the first block, chosen so that most blocks
+//              look like pages
+//  pages       u32, number of blocks taken as pages
+//  bitmap      one bit per block, set for pages
+//  headers     the page headers, transposed so that byte n of every header
+//              comes together
+//  slots       the slot arrays as differences between consecutive
+//              entries, low bytes then high bytes
+//  rows        the rest of every page
+//  raw         the bytes before the first block, the blocks that are not
+//              pages and the bytes after the last block
+//
+// Every region but the first two is a permutation or a reversible
+// difference of the input, so the transform can be undone exactly whatever
+// the data was; misdetecting a page only costs compression ratio.
+//
+
+#include <cstring>
+#include <vector>
+
+#include "vdile.h"
+#include "vdipage.h"
+
+using namespace std;
+
+// Page header fields used to recognize a page.
+//
+#define PAGE_HEADER_VERSION     1
+#define PAGE_TYPE_MAX           20
+#define PAGE_SLOT_COUNT_OFFSET  22
+#define PAGE_MAX_SLOTS          ((SQL_PAGE_SIZE - SQL_PAGE_HEADER_SIZE) / 2)
+
+// Candidate phases are tried in steps of PAGE_PHASE_STEP, on the first
+// PAGE_PHASE_PROBES blocks.
+//
+#define PAGE_PHASE_STEP         512
+#define PAGE_PHASE_PROBES       16
+
+#define TRANSFORM_HEADER_SIZE   8
+
+static uint32_t slotCount(const uint8_t* page)
+{
+    return page[PAGE_SLOT_COUNT_OFFSET] | (page[PAGE_SLOT_COUNT_OFFSET + 1] << 8);
+}
+
+static bool isPage(const uint8_t* block)
+{
+    return block[0] == PAGE_HEADER_VERSION && block[1] >= 1 && block[1] <= PAGE_TYPE_MAX &&
+           slotCount(block) <= PAGE_MAX_SLOTS;
+}
+
+// Pick the offset of the first block that makes the most of the probed
+// blocks look like pages.
+//
+static size_t choosePhase(const uint8_t* input, size_t length)
+{
+    size_t bestPhase = 0;
+    int bestPages = -1;
+
+    for (size_t phase = 0; phase < SQL_PAGE_SIZE && phase + SQL_PAGE_SIZE <= length;
+         phase += PAGE_PHASE_STEP)
+    {
+        int pages = 0;
+        for (size_t block = 0; block < PAGE_PHASE_PROBES &&
+             phase + (block + 1) * SQL_PAGE_SIZE <= length; block++)
+        {
+            pages += isPage(input + phase + block * SQL_PAGE_SIZE);
+        }
+        if (pages > bestPages)
+        {
+            bestPhase = phase;
+            bestPages = pages;
+        }
+    }
+    return bestPhase;
+}
+
+size_t pageTransformBound(size_t length)
+{
+    return TRANSFORM_HEADER_SIZE + (length / SQL_PAGE_SIZE + 7) / 8 + length;
+}
+
+size_t pageTransform(const uint8_t* input, size_t length, uint8_t* output)
+{
+    size_t phase = choosePhase(input, length);
+    size_t blocks = (length - phase) / SQL_PAGE_SIZE;
+    size_t bitmapSize = (blocks + 7) / 8;
+    uint8_t* bitmap = output + TRANSFORM_HEADER_SIZE;
+    vector<size_t> pages;
+    size_t slots = 0;
+
+    memset(bitmap, 0, bitmapSize);
+    for (size_t block = 0; block < blocks; block++)
+    {
+        const uint8_t* p = input + phase + block * SQL_PAGE_SIZE;
+        if (isPage(p))
+        {
+            bitmap[block / 8] |= (uint8_t)(1 << (block % 8));
+            pages.push_back(block);
+            slots += slotCount(p);
+        }
+    }
+
+    putLE32(output, (uint32_t)phase);
+    putLE32(output + 4, (uint32_t)pages.size());
+
+    uint8_t* headers = bitmap + bitmapSize;
+    uint8_t* slotsLow = headers + pages.size() * SQL_PAGE_HEADER_SIZE;
+    uint8_t* slotsHigh = slotsLow + slots;
+    uint8_t* rows = slotsHigh + slots;
+
+    for (size_t ix = 0; ix < pages.size(); ix++)
+    {
+        const uint8_t* p = input + phase + pages[ix] * SQL_PAGE_SIZE;
+        uint32_t count = slotCount(p);
+        uint16_t previous = SQL_PAGE_HEADER_SIZE;
+
+        for (size_t byte = 0; byte < SQL_PAGE_HEADER_SIZE; byte++)
+        {
+            headers[byte * pages.size() + ix] = p[byte];
+        }
+
+        // Slot 0 is at the end of the page.
+        //
+        for (uint32_t slot = 0; slot < count; slot++)
+        {
+            const uint8_t* entry = p + SQL_PAGE_SIZE - 2 * (slot + 1);
+            uint16_t offset = (uint16_t)(entry[0] | (entry[1] << 8));
+            uint16_t delta = (uint16_t)(offset - previous);
+
+            *slotsLow++ = (uint8_t)delta;
+            *slotsHigh++ = (uint8_t)(delta >> 8);
+            previous = offset;
+        }
+
+        size_t rowBytes = SQL_PAGE_SIZE - SQL_PAGE_HEADER_SIZE - 2 * count;
+        memcpy(rows, p + SQL_PAGE_HEADER_SIZE, rowBytes);
+        rows += rowBytes;
+    }
+
+    // Everything that is not a page, in order.
+    //
+    uint8_t* raw = rows;
+    memcpy(raw, input, phase);
+    raw += phase;
+    for (size_t block = 0, ix = 0; block < blocks; block++)
+    {
+        if (ix < pages.size() && pages[ix] == block)
+        {
+            ix++;
+            continue;
+        }
+        memcpy(raw, input + phase + block * SQL_PAGE_SIZE, SQL_PAGE_SIZE);
+        raw += SQL_PAGE_SIZE;
+    }
+    size_t tail = phase + blocks * SQL_PAGE_SIZE;
+    memcpy(raw, input + tail, length - tail);
+    raw += length - tail;
+
+    return raw - output;
+}
+
+bool pageRestore(const uint8_t* input, size_t inputLength, uint8_t* output, size_t length)
+{
+    if (inputLength < TRANSFORM_HEADER_SIZE)
+    {
+        return false;
+    }
+
+    size_t phase = getLE32(input);
+    size_t nPages = getLE32(input + 4);
+    size_t blocks = (length >= SQL_PAGE_SIZE && phase < SQL_PAGE_SIZE && phase <= length)
+        ? (length - phase) / SQL_PAGE_SIZE
+        : 0;
+    size_t bitmapSize = (blocks + 7) / 8;
+
+    if ((blocks == 0 && (phase != 0 || nPages != 0)) ||
+        inputLength != TRANSFORM_HEADER_SIZE + bitmapSize + length)
+    {
+        return false;
+    }
+
+    const uint8_t* bitmap = input + TRANSFORM_HEADER_SIZE;
+    vector<size_t> pages;
+    for (size_t block = 0; block < blocks; block++)
+    {
+        if (bitmap[block / 8] & (1 << (block % 8)))
+        {
+            pages.push_back(block);
+        }
+    }
+    if (pages.size() != nPages)
+    {
+        return false;
+    }
+
+    // The headers first, as they hold the slot counts.
+    //
+    const uint8_t* headers = bitmap + bitmapSize;
+    size_t slots = 0;
+    for (size_t ix = 0; ix < nPages; ix++)
+    {
+        uint8_t* p = output + phase + pages[ix] * SQL_PAGE_SIZE;
+        for (size_t byte = 0; byte < SQL_PAGE_HEADER_SIZE; byte++)
+        {
+            p[byte] = headers[byte * nPages + ix];
+        }
+        if (slotCount(p) > PAGE_MAX_SLOTS)
+        {
+            return false;
+        }
+        slots += slotCount(p);
+    }
+
+    const uint8_t* slotsLow = headers + nPages * SQL_PAGE_HEADER_SIZE;
+    const uint8_t* slotsHigh = slotsLow + slots;
+    const uint8_t* rows = slotsHigh + slots;
+
+    for (size_t ix = 0; ix < nPages; ix++)
+    {
+        uint8_t* p = output + phase + pages[ix] * SQL_PAGE_SIZE;
+        uint32_t count = slotCount(p);
+        uint16_t previous = SQL_PAGE_HEADER_SIZE;
+
+        for (uint32_t slot = 0; slot < count; slot++)
+        {
+            uint16_t offset = (uint16_t)(previous + (*slotsLow++ | (*slotsHigh++ << 8)));
+            uint8_t* entry = p + SQL_PAGE_SIZE - 2 * (slot + 1);
+
+            entry[0] = (uint8_t)offset;
+            entry[1] = (uint8_t)(offset >> 8);
+            previous = offset;
+        }
+
+        size_t rowBytes = SQL_PAGE_SIZE - SQL_PAGE_HEADER_SIZE - 2 * count;
+        memcpy(p + SQL_PAGE_HEADER_SIZE, rows, rowBytes);
+        rows += rowBytes;
+    }
+
+    const uint8_t* raw = rows;
+    memcpy(output, raw, phase);
+    raw += phase;
+    for (size_t block = 0, ix = 0; block < blocks; block++)
+    {
+        if (ix < nPages && pages[ix] == block)
+        {
+            ix++;
+            continue;
+        }
+        memcpy(output + phase + block * SQL_PAGE_SIZE, raw, SQL_PAGE_SIZE);
+        raw += SQL_PAGE_SIZE;
+    }
+    size_t tail = phase + blocks * SQL_PAGE_SIZE;
+    memcpy(output + tail, raw, length - tail);
+
+    return true;
+}
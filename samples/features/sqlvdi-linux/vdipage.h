@@ -0,0 +1,49 @@
+//*********************************************************************
+//                 Copyright (C) Microsoft Corporation.
+//
+// @File: vdipage.h
+//
+// Purpose:
+//   A reversible transform of backup data that separates the parts of
+//   SQL Server 8 KB pages: the 96 byte page headers, the slot arrays and
+//   the row data, so that a compressor sees similar bytes next to each
+//   other.
+//
+// Notes:
+//   Any data can be transformed and restored exactly; data that does not
+//   look like pages is passed through, at a cost of a few bytes.
+//
+//*********************************************************************
+#ifndef VDIPAGE_H_
+#define VDIPAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SQL_PAGE_SIZE           8192
+#define SQL_PAGE_HEADER_SIZE    96
+
+// The largest output of pageTransform() for 'length' bytes of input.
+//
+size_t pageTransformBound(
+    size_t length);
+
+// Transform 'length' bytes of 'input' into 'output', which must hold
+// pageTransformBound(length) bytes. Returns the length of the output.
+//
+size_t pageTransform(
+    const uint8_t* input,
+    size_t         length,
+    uint8_t*       output);
+
+// Rebuild the 'length' bytes that pageTransform() turned into the
+// 'inputLength' bytes of 'input', into 'output'.
+// Returns false if 'input' is not a valid transform of that many bytes.
+//
+bool pageRestore(
+    const uint8_t* input,
+    size_t         inputLength,
+    uint8_t*       output,
+    size_t         length);
+
+#endif
@@ -17,7 +17,8 @@
 //
 // The program will backup or restore a database.
 //
-// The program accepts 6 command line parameters.
+// The program accepts 6 command line parameters, optionally preceded by
+// transfer options.
 //
 // One of:
 //  b   perform a backup
@@ -34,35 +35,206 @@
 // And the filename:
 //  filename.bak
 //
+// Transfer options:
+//  --io=stdio      service one command at a time with fread/fwrite (default)
+//  --io=fd         service one command at a time with read/write
+//  --io=direct     bypass the page cache with O_DIRECT, using aligned buffers
+//  --io=uring      keep several commands in flight using io_uring
+//  --depth=N       number of commands to keep in flight with --io=uring (1-64)
+//  --streams=N     number of virtual devices, each serviced by its own thread
+//                  (1-32). Stream 0 uses 'filename', stream n uses 'filename.n'
+//  --processes     service each stream in a secondary process instead of a
+//                  thread
+//  --stage=MB      on backup, complete each write once its data is copied
+//                  into a staging ring of MB megabytes, drained to the file
+//                  by a writer thread (not with --io=uring)
+//  --readahead=MB  on restore, read the file ahead of the server into MB
+//                  one megabyte buffers filled by a reader thread
+//                  (not with --io=uring)
+//  --compress=L    compress the backup at zstd level L (1-19) in 4 MB
+//                  frames, and decompress it on restore (not with
+//                  --io=uring)
+//  --codec=C       with --compress, compress every frame with zstd (default)
+//                  or lz4, or choose per frame with auto: frames that look
+//                  random are stored, others use lz4 or zstd
+//  --compress-threads=N
+//                  number of compression threads per stream (1-64,
+//                  default 4), also used to restore from a gzip, zstd
+//                  or xz archive
+//  --page-transform
+//                  with --compress, separate the headers, slot arrays and
+//                  rows of the 8 KB pages of every frame before compressing
+//                  it
+//  --dict=DIR      with --compress, compress with the current dictionary
+//                  trained into DIR, and find the dictionaries a backup
+//                  was made with there on restore
+//  --dedup=DIR     back up into the deduplicating chunk store DIR, writing
+//                  only a recipe of chunk hashes to the backup file, and
+//                  restore from it with --compress-threads prefetch
+//                  threads (not with --compress or --io other than stdio)
+//  --delta-base=FILE
+//                  on backup, write only the differences from the earlier
+//                  full backup FILE, and rebuild the backup from FILE and
+//                  the differences on restore. Stream n uses 'FILE.n'
+//                  (not with --io=uring or --dedup)
+//  --checksum      on backup, write the CRC32C of every 64 KB block of the
+//                  data to 'filename.crc', and check every block against
+//                  it on restore before returning it (not with --io=uring)
+//  --encrypt=KEYFILE
+//                  encrypt the backup with AES-256-GCM under the key in
+//                  KEYFILE, in independent 1 MB chunks on --compress-threads
+//                  threads, and decrypt and authenticate it on restore
+//                  (not with --io=uring or --dedup)
+//  --stripe=DIR[,DIR...]
+//                  spread the data of every stream over one file per
+//                  directory, in 1 MB units written and read by one thread
+//                  per file, and keep only the stripe map in the backup
+//                  file. Give the same directories, in the same order, on
+//                  restore (not with --io=uring, --dedup or --compress)
+//  --mirror=DIR[,DIR...]
+//                  on backup, also write a copy of every stream to each
+//                  directory, each copy from its own queue and thread
+//  --mirror-quorum=N
+//                  with --mirror, complete every command once N copies,
+//                  counting the backup file, have its data (default all);
+//                  the others catch up in the background
+//                  (--mirror is not for restore, nor with --io=uring or
+//                  --dedup)
+//  --preallocate=MB|auto
+//                  on backup, reserve space for a backup of MB megabytes,
+//                  shared by the streams, with fallocate before writing,
+//                  extend the reservation in large steps if the backup
+//                  outgrows it, and give back the rest at the end. With
+//                  auto, the size is estimated from the space used by the
+//                  database or log (not with --io=uring or --dedup)
+//  --writeback=MB  on buffered backup, start writing every MB megabytes
+//                  to disk as soon as they are written, wait for the
+//                  previous MB megabytes and drop them from the page cache,
+//                  instead of leaving it all to the final flush (not with
+//                  --io=direct, --io=uring or --dedup)
+//  --volume-size=MB
+//                  split every stream into volume files of MB megabytes,
+//                  'file.vol0000' and so on, written and closed by a pool
+//                  of writer threads, and keep the manifest of the volumes
+//                  in the backup file; give the same size on restore
+//                  (not with --io=uring, --dedup, --stripe, --mirror or
+//                  --compress)
+//  --trace=N       keep the last N commands in a trace ring, printed if a
+//                  stream fails, on SIGUSR1 and at exit
+//  --no-sql        do not start sqlcmd; for use with a stand-in for
+//                  libsqlvdi, such as the one in the mock directory
+//
+// Dictionary training, instead of a backup or restore:
+//  --train-dict=DIR <file>...
+//                  train a dictionary from uncompressed backups, such as
+//                  earlier log backups, store it in DIR and make it the
+//                  current one
+//
+// Key generation, instead of a backup or restore:
+//  --new-key=KEYFILE
+//                  write a new random key to KEYFILE, which must not exist
+//
+// On restore without --compress, a file compressed with gzip, zstd or xz
+// is recognized and decoded on the fly (not with --io=uring).
+//
+// Used internally:
+//  --secondary=N:name  act as the secondary process for stream N of the
+//                      virtual device set 'name'
+//
 
 #include <cstdio>  // for file operations
 #include <ctype.h> // for toupper ()
 #include <cstdio>
 #include <iostream>
 #include <memory>
+#include <cstdlib> // for atoi
 #include <cstring> // for memset
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
+#include <getopt.h>
 #include <unistd.h>
 #include <uuid/uuid.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "vdi.h"      // interface declaration
 #include "vdierror.h" // error constants
+#include "vdimedia.h"  // backup media
+#include "vdiuring.h"  // io_uring transfer loop
+#include "vditrace.h"  // command tracing
 
 using namespace std;
 
-void performTransfer(
+// The transfer settings chosen on the command line.
+//
+struct TransferOptions
+{
+    bool          doBackup;
+    bool          directIO;
+    bool          fdIO;
+    bool          useUring;
+    int           depth;
+    int           nStreams;
+    bool          useProcesses;
+    int           stageMB;
+    int           readAheadMB;
+    int           compressLevel;
+    CompressCodec codec;
+    int           compressThreads;
+    char*         dictDir;
+    bool          pageTransform;
+    char*         dedupDir;
+    char*         deltaBase;
+    bool          checksum;
+    char*         keyFile;
+    char*         stripeDirs;
+    char*         mirrorDirs;
+    int           mirrorQuorum;
+    uint64_t      preallocateMB;
+    bool          preallocateAuto;
+    uint64_t      writebackMB;
+    uint64_t      volumeMB;
+    char*         backupFile;
+};
+
+int performTransfer(
     ClientVirtualDevice* vd,
-    int                  backup,
-    char*                fname);
+    int                  streamId,
+    BackupMedia*         media);
+
+int runSecondary(
+    ClientVirtualDeviceSet* vds,
+    const TransferOptions&  options,
+    int                     streamId);
+
+int runSecondaryProcess(
+    TransferOptions& options,
+    int              streamId);
+
+int startSecondaryProcesses(
+    ClientVirtualDeviceSet* vds,
+    const TransferOptions&  options,
+    int                     argc,
+    char*                   argv[],
+    vector<int>&            streamStatus);
 
 shared_ptr<FILE> sendSQL(bool  doBackup,
                          bool  dataBackup,
                          char* databaseName,
                          char* userName,
-                         char* password);
+                         char* password,
+                         int   nStreams,
+                         int   bufferCount);
+
+uint64_t estimateBackupSize(bool  dataBackup,
+                            char* databaseName,
+                            char* userName,
+                            char* password);
 
 // Using a GUID for the VDS Name is a good way to assure uniqueness.
 //
@@ -74,30 +246,280 @@ static char wVdsName [50];
 int main(int argc, char* argv[])
 {
     ClientVirtualDeviceSet* vds = NULL;
-    ClientVirtualDevice* vd = NULL;
     int status;
+    int termCode = -1;
 
     VDConfig config;
     bool badParm = false;
-    bool doBackup = true;
     bool dataBackup = true;
     char* databaseName = nullptr;
     char* userName = nullptr;
     char* password = nullptr;
-    char* backupFile = nullptr;
+    TransferOptions options = { true, false, false, false, 1, 1, false, 0, 0, 0, CompressZstd, 4,
+                                nullptr, false, nullptr, nullptr, false, nullptr, nullptr, nullptr, 0,
+                                0, false, 0, 0, nullptr };
+    int secondaryStream = -1;
+    char* trainDir = nullptr;
+    char* newKeyFile = nullptr;
+    int traceEntries = 0;
+    bool noSQL = false;
+    int originalArgc = argc;
+    char** originalArgv = argv;
+    vector<thread> secondaries;
+    vector<int> streamStatus;
     shared_ptr<FILE>            processPipe;
 
+    // Check the transfer options
+    //
+    static const struct option longOptions[] =
+    {
+        { "io",    required_argument, NULL, 'i' },
+        { "depth", required_argument, NULL, 'q' },
+        { "streams", required_argument, NULL, 's' },
+        { "processes", no_argument,     NULL, 'p' },
+        { "secondary", required_argument, NULL, 'x' },
+        { "stage", required_argument, NULL, 'g' },
+        { "readahead", required_argument, NULL, 'r' },
+        { "trace", required_argument, NULL, 't' },
+        { "compress", required_argument, NULL, 'z' },
+        { "compress-threads", required_argument, NULL, 'w' },
+        { "codec", required_argument, NULL, 'c' },
+        { "dict", required_argument, NULL, 'd' },
+        { "page-transform", no_argument, NULL, 'a' },
+        { "train-dict", required_argument, NULL, 'y' },
+        { "dedup", required_argument, NULL, 'e' },
+        { "delta-base", required_argument, NULL, 'b' },
+        { "checksum", no_argument, NULL, 'k' },
+        { "encrypt", required_argument, NULL, 'v' },
+        { "new-key", required_argument, NULL, 'u' },
+        { "stripe", required_argument, NULL, 'f' },
+        { "mirror", required_argument, NULL, 'm' },
+        { "mirror-quorum", required_argument, NULL, 'j' },
+        { "preallocate", required_argument, NULL, 'l' },
+        { "writeback", required_argument, NULL, 'o' },
+        { "volume-size", required_argument, NULL, 'h' },
+        { "no-sql", no_argument,       NULL, 'n' },
+        { NULL,    0,                 NULL, 0   }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'i':
+            if (strcmp(optarg, "uring") == 0)
+            {
+                options.useUring = true;
+            }
+            else if (strcmp(optarg, "direct") == 0)
+            {
+                options.directIO = true;
+            }
+            else if (strcmp(optarg, "fd") == 0)
+            {
+                options.fdIO = true;
+            }
+            else if (strcmp(optarg, "stdio") != 0)
+            {
+                badParm = true;
+            }
+            break;
+
+        case 'q':
+            options.depth = atoi(optarg);
+            if (options.depth < 1 || options.depth > 64)
+            {
+                badParm = true;
+            }
+            break;
+
+        case 's':
+            options.nStreams = atoi(optarg);
+            if (options.nStreams < 1 || options.nStreams > 32)
+            {
+                badParm = true;
+            }
+            break;
+
+        case 'p':
+            options.useProcesses = true;
+            break;
+
+        case 'g':
+            options.stageMB = atoi(optarg);
+            if (options.stageMB < 1 || options.stageMB > 4096)
+            {
+                badParm = true;
+            }
+            break;
+
+        case 'r':
+            options.readAheadMB = atoi(optarg);
+            if (options.readAheadMB < 1 || options.readAheadMB > 4096)
+            {
+                badParm = true;
+            }
+            break;
+
+        case 't':
+            traceEntries = atoi(optarg);
+            if (traceEntries < 16 || traceEntries > 1048576)
+            {
+                badParm = true;
+            }
+            break;
+
+        case 'n':
+            noSQL = true;
+            break;
+
+        case 'z':
+            options.compressLevel = atoi(optarg);
+            if (options.compressLevel < 1 || options.compressLevel > 19)
+            {
+                badParm = true;
+            }
+            break;
+
+        case 'c':
+            if (strcmp(optarg, "zstd") == 0)
+            {
+                options.codec = CompressZstd;
+            }
+            else if (strcmp(optarg, "lz4") == 0)
+            {
+                options.codec = CompressLz4;
+            }
+            else if (strcmp(optarg, "auto") == 0)
+            {
+                options.codec = CompressAuto;
+            }
+            else
+            {
+                badParm = true;
+            }
+            break;
+
+        case 'd':
+            options.dictDir = optarg;
+            break;
+
+        case 'a':
+            options.pageTransform = true;
+            break;
+
+        case 'y':
+            trainDir = optarg;
+            break;
+
+        case 'e':
+            options.dedupDir = optarg;
+            break;
+
+        case 'b':
+            options.deltaBase = optarg;
+            break;
+
+        case 'k':
+            options.checksum = true;
+            break;
+
+        case 'v':
+            options.keyFile = optarg;
+            break;
+
+        case 'u':
+            newKeyFile = optarg;
+            break;
+
+        case 'f':
+            options.stripeDirs = optarg;
+            break;
+
+        case 'm':
+            options.mirrorDirs = optarg;
+            break;
+
+        case 'j':
+            options.mirrorQuorum = atoi(optarg);
+            if (options.mirrorQuorum < 1)
+            {
+                badParm = true;
+            }
+            break;
+
+        case 'l':
+            options.preallocateAuto = (strcmp(optarg, "auto") == 0);
+            if (!options.preallocateAuto)
+            {
+                options.preallocateMB = strtoull(optarg, NULL, 10);
+                if (options.preallocateMB < 1)
+                {
+                    badParm = true;
+                }
+            }
+            break;
+
+        case 'o':
+            options.writebackMB = strtoull(optarg, NULL, 10);
+            if (options.writebackMB < 1)
+            {
+                badParm = true;
+            }
+            break;
+
+        case 'h':
+            options.volumeMB = strtoull(optarg, NULL, 10);
+            if (options.volumeMB < 1 || options.volumeMB > 1048576)
+            {
+                badParm = true;
+            }
+            break;
+
+        case 'w':
+            options.compressThreads = atoi(optarg);
+            if (options.compressThreads < 1 || options.compressThreads > 64)
+            {
+                badParm = true;
+            }
+            break;
+
+        case 'x':
+            if (sscanf(optarg, "%d:%49s", &secondaryStream, wVdsName) != 2)
+            {
+                badParm = true;
+            }
+            break;
+
+        default:
+            badParm = true;
+        }
+    }
+
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (trainDir != nullptr && !badParm && argc > 1)
+    {
+        return trainDictionary(trainDir, argc - 1, &argv[1]) ? 0 : 1;
+    }
+    if (newKeyFile != nullptr && !badParm && argc == 1)
+    {
+        return createKey(newKeyFile) ? 0 : 1;
+    }
+
     // Check the input parm
     //
     if (argc == 7)
     {
         if (toupper(argv[1][0]) == 'B')
         {
-            doBackup = true;
+            options.doBackup = true;
         }
         else if (toupper(argv[1][0]) == 'R')
         {
-            doBackup = false;
+            options.doBackup = false;
         }
         else
         {
@@ -120,21 +542,147 @@ int main(int argc, char* argv[])
         databaseName = &argv[3][0];
         userName = &argv[4][0];
         password = &argv[5][0];
-        backupFile = &argv[6][0];
+        options.backupFile = &argv[6][0];
     }
     else
     {
         badParm = true;
     }
 
+    // Staging, read-ahead and compression sit in front of the media used by
+    // the basic transfer loop.
+    //
+    if (options.useUring &&
+        (options.stageMB > 0 || options.readAheadMB > 0 || options.compressLevel > 0))
+    {
+        badParm = true;
+    }
+    if ((options.dictDir != NULL || options.pageTransform) && options.compressLevel == 0)
+    {
+        badParm = true;
+    }
+
+    // The chunk store replaces the backup file and its compression.
+    //
+    if (options.dedupDir != NULL &&
+        (options.useUring || options.directIO || options.fdIO || options.compressLevel > 0))
+    {
+        badParm = true;
+    }
+    if (options.deltaBase != NULL && (options.useUring || options.dedupDir != NULL))
+    {
+        badParm = true;
+    }
+    if (options.checksum && options.useUring)
+    {
+        badParm = true;
+    }
+    if (options.keyFile != NULL && (options.useUring || options.dedupDir != NULL))
+    {
+        badParm = true;
+    }
+
+    // A mirror copies the backup file: restore from any of the copies.
+    //
+    if (options.mirrorDirs != NULL &&
+        (!options.doBackup || options.useUring || options.dedupDir != NULL))
+    {
+        badParm = true;
+    }
+    if (options.mirrorQuorum > 0 && options.mirrorDirs == NULL)
+    {
+        badParm = true;
+    }
+
+    if ((options.preallocateMB > 0 || options.preallocateAuto) &&
+        (!options.doBackup || options.useUring || options.dedupDir != NULL))
+    {
+        badParm = true;
+    }
+
+    if (options.writebackMB > 0 &&
+        (!options.doBackup || options.directIO || options.useUring || options.dedupDir != NULL))
+    {
+        badParm = true;
+    }
+
+    // A compressed restore reads its seek table from the end of the backup
+    // file, which only holds the map of a striped backup, or the manifest
+    // of its volumes.
+    //
+    if (options.stripeDirs != NULL &&
+        (options.useUring || options.dedupDir != NULL || options.compressLevel > 0))
+    {
+        badParm = true;
+    }
+
+    if (options.volumeMB > 0 &&
+        (options.useUring || options.dedupDir != NULL || options.stripeDirs != NULL ||
+         options.mirrorDirs != NULL || options.compressLevel > 0))
+    {
+        badParm = true;
+    }
+
     if (badParm)
     {
-        printf("usage: vdipipesample {B|R} {D|L} <databaseName> <userName> <password> <filename>\n"
+        printf("usage: vdipipesample [--io=stdio|fd|direct|uring] [--depth=N] [--streams=N] [--processes]\n"
+               "                     [--stage=MB] [--readahead=MB] [--compress=L] [--codec=zstd|lz4|auto]\n"
+               "                     [--compress-threads=N] [--dict=DIR] [--page-transform]\n"
+               "                     [--dedup=DIR] [--delta-base=FILE] [--checksum]\n"
+               "                     [--encrypt=KEYFILE] [--stripe=DIR[,DIR...]]\n"
+               "                     [--mirror=DIR[,DIR...]] [--mirror-quorum=N]\n"
+               "                     [--preallocate=MB|auto] [--writeback=MB] [--volume-size=MB]\n"
+               "                     [--trace=N] [--no-sql]\n"
+               "                     {B|R} {D|L} <databaseName> <userName> <password> <filename>\n"
+               "       vdipipesample --train-dict=DIR <file>...\n"
+               "       vdipipesample --new-key=KEYFILE\n"
                "Demonstrate a Backup or Restore using the Virtual Device Interface\n");
         return 1;
     }
 
+    if (!options.useUring)
+    {
+        options.depth = 1;
+    }
+
     umask(0);
+
+    // The trace ring must exist before any other thread is started.
+    //
+    if (traceEntries > 0 && !traceEnable(traceEntries))
+    {
+        return 1;
+    }
+
+    // Perform secondary processing, if this is a
+    // secondary process.
+    //
+    if (secondaryStream >= 0)
+    {
+        return runSecondaryProcess(options, secondaryStream);
+    }
+
+    // The estimate is made once, here; secondary processes are handed
+    // its result.
+    //
+    if (options.preallocateAuto)
+    {
+        uint64_t estimate = 0;
+        if (noSQL)
+        {
+            printf("No size estimate without SQL Server: not preallocating\n");
+        }
+        else
+        {
+            estimate = estimateBackupSize(dataBackup, databaseName, userName, password);
+        }
+        options.preallocateMB = (estimate + (1 << 20) - 1) >> 20;
+        if (options.preallocateMB > 0)
+        {
+            printf("Estimated backup size: %llu MB\n", (unsigned long long)options.preallocateMB);
+        }
+    }
+
     vds = new ClientVirtualDeviceSet();
 
     // Setup the VDI configuration we want to use.
@@ -145,7 +693,16 @@ int main(int argc, char* argv[])
     // I/O will be strictly sequential with only the basic commands.
     //
     memset(&config, 0, sizeof(config));
-    config.deviceCount = 1;
+    config.deviceCount = options.nStreams;
+
+    // For unbuffered I/O, ask the server for buffers and transfer
+    // lengths that can be handed to an O_DIRECT file as they are.
+    //
+    if (options.directIO)
+    {
+        config.alignment = DIRECT_IO_ALIGNMENT;
+        config.blockSize = DIRECT_IO_ALIGNMENT;
+    }
 
     // Create a GUID to use for a unique virtual device name
     //
@@ -164,13 +721,17 @@ int main(int argc, char* argv[])
 
     // Send the SQL command, by starting 'sqlcmd' in a new process.
     //
-    printf("\nSending the SQL...\n");
-
-    processPipe = sendSQL(doBackup, dataBackup, databaseName, userName, password);
-    if (!processPipe)
+    if (!noSQL)
     {
-        printf("sendSQL failed.\n");
-        goto shutdown;
+        printf("\nSending the SQL...\n");
+
+        processPipe = sendSQL(options.doBackup, dataBackup, databaseName, userName, password,
+                              options.nStreams, options.depth * options.nStreams);
+        if (!processPipe)
+        {
+            printf("sendSQL failed.\n");
+            goto shutdown;
+        }
     }
 
     printf("\nGetting configuration.\n");
@@ -188,20 +749,60 @@ int main(int argc, char* argv[])
     }
 
     printf("Features returned by SQL Server: 0x%x\n", config.features);
+    if (options.directIO)
+    {
+        printf("Buffer alignment: %u, block size: %u\n", config.alignment, config.blockSize);
+    }
 
-    printf("\nOpening the device.\n");
-    // Open the single device in the set.
+    // Never keep more commands in flight than the server has buffers for.
     //
-    status = vds->OpenDevice(wVdsName, &vd);
-    if (status != 0)
+    if (config.maxIODepth != 0 && (uint32_t)options.depth > config.maxIODepth)
     {
-        printf("VDS::OpenDevice fails: x%X\n", status);
-        goto shutdown;
+        options.depth = (int)config.maxIODepth;
+    }
+    if (options.useUring)
+    {
+        printf("Using io_uring with %d command(s) in flight.\n", options.depth);
     }
 
-    printf("\nPerforming data transfer...\n");
+    // Service each virtual device in its own thread, or its own process.
+    //
+    printf("\nStarting %d stream(s).\n", options.nStreams);
+
+    streamStatus.resize(options.nStreams, -1);
+    status = 0;
+    if (options.useProcesses)
+    {
+        status = startSecondaryProcesses(vds, options, originalArgc, originalArgv, streamStatus);
+    }
+    else
+    {
+        for (int ix = 0; ix < options.nStreams; ix++)
+        {
+            secondaries.push_back(thread([vds, &options, &streamStatus, ix]()
+            {
+                streamStatus[ix] = runSecondary(vds, options, ix);
+            }));
+        }
 
-    performTransfer(vd, doBackup, backupFile);
+        for (size_t ix = 0; ix < secondaries.size(); ix++)
+        {
+            secondaries[ix].join();
+        }
+    }
+
+    // Report the outcome of every stream. The primary can fail on its own,
+    // when it loses track of a secondary process.
+    //
+    termCode = (status == 0) ? 0 : -1;
+    for (int ix = 0; ix < options.nStreams; ix++)
+    {
+        printf("Stream %d: %s\n", ix, (streamStatus[ix] == 0) ? "ok" : "failed");
+        if (streamStatus[ix] != 0)
+        {
+            termCode = -1;
+        }
+    }
 
 shutdown:
 
@@ -222,7 +823,9 @@ exit:
         }
     }
 
-    return 0;
+    traceDump("exit");
+
+    return termCode;
 }
 
 // Execute a basic backup/restore, by spawning a process to execute 'sqlcmd'.
@@ -231,84 +834,534 @@ shared_ptr<FILE> sendSQL(bool  doBackup,
                          bool  dataBackup,
                          char* databaseName,
                          char* userName,
-                         char* password)
+                         char* password,
+                         int   nStreams,
+                         int   bufferCount)
 {
     printf("Connecting to SQL Server.");
-    char sqlCommand [1024]; // plenty of space for our purpose
+    char sqlCommand [4096]; // plenty of space for our purpose
+    char devices [2048];
+    char bufferOption [32] = "";
+
+    // Name one device per stream. The first device has the same name
+    // as the set; the others append their stream number.
+    //
+    int used = sprintf(devices, "VIRTUAL_DEVICE='%s'", wVdsName);
+    for (int ix = 1; ix < nStreams; ix++)
+    {
+        used += sprintf(devices + used, ", VIRTUAL_DEVICE='%s%d'", wVdsName, ix);
+    }
+
+    // Let the server hand out enough buffers to keep every
+    // requested command in flight.
+    //
+    if (bufferCount > 1)
+    {
+        sprintf(bufferOption, ", BUFFERCOUNT=%d", bufferCount);
+    }
 
     sprintf(sqlCommand,
-            "sqlcmd -U %s -P %s -S . -Q \"%s %s %s %s VIRTUAL_DEVICE='%s' WITH %s, MAXTRANSFERSIZE=1048576 \"",
+            "sqlcmd -U %s -P %s -S . -Q \"%s %s %s %s %s WITH %s, MAXTRANSFERSIZE=1048576%s \"",
             userName,
             password,
             (doBackup) ? "BACKUP" : "RESTORE",
             (dataBackup) ? "DATABASE" : "LOG",
             databaseName,
             (doBackup) ? "TO" : "FROM",
-            wVdsName,
-            (doBackup) ? "FORMAT" : "REPLACE");
+            devices,
+            (doBackup) ? "FORMAT" : "REPLACE",
+            bufferOption);
 
     shared_ptr<FILE> pipe(popen(sqlCommand, "r"), pclose);
 
     return pipe;
 }
 
-// This routine reads commands from the server until a 'Close' status is received.
+// Estimate the size of a backup from the space used by the data files of
+// the database, or by its log, asking through 'sqlcmd' as above. A little
+// is added for the headers of the backup. Returns 0 if there is no estimate.
 //
-void performTransfer(
-    ClientVirtualDevice* vd,
-    int                  backup,
-    char*                fname)
+uint64_t estimateBackupSize(bool  dataBackup,
+                            char* databaseName,
+                            char* userName,
+                            char* password)
 {
-    FILE*          fh;
-    VDC_Command*   cmd;
-    int completionCode;
-    size_t bytesTransferred;
+    char sqlCommand [1024];
+
+    sprintf(sqlCommand,
+            "sqlcmd -U %s -P %s -S . -d %s -h -1 -W -Q \"SET NOCOUNT ON; %s\"",
+            userName,
+            password,
+            databaseName,
+            (dataBackup)
+                ? "SELECT SUM(CAST(FILEPROPERTY(name, 'SpaceUsed') AS bigint)) * 8192 "
+                  "FROM sys.database_files WHERE type = 0"
+                : "SELECT used_log_space_in_bytes FROM sys.dm_db_log_space_usage");
+
+    FILE* pipe = popen(sqlCommand, "r");
+    if (pipe == NULL)
+    {
+        printf("Failed to estimate the backup size\n");
+        return 0;
+    }
+
+    unsigned long long bytes = 0;
+    char line[1024];
+    bool found = false;
+    while (fgets(line, sizeof(line), pipe))
+    {
+        if (!found && sscanf(line, "%llu", &bytes) == 1)
+        {
+            found = true;
+        }
+    }
+    pclose(pipe);
+
+    if (!found)
+    {
+        printf("Failed to estimate the backup size\n");
+        return 0;
+    }
+    return bytes + bytes / 16;
+}
+
+//------------------------------------------------------------------
+// Service one virtual device of the set from within a thread.
+// Returns 0 if no errors were detected, else nonzero.
+//
+int runSecondary(
+    ClientVirtualDeviceSet* vds,
+    const TransferOptions&  options,
+    int                     streamId)
+{
+    char devName [64];
+    string fname = options.backupFile;
+    ClientVirtualDevice* vd;
     int status;
+    int termCode = -1;
 
-    fh = fopen(fname, (backup) ? "wb" : "rb");
-    if (fh == NULL)
+    // Build the name of the device assigned to this thread, and the file
+    // that holds its stream.
+    //
+    if (streamId == 0)
     {
-        printf("Failed to open: %s\n", fname);
-        return;
+        // The first device has the same name as the set.
+        //
+        strcpy(devName, wVdsName);
+    }
+    else
+    {
+        sprintf(devName, "%s%d", wVdsName, streamId);
+        fname += "." + to_string(streamId);
     }
 
-    // Timeout in seconds
+    // Open the device assigned to this thread.
     //
-    int timeout = 90;
-    while ((status = vd->GetCommand(timeout, &cmd)) == 0)
+    status = vds->OpenDevice(devName, &vd);
+    if (status != 0)
     {
-        bytesTransferred = 0;
-        switch (cmd->commandCode)
+        printf("VDS::OpenDevice fails on %s: x%X\n", devName, status);
+        goto errExit;
+    }
+
+    printf("\nPerforming data transfer on stream %d (%s)...\n", streamId, fname.c_str());
+
+    if (options.useUring)
+    {
+        termCode = performUringTransfer(vd, streamId, options.doBackup, fname.c_str(),
+                                        options.depth);
+    }
+    else
+    {
+        // The preallocation is shared evenly by the streams.
+        //
+        uint64_t preallocate = (options.preallocateMB << 20) / options.nStreams;
+        uint64_t writeback = options.writebackMB << 20;
+
+        BackupMedia* media;
+        if (options.dedupDir != NULL)
         {
-        case VDC_Read:
-            bytesTransferred = fread(cmd->buffer, 1, cmd->size, fh);
-            if (bytesTransferred == (size_t)cmd->size)
+            media = openDedupMedia(fname.c_str(), options.doBackup, options.dedupDir,
+                                   options.compressThreads);
+        }
+        else if (options.stripeDirs != NULL)
+        {
+            media = openStripeMedia(fname.c_str(), options.doBackup, options.stripeDirs,
+                                    options.directIO, preallocate, writeback);
+        }
+        else if (options.volumeMB > 0)
+        {
+            media = openVolumeMedia(fname.c_str(), options.doBackup, options.volumeMB << 20,
+                                    options.directIO, preallocate > 0, writeback);
+        }
+        else if (options.directIO)
+        {
+            media = openDirectMedia(fname.c_str(), options.doBackup, DIRECT_IO_ALIGNMENT);
+        }
+        else if (options.fdIO)
+        {
+            media = openFdMedia(fname.c_str(), options.doBackup);
+        }
+        else
+        {
+            media = openStdioMedia(fname.c_str(), options.doBackup);
+        }
+
+        if (media != NULL && preallocate > 0 && options.stripeDirs == NULL &&
+            options.volumeMB == 0)
+        {
+            media = openPreallocateMedia(media, fname.c_str(), preallocate);
+        }
+        if (media != NULL && writeback > 0 && options.stripeDirs == NULL &&
+            options.volumeMB == 0)
+        {
+            media = openWritebackMedia(media, fname.c_str(), writeback);
+        }
+        if (media != NULL && options.mirrorDirs != NULL)
+        {
+            media = openMirrorMedia(media, fname.c_str(), options.mirrorDirs,
+                                    options.mirrorQuorum, options.directIO, preallocate,
+                                    writeback);
+        }
+        if (media != NULL && options.doBackup && options.stageMB > 0)
+        {
+            media = openStagingMedia(media, (size_t)options.stageMB << 20);
+        }
+        if (media != NULL && !options.doBackup && options.readAheadMB > 0)
+        {
+            media = openReadAheadMedia(media, 1024 * 1024, options.readAheadMB);
+        }
+        if (media != NULL && options.keyFile != NULL)
+        {
+            media = openEncryptMedia(media, fname.c_str(), options.keyFile, options.doBackup,
+                                     options.compressThreads);
+        }
+        if (media != NULL && options.compressLevel > 0)
+        {
+            media = openCompressMedia(media, fname.c_str(), options.doBackup, 4 * 1024 * 1024,
+                                      options.codec, options.compressLevel, options.dictDir,
+                                      options.pageTransform, options.keyFile,
+                                      options.compressThreads);
+        }
+        else if (media != NULL && !options.doBackup && options.dedupDir == NULL &&
+                 options.keyFile == NULL)
+        {
+            media = openArchiveMedia(media, fname.c_str(), options.compressThreads);
+        }
+        if (media != NULL && options.deltaBase != NULL)
+        {
+            string baseName = options.deltaBase;
+            if (streamId > 0)
             {
-                completionCode = ERROR_SUCCESS;
+                baseName += "." + to_string(streamId);
             }
-            else
+            media = openDeltaMedia(media, baseName.c_str(), options.doBackup);
+        }
+        if (media != NULL && options.checksum)
+        {
+            media = openManifestMedia(media, fname.c_str(), options.doBackup);
+        }
+
+        if (media != NULL)
+        {
+            termCode = performTransfer(vd, streamId, media);
+            delete media;
+        }
+    }
+
+errExit:
+
+    // If errors were detected, force an abort.
+    //
+    if (termCode != 0)
+    {
+        vds->SignalAbort();
+    }
+
+    return termCode;
+}
+
+//------------------------------------------------------------------
+// Invoke one secondary process per stream, and wait for all of them
+// to complete.
+//
+// Each child runs this program again with --secondary, so it starts from
+// a clean process image rather than a copy of a multithreaded one. Its
+// exit is watched through a pidfd; in the multiprocess model the primary
+// is responsible for detecting abnormal termination of a secondary, and
+// it aborts the whole set as soon as one fails rather than waiting for
+// the others to time out.
+//
+// Returns: 0 if no errors were detected.
+//
+int startSecondaryProcesses(
+    ClientVirtualDeviceSet* vds,
+    const TransferOptions&  options,
+    int                     argc,
+    char*                   argv[],
+    vector<int>&            streamStatus)
+{
+    vector<pid_t> children(options.nStreams, -1);
+    vector<int> pidfds(options.nStreams, -1);
+    int epfd;
+    int nActive = 0;
+    int termCode = 0;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+    {
+        perror("epoll_create1");
+        vds->SignalAbort();
+        return -1;
+    }
+
+    for (int ix = 0; ix < options.nStreams; ix++)
+    {
+        char secondary [80];
+        vector<char*> args;
+
+        sprintf(secondary, "--secondary=%d:%s", ix, wVdsName);
+        args.push_back(argv[0]);
+        args.push_back(secondary);
+        for (int arg = 1; arg < argc; arg++)
+        {
+            args.push_back(argv[arg]);
+        }
+
+        // Pass the estimate made by this process on; the last
+        // --preallocate wins.
+        //
+        char preallocate [48];
+        if (options.preallocateMB > 0)
+        {
+            sprintf(preallocate, "--preallocate=%llu", (unsigned long long)options.preallocateMB);
+            args.push_back(preallocate);
+        }
+        args.push_back(NULL);
+
+        // Don't let the child inherit unflushed output.
+        //
+        fflush(stdout);
+
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            execv("/proc/self/exe", &args[0]);
+            perror("execv");
+            _exit(127);
+        }
+        if (pid < 0)
+        {
+            perror("fork");
+            termCode = -1;
+            break;
+        }
+
+        children[ix] = pid;
+        printf("\nStarted secondary process %d for stream %d\n", pid, ix);
+
+        pidfds[ix] = (int)syscall(SYS_pidfd_open, pid, 0);
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u32 = (uint32_t)ix;
+        if (pidfds[ix] < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, pidfds[ix], &event) != 0)
+        {
+            perror("pidfd_open");
+            termCode = -1;
+            break;
+        }
+        nActive++;
+    }
+
+    if (termCode != 0)
+    {
+        vds->SignalAbort();
+    }
+
+    printf("All children are now running.\n"
+           "Waiting for their completion...\n");
+
+    // A pidfd becomes readable when its process exits.
+    //
+    while (nActive > 0)
+    {
+        epoll_event events[32];
+        int nEvents = epoll_wait(epfd, events, 32, -1);
+        if (nEvents < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("epoll_wait");
+            if (termCode == 0)
             {
-                // assume failure is eof
-                completionCode = ERROR_HANDLE_EOF;
+                vds->SignalAbort();
             }
+            termCode = -1;
             break;
+        }
 
-        case VDC_Write:
-            bytesTransferred = fwrite(cmd->buffer, 1, cmd->size, fh);
-            if (bytesTransferred == (size_t)cmd->size)
+        for (int ev = 0; ev < nEvents; ev++)
+        {
+            int ix = (int)events[ev].data.u32;
+            int waitStatus;
+
+            // The pidfd stays readable until the child is removed from the
+            // epoll set, so an interrupted wait is simply retried.
+            //
+            pid_t reaped = waitpid(children[ix], &waitStatus, 0);
+            if (reaped < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            int waitError = errno;
+            epoll_ctl(epfd, EPOLL_CTL_DEL, pidfds[ix], NULL);
+            close(pidfds[ix]);
+            pidfds[ix] = -1;
+            nActive--;
+
+            pid_t pid = children[ix];
+            children[ix] = -1;
+
+            if (reaped != pid)
+            {
+                // The child can no longer be waited for, for example after
+                // something else reaped it: its outcome is unknown.
+                //
+                printf("Lost secondary process %d for stream %d: %s\n",
+                       pid, ix, strerror(waitError));
+            }
+            else if (WIFEXITED(waitStatus) && WEXITSTATUS(waitStatus) == 0)
             {
-                completionCode = ERROR_SUCCESS;
+                streamStatus[ix] = 0;
+                continue;
+            }
+            else if (WIFSIGNALED(waitStatus))
+            {
+                printf("Secondary process %d for stream %d was killed by signal %d\n",
+                       pid, ix, WTERMSIG(waitStatus));
             }
             else
             {
-                // assume failure is disk full
-                completionCode = ERROR_DISK_FULL;
+                printf("Secondary process %d for stream %d exited with code %d\n",
+                       pid, ix, WEXITSTATUS(waitStatus));
+            }
+
+            // SignalAbort() will cause all processes using the virtual
+            // device set to terminate processing.
+            //
+            if (termCode == 0)
+            {
+                vds->SignalAbort();
             }
+            termCode = -1;
+        }
+    }
+
+    // Reap any children left behind by a failure above. The set has
+    // been aborted, so they are on their way out.
+    //
+    for (int ix = 0; ix < options.nStreams; ix++)
+    {
+        if (pidfds[ix] >= 0)
+        {
+            close(pidfds[ix]);
+        }
+        if (children[ix] > 0)
+        {
+            waitpid(children[ix], NULL, 0);
+        }
+    }
+    close(epfd);
+
+    return termCode;
+}
+
+//------------------------------------------------------------------
+// Perform secondary client processing for one stream, in a process
+// started by startSecondaryProcesses().
+// Return 0 if no errors detected, else nonzero.
+//
+int runSecondaryProcess(
+    TransferOptions& options,
+    int              streamId)
+{
+    ClientVirtualDeviceSet* vds = new ClientVirtualDeviceSet();
+    VDConfig config;
+    int status;
+    int termCode;
+
+    // Open the virtual device set in this secondary process.
+    //
+    status = vds->OpenInSecondary(wVdsName);
+    if (status != 0)
+    {
+        printf("VDS::OpenInSecondary(%s) fails: x%X\n", wVdsName, status);
+        return -1;
+    }
+
+    // Grab the config to limit the depth as the primary did.
+    //
+    status = vds->GetConfiguration(10000, &config);
+    if (status != 0)
+    {
+        printf("VDS::Getconfig fails: x%X\n", status);
+        vds->SignalAbort();
+        vds->Close();
+        return -1;
+    }
+    if (config.maxIODepth != 0 && (uint32_t)options.depth > config.maxIODepth)
+    {
+        options.depth = (int)config.maxIODepth;
+    }
+
+    termCode = runSecondary(vds, options, streamId);
+
+    vds->Close();
+
+    traceDump("exit");
+
+    return termCode;
+}
+
+// This routine reads commands from the server until a 'Close' status is received.
+//
+// Returns 0, if no errors are detected, else non-zero.
+//
+int performTransfer(
+    ClientVirtualDevice* vd,
+    int                  streamId,
+    BackupMedia*         media)
+{
+    VDC_Command*   cmd;
+    int completionCode;
+    uint32_t bytesTransferred;
+    int status;
+    int termCode = -1;
+    CommandTrace trace(streamId);
+
+    // Timeout in seconds
+    //
+    int timeout = 90;
+    uint64_t requested = traceClock();
+    while ((status = vd->GetCommand(timeout, &cmd)) == 0)
+    {
+        uint64_t received = traceClock();
+
+        bytesTransferred = 0;
+        switch (cmd->commandCode)
+        {
+        case VDC_Read:
+            completionCode = media->Read(cmd->buffer, cmd->size, &bytesTransferred);
+            break;
+
+        case VDC_Write:
+            completionCode = media->Write(cmd->buffer, cmd->size, &bytesTransferred);
             break;
 
         case VDC_Flush:
-            fflush(fh);
-            completionCode = ERROR_SUCCESS;
+            completionCode = media->Flush();
             break;
 
         case VDC_ClearError:
@@ -320,14 +1373,21 @@ void performTransfer(
             completionCode = ERROR_NOT_SUPPORTED;
         }
 
+        // The command is the server's again once it is completed.
+        //
+        int commandCode = cmd->commandCode;
+        uint32_t size = cmd->size;
+        uint64_t processed = traceClock();
         status = vd->CompleteCommand(cmd, completionCode, bytesTransferred, 0);
-        printf("Completed command code: %i, completionCode: %i, bytes; %li \n",
-               cmd->commandCode, completionCode, bytesTransferred);
+        trace.Record(commandCode, size, completionCode, bytesTransferred, requested, received,
+                     processed);
         if (status != 0)
         {
             printf("Completion Failed: x%X\n", status);
             break;
         }
+
+        requested = traceClock();
     }
 
     if (status != VD_E_CLOSE)
@@ -342,8 +1402,17 @@ void performTransfer(
         // really successful.
         //
         printf("Successfully completed data transfer.\n");
+        termCode = 0;
+    }
+
+    if (media->Close() != ERROR_SUCCESS)
+    {
+        printf("Failed to close the backup media.\n");
+        termCode = -1;
     }
 
-    fclose(fh);
+    trace.Finish(termCode != 0);
+
+    return termCode;
 }
 
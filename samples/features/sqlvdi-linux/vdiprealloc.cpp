@@ -0,0 +1,193 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vdiprealloc.cpp
+//
+// Preallocation of backup files.
+//
+// A file that grows one write at a time gets its space one extent at a
+// time, and several backups growing side by side interleave their extents,
+// so every file ends up fragmented and is read back slowly. Here the space
+// of the expected size of the backup is reserved with fallocate() before
+// the first write, without changing the size of the file, so the file
+// system can hand it out in a few large extents. If the backup outgrows
+// the estimate, more is reserved in large steps; when it is closed, the
+// space reserved past the end of the data is given back.
+//
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "vdi.h"      // completion codes
+#include "vdimedia.h"
+
+using namespace std;
+
+// Smallest step by which a reservation grows once the estimate is passed;
+// steps are a quarter of the space reserved so far when that is larger.
+//
+#define PREALLOCATE_STEP    (256ULL * 1024 * 1024)
+
+//----------------------------------------------------------------------------
+// NAME: PreallocateMedia
+//
+// PURPOSE:
+//
+// Keep the space reserved for the backup file ahead of the data written to
+// 'target'. 'fd' is a descriptor of the same file, used for fallocate(),
+// so that any kind of file media can be preallocated. A file system that
+// can not reserve space only loses the benefit: failures are reported once
+// and the backup goes on without preallocation.
+//
+class PreallocateMedia : public BackupMedia
+{
+public:
+    PreallocateMedia(BackupMedia* target, int fd, const char* fname)
+        : target(target), fd(fd), fname(fname), reserved(0), written(0), steps(0),
+          enabled(true)
+    {
+    }
+
+    ~PreallocateMedia()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        delete target;
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred)
+    {
+        *bytesTransferred = 0;
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred)
+    {
+        if (enabled && written + size > reserved)
+        {
+            uint64_t step = reserved / 4;
+            if (step < PREALLOCATE_STEP)
+            {
+                step = PREALLOCATE_STEP;
+            }
+            if (Reserve(written + size + step))
+            {
+                steps++;
+            }
+        }
+
+        int completionCode = target->Write(buffer, size, bytesTransferred);
+        written += *bytesTransferred;
+        return completionCode;
+    }
+
+    int
+    Flush()
+    {
+        return target->Flush();
+    }
+
+    int
+    Close();
+
+    // Reserve space for the first 'size' bytes of the file.
+    //
+    bool
+    Reserve(
+        uint64_t size);
+
+private:
+    BackupMedia*    target;
+    int             fd;
+    string          fname;
+    uint64_t        reserved;
+    uint64_t        written;
+    int             steps;      // times the estimate had to be extended
+    bool            enabled;
+};
+
+bool PreallocateMedia::Reserve(uint64_t size)
+{
+    if (size <= reserved)
+    {
+        return true;
+    }
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, reserved, size - reserved) != 0)
+    {
+        printf("Not preallocating %s any further: %s\n", fname.c_str(), strerror(errno));
+        enabled = false;
+        return false;
+    }
+    reserved = size;
+    return true;
+}
+
+int PreallocateMedia::Close()
+{
+    int completionCode = target->Close();
+
+    // Give back the space reserved past the end of the data. Truncating a
+    // file to its own size frees the blocks beyond it.
+    //
+    struct stat st;
+    if (fstat(fd, &st) == 0 && (uint64_t)st.st_size < reserved)
+    {
+        if (ftruncate(fd, st.st_size) != 0 || fdatasync(fd) != 0)
+        {
+            printf("Failed to trim the preallocation of %s: %s\n", fname.c_str(),
+                   strerror(errno));
+        }
+    }
+    if (fstat(fd, &st) == 0)
+    {
+        printf("Preallocated %s: %.1f MB reserved, %.1f MB used, %d extensions, "
+               "%.1f MB allocated at close\n",
+               fname.c_str(), reserved / 1048576.0, written / 1048576.0, steps,
+               st.st_blocks * 512 / 1048576.0);
+    }
+
+    close(fd);
+    fd = -1;
+    return completionCode;
+}
+
+BackupMedia* openPreallocateMedia(
+    BackupMedia* media,
+    const char*  fname,
+    uint64_t     size)
+{
+    int fd = open(fname, O_WRONLY);
+    if (fd < 0)
+    {
+        printf("Failed to open: %s\n", fname);
+        media->Close();
+        delete media;
+        return NULL;
+    }
+
+    PreallocateMedia* result = new PreallocateMedia(media, fd, fname);
+    result->Reserve(size);
+    return result;
+}
@@ -0,0 +1,259 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vdireadahead.cpp
+//
+// Read-ahead for restores.
+//
+// Without read-ahead, each VDC_Read waits for the backup file to be read.
+// Here a reader thread streams the file into a fixed set of buffers ahead
+// of the server, so a VDC_Read is usually satisfied by copying data that
+// is already in memory.
+//
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "vdi.h"      // completion codes
+#include "vdimedia.h"
+
+using namespace std;
+
+//----------------------------------------------------------------------------
+// NAME: ReadAheadMedia
+//
+// PURPOSE:
+//
+// A ring of 'bufferCount' buffers filled in order by the reader thread.
+// 'filled' buffers starting at 'readIndex' hold data not yet returned by
+// Read(); the reader fills the others. The reader stops at the first read
+// of the source that does not succeed: ERROR_HANDLE_EOF marks the end of
+// the media, any other code is returned by Read() once the data before it
+// has been consumed.
+//
+class ReadAheadMedia : public BackupMedia
+{
+public:
+    ReadAheadMedia(BackupMedia* source, uint32_t bufferSize, const vector<uint8_t*>& buffers)
+        : source(source), bufferSize(bufferSize), buffers(buffers),
+          lengths(buffers.size(), 0), readIndex(0), readOffset(0), fillIndex(0),
+          filled(0), finished(false), sourceError(ERROR_SUCCESS), stopping(false), stalls(0)
+    {
+        reader = thread(&ReadAheadMedia::ReaderThread, this);
+    }
+
+    ~ReadAheadMedia()
+    {
+        if (reader.joinable())
+        {
+            Stop();
+        }
+        delete source;
+        for (size_t ix = 0; ix < buffers.size(); ix++)
+        {
+            free(buffers[ix]);
+        }
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred);
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred)
+    {
+        return source->Write(buffer, size, bytesTransferred);
+    }
+
+    int
+    Flush()
+    {
+        return source->Flush();
+    }
+
+    int
+    Close();
+
+private:
+    void
+    ReaderThread();
+
+    void
+    Stop();
+
+    BackupMedia*        source;
+    uint32_t            bufferSize;
+    vector<uint8_t*>    buffers;
+    vector<uint32_t>    lengths;
+
+    mutex               lock;
+    condition_variable  dataReady;  // signalled when a buffer is filled
+    condition_variable  bufferFree; // signalled when a buffer is consumed
+    thread              reader;
+    size_t              readIndex;
+    uint32_t            readOffset;
+    size_t              fillIndex;
+    size_t              filled;
+    bool                finished;   // the source has no more data
+    int                 sourceError;    // why, once finished
+    bool                stopping;
+
+    uint64_t            stalls;     // reads that waited for data
+};
+
+void ReadAheadMedia::ReaderThread()
+{
+    unique_lock<mutex> guard(lock);
+
+    while (!finished && !stopping)
+    {
+        while (filled == buffers.size() && !stopping)
+        {
+            bufferFree.wait(guard);
+        }
+        if (stopping)
+        {
+            break;
+        }
+
+        // Buffers outside the filled range belong to this thread.
+        //
+        size_t index = fillIndex;
+
+        guard.unlock();
+        uint32_t length;
+        int completionCode = source->Read(buffers[index], bufferSize, &length);
+        guard.lock();
+
+        if (length > 0)
+        {
+            lengths[index] = length;
+            fillIndex = (fillIndex + 1) % buffers.size();
+            filled++;
+        }
+        if (completionCode != ERROR_SUCCESS)
+        {
+            finished = true;
+            sourceError = completionCode;
+        }
+        dataReady.notify_one();
+    }
+}
+
+int ReadAheadMedia::Read(uint8_t* buffer, uint32_t size, uint32_t* bytesTransferred)
+{
+    uint32_t done = 0;
+    bool stalled = false;
+
+    unique_lock<mutex> guard(lock);
+    while (done < size)
+    {
+        while (filled == 0 && !finished)
+        {
+            stalled = true;
+            dataReady.wait(guard);
+        }
+        if (filled == 0)
+        {
+            break;
+        }
+
+        size_t index = readIndex;
+        uint32_t n = lengths[index] - readOffset;
+        if (n > size - done)
+        {
+            n = size - done;
+        }
+
+        guard.unlock();
+        memcpy(buffer + done, buffers[index] + readOffset, n);
+        guard.lock();
+
+        done += n;
+        readOffset += n;
+        if (readOffset == lengths[index])
+        {
+            readIndex = (readIndex + 1) % buffers.size();
+            readOffset = 0;
+            filled--;
+            bufferFree.notify_one();
+        }
+    }
+
+    if (stalled)
+    {
+        stalls++;
+    }
+
+    *bytesTransferred = done;
+
+    // Running out of data is the end of the media, unless the source failed.
+    //
+    return (done == size) ? ERROR_SUCCESS : sourceError;
+}
+
+void ReadAheadMedia::Stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    bufferFree.notify_one();
+    reader.join();
+}
+
+int ReadAheadMedia::Close()
+{
+    Stop();
+
+    printf("Read-ahead: %zu buffers of %u KB, %llu read(s) waited for data\n",
+           buffers.size(), bufferSize >> 10, (unsigned long long)stalls);
+
+    return source->Close();
+}
+
+BackupMedia* openReadAheadMedia(
+    BackupMedia* source,
+    uint32_t     bufferSize,
+    int          bufferCount)
+{
+    vector<uint8_t*> buffers;
+
+    // Aligned buffers let an O_DIRECT source read straight into them.
+    //
+    for (int ix = 0; ix < bufferCount; ix++)
+    {
+        void* p;
+        if (posix_memalign(&p, DIRECT_IO_ALIGNMENT, bufferSize) != 0)
+        {
+            printf("Failed to allocate read-ahead buffers\n");
+            for (size_t jx = 0; jx < buffers.size(); jx++)
+            {
+                free(buffers[jx]);
+            }
+            source->Close();
+            delete source;
+            return NULL;
+        }
+        buffers.push_back((uint8_t*)p);
+    }
+
+    return new ReadAheadMedia(source, bufferSize, buffers);
+}
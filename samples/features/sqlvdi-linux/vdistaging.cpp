@@ -0,0 +1,302 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vdistaging.cpp
+//
+// Write-behind staging for backups.
+//
+// Without staging, a VDC_Write is completed only once the data has been
+// written to the backup file, so every latency spike of the target storage
+// holds up the server. Here the data is copied into a fixed size ring and
+// the command is completed at once; a writer thread drains the ring to the
+// target media. The server only waits when the ring is full, or when it
+// asks for a VDC_Flush, which returns once all staged data is durable.
+//
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+
+#include "vdi.h"      // completion codes
+#include "vdimedia.h"
+
+using namespace std;
+
+// Largest single write handed to the target media.
+//
+#define STAGING_WRITE_SIZE (4 * 1024 * 1024)
+
+//----------------------------------------------------------------------------
+// NAME: StagingMedia
+//
+// PURPOSE:
+//
+// A ring of 'ringSize' bytes in front of the target media. The bytes at
+// [head, head + used) are staged; the writer thread consumes from 'head'
+// while Write() appends after the staged bytes.
+//
+// A failure of the writer can no longer be reported for the command whose
+// data failed, so it is kept and returned by the next command instead.
+//
+class StagingMedia : public BackupMedia
+{
+public:
+    StagingMedia(BackupMedia* target, uint8_t* ring, size_t ringSize)
+        : target(target), ring(ring), ringSize(ringSize), head(0), used(0),
+          closing(false), error(ERROR_SUCCESS), highWater(0), stalls(0)
+    {
+        writer = thread(&StagingMedia::WriterThread, this);
+    }
+
+    ~StagingMedia()
+    {
+        if (writer.joinable())
+        {
+            Stop();
+        }
+        delete target;
+        free(ring);
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred)
+    {
+        return target->Read(buffer, size, bytesTransferred);
+    }
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred);
+
+    int
+    Flush();
+
+    int
+    Close();
+
+private:
+    void
+    WriterThread();
+
+    int
+    Drain();
+
+    void
+    Stop();
+
+    BackupMedia*        target;
+    uint8_t*            ring;
+    size_t              ringSize;
+
+    mutex               lock;
+    condition_variable  dataReady;  // signalled when bytes are staged
+    condition_variable  spaceFree;  // signalled when bytes are written
+    thread              writer;
+    size_t              head;
+    size_t              used;
+    bool                closing;
+    int                 error;
+
+    size_t              highWater;
+    uint64_t            stalls;     // writes that waited for space
+};
+
+int StagingMedia::Write(const uint8_t* buffer, uint32_t size, uint32_t* bytesTransferred)
+{
+    uint32_t done = 0;
+    bool stalled = false;
+
+    *bytesTransferred = 0;
+
+    unique_lock<mutex> guard(lock);
+    while (done < size)
+    {
+        while (used == ringSize && error == ERROR_SUCCESS)
+        {
+            stalled = true;
+            spaceFree.wait(guard);
+        }
+        if (error != ERROR_SUCCESS)
+        {
+            return error;
+        }
+
+        // Copy into the free space after the staged bytes, which the
+        // writer does not touch, without holding the lock.
+        //
+        size_t tail = (head + used) % ringSize;
+        size_t n = ringSize - used;
+        if (n > ringSize - tail)
+        {
+            n = ringSize - tail;
+        }
+        if (n > size - done)
+        {
+            n = size - done;
+        }
+
+        guard.unlock();
+        memcpy(ring + tail, buffer + done, n);
+        guard.lock();
+
+        if (error != ERROR_SUCCESS)
+        {
+            return error;
+        }
+        used += n;
+        done += (uint32_t)n;
+        if (used > highWater)
+        {
+            highWater = used;
+        }
+        dataReady.notify_one();
+    }
+
+    if (stalled)
+    {
+        stalls++;
+    }
+
+    *bytesTransferred = size;
+    return ERROR_SUCCESS;
+}
+
+void StagingMedia::WriterThread()
+{
+    unique_lock<mutex> guard(lock);
+
+    for (;;)
+    {
+        while (used == 0 && !closing)
+        {
+            dataReady.wait(guard);
+        }
+        if (used == 0)
+        {
+            break;
+        }
+
+        size_t n = used;
+        if (n > ringSize - head)
+        {
+            n = ringSize - head;
+        }
+        if (n > STAGING_WRITE_SIZE)
+        {
+            n = STAGING_WRITE_SIZE;
+        }
+
+        guard.unlock();
+        uint32_t written;
+        int completionCode = target->Write(ring + head, (uint32_t)n, &written);
+        guard.lock();
+
+        if (completionCode != ERROR_SUCCESS && error == ERROR_SUCCESS)
+        {
+            error = completionCode;
+        }
+
+        // After a failure the staged data is dropped, so that nobody
+        // waits for it; the error fails the backup.
+        //
+        if (error != ERROR_SUCCESS)
+        {
+            head = 0;
+            used = 0;
+        }
+        else
+        {
+            head = (head + n) % ringSize;
+            used -= n;
+        }
+        spaceFree.notify_all();
+    }
+}
+
+// Wait until everything staged so far has been written to the target.
+//
+int StagingMedia::Drain()
+{
+    unique_lock<mutex> guard(lock);
+
+    while (used > 0 && error == ERROR_SUCCESS)
+    {
+        spaceFree.wait(guard);
+    }
+
+    return error;
+}
+
+void StagingMedia::Stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        closing = true;
+    }
+    dataReady.notify_one();
+    writer.join();
+}
+
+int StagingMedia::Flush()
+{
+    int completionCode = Drain();
+    if (completionCode != ERROR_SUCCESS)
+    {
+        return completionCode;
+    }
+
+    return target->Flush();
+}
+
+int StagingMedia::Close()
+{
+    int completionCode = Flush();
+
+    Stop();
+
+    int closeCode = target->Close();
+    if (completionCode == ERROR_SUCCESS)
+    {
+        completionCode = closeCode;
+    }
+
+    printf("Staging ring: %zu MB, high water %zu MB, %llu write(s) waited for space\n",
+           ringSize >> 20, highWater >> 20, (unsigned long long)stalls);
+
+    return completionCode;
+}
+
+BackupMedia* openStagingMedia(
+    BackupMedia* target,
+    size_t       ringSize)
+{
+    void* ring = NULL;
+
+    // Keep the ring aligned so that an O_DIRECT target can be written
+    // from it without a bounce buffer.
+    //
+    if (posix_memalign(&ring, DIRECT_IO_ALIGNMENT, ringSize) != 0)
+    {
+        printf("Failed to allocate a %zu MB staging ring\n", ringSize >> 20);
+        target->Close();
+        delete target;
+        return NULL;
+    }
+
+    return new StagingMedia(target, (uint8_t*)ring, ringSize);
+}
@@ -0,0 +1,860 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vdistripe.cpp
+//
+// Striping of one stream across several files.
+//
+// A single virtual device is limited by the one file it writes to. Here the
+// data is cut into units of STRIPE_UNIT_SIZE bytes dealt round robin to N
+// stripe files, typically on different disks: unit k goes to stripe k % N.
+// Each stripe has its own writer thread, or reader thread on restore, so
+// all the disks are busy at once. The backup file itself only holds the
+// stripe map:
+//
+//  header  STRIPE_MAGIC, u32 version, u32 unit size, u32 stripe count,
+//          u32 zero, u64 length of the data (all ones until the backup
+//          is complete)
+//  names   for every stripe, u32 length and the file name of the stripe
+//
+// All integers are little endian. Stripe i of 'dir/file' is written to
+// the i-th directory as 'file.stripe<i>'.
+//
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "vdi.h"      // completion codes
+#include "vdile.h"
+#include "vdimedia.h"
+
+using namespace std;
+
+#define STRIPE_MAGIC        "VDISTRIP"
+#define STRIPE_VERSION      1
+#define STRIPE_HEADER_SIZE  32
+#define STRIPE_UNIT_SIZE    (1024 * 1024)
+#define STRIPE_MAX          64
+
+// Units in flight per stripe.
+//
+#define STRIPE_DEPTH        4
+
+#define STRIPE_INCOMPLETE   (~(uint64_t)0)
+
+enum UnitState
+{
+    UNIT_FREE = 0,
+    UNIT_FILLING,       // backup: owned by Write()
+    UNIT_READY,         // backup: waiting for its writer; restore: filled
+    UNIT_BUSY           // being written or read by a stripe thread
+};
+
+// One unit in flight. On backup, 'written' bytes of it are already in the
+// stripe: a flush writes the part of a unit filled so far, and the rest
+// follows it when the unit is complete.
+//
+struct StripeUnit
+{
+    UnitState   state;
+    uint64_t    unit;
+    uint8_t*    data;
+    uint32_t    length;
+    uint32_t    written;    // backup: bytes in the stripe; restore: bytes returned
+};
+
+static bool allocateUnits(vector<StripeUnit>* units, size_t count)
+{
+    units->resize(count);
+    for (size_t ix = 0; ix < count; ix++)
+    {
+        void* p = NULL;
+        StripeUnit& unit = (*units)[ix];
+
+        // Aligned, so that O_DIRECT stripes need no bounce buffer.
+        //
+        if (posix_memalign(&p, DIRECT_IO_ALIGNMENT, STRIPE_UNIT_SIZE) != 0)
+        {
+            printf("Failed to allocate stripe buffers\n");
+            return false;
+        }
+        unit.state = UNIT_FREE;
+        unit.unit = 0;
+        unit.data = (uint8_t*)p;
+        unit.length = 0;
+        unit.written = 0;
+    }
+    return true;
+}
+
+static void freeUnits(vector<StripeUnit>* units)
+{
+    for (size_t ix = 0; ix < units->size(); ix++)
+    {
+        free((*units)[ix].data);
+    }
+    units->clear();
+}
+
+static void closeStripes(vector<BackupMedia*>* stripes)
+{
+    for (size_t ix = 0; ix < stripes->size(); ix++)
+    {
+        if ((*stripes)[ix] != NULL)
+        {
+            (*stripes)[ix]->Close();
+            delete (*stripes)[ix];
+        }
+    }
+    stripes->clear();
+}
+
+//----------------------------------------------------------------------------
+// NAME: StripeWriteMedia
+//
+// PURPOSE:
+//
+// Deal the backup data to the stripes. Write() fills the units in order;
+// the writer thread of stripe i writes units i, i + N, ... in order as
+// they become ready. The ring holds STRIPE_DEPTH units per stripe, and
+// unit k always uses slot k % ring size, so every slot belongs to one
+// stripe. Flush() hands over the partial unit, then has every writer
+// flush its stripe, all at once.
+//
+class StripeWriteMedia : public BackupMedia
+{
+public:
+    StripeWriteMedia(vector<BackupMedia*>& stripeMedia, vector<StripeUnit>& ring, FILE* map,
+                     const string& mapName)
+        : map(map), mapName(mapName), fillUnit(0), flushRequest(0), closing(false),
+          error(ERROR_SUCCESS), length(0)
+    {
+        stripes.swap(stripeMedia);
+        units.swap(ring);
+        flushed.resize(stripes.size(), 0);
+        for (size_t ix = 0; ix < stripes.size(); ix++)
+        {
+            writers.push_back(thread(&StripeWriteMedia::WriterThread, this, ix));
+        }
+    }
+
+    ~StripeWriteMedia()
+    {
+        if (!writers.empty())
+        {
+            Stop();
+        }
+        if (map != NULL)
+        {
+            fclose(map);
+        }
+        closeStripes(&stripes);
+        freeUnits(&units);
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred)
+    {
+        *bytesTransferred = 0;
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred);
+
+    int
+    Flush();
+
+    int
+    Close();
+
+private:
+    void
+    WriterThread(
+        size_t stripe);
+
+    void
+    Stop();
+
+    vector<BackupMedia*>    stripes;
+    FILE*                   map;
+    string                  mapName;
+
+    mutex                   lock;
+    condition_variable      unitReady;  // a unit, or a flush, is waiting for a writer
+    condition_variable      unitDone;   // a writer finished a unit or a flush
+    vector<StripeUnit>      units;
+    vector<thread>          writers;
+    uint64_t                fillUnit;   // unit being filled by Write()
+    uint64_t                flushRequest;
+    vector<uint64_t>        flushed;    // last flush request done by each writer
+    bool                    closing;
+    int                     error;
+    uint64_t                length;
+};
+
+int StripeWriteMedia::Write(const uint8_t* buffer, uint32_t size, uint32_t* bytesTransferred)
+{
+    uint32_t done = 0;
+
+    *bytesTransferred = 0;
+
+    unique_lock<mutex> guard(lock);
+    while (done < size)
+    {
+        StripeUnit* unit = &units[fillUnit % units.size()];
+
+        while (unit->state != UNIT_FREE && unit->state != UNIT_FILLING &&
+               error == ERROR_SUCCESS)
+        {
+            unitDone.wait(guard);
+        }
+        if (error != ERROR_SUCCESS)
+        {
+            return error;
+        }
+        if (unit->state == UNIT_FREE)
+        {
+            unit->state = UNIT_FILLING;
+            unit->unit = fillUnit;
+            unit->length = 0;
+            unit->written = 0;
+        }
+
+        // The unit being filled belongs to this thread.
+        //
+        uint32_t n = STRIPE_UNIT_SIZE - unit->length;
+        if (n > size - done)
+        {
+            n = size - done;
+        }
+
+        guard.unlock();
+        memcpy(unit->data + unit->length, buffer + done, n);
+        guard.lock();
+
+        unit->length += n;
+        done += n;
+        length += n;
+        if (unit->length == STRIPE_UNIT_SIZE)
+        {
+            unit->state = UNIT_READY;
+            fillUnit++;
+            unitReady.notify_all();
+        }
+    }
+
+    *bytesTransferred = size;
+    return ERROR_SUCCESS;
+}
+
+void StripeWriteMedia::WriterThread(size_t stripe)
+{
+    uint64_t nextUnit = stripe;
+
+    unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        StripeUnit* unit = &units[nextUnit % units.size()];
+
+        while (!(unit->state == UNIT_READY && unit->unit == nextUnit) &&
+               flushed[stripe] == flushRequest && !closing)
+        {
+            unitReady.wait(guard);
+        }
+
+        if (unit->state == UNIT_READY && unit->unit == nextUnit)
+        {
+            unit->state = UNIT_BUSY;
+
+            int completionCode = error;
+            if (completionCode == ERROR_SUCCESS)
+            {
+                guard.unlock();
+                uint32_t bytes;
+                completionCode = stripes[stripe]->Write(unit->data + unit->written,
+                                                        unit->length - unit->written, &bytes);
+                guard.lock();
+            }
+            if (completionCode != ERROR_SUCCESS && error == ERROR_SUCCESS)
+            {
+                error = completionCode;
+            }
+
+            // A partial unit goes back to Write() to be completed.
+            //
+            unit->written = unit->length;
+            if (unit->length == STRIPE_UNIT_SIZE)
+            {
+                unit->state = UNIT_FREE;
+                nextUnit += stripes.size();
+            }
+            else
+            {
+                unit->state = UNIT_FILLING;
+            }
+            unitDone.notify_all();
+        }
+        else if (flushed[stripe] != flushRequest)
+        {
+            // The units of a stripe become ready in order, so everything
+            // handed to this one so far is written.
+            //
+            uint64_t request = flushRequest;
+            guard.unlock();
+            int completionCode = stripes[stripe]->Flush();
+            guard.lock();
+            if (completionCode != ERROR_SUCCESS && error == ERROR_SUCCESS)
+            {
+                error = completionCode;
+            }
+            flushed[stripe] = request;
+            unitDone.notify_all();
+        }
+        else
+        {
+            break;
+        }
+    }
+}
+
+int StripeWriteMedia::Flush()
+{
+    unique_lock<mutex> guard(lock);
+
+    StripeUnit* unit = &units[fillUnit % units.size()];
+    if (unit->state == UNIT_FILLING && unit->length > unit->written)
+    {
+        unit->state = UNIT_READY;
+    }
+
+    uint64_t request = ++flushRequest;
+    unitReady.notify_all();
+
+    for (size_t ix = 0; ix < flushed.size(); ix++)
+    {
+        while (flushed[ix] < request)
+        {
+            unitDone.wait(guard);
+        }
+    }
+    return error;
+}
+
+void StripeWriteMedia::Stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        closing = true;
+    }
+    unitReady.notify_all();
+    for (size_t ix = 0; ix < writers.size(); ix++)
+    {
+        writers[ix].join();
+    }
+    writers.clear();
+}
+
+int StripeWriteMedia::Close()
+{
+    int completionCode = Flush();
+
+    Stop();
+
+    for (size_t ix = 0; ix < stripes.size(); ix++)
+    {
+        int closeCode = stripes[ix]->Close();
+        if (completionCode == ERROR_SUCCESS)
+        {
+            completionCode = closeCode;
+        }
+        delete stripes[ix];
+    }
+    size_t nStripes = stripes.size();
+    stripes.clear();
+
+    // The length in the map marks the backup complete.
+    //
+    if (completionCode == ERROR_SUCCESS)
+    {
+        uint8_t value[8];
+        putLE64(value, length);
+        if (fseek(map, 24, SEEK_SET) != 0 || fwrite(value, 1, sizeof(value), map) != sizeof(value) ||
+            fflush(map) != 0 || fdatasync(fileno(map)) != 0)
+        {
+            printf("Failed to write the stripe map: %s\n", mapName.c_str());
+            completionCode = ERROR_DISK_FULL;
+        }
+    }
+    if (fclose(map) != 0 && completionCode == ERROR_SUCCESS)
+    {
+        completionCode = ERROR_DISK_FULL;
+    }
+    map = NULL;
+
+    printf("Stripe: %.1f MB in %zu stripes of %d KB units\n", length / 1048576.0, nStripes,
+           STRIPE_UNIT_SIZE / 1024);
+
+    return completionCode;
+}
+
+//----------------------------------------------------------------------------
+// NAME: StripeReadMedia
+//
+// PURPOSE:
+//
+// Read the stripes in parallel and return the units in order. The reader
+// thread of stripe i reads units i, i + N, ... ahead of Read() into the
+// slots of the ring that belong to its stripe. The length in the map says
+// how many units there are and how long the last one is.
+//
+class StripeReadMedia : public BackupMedia
+{
+public:
+    StripeReadMedia(vector<BackupMedia*>& stripeMedia, vector<StripeUnit>& ring,
+                    const vector<string>& names, uint64_t length)
+        : names(names), readUnit(0), closing(false), error(ERROR_SUCCESS), length(length)
+    {
+        stripes.swap(stripeMedia);
+        units.swap(ring);
+        nUnits = (length + STRIPE_UNIT_SIZE - 1) / STRIPE_UNIT_SIZE;
+        for (size_t ix = 0; ix < stripes.size(); ix++)
+        {
+            readers.push_back(thread(&StripeReadMedia::ReaderThread, this, ix));
+        }
+    }
+
+    ~StripeReadMedia()
+    {
+        if (!readers.empty())
+        {
+            Stop();
+        }
+        closeStripes(&stripes);
+        freeUnits(&units);
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred);
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred)
+    {
+        *bytesTransferred = 0;
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    int
+    Flush()
+    {
+        return ERROR_SUCCESS;
+    }
+
+    int
+    Close();
+
+private:
+    void
+    ReaderThread(
+        size_t stripe);
+
+    void
+    Stop();
+
+    vector<BackupMedia*>    stripes;
+    vector<string>          names;
+
+    mutex                   lock;
+    condition_variable      unitReady;  // a unit was read
+    condition_variable      unitFree;   // a unit was consumed by Read()
+    vector<StripeUnit>      units;
+    vector<thread>          readers;
+    uint64_t                readUnit;   // next unit for Read()
+    uint64_t                nUnits;
+    bool                    closing;
+    int                     error;
+    uint64_t                length;
+};
+
+void StripeReadMedia::ReaderThread(size_t stripe)
+{
+    unique_lock<mutex> guard(lock);
+    for (uint64_t nextUnit = stripe; nextUnit < nUnits; nextUnit += stripes.size())
+    {
+        StripeUnit* unit = &units[nextUnit % units.size()];
+
+        while (unit->state != UNIT_FREE && !closing)
+        {
+            unitFree.wait(guard);
+        }
+        if (closing || error != ERROR_SUCCESS)
+        {
+            break;
+        }
+        unit->state = UNIT_BUSY;
+
+        uint64_t start = nextUnit * STRIPE_UNIT_SIZE;
+        uint32_t want = (length - start < STRIPE_UNIT_SIZE) ? (uint32_t)(length - start)
+                                                            : STRIPE_UNIT_SIZE;
+        uint32_t bytes = 0;
+
+        guard.unlock();
+        stripes[stripe]->Read(unit->data, want, &bytes);
+        guard.lock();
+
+        if (bytes != want)
+        {
+            printf("Stripe %zu (%s) ends early, at unit %llu\n", stripe, names[stripe].c_str(),
+                   (unsigned long long)nextUnit);
+            if (error == ERROR_SUCCESS)
+            {
+                error = ERROR_OPERATION_ABORTED;
+            }
+        }
+        unit->unit = nextUnit;
+        unit->length = bytes;
+        unit->written = 0;
+        unit->state = UNIT_READY;
+        unitReady.notify_all();
+    }
+}
+
+int StripeReadMedia::Read(uint8_t* buffer, uint32_t size, uint32_t* bytesTransferred)
+{
+    uint32_t done = 0;
+
+    *bytesTransferred = 0;
+
+    unique_lock<mutex> guard(lock);
+    while (done < size && readUnit < nUnits)
+    {
+        StripeUnit* unit = &units[readUnit % units.size()];
+
+        while (!(unit->state == UNIT_READY && unit->unit == readUnit) &&
+               error == ERROR_SUCCESS)
+        {
+            unitReady.wait(guard);
+        }
+        if (error != ERROR_SUCCESS)
+        {
+            return error;
+        }
+
+        uint32_t n = unit->length - unit->written;
+        if (n > size - done)
+        {
+            n = size - done;
+        }
+
+        guard.unlock();
+        memcpy(buffer + done, unit->data + unit->written, n);
+        guard.lock();
+
+        unit->written += n;
+        done += n;
+        if (unit->written == unit->length)
+        {
+            unit->state = UNIT_FREE;
+            readUnit++;
+            unitFree.notify_all();
+        }
+    }
+
+    *bytesTransferred = done;
+    return (done == size) ? ERROR_SUCCESS : ERROR_HANDLE_EOF;
+}
+
+void StripeReadMedia::Stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        closing = true;
+    }
+    unitFree.notify_all();
+    for (size_t ix = 0; ix < readers.size(); ix++)
+    {
+        readers[ix].join();
+    }
+    readers.clear();
+}
+
+int StripeReadMedia::Close()
+{
+    int completionCode = ERROR_SUCCESS;
+
+    Stop();
+    for (size_t ix = 0; ix < stripes.size(); ix++)
+    {
+        int closeCode = stripes[ix]->Close();
+        if (completionCode == ERROR_SUCCESS)
+        {
+            completionCode = closeCode;
+        }
+        delete stripes[ix];
+    }
+    stripes.clear();
+    return completionCode;
+}
+
+// Split the comma separated directory list 'stripeDirs'.
+//
+static bool parseStripeDirs(const char* stripeDirs, vector<string>* dirs)
+{
+    string list = stripeDirs;
+    size_t start = 0;
+
+    for (;;)
+    {
+        size_t comma = list.find(',', start);
+        string dir = list.substr(start, (comma == string::npos) ? string::npos : comma - start);
+        if (dir.empty())
+        {
+            break;
+        }
+        dirs->push_back(dir);
+        if (comma == string::npos)
+        {
+            return dirs->size() <= STRIPE_MAX;
+        }
+        start = comma + 1;
+    }
+
+    printf("Bad stripe directory list: %s\n", stripeDirs);
+    return false;
+}
+
+// The bytes stripe 'stripe' of 'nStripes' holds of 'length' bytes of data.
+//
+static uint64_t stripeLength(uint64_t length, size_t stripe, size_t nStripes)
+{
+    uint64_t fullUnits = length / STRIPE_UNIT_SIZE;
+    uint64_t result = (fullUnits / nStripes) * STRIPE_UNIT_SIZE;
+
+    if (stripe < fullUnits % nStripes)
+    {
+        result += STRIPE_UNIT_SIZE;
+    }
+    else if (stripe == fullUnits % nStripes)
+    {
+        result += length % STRIPE_UNIT_SIZE;
+    }
+    return result;
+}
+
+static BackupMedia* openStripe(const string& name, int backup, bool directIO)
+{
+    return (directIO) ? openDirectMedia(name.c_str(), backup, DIRECT_IO_ALIGNMENT)
+                      : openFdMedia(name.c_str(), backup);
+}
+
+static BackupMedia* openStripeBackup(const char* fname, const vector<string>& dirs,
+                                     bool directIO, uint64_t preallocate,
+                                     uint64_t writeback)
+{
+    string base = fname;
+    size_t slash = base.rfind('/');
+    if (slash != string::npos)
+    {
+        base = base.substr(slash + 1);
+    }
+
+    FILE* map = fopen(fname, "wb");
+    if (map == NULL)
+    {
+        printf("Failed to open: %s\n", fname);
+        return NULL;
+    }
+
+    vector<uint8_t> contents(STRIPE_HEADER_SIZE);
+    memcpy(&contents[0], STRIPE_MAGIC, 8);
+    putLE32(&contents[8], STRIPE_VERSION);
+    putLE32(&contents[12], STRIPE_UNIT_SIZE);
+    putLE32(&contents[16], (uint32_t)dirs.size());
+    putLE32(&contents[20], 0);
+    putLE64(&contents[24], STRIPE_INCOMPLETE);
+
+    vector<BackupMedia*> stripes;
+    bool ok = true;
+    for (size_t ix = 0; ix < dirs.size() && ok; ix++)
+    {
+        string name = base + ".stripe" + to_string(ix);
+        uint8_t nameLength[4];
+        putLE32(nameLength, (uint32_t)name.size());
+        contents.insert(contents.end(), nameLength, nameLength + 4);
+        contents.insert(contents.end(), name.begin(), name.end());
+
+        BackupMedia* stripe = openStripe(dirs[ix] + "/" + name, true, directIO);
+        if (stripe != NULL && preallocate > 0)
+        {
+            stripe = openPreallocateMedia(stripe, (dirs[ix] + "/" + name).c_str(),
+                                          stripeLength(preallocate, ix, dirs.size()));
+        }
+        if (stripe != NULL && writeback > 0 && !directIO)
+        {
+            stripe = openWritebackMedia(stripe, (dirs[ix] + "/" + name).c_str(), writeback);
+        }
+        ok = (stripe != NULL);
+        stripes.push_back(stripe);
+    }
+
+    if (ok && (fwrite(&contents[0], 1, contents.size(), map) != contents.size() ||
+               fflush(map) != 0))
+    {
+        printf("Failed to write the stripe map: %s\n", fname);
+        ok = false;
+    }
+
+    vector<StripeUnit> units;
+    if (ok)
+    {
+        ok = allocateUnits(&units, STRIPE_DEPTH * dirs.size());
+    }
+    if (!ok)
+    {
+        freeUnits(&units);
+        closeStripes(&stripes);
+        fclose(map);
+        return NULL;
+    }
+
+    return new StripeWriteMedia(stripes, units, map, fname);
+}
+
+static BackupMedia* openStripeRestore(const char* fname, const vector<string>& dirs,
+                                      bool directIO)
+{
+    FILE* map = fopen(fname, "rb");
+    if (map == NULL)
+    {
+        printf("Failed to open: %s\n", fname);
+        return NULL;
+    }
+
+    uint8_t header[STRIPE_HEADER_SIZE];
+    vector<string> names;
+    uint64_t length = 0;
+    bool ok = fread(header, 1, sizeof(header), map) == sizeof(header) &&
+              memcmp(header, STRIPE_MAGIC, 8) == 0 &&
+              getLE32(header + 8) == STRIPE_VERSION &&
+              getLE32(header + 12) == STRIPE_UNIT_SIZE;
+    if (!ok)
+    {
+        printf("%s is not a striped backup\n", fname);
+    }
+    else if (getLE64(header + 24) == STRIPE_INCOMPLETE)
+    {
+        printf("The striped backup %s was not completed\n", fname);
+        ok = false;
+    }
+    else if (getLE32(header + 16) != dirs.size())
+    {
+        printf("%s has %u stripes, %zu directories were given\n", fname, getLE32(header + 16),
+               dirs.size());
+        ok = false;
+    }
+    length = getLE64(header + 24);
+
+    for (size_t ix = 0; ix < dirs.size() && ok; ix++)
+    {
+        uint8_t nameLength[4];
+        ok = fread(nameLength, 1, 4, map) == 4 && getLE32(nameLength) < 4096;
+        if (ok)
+        {
+            string name(getLE32(nameLength), '\0');
+            ok = fread(&name[0], 1, name.size(), map) == name.size();
+            names.push_back(dirs[ix] + "/" + name);
+        }
+        if (!ok)
+        {
+            printf("The stripe map is damaged: %s\n", fname);
+        }
+    }
+    fclose(map);
+
+    // Every stripe must hold exactly its share of the data.
+    //
+    for (size_t ix = 0; ix < names.size() && ok; ix++)
+    {
+        struct stat st;
+        uint64_t expected = stripeLength(length, ix, names.size());
+        if (stat(names[ix].c_str(), &st) != 0)
+        {
+            printf("Failed to open stripe %zu: %s\n", ix, names[ix].c_str());
+            ok = false;
+        }
+        else if ((uint64_t)st.st_size != expected)
+        {
+            printf("Stripe %zu (%s) holds %llu bytes, the map calls for %llu\n", ix,
+                   names[ix].c_str(), (unsigned long long)st.st_size,
+                   (unsigned long long)expected);
+            ok = false;
+        }
+    }
+
+    vector<BackupMedia*> stripes;
+    for (size_t ix = 0; ix < names.size() && ok; ix++)
+    {
+        BackupMedia* stripe = openStripe(names[ix], false, directIO);
+        ok = (stripe != NULL);
+        stripes.push_back(stripe);
+    }
+
+    vector<StripeUnit> units;
+    if (ok)
+    {
+        ok = allocateUnits(&units, STRIPE_DEPTH * names.size());
+    }
+    if (!ok)
+    {
+        freeUnits(&units);
+        closeStripes(&stripes);
+        return NULL;
+    }
+
+    return new StripeReadMedia(stripes, units, names, length);
+}
+
+BackupMedia* openStripeMedia(
+    const char* fname,
+    int         backup,
+    const char* stripeDirs,
+    bool        directIO,
+    uint64_t    preallocate,
+    uint64_t    writeback)
+{
+    vector<string> dirs;
+
+    if (!parseStripeDirs(stripeDirs, &dirs))
+    {
+        return NULL;
+    }
+    return (backup) ? openStripeBackup(fname, dirs, directIO, preallocate, writeback)
+                    : openStripeRestore(fname, dirs, directIO);
+}
@@ -0,0 +1,370 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vditrace.cpp
+//
+// Command tracing for vdipipesample.
+//
+// Printing a line for every command costs a synchronous write to the
+// terminal or the journal per VDC_Read or VDC_Write, millions of them for
+// a large backup. Instead each device keeps counters and latency
+// histograms, printed once at the end, and every command can be recorded
+// in a fixed size ring in memory.
+// Any thread adds records with a single atomic increment; the ring is
+// printed on failure, on SIGUSR1 and at exit.
+//
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include "vditrace.h"
+#include "vdierror.h" // error constants
+
+using namespace std;
+
+// One traced command. Times are traceClock() values.
+//
+struct TraceRecord
+{
+    uint64_t    requested;
+    uint64_t    received;
+    uint64_t    processed;
+    uint64_t    completed;
+    uint32_t    size;
+    uint32_t    bytesTransferred;
+    int         completionCode;
+    int         device;
+    int         commandCode;
+};
+
+// A ring slot. 'sequence' is 2n+1 while record n is being written and
+// 2n+2 once it is complete, so a reader can tell whether the record it
+// copied is the one it expected and was not overwritten meanwhile.
+//
+struct TraceSlot
+{
+    atomic<uint64_t>    sequence;
+    TraceRecord         record;
+};
+
+static TraceSlot*           traceSlots = NULL;
+static uint64_t             traceMask;
+static atomic<uint64_t>     traceNext(0);
+static uint64_t             traceDumped = 0;    // records before this were printed
+static uint64_t             traceStarted;
+static mutex                traceDumpLock;
+
+uint64_t traceClock()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static void traceAdd(const TraceRecord& record)
+{
+    uint64_t n = traceNext.fetch_add(1, memory_order_relaxed);
+    TraceSlot* slot = &traceSlots[n & traceMask];
+
+    slot->sequence.store(2 * n + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->record = record;
+    slot->sequence.store(2 * n + 2, memory_order_release);
+}
+
+void traceDump(const char* reason)
+{
+    if (traceSlots == NULL)
+    {
+        return;
+    }
+
+    lock_guard<mutex> guard(traceDumpLock);
+
+    uint64_t next = traceNext.load(memory_order_acquire);
+    uint64_t first = traceDumped;
+    if (next - first > traceMask + 1)
+    {
+        first = next - (traceMask + 1);
+    }
+    if (first == next)
+    {
+        return;
+    }
+
+    printf("Trace (%s): commands %llu to %llu of %llu\n", reason,
+           (unsigned long long)first, (unsigned long long)(next - 1),
+           (unsigned long long)next);
+    printf("trace,seq,device,command,size,bytes,completion,received_us,"
+           "wait_us,io_us,complete_us\n");
+
+    for (uint64_t n = first; n < next; n++)
+    {
+        TraceSlot* slot = &traceSlots[n & traceMask];
+
+        // Skip records still being written, or already replaced by a
+        // newer command.
+        //
+        if (slot->sequence.load(memory_order_acquire) != 2 * n + 2)
+        {
+            continue;
+        }
+        TraceRecord record = slot->record;
+        atomic_thread_fence(memory_order_acquire);
+        if (slot->sequence.load(memory_order_relaxed) != 2 * n + 2)
+        {
+            continue;
+        }
+
+        printf("trace,%llu,%d,%d,%u,%u,%d,%.1f,%.1f,%.1f,%.1f\n",
+               (unsigned long long)n, record.device, record.commandCode,
+               record.size, record.bytesTransferred, record.completionCode,
+               (record.received - traceStarted) / 1000.0,
+               (record.received - record.requested) / 1000.0,
+               (record.processed - record.received) / 1000.0,
+               (record.completed - record.processed) / 1000.0);
+    }
+    fflush(stdout);
+
+    traceDumped = next;
+}
+
+// Print the ring each time SIGUSR1 arrives. Every other thread has the
+// signal blocked, so it is only ever delivered here.
+//
+static void traceSignalThread(sigset_t signals)
+{
+    int signo;
+
+    while (sigwait(&signals, &signo) == 0)
+    {
+        traceDump("SIGUSR1");
+    }
+}
+
+bool traceEnable(unsigned entries)
+{
+    uint64_t size = 1;
+    while (size < entries)
+    {
+        size <<= 1;
+    }
+
+    traceSlots = (TraceSlot*)calloc(size, sizeof(TraceSlot));
+    if (traceSlots == NULL)
+    {
+        printf("Failed to allocate a trace ring of %u entries\n", entries);
+        return false;
+    }
+    traceMask = size - 1;
+    traceStarted = traceClock();
+
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    thread(traceSignalThread, signals).detach();
+
+    return true;
+}
+
+// Enough buckets for any 64 bit latency.
+//
+#define LATENCY_BUCKETS ((64 - 3) * LATENCY_SUB_BUCKETS)
+
+static unsigned latencyBucket(uint64_t nanoseconds)
+{
+    if (nanoseconds < LATENCY_SUB_BUCKETS)
+    {
+        return (unsigned)nanoseconds;
+    }
+
+    // The top bit selects the group, the next four the bucket within it.
+    //
+    int msb = 63 - __builtin_clzll(nanoseconds);
+    return (msb - 3) * LATENCY_SUB_BUCKETS
+        + (unsigned)((nanoseconds >> (msb - 4)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+// The largest latency counted in 'bucket'.
+//
+static uint64_t latencyBucketTop(unsigned bucket)
+{
+    if (bucket < LATENCY_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+
+    int msb = bucket / LATENCY_SUB_BUCKETS + 3;
+    uint64_t sub = bucket % LATENCY_SUB_BUCKETS;
+    return ((LATENCY_SUB_BUCKETS + sub + 1) << (msb - 4)) - 1;
+}
+
+LatencyHistogram::LatencyHistogram()
+    : counts(LATENCY_BUCKETS, 0), total(0), max(0)
+{
+}
+
+void LatencyHistogram::Add(uint64_t nanoseconds)
+{
+    counts[latencyBucket(nanoseconds)]++;
+    total++;
+    if (nanoseconds > max)
+    {
+        max = nanoseconds;
+    }
+}
+
+uint64_t LatencyHistogram::Percentile(double p) const
+{
+    uint64_t rank = (uint64_t)(p * total + 0.5);
+    uint64_t seen = 0;
+
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+    for (unsigned bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+    {
+        seen += counts[bucket];
+        if (seen >= rank)
+        {
+            uint64_t top = latencyBucketTop(bucket);
+            return (top < max) ? top : max;
+        }
+    }
+
+    return max;
+}
+
+// Latency phases and command classes, as indexes into
+// CommandTrace::latency.
+//
+enum LatencyPhase { PhaseWait, PhaseIO, PhaseComplete, PhaseCount };
+enum LatencyClass { ClassRead, ClassWrite, ClassFlush, ClassOther, ClassCount };
+
+static const char* phaseNames[PhaseCount] = { "wait", "io", "complete" };
+static const char* classNames[ClassCount] = { "read", "write", "flush", "other" };
+
+CommandTrace::CommandTrace(int device)
+    : device(device), started(traceClock()), reads(0), writes(0), flushes(0),
+      others(0), failures(0), bytes(0), latency(PhaseCount * ClassCount)
+{
+}
+
+void CommandTrace::Record(
+    int      commandCode,
+    uint32_t size,
+    int      completionCode,
+    uint32_t bytesTransferred,
+    uint64_t requested,
+    uint64_t received,
+    uint64_t processed)
+{
+    uint64_t completed = traceClock();
+    LatencyClass commandClass;
+
+    switch (commandCode)
+    {
+    case VDC_Read:
+        reads++;
+        commandClass = ClassRead;
+        break;
+
+    case VDC_Write:
+        writes++;
+        commandClass = ClassWrite;
+        break;
+
+    case VDC_Flush:
+        flushes++;
+        commandClass = ClassFlush;
+        break;
+
+    default:
+        others++;
+        commandClass = ClassOther;
+    }
+    bytes += bytesTransferred;
+
+    latency[PhaseWait * ClassCount + commandClass].Add(received - requested);
+    latency[PhaseIO * ClassCount + commandClass].Add(processed - received);
+    latency[PhaseComplete * ClassCount + commandClass].Add(completed - processed);
+
+    // Reaching the end of the media on restore is expected.
+    //
+    if (completionCode != ERROR_SUCCESS && completionCode != ERROR_HANDLE_EOF)
+    {
+        failures++;
+    }
+
+    if (traceSlots != NULL)
+    {
+        TraceRecord record;
+        record.requested = requested;
+        record.received = received;
+        record.processed = processed;
+        record.completed = completed;
+        record.size = size;
+        record.bytesTransferred = bytesTransferred;
+        record.completionCode = completionCode;
+        record.device = device;
+        record.commandCode = commandCode;
+        traceAdd(record);
+    }
+}
+
+void CommandTrace::Finish(bool failed)
+{
+    double seconds = (traceClock() - started) / 1e9;
+
+    printf("Stream %d: %llu read(s), %llu write(s), %llu flush(es), %llu other, "
+           "%llu failed, %.1f MB in %.2f s\n",
+           device, (unsigned long long)reads, (unsigned long long)writes,
+           (unsigned long long)flushes, (unsigned long long)others,
+           (unsigned long long)failures, bytes / 1048576.0, seconds);
+
+    // One CSV line per phase and command class that saw any commands.
+    //
+    printf("latency,device,phase,command,count,p50_us,p99_us,p999_us,max_us\n");
+    for (int phase = 0; phase < PhaseCount; phase++)
+    {
+        for (int commandClass = 0; commandClass < ClassCount; commandClass++)
+        {
+            const LatencyHistogram& histogram = latency[phase * ClassCount + commandClass];
+            if (histogram.Count() == 0)
+            {
+                continue;
+            }
+
+            printf("latency,%d,%s,%s,%llu,%.1f,%.1f,%.1f,%.1f\n",
+                   device, phaseNames[phase], classNames[commandClass],
+                   (unsigned long long)histogram.Count(),
+                   histogram.Percentile(0.50) / 1000.0,
+                   histogram.Percentile(0.99) / 1000.0,
+                   histogram.Percentile(0.999) / 1000.0,
+                   histogram.Max() / 1000.0);
+        }
+    }
+
+    if (failed || failures > 0)
+    {
+        char reason[64];
+        sprintf(reason, "stream %d failed", device);
+        traceDump(reason);
+    }
+}
@@ -0,0 +1,146 @@
+//*********************************************************************
+//                 Copyright (C) Microsoft Corporation.
+//
+// @File: vditrace.h
+//
+// Purpose:
+//   Command tracing for the vdipipesample transfer loops: a one line
+//   summary and latency histograms per device, and an optional in-memory
+//   ring holding the most recent commands, printed when something goes
+//   wrong.
+//
+// Notes:
+//   Recording a command never blocks and never does I/O, so tracing can
+//   stay enabled on the hot path of a large backup.
+//
+//*********************************************************************
+#ifndef VDITRACE_H_
+#define VDITRACE_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include "vdi.h"
+
+// Allocate a trace ring for the most recent 'entries' commands (rounded up
+// to a power of two), and print it when the process receives SIGUSR1.
+// Must be called before any other thread is started, so that they all
+// inherit SIGUSR1 blocked.
+// Returns false, after printing the reason, on failure.
+//
+bool traceEnable(
+    unsigned entries);
+
+// Print the records added to the trace ring since the last dump, if the
+// ring is enabled.
+//
+void traceDump(
+    const char* reason);
+
+// Nanoseconds on a monotonic clock.
+//
+uint64_t traceClock();
+
+// Each power of two of latency is split into this many buckets, which
+// bounds the error of a reported percentile to 1/16th.
+//
+#define LATENCY_SUB_BUCKETS 16
+
+//----------------------------------------------------------------------------
+// NAME: LatencyHistogram
+//
+// PURPOSE:
+//
+// Count latencies in nanoseconds in log-linear buckets: exact below
+// LATENCY_SUB_BUCKETS, then LATENCY_SUB_BUCKETS buckets per power of two.
+//
+class LatencyHistogram
+{
+public:
+    LatencyHistogram();
+
+    void
+    Add(
+        uint64_t nanoseconds);
+
+    // The latency below which a fraction 'p' of the samples fall, rounded
+    // up to the top of its bucket.
+    //
+    uint64_t
+    Percentile(
+        double p) const;
+
+    uint64_t
+    Count() const
+    {
+        return total;
+    }
+
+    uint64_t
+    Max() const
+    {
+        return max;
+    }
+
+private:
+    std::vector<uint64_t>   counts;
+    uint64_t                total;
+    uint64_t                max;
+};
+
+//----------------------------------------------------------------------------
+// NAME: CommandTrace
+//
+// PURPOSE:
+//
+// Account for the commands handled by one virtual device. Record() adds
+// each completed command to the device's totals, to the trace ring, and
+// to a latency histogram per phase and command code:
+//
+//   wait       GetCommand, that is time spent waiting for SQL Server
+//   io         the backup media, or the io_uring requests
+//   complete   CompleteCommand
+//
+// Finish() prints the totals and the histograms, and dumps the ring if the
+// transfer or any command failed.
+// Only the thread servicing the device may call Record().
+//
+class CommandTrace
+{
+public:
+    explicit CommandTrace(int device);
+
+    // 'commandCode' and 'size' are those of the command, copied before it
+    // was completed: the command belongs to the server again once
+    // CompleteCommand has been called. The times are traceClock() values:
+    // 'requested' when GetCommand was called, 'received' when it returned
+    // the command, and 'processed' when CompleteCommand was called.
+    //
+    void
+    Record(
+        int      commandCode,
+        uint32_t size,
+        int      completionCode,
+        uint32_t bytesTransferred,
+        uint64_t requested,
+        uint64_t received,
+        uint64_t processed);
+
+    void
+    Finish(
+        bool failed);
+
+private:
+    int         device;
+    uint64_t    started;
+    uint64_t    reads;
+    uint64_t    writes;
+    uint64_t    flushes;
+    uint64_t    others;
+    uint64_t    failures;
+    uint64_t    bytes;
+
+    std::vector<LatencyHistogram>   latency;    // [phase][command class]
+};
+
+#endif
@@ -0,0 +1,604 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vdiuring.cpp
+//
+// An io_uring based transfer loop for vdipipesample.
+//
+// The basic transfer loop in vdipipesample.cpp services one command at a
+// time: the server cannot hand over its next buffer until the previous
+// fread/fwrite has returned. Here the client keeps fetching commands
+// while earlier reads and writes are still in progress in the kernel, up
+// to the requested depth, and completes each command back to the server
+// as soon as it (and every command received before it) has finished.
+//
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "vdiuring.h"
+#include "vditrace.h"
+#include "vdierror.h" // error constants
+
+using namespace std;
+
+static int io_uring_setup(unsigned entries, io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+UringQueue::UringQueue()
+    : ringFd(-1), sqRing(MAP_FAILED), sqRingSize(0), cqRing(MAP_FAILED), cqRingSize(0),
+      sqes((io_uring_sqe*)MAP_FAILED), sqesSize(0), sqHead(NULL), sqTail(NULL),
+      sqMask(NULL), sqArray(NULL), sqEntries(0), sqPending(0), cqHead(NULL),
+      cqTail(NULL), cqMask(NULL), cqes(NULL)
+{
+}
+
+UringQueue::~UringQueue()
+{
+    if (sqes != MAP_FAILED)
+    {
+        munmap(sqes, sqesSize);
+    }
+    if (cqRing != MAP_FAILED && cqRing != sqRing)
+    {
+        munmap(cqRing, cqRingSize);
+    }
+    if (sqRing != MAP_FAILED)
+    {
+        munmap(sqRing, sqRingSize);
+    }
+    if (ringFd >= 0)
+    {
+        close(ringFd);
+    }
+}
+
+int UringQueue::Init(unsigned entries)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ringFd = io_uring_setup(entries, &params);
+    if (ringFd < 0)
+    {
+        return -errno;
+    }
+
+    // Map the submission and completion rings. Newer kernels place both
+    // in a single mapping.
+    //
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (cqRingSize > sqRingSize)
+        {
+            sqRingSize = cqRingSize;
+        }
+        cqRingSize = sqRingSize;
+    }
+
+    sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED)
+    {
+        return -errno;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        cqRing = sqRing;
+    }
+    else
+    {
+        cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED)
+        {
+            return -errno;
+        }
+    }
+
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe*)mmap(NULL, sqesSize, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        return -errno;
+    }
+
+    uint8_t* sq = (uint8_t*)sqRing;
+    sqHead = (unsigned*)(sq + params.sq_off.head);
+    sqTail = (unsigned*)(sq + params.sq_off.tail);
+    sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    sqArray = (unsigned*)(sq + params.sq_off.array);
+    sqEntries = params.sq_entries;
+
+    uint8_t* cq = (uint8_t*)cqRing;
+    cqHead = (unsigned*)(cq + params.cq_off.head);
+    cqTail = (unsigned*)(cq + params.cq_off.tail);
+    cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+io_uring_sqe* UringQueue::GetSqe()
+{
+    unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+    unsigned tail = *sqTail;
+
+    if (tail - head >= sqEntries)
+    {
+        return NULL;
+    }
+
+    unsigned index = tail & *sqMask;
+    io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+
+    // Publish the entry; the kernel only looks at it after Submit().
+    //
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    sqPending++;
+
+    return sqe;
+}
+
+bool UringQueue::PrepareRead(int fd, void* buffer, unsigned length, int64_t offset, uint64_t tag)
+{
+    io_uring_sqe* sqe = GetSqe();
+    if (sqe == NULL)
+    {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = length;
+    sqe->off = (uint64_t)offset;
+    sqe->user_data = tag;
+    return true;
+}
+
+bool UringQueue::PrepareWrite(int fd, const void* buffer, unsigned length, int64_t offset, uint64_t tag)
+{
+    io_uring_sqe* sqe = GetSqe();
+    if (sqe == NULL)
+    {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer;
+    sqe->len = length;
+    sqe->off = (uint64_t)offset;
+    sqe->user_data = tag;
+    return true;
+}
+
+int UringQueue::Submit(unsigned waitFor)
+{
+    // Completions can be read straight from the shared ring, so the
+    // kernel only needs to be entered to submit or to wait.
+    //
+    while (sqPending > 0 || waitFor > 0)
+    {
+        int ret = io_uring_enter(ringFd, sqPending, waitFor,
+                                 waitFor ? IORING_ENTER_GETEVENTS : 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -errno;
+        }
+
+        sqPending -= (unsigned)ret;
+        break;
+    }
+
+    return 0;
+}
+
+bool UringQueue::GetCompletion(uint64_t* tag, int* result)
+{
+    unsigned head = *cqHead;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+
+    if (head == tail)
+    {
+        return false;
+    }
+
+    io_uring_cqe* cqe = &cqes[head & *cqMask];
+    *tag = cqe->user_data;
+    *result = cqe->res;
+
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// The state of one read or write command received from the server.
+//
+struct UringSlot
+{
+    VDC_Command*    cmd;
+    int64_t         offset;         // file offset of the first byte
+    uint64_t        requested;      // traceClock() time of the GetCommand call
+    uint64_t        received;       // and of its return
+    uint32_t        done;           // bytes transferred so far
+    int             completionCode;
+    bool            busy;           // a request is outstanding in the kernel
+};
+
+//----------------------------------------------------------------------------
+// NAME: UringTransfer
+//
+// PURPOSE:
+//
+// Drive one virtual device through an io_uring queue. Commands occupy the
+// slots in arrival order, so the slots double as the FIFO used to complete
+// commands back to the server in order.
+//
+class UringTransfer
+{
+public:
+    UringTransfer(ClientVirtualDevice* vd, CommandTrace& trace, int backup, int fd, unsigned depth)
+        : vd(vd), trace(trace), backup(backup), fd(fd), depth(depth), slots(depth), head(0),
+          count(0)
+    {
+    }
+
+    int
+    Init()
+    {
+        return ring.Init(depth);
+    }
+
+    int
+    Run();
+
+private:
+    bool
+    Issue(
+        UringSlot* slot,
+        uint64_t   tag);
+
+    int
+    Reap(
+        bool wait);
+
+    int
+    Retire();
+
+    int
+    Drain();
+
+    ClientVirtualDevice*    vd;
+    CommandTrace&           trace;
+    int                     backup;
+    int                     fd;
+    unsigned                depth;
+    UringQueue              ring;
+    vector<UringSlot>       slots;
+    unsigned                head;   // oldest command not yet completed
+    unsigned                count;  // commands not yet completed
+};
+
+// Queue the untransferred part of a command.
+//
+bool UringTransfer::Issue(UringSlot* slot, uint64_t tag)
+{
+    uint8_t* buffer = slot->cmd->buffer + slot->done;
+    unsigned length = slot->cmd->size - slot->done;
+    int64_t offset = slot->offset + slot->done;
+
+    slot->busy = (backup)
+        ? ring.PrepareWrite(fd, buffer, length, offset, tag)
+        : ring.PrepareRead(fd, buffer, length, offset, tag);
+
+    return slot->busy;
+}
+
+// Collect finished requests, optionally waiting for at least one.
+// Partial transfers are resubmitted for the remainder.
+//
+int UringTransfer::Reap(bool wait)
+{
+    uint64_t tag;
+    int result;
+    int status;
+
+    status = ring.Submit(wait ? 1 : 0);
+    if (status != 0)
+    {
+        return status;
+    }
+
+    while (ring.GetCompletion(&tag, &result))
+    {
+        UringSlot* slot = &slots[tag];
+        slot->busy = false;
+
+        if (result < 0 || (result == 0 && slot->cmd->size > 0))
+        {
+            // assume a failed write is disk full, and a failed read is eof
+            slot->completionCode = (backup) ? ERROR_DISK_FULL : ERROR_HANDLE_EOF;
+            continue;
+        }
+
+        slot->done += (uint32_t)result;
+        if (slot->done < (uint32_t)slot->cmd->size)
+        {
+            if (!Issue(slot, tag))
+            {
+                return -EBUSY;
+            }
+        }
+        else
+        {
+            slot->completionCode = ERROR_SUCCESS;
+        }
+    }
+
+    return ring.Submit(0);
+}
+
+// Hand finished commands back to the server, oldest first.
+//
+int UringTransfer::Retire()
+{
+    while (count > 0 && !slots[head].busy)
+    {
+        UringSlot* slot = &slots[head];
+
+        // The command is the server's again once it is completed.
+        //
+        int commandCode = slot->cmd->commandCode;
+        uint32_t size = slot->cmd->size;
+        uint64_t processed = traceClock();
+        int status = vd->CompleteCommand(slot->cmd, slot->completionCode, slot->done, 0);
+        trace.Record(commandCode, size, slot->completionCode, slot->done, slot->requested,
+                     slot->received, processed);
+        if (status != 0)
+        {
+            printf("Completion Failed: x%X\n", status);
+            return status;
+        }
+
+        head = (head + 1) % depth;
+        count--;
+    }
+
+    return 0;
+}
+
+// Complete every outstanding command.
+//
+int UringTransfer::Drain()
+{
+    int status = 0;
+
+    while (count > 0 && status == 0)
+    {
+        status = Retire();
+        if (status == 0 && count > 0)
+        {
+            status = Reap(true);
+        }
+    }
+
+    return status;
+}
+
+int UringTransfer::Run()
+{
+    VDC_Command*   cmd;
+    int completionCode;
+    int status;
+    int64_t fileOffset = 0;
+
+    // Timeout in seconds
+    //
+    int timeout = 90;
+    for (;;)
+    {
+        status = Reap(false);
+        if (status == 0)
+        {
+            status = Retire();
+        }
+        if (status != 0)
+        {
+            break;
+        }
+
+        if (count == depth)
+        {
+            status = Reap(true);
+            if (status != 0)
+            {
+                break;
+            }
+            continue;
+        }
+
+        // While transfers are outstanding, only poll for the next command
+        // so that finished ones can be completed without delay.
+        //
+        uint64_t requested = traceClock();
+        status = vd->GetCommand((count > 0) ? 0 : timeout, &cmd);
+        if (status == VD_E_TIMEOUT && count > 0)
+        {
+            status = Reap(true);
+            if (status != 0)
+            {
+                break;
+            }
+            continue;
+        }
+        if (status != 0)
+        {
+            break;
+        }
+
+        uint64_t received = traceClock();
+
+        if (cmd->commandCode == VDC_Read || cmd->commandCode == VDC_Write)
+        {
+            unsigned index = (head + count) % depth;
+            UringSlot* slot = &slots[index];
+
+            slot->cmd = cmd;
+            slot->offset = fileOffset;
+            slot->requested = requested;
+            slot->received = received;
+            slot->done = 0;
+            slot->completionCode = ERROR_SUCCESS;
+            fileOffset += cmd->size;
+            count++;
+
+            if (cmd->size > 0 && !Issue(slot, index))
+            {
+                status = -EBUSY;
+                break;
+            }
+            status = ring.Submit(0);
+            if (status != 0)
+            {
+                break;
+            }
+            continue;
+        }
+
+        // Any other command is handled once everything received before
+        // it has been completed, so the server sees commands finish in
+        // the order it issued them.
+        //
+        status = Drain();
+        if (status != 0)
+        {
+            break;
+        }
+
+        switch (cmd->commandCode)
+        {
+        case VDC_Flush:
+            completionCode = (fdatasync(fd) == 0) ? ERROR_SUCCESS : ERROR_DISK_FULL;
+            break;
+
+        case VDC_ClearError:
+            completionCode = ERROR_SUCCESS;
+            break;
+
+        default:
+            // If command is unknown...
+            completionCode = ERROR_NOT_SUPPORTED;
+        }
+
+        int commandCode = cmd->commandCode;
+        uint32_t size = cmd->size;
+        uint64_t processed = traceClock();
+        status = vd->CompleteCommand(cmd, completionCode, 0, 0);
+        trace.Record(commandCode, size, completionCode, 0, requested, received, processed);
+        if (status != 0)
+        {
+            printf("Completion Failed: x%X\n", status);
+            break;
+        }
+    }
+
+    // The kernel may still be using server buffers if the loop ended
+    // early. Wait for those requests before letting the buffers go.
+    //
+    for (unsigned ix = 0; ix < count; ix++)
+    {
+        while (slots[(head + ix) % depth].busy && Reap(true) == 0)
+        {
+        }
+    }
+
+    return status;
+}
+
+// This routine reads commands from the server until a 'Close' status is received.
+//
+int performUringTransfer(
+    ClientVirtualDevice* vd,
+    int                  streamId,
+    int                  backup,
+    const char*          fname,
+    unsigned             depth)
+{
+    int fd;
+    int status;
+    int termCode = -1;
+
+    fd = open(fname, (backup) ? (O_WRONLY | O_CREAT | O_TRUNC) : O_RDONLY, 0666);
+    if (fd < 0)
+    {
+        printf("Failed to open: %s\n", fname);
+        return -1;
+    }
+
+    CommandTrace trace(streamId);
+    UringTransfer transfer(vd, trace, backup, fd, depth);
+
+    status = transfer.Init();
+    if (status != 0)
+    {
+        printf("io_uring setup fails: %s\n", strerror(-status));
+        close(fd);
+        return -1;
+    }
+
+    status = transfer.Run();
+
+    if (status != VD_E_CLOSE)
+    {
+        printf("Unexpected termination: x%X\n", status);
+    }
+    else
+    {
+        // As far as the data transfer is concerned, no
+        // errors occurred.  The code which issues the SQL
+        // must determine if the backup/restore was
+        // really successful.
+        //
+        printf("Successfully completed data transfer.\n");
+        termCode = 0;
+    }
+
+    close(fd);
+
+    trace.Finish(termCode != 0);
+
+    return termCode;
+}
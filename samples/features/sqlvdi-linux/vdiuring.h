@@ -0,0 +1,124 @@
+//*********************************************************************
+//                 Copyright (C) Microsoft Corporation.
+//
+// @File: vdiuring.h
+//
+// Purpose:
+//   A minimal io_uring submission/completion queue used by the
+//   vdipipesample transfer loop to keep several VDI commands in
+//   flight on a single virtual device.
+//
+// Notes:
+//   The queue talks to the kernel directly through the io_uring system
+//   calls so that the sample does not need liburing to build.
+//   Requires a Linux 5.6 or later kernel.
+//
+//*********************************************************************
+#ifndef VDIURING_H_
+#define VDIURING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vdi.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+//----------------------------------------------------------------------------
+// NAME: UringQueue
+//
+// PURPOSE:
+//
+// Own one io_uring instance. Requests are queued with the Prepare* methods,
+// handed to the kernel with Submit() and reaped with GetCompletion().
+// Every request carries a caller supplied 64 bit tag which is returned
+// with its completion.
+//
+class UringQueue
+{
+public:
+    UringQueue();
+    ~UringQueue();
+
+    // Create the ring. Returns 0 or a negative errno value.
+    //
+    int
+    Init(
+        unsigned entries);
+
+    bool
+    PrepareRead(
+        int      fd,
+        void*    buffer,
+        unsigned length,
+        int64_t  offset,
+        uint64_t tag);
+
+    bool
+    PrepareWrite(
+        int         fd,
+        const void* buffer,
+        unsigned    length,
+        int64_t     offset,
+        uint64_t    tag);
+
+    bool
+    PrepareFsync(
+        int      fd,
+        uint64_t tag);
+
+    // Submit all prepared requests, optionally waiting until at least
+    // 'waitFor' completions are available.
+    // Returns 0 or a negative errno value.
+    //
+    int
+    Submit(
+        unsigned waitFor);
+
+    // Fetch one completion. Returns false if none is ready.
+    //
+    bool
+    GetCompletion(
+        uint64_t* tag,
+        int*      result);
+
+private:
+    io_uring_sqe*
+    GetSqe();
+
+    int             ringFd;
+    void*           sqRing;
+    size_t          sqRingSize;
+    void*           cqRing;
+    size_t          cqRingSize;
+    io_uring_sqe*   sqes;
+    size_t          sqesSize;
+
+    unsigned*       sqHead;
+    unsigned*       sqTail;
+    unsigned*       sqMask;
+    unsigned*       sqArray;
+    unsigned        sqEntries;
+    unsigned        sqPending;
+
+    unsigned*       cqHead;
+    unsigned*       cqTail;
+    unsigned*       cqMask;
+    io_uring_cqe*   cqes;
+};
+
+// Service a virtual device with up to 'depth' read or write commands
+// outstanding at once. Commands are completed in the order they were
+// received. 'streamId' identifies the device in the command trace.
+//
+// Returns 0, if no errors are detected, else non-zero.
+//
+int performUringTransfer(
+    ClientVirtualDevice* vd,
+    int                  streamId,
+    int                  backup,
+    const char*          fname,
+    unsigned             depth);
+
+#endif
@@ -0,0 +1,314 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vdiverify.cpp
+//
+// Offline verifier for backups written by vdipipesample --checksum.
+//
+// Checks backup files against their block manifests, 'file.crc', without
+// SQL Server, so that verification can run on a separate host. The files,
+// for example the files of the streams of one backup, are memory mapped
+// and cut into segments of VERIFY_SEGMENT_BLOCKS blocks; all the segments
+// of all the files are shared by a pool of threads, each of which asks the
+// kernel to read its segment ahead, checks the CRC32C of every block, and
+// drops the segment from the page cache when it is done. One line is
+// printed per file, followed by the ranges of corrupt blocks:
+//
+//  pubs.bak: ok, 16384 blocks
+//  pubs.bak.1: 2 corrupt blocks
+//    bytes 4980736-5111807 (blocks 76-77)
+//
+// The manifest holds the CRCs of the data exchanged with the server, so
+// only backups written without --compress, --delta-base, --dedup,
+// --encrypt, --stripe or --volume-size can be verified here; those are
+// verified by a restore with --checksum.
+//
+// The exit code is 0 if every file is intact, 1 otherwise.
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "vdicrc.h"
+
+using namespace std;
+
+// Blocks per unit of work: 16 MB with 64 KB blocks.
+//
+#define VERIFY_SEGMENT_BLOCKS   256
+
+// A backup file being verified.
+//
+struct VerifyFile
+{
+    string              name;
+    int                 fd;
+    const uint8_t*      data;
+    uint64_t            length;
+    vector<uint32_t>    crcs;
+    bool                usable;     // opened, mapped and matching its manifest
+    vector<uint64_t>    badBlocks;  // filled by the threads, under badBlocksLock
+};
+
+// One segment of one file.
+//
+struct Segment
+{
+    size_t      file;
+    uint64_t    firstBlock;
+};
+
+static mutex badBlocksLock;
+
+static bool openFile(VerifyFile* file)
+{
+    uint64_t length;
+
+    file->fd = -1;
+    file->data = NULL;
+    file->usable = false;
+
+    if (!loadManifest(file->name.c_str(), &file->crcs, &length))
+    {
+        return false;
+    }
+
+    struct stat st;
+    file->fd = open(file->name.c_str(), O_RDONLY);
+    if (file->fd < 0 || fstat(file->fd, &st) != 0)
+    {
+        printf("Failed to open: %s\n", file->name.c_str());
+        return false;
+    }
+
+    if ((uint64_t)st.st_size != length)
+    {
+        printf("%s: %llu bytes, the manifest lists %llu; a backup written with --compress, "
+               "--delta-base, --dedup, --encrypt, --stripe or --volume-size is verified by restoring it "
+               "with --checksum\n",
+               file->name.c_str(), (unsigned long long)st.st_size, (unsigned long long)length);
+        return false;
+    }
+
+    file->length = length;
+    if (length > 0)
+    {
+        void* map = mmap(NULL, length, PROT_READ, MAP_SHARED, file->fd, 0);
+        if (map == MAP_FAILED)
+        {
+            printf("Failed to map: %s\n", file->name.c_str());
+            return false;
+        }
+        madvise(map, length, MADV_SEQUENTIAL);
+        file->data = (const uint8_t*)map;
+    }
+
+    file->usable = true;
+    return true;
+}
+
+static void verifyThread(vector<VerifyFile>* files, const vector<Segment>* segments,
+                         atomic<size_t>* nextSegment)
+{
+    for (;;)
+    {
+        size_t ix = (*nextSegment)++;
+        if (ix >= segments->size())
+        {
+            break;
+        }
+
+        VerifyFile& file = (*files)[(*segments)[ix].file];
+        uint64_t first = (*segments)[ix].firstBlock;
+        uint64_t start = first * CRC_BLOCK_SIZE;
+        uint64_t end = min(file.length, start + (uint64_t)VERIFY_SEGMENT_BLOCKS * CRC_BLOCK_SIZE);
+        vector<uint64_t> bad;
+
+        madvise((void*)(file.data + start), end - start, MADV_WILLNEED);
+
+        for (uint64_t offset = start, block = first; offset < end;
+             offset += CRC_BLOCK_SIZE, block++)
+        {
+            size_t length = (size_t)min((uint64_t)CRC_BLOCK_SIZE, end - offset);
+            if (crc32c(0, file.data + offset, length) != file.crcs[block])
+            {
+                bad.push_back(block);
+            }
+        }
+
+        // The backup is only read once; leave the page cache to others.
+        //
+        posix_fadvise(file.fd, start, end - start, POSIX_FADV_DONTNEED);
+
+        if (!bad.empty())
+        {
+            lock_guard<mutex> guard(badBlocksLock);
+            file.badBlocks.insert(file.badBlocks.end(), bad.begin(), bad.end());
+        }
+    }
+}
+
+// Print the corrupt blocks of 'file' as ranges of consecutive blocks.
+//
+static void printRanges(VerifyFile* file)
+{
+    vector<uint64_t>& bad = file->badBlocks;
+
+    sort(bad.begin(), bad.end());
+    for (size_t ix = 0; ix < bad.size();)
+    {
+        size_t last = ix;
+        while (last + 1 < bad.size() && bad[last + 1] == bad[last] + 1)
+        {
+            last++;
+        }
+
+        uint64_t start = bad[ix] * CRC_BLOCK_SIZE;
+        uint64_t end = min(file->length, (bad[last] + 1) * CRC_BLOCK_SIZE) - 1;
+        printf("  bytes %llu-%llu (blocks %llu-%llu)\n",
+               (unsigned long long)start, (unsigned long long)end,
+               (unsigned long long)bad[ix], (unsigned long long)bad[last]);
+        ix = last + 1;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int nThreads = (int)thread::hardware_concurrency();
+    bool badParm = false;
+
+    static const struct option longOptions[] =
+    {
+        { "threads", required_argument, NULL, 't' },
+        { NULL,      0,                 NULL, 0   }
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", longOptions, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            nThreads = atoi(optarg);
+            badParm = badParm || nThreads < 1 || nThreads > 256;
+            break;
+
+        default:
+            badParm = true;
+        }
+    }
+
+    if (badParm || optind == argc)
+    {
+        printf("usage: vdiverify [--threads=N] <file>...\n"
+               "Verify backup files written with vdipipesample --checksum against their manifests\n");
+        return 1;
+    }
+    if (nThreads < 1)
+    {
+        nThreads = 1;
+    }
+
+    // Manifests are skipped, so that 'pubs.bak*' names the files of all
+    // the streams of a backup.
+    //
+    vector<VerifyFile> files;
+    for (int ix = optind; ix < argc; ix++)
+    {
+        string name = argv[ix];
+        size_t suffix = strlen(CRC_MANIFEST_SUFFIX);
+        if (name.size() <= suffix ||
+            name.compare(name.size() - suffix, suffix, CRC_MANIFEST_SUFFIX) != 0)
+        {
+            files.push_back(VerifyFile());
+            files.back().name = name;
+        }
+    }
+
+    vector<Segment> segments;
+    uint64_t totalBytes = 0;
+
+    for (size_t ix = 0; ix < files.size(); ix++)
+    {
+        if (!openFile(&files[ix]))
+        {
+            continue;
+        }
+
+        totalBytes += files[ix].length;
+        for (uint64_t block = 0; block < files[ix].crcs.size(); block += VERIFY_SEGMENT_BLOCKS)
+        {
+            Segment segment = { ix, block };
+            segments.push_back(segment);
+        }
+    }
+
+    auto start = chrono::steady_clock::now();
+    atomic<size_t> nextSegment(0);
+    vector<thread> threads;
+    for (int ix = 0; ix < nThreads; ix++)
+    {
+        threads.push_back(thread(verifyThread, &files, &segments, &nextSegment));
+    }
+    for (size_t ix = 0; ix < threads.size(); ix++)
+    {
+        threads[ix].join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    int failed = 0;
+    for (size_t ix = 0; ix < files.size(); ix++)
+    {
+        VerifyFile& file = files[ix];
+        if (!file.usable)
+        {
+            failed++;
+        }
+        else if (file.badBlocks.empty())
+        {
+            printf("%s: ok, %llu blocks\n", file.name.c_str(), (unsigned long long)file.crcs.size());
+        }
+        else
+        {
+            printf("%s: %llu corrupt blocks\n", file.name.c_str(),
+                   (unsigned long long)file.badBlocks.size());
+            printRanges(&file);
+            failed++;
+        }
+
+        if (file.data != NULL)
+        {
+            munmap((void*)file.data, file.length);
+        }
+        if (file.fd >= 0)
+        {
+            close(file.fd);
+        }
+    }
+
+    printf("Verified %zu files, %.1f MB in %.2f s (%.2f GB/s) on %d threads, %d failed\n",
+           files.size(), totalBytes / 1048576.0, seconds,
+           (seconds > 0) ? totalBytes / seconds / 1e9 : 0.0, nThreads, failed);
+
+    return (failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,972 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vdivolume.cpp
+//
+// Backups split into volumes of a fixed size.
+//
+// The data of a stream is written to numbered volume files of the same
+// size, all but the last one full: 'dir/file' becomes 'dir/file.vol0000',
+// 'dir/file.vol0001' and so on. The volumes are written by a small pool of
+// writer threads, so that a full volume is flushed and closed while the
+// next one is already being written. Every volume is durable before it is
+// listed in the manifest, which the backup file itself holds, so a volume
+// can be shipped as soon as it appears there:
+//
+//  header  VOLUME_MAGIC, u32 version, u32 zero, u64 volume size
+//  entries for every volume, in the order they were closed: u32 volume
+//          number, u32 CRC32C of the volume, u64 length, u32 length and
+//          the file name of the volume
+//  trailer VOLUME_END_MAGIC, u32 volume count, u32 zero, u64 length of
+//          the data, once the backup is complete
+//
+// All integers are little endian. On restore, the next volume is opened,
+// and read ahead if buffered, while the current one is read, and every
+// volume is checked against its CRC when it has been read.
+//
+
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "vdi.h"      // completion codes
+#include "vdicrc.h"
+#include "vdile.h"
+#include "vdimedia.h"
+
+using namespace std;
+
+#define VOLUME_MAGIC        "VDIVOLUM"
+#define VOLUME_END_MAGIC    "VDIVOLND"
+#define VOLUME_VERSION      1
+#define VOLUME_HEADER_SIZE  24
+#define VOLUME_TRAILER_SIZE 24
+#define VOLUME_MAX          100000
+
+// Threads writing and closing volumes.
+//
+#define VOLUME_WRITERS      2
+
+// Most data queued and not yet written.
+//
+#define VOLUME_QUEUE_SIZE   (256 * 1024 * 1024)
+
+// Read ahead at the start of the next volume on restore.
+//
+#define VOLUME_PREFETCH     (16 * 1024 * 1024)
+
+// The file name of volume 'volume' of the backup file 'base'.
+//
+static string volumeName(const string& base, uint32_t volume)
+{
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), ".vol%04u", volume);
+    return base + suffix;
+}
+
+// A buffer of backup data queued to a volume.
+//
+struct VolumeBlock
+{
+    vector<uint8_t> data;
+    uint32_t        length;
+};
+
+// A volume being written. Write() queues its blocks; one writer thread
+// opens it, writes the blocks in order, and closes it once it is complete.
+//
+struct Volume
+{
+    uint32_t                number;
+    string                  name;       // file name, without the directory
+    BackupMedia*            media;
+    deque<VolumeBlock*>     blocks;
+    uint64_t                length;     // bytes queued so far
+    uint32_t                crc;
+    bool                    complete;   // no more data will be queued
+    bool                    claimed;    // by a writer thread
+    bool                    busy;       // the writer is opening it or writing a block
+};
+
+//----------------------------------------------------------------------------
+// NAME: VolumeWriteMedia
+//
+// PURPOSE:
+//
+// Cut the backup data into volumes. Write() queues the data to the volume
+// being filled, starting a new one when it is full; the writer threads
+// each take the oldest volume nobody writes yet. Flush() waits for all the
+// volumes before the current one to be closed, and flushes that one.
+//
+class VolumeWriteMedia : public BackupMedia
+{
+public:
+    VolumeWriteMedia(FILE* manifest, const string& fname, uint64_t volumeSize, bool directIO,
+                     bool preallocate, uint64_t writeback)
+        : manifest(manifest), fname(fname), volumeSize(volumeSize), directIO(directIO),
+          preallocate(preallocate), writeback(writeback), current(NULL), nVolumes(0),
+          closedVolumes(0), queued(0), length(0), closing(false), error(ERROR_SUCCESS)
+    {
+        size_t slash = fname.rfind('/');
+        dir = (slash == string::npos) ? "" : fname.substr(0, slash + 1);
+        base = fname.substr(dir.size());
+        for (int ix = 0; ix < VOLUME_WRITERS; ix++)
+        {
+            writers.push_back(thread(&VolumeWriteMedia::WriterThread, this));
+        }
+    }
+
+    ~VolumeWriteMedia()
+    {
+        if (!writers.empty())
+        {
+            Stop();
+        }
+        if (manifest != NULL)
+        {
+            fclose(manifest);
+        }
+        for (size_t ix = 0; ix < volumes.size(); ix++)
+        {
+            if (volumes[ix]->media != NULL)
+            {
+                volumes[ix]->media->Close();
+                delete volumes[ix]->media;
+            }
+            for (size_t block = 0; block < volumes[ix]->blocks.size(); block++)
+            {
+                delete volumes[ix]->blocks[block];
+            }
+            delete volumes[ix];
+        }
+        for (size_t ix = 0; ix < spare.size(); ix++)
+        {
+            delete spare[ix];
+        }
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred)
+    {
+        *bytesTransferred = 0;
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred);
+
+    int
+    Flush();
+
+    int
+    Close();
+
+private:
+    void
+    WriterThread();
+
+    int
+    WriteVolume(
+        unique_lock<mutex>& guard,
+        Volume*             volume);
+
+    Volume*
+    NewVolume();
+
+    void
+    Stop();
+
+    FILE*                   manifest;
+    string                  fname;
+    string                  dir;
+    string                  base;
+    uint64_t                volumeSize;
+    bool                    directIO;
+    bool                    preallocate;
+    uint64_t                writeback;
+
+    mutex                   lock;
+    condition_variable      blockReady; // data, or a complete volume, waits for a writer
+    condition_variable      blockDone;  // a writer wrote a block or closed a volume
+    deque<Volume*>          volumes;    // not closed yet, oldest first
+    vector<VolumeBlock*>    spare;
+    vector<thread>          writers;
+    Volume*                 current;    // being filled by Write()
+    uint32_t                nVolumes;
+    uint32_t                closedVolumes;
+    uint64_t                queued;     // bytes in the queues of the volumes
+    uint64_t                length;
+    bool                    closing;
+    int                     error;
+};
+
+// Start the next volume. Called with the lock held.
+//
+Volume* VolumeWriteMedia::NewVolume()
+{
+    Volume* volume = new Volume();
+    volume->number = nVolumes++;
+    volume->name = volumeName(base, volume->number);
+    volume->media = NULL;
+    volume->length = 0;
+    volume->crc = 0;
+    volume->complete = false;
+    volume->claimed = false;
+    volume->busy = false;
+    volumes.push_back(volume);
+    return volume;
+}
+
+int VolumeWriteMedia::Write(const uint8_t* buffer, uint32_t size, uint32_t* bytesTransferred)
+{
+    uint32_t done = 0;
+
+    *bytesTransferred = 0;
+
+    unique_lock<mutex> guard(lock);
+    while (done < size)
+    {
+        while (queued >= VOLUME_QUEUE_SIZE && error == ERROR_SUCCESS)
+        {
+            blockDone.wait(guard);
+        }
+        if (error != ERROR_SUCCESS)
+        {
+            return error;
+        }
+        if (nVolumes == VOLUME_MAX)
+        {
+            printf("Too many volumes for %s\n", fname.c_str());
+            error = ERROR_DISK_FULL;
+            return error;
+        }
+
+        if (current == NULL)
+        {
+            current = NewVolume();
+        }
+
+        uint32_t n = size - done;
+        if (n > volumeSize - current->length)
+        {
+            n = (uint32_t)(volumeSize - current->length);
+        }
+
+        VolumeBlock* block;
+        if (spare.empty())
+        {
+            block = new VolumeBlock();
+        }
+        else
+        {
+            block = spare.back();
+            spare.pop_back();
+        }
+
+        guard.unlock();
+        block->data.resize(n);
+        memcpy(&block->data[0], buffer + done, n);
+        block->length = n;
+        guard.lock();
+
+        current->blocks.push_back(block);
+        current->length += n;
+        queued += n;
+        length += n;
+        done += n;
+        if (current->length == volumeSize)
+        {
+            current->complete = true;
+            current = NULL;
+        }
+        blockReady.notify_all();
+    }
+
+    *bytesTransferred = size;
+    return ERROR_SUCCESS;
+}
+
+void VolumeWriteMedia::WriterThread()
+{
+    unique_lock<mutex> guard(lock);
+    for (;;)
+    {
+        // The oldest volume with data that no other writer has taken.
+        //
+        Volume* volume = NULL;
+        for (;;)
+        {
+            for (size_t ix = 0; ix < volumes.size() && volume == NULL; ix++)
+            {
+                if (!volumes[ix]->claimed &&
+                    (!volumes[ix]->blocks.empty() || volumes[ix]->complete))
+                {
+                    volume = volumes[ix];
+                }
+            }
+            if (volume != NULL || closing)
+            {
+                break;
+            }
+            blockReady.wait(guard);
+        }
+        if (volume == NULL)
+        {
+            break;
+        }
+
+        volume->claimed = true;
+        int completionCode = WriteVolume(guard, volume);
+        if (completionCode != ERROR_SUCCESS && error == ERROR_SUCCESS)
+        {
+            error = completionCode;
+        }
+
+        for (size_t ix = 0; ix < volumes.size(); ix++)
+        {
+            if (volumes[ix] == volume)
+            {
+                volumes.erase(volumes.begin() + ix);
+                break;
+            }
+        }
+        for (size_t ix = 0; ix < volume->blocks.size(); ix++)
+        {
+            queued -= volume->blocks[ix]->length;
+            spare.push_back(volume->blocks[ix]);
+        }
+        delete volume;
+        closedVolumes++;
+        blockDone.notify_all();
+    }
+}
+
+// Open 'volume', write its blocks as they come, and once it is complete
+// make it durable, close it and add it to the manifest. After a failure
+// the blocks are only dropped, until Write() or Close() is done with the
+// volume. Called, and returns, with the lock held.
+//
+int VolumeWriteMedia::WriteVolume(unique_lock<mutex>& guard, Volume* volume)
+{
+    string path = dir + volume->name;
+
+    volume->busy = true;
+    guard.unlock();
+    BackupMedia* media = (directIO) ? openDirectMedia(path.c_str(), true, DIRECT_IO_ALIGNMENT)
+                                    : openFdMedia(path.c_str(), true);
+    if (media != NULL && preallocate)
+    {
+        media = openPreallocateMedia(media, path.c_str(), volumeSize);
+    }
+    if (media != NULL && writeback > 0 && !directIO)
+    {
+        media = openWritebackMedia(media, path.c_str(), writeback);
+    }
+    guard.lock();
+    volume->media = media;
+    volume->busy = false;
+
+    int completionCode = ERROR_SUCCESS;
+    if (media == NULL)
+    {
+        completionCode = ERROR_DISK_FULL;
+        if (error == ERROR_SUCCESS)
+        {
+            error = completionCode;
+        }
+    }
+    blockDone.notify_all();
+
+    for (;;)
+    {
+        while (volume->blocks.empty() && !volume->complete && !closing)
+        {
+            blockReady.wait(guard);
+        }
+        if (volume->blocks.empty())
+        {
+            break;
+        }
+
+        VolumeBlock* block = volume->blocks.front();
+        volume->busy = true;
+        guard.unlock();
+        uint32_t bytes;
+        if (completionCode == ERROR_SUCCESS && error == ERROR_SUCCESS)
+        {
+            completionCode = media->Write(&block->data[0], block->length, &bytes);
+            volume->crc = crc32c(volume->crc, &block->data[0], block->length);
+        }
+        guard.lock();
+        volume->busy = false;
+        if (completionCode != ERROR_SUCCESS && error == ERROR_SUCCESS)
+        {
+            error = completionCode;
+        }
+
+        volume->blocks.pop_front();
+        queued -= block->length;
+        spare.push_back(block);
+        blockDone.notify_all();
+    }
+
+    if (media != NULL)
+    {
+        guard.unlock();
+        if (completionCode == ERROR_SUCCESS)
+        {
+            completionCode = media->Flush();
+        }
+        int closeCode = media->Close();
+        if (completionCode == ERROR_SUCCESS)
+        {
+            completionCode = closeCode;
+        }
+        guard.lock();
+        delete media;
+        volume->media = NULL;
+    }
+
+    // A volume is only listed once it is complete and durable.
+    //
+    if (completionCode == ERROR_SUCCESS && error == ERROR_SUCCESS)
+    {
+        vector<uint8_t> entry(20);
+        putLE32(&entry[0], volume->number);
+        putLE32(&entry[4], volume->crc);
+        putLE64(&entry[8], volume->length);
+        putLE32(&entry[16], (uint32_t)volume->name.size());
+        entry.insert(entry.end(), volume->name.begin(), volume->name.end());
+
+        if (fwrite(&entry[0], 1, entry.size(), manifest) != entry.size() ||
+            fflush(manifest) != 0 || fdatasync(fileno(manifest)) != 0)
+        {
+            printf("Failed to write the volume manifest: %s\n", fname.c_str());
+            completionCode = ERROR_DISK_FULL;
+        }
+    }
+    else if (completionCode != ERROR_SUCCESS)
+    {
+        printf("Failed to write volume %u: %s\n", volume->number, path.c_str());
+    }
+    return completionCode;
+}
+
+int VolumeWriteMedia::Flush()
+{
+    unique_lock<mutex> guard(lock);
+
+    // The volumes before the current one are durable once they are closed;
+    // the current one is flushed here, while its writer waits for data.
+    //
+    for (;;)
+    {
+        bool idle = volumes.empty() ||
+                    (volumes.size() == 1 && volumes[0] == current && current->blocks.empty() &&
+                     !current->busy && (current->media != NULL || current->length == 0));
+        if (idle || error != ERROR_SUCCESS)
+        {
+            break;
+        }
+        blockDone.wait(guard);
+    }
+    if (error == ERROR_SUCCESS && current != NULL && current->media != NULL)
+    {
+        BackupMedia* media = current->media;
+        guard.unlock();
+        int completionCode = media->Flush();
+        guard.lock();
+        if (completionCode != ERROR_SUCCESS && error == ERROR_SUCCESS)
+        {
+            error = completionCode;
+        }
+    }
+    return error;
+}
+
+void VolumeWriteMedia::Stop()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        closing = true;
+    }
+    blockReady.notify_all();
+    for (size_t ix = 0; ix < writers.size(); ix++)
+    {
+        writers[ix].join();
+    }
+    writers.clear();
+}
+
+int VolumeWriteMedia::Close()
+{
+    {
+        lock_guard<mutex> guard(lock);
+
+        // An empty backup still has one, empty, volume.
+        //
+        if (current == NULL && nVolumes == 0)
+        {
+            current = NewVolume();
+        }
+        if (current != NULL)
+        {
+            current->complete = true;
+            current = NULL;
+        }
+        blockReady.notify_all();
+    }
+
+    Stop();
+
+    int completionCode = error;
+    if (completionCode == ERROR_SUCCESS)
+    {
+        uint8_t trailer[VOLUME_TRAILER_SIZE];
+        memcpy(trailer, VOLUME_END_MAGIC, 8);
+        putLE32(trailer + 8, nVolumes);
+        putLE32(trailer + 12, 0);
+        putLE64(trailer + 16, length);
+        if (fwrite(trailer, 1, sizeof(trailer), manifest) != sizeof(trailer) ||
+            fflush(manifest) != 0 || fdatasync(fileno(manifest)) != 0)
+        {
+            printf("Failed to write the volume manifest: %s\n", fname.c_str());
+            completionCode = ERROR_DISK_FULL;
+        }
+    }
+    if (fclose(manifest) != 0 && completionCode == ERROR_SUCCESS)
+    {
+        completionCode = ERROR_DISK_FULL;
+    }
+    manifest = NULL;
+
+    printf("Volumes: %.1f MB in %u volumes of %.1f MB\n", length / 1048576.0, closedVolumes,
+           volumeSize / 1048576.0);
+
+    return completionCode;
+}
+
+// A volume listed in the manifest.
+//
+struct VolumeEntry
+{
+    string      path;
+    uint64_t    length;
+    uint32_t    crc;
+    bool        listed;
+};
+
+//----------------------------------------------------------------------------
+// NAME: VolumeReadMedia
+//
+// PURPOSE:
+//
+// Read the volumes in order. While one is read, an opener thread opens
+// the next one and asks the kernel to read its start, so that Read() does
+// not wait at the boundary.
+//
+class VolumeReadMedia : public BackupMedia
+{
+public:
+    VolumeReadMedia(vector<VolumeEntry>& entries, BackupMedia* first, bool directIO)
+        : directIO(directIO), media(first), next(NULL), volume(0), offset(0), crc(0),
+          error(ERROR_SUCCESS)
+    {
+        volumes.swap(entries);
+        StartOpener();
+    }
+
+    ~VolumeReadMedia()
+    {
+        if (opener.joinable())
+        {
+            opener.join();
+        }
+        if (media != NULL)
+        {
+            media->Close();
+            delete media;
+        }
+        if (next != NULL)
+        {
+            next->Close();
+            delete next;
+        }
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred);
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred)
+    {
+        *bytesTransferred = 0;
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    int
+    Flush()
+    {
+        return ERROR_SUCCESS;
+    }
+
+    int
+    Close();
+
+private:
+    void
+    StartOpener();
+
+    void
+    OpenerThread(
+        size_t ix);
+
+    bool
+    NextVolume();
+
+    vector<VolumeEntry>     volumes;
+    bool                    directIO;
+    BackupMedia*            media;      // volume 'volume'
+    BackupMedia*            next;       // volume 'volume' + 1, set by the opener
+    thread                  opener;
+    size_t                  volume;
+    uint64_t                offset;     // in the current volume
+    uint32_t                crc;
+    int                     error;
+};
+
+void VolumeReadMedia::StartOpener()
+{
+    if (volume + 1 < volumes.size())
+    {
+        opener = thread(&VolumeReadMedia::OpenerThread, this, volume + 1);
+    }
+}
+
+void VolumeReadMedia::OpenerThread(size_t ix)
+{
+    const char* path = volumes[ix].path.c_str();
+
+    if (!directIO)
+    {
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0)
+        {
+            posix_fadvise(fd, 0, VOLUME_PREFETCH, POSIX_FADV_WILLNEED);
+            close(fd);
+        }
+    }
+    next = (directIO) ? openDirectMedia(path, false, DIRECT_IO_ALIGNMENT)
+                      : openFdMedia(path, false);
+}
+
+// Check the volume just read and move on to the next one.
+//
+bool VolumeReadMedia::NextVolume()
+{
+    if (crc != volumes[volume].crc)
+    {
+        printf("Volume %zu (%s) is corrupt: CRC %08x, the manifest lists %08x\n", volume,
+               volumes[volume].path.c_str(), crc, volumes[volume].crc);
+        return false;
+    }
+
+    media->Close();
+    delete media;
+    media = NULL;
+
+    volume++;
+    offset = 0;
+    crc = 0;
+    if (volume == volumes.size())
+    {
+        return true;
+    }
+
+    opener.join();
+    media = next;
+    next = NULL;
+    if (media == NULL)
+    {
+        return false;
+    }
+    StartOpener();
+    return true;
+}
+
+int VolumeReadMedia::Read(uint8_t* buffer, uint32_t size, uint32_t* bytesTransferred)
+{
+    uint32_t done = 0;
+
+    *bytesTransferred = 0;
+    if (error != ERROR_SUCCESS)
+    {
+        return error;
+    }
+
+    while (done < size && volume < volumes.size())
+    {
+        uint64_t remaining = volumes[volume].length - offset;
+        if (remaining == 0)
+        {
+            if (!NextVolume())
+            {
+                error = ERROR_OPERATION_ABORTED;
+                break;
+            }
+            continue;
+        }
+
+        uint32_t n = size - done;
+        if (n > remaining)
+        {
+            n = (uint32_t)remaining;
+        }
+
+        uint32_t bytes = 0;
+        media->Read(buffer + done, n, &bytes);
+        crc = crc32c(crc, buffer + done, bytes);
+        offset += bytes;
+        done += bytes;
+        if (bytes != n)
+        {
+            printf("Volume %zu (%s) ends early, at byte %llu\n", volume,
+                   volumes[volume].path.c_str(), (unsigned long long)offset);
+            error = ERROR_OPERATION_ABORTED;
+            break;
+        }
+    }
+
+    // The last volume is checked as soon as it has been read.
+    //
+    if (error == ERROR_SUCCESS && volume + 1 == volumes.size() &&
+        offset == volumes[volume].length && !NextVolume())
+    {
+        error = ERROR_OPERATION_ABORTED;
+    }
+
+    *bytesTransferred = done;
+    if (error != ERROR_SUCCESS)
+    {
+        return error;
+    }
+    return (done == size) ? ERROR_SUCCESS : ERROR_HANDLE_EOF;
+}
+
+int VolumeReadMedia::Close()
+{
+    int completionCode = ERROR_SUCCESS;
+
+    if (opener.joinable())
+    {
+        opener.join();
+    }
+    if (media != NULL)
+    {
+        completionCode = media->Close();
+        delete media;
+        media = NULL;
+    }
+    if (next != NULL)
+    {
+        next->Close();
+        delete next;
+        next = NULL;
+    }
+    return completionCode;
+}
+
+static BackupMedia* openVolumeBackup(const char* fname, uint64_t volumeSize, bool directIO,
+                                     bool preallocate, uint64_t writeback)
+{
+    FILE* manifest = fopen(fname, "wb");
+    if (manifest == NULL)
+    {
+        printf("Failed to open: %s\n", fname);
+        return NULL;
+    }
+
+    uint8_t header[VOLUME_HEADER_SIZE];
+    memcpy(header, VOLUME_MAGIC, 8);
+    putLE32(header + 8, VOLUME_VERSION);
+    putLE32(header + 12, 0);
+    putLE64(header + 16, volumeSize);
+    if (fwrite(header, 1, sizeof(header), manifest) != sizeof(header) || fflush(manifest) != 0)
+    {
+        printf("Failed to write the volume manifest: %s\n", fname);
+        fclose(manifest);
+        return NULL;
+    }
+
+    return new VolumeWriteMedia(manifest, fname, volumeSize, directIO, preallocate, writeback);
+}
+
+static BackupMedia* openVolumeRestore(const char* fname, uint64_t volumeSize, bool directIO)
+{
+    FILE* manifest = fopen(fname, "rb");
+    if (manifest == NULL)
+    {
+        printf("Failed to open: %s\n", fname);
+        return NULL;
+    }
+
+    string name = fname;
+    size_t slash = name.rfind('/');
+    string dir = (slash == string::npos) ? "" : name.substr(0, slash + 1);
+
+    uint8_t header[VOLUME_HEADER_SIZE];
+    bool ok = fread(header, 1, sizeof(header), manifest) == sizeof(header) &&
+              memcmp(header, VOLUME_MAGIC, 8) == 0 &&
+              getLE32(header + 8) == VOLUME_VERSION;
+    if (!ok)
+    {
+        printf("%s is not a backup split into volumes\n", fname);
+    }
+    else if (getLE64(header + 16) != volumeSize)
+    {
+        printf("%s has volumes of %llu MB, %llu MB were given\n", fname,
+               (unsigned long long)(getLE64(header + 16) >> 20),
+               (unsigned long long)(volumeSize >> 20));
+        ok = false;
+    }
+    if (!ok)
+    {
+        fclose(manifest);
+        return NULL;
+    }
+
+    // The entries come in the order the volumes were closed; the trailer
+    // says how many there are.
+    //
+    vector<VolumeEntry> volumes;
+    uint64_t length = 0;
+    bool complete = false;
+    while (ok)
+    {
+        uint8_t entry[VOLUME_TRAILER_SIZE];
+        if (fread(entry, 1, 20, manifest) != 20)
+        {
+            break;
+        }
+        if (memcmp(entry, VOLUME_END_MAGIC, 8) == 0)
+        {
+            ok = fread(entry + 20, 1, 4, manifest) == 4 && getLE32(entry + 8) <= VOLUME_MAX;
+            if (ok)
+            {
+                volumes.resize(getLE32(entry + 8));
+                length = getLE64(entry + 16);
+                complete = true;
+            }
+            break;
+        }
+
+        uint32_t number = getLE32(entry);
+        uint32_t nameLength = getLE32(entry + 16);
+        ok = number < VOLUME_MAX && nameLength < 4096;
+        string volumeFile(ok ? nameLength : 0, '\0');
+        ok = ok && fread(&volumeFile[0], 1, nameLength, manifest) == nameLength;
+        if (ok)
+        {
+            if (number >= volumes.size())
+            {
+                volumes.resize(number + 1);
+            }
+            volumes[number].path = dir + volumeFile;
+            volumes[number].crc = getLE32(entry + 4);
+            volumes[number].length = getLE64(entry + 8);
+            volumes[number].listed = true;
+        }
+    }
+    fclose(manifest);
+
+    if (ok && !complete)
+    {
+        printf("The backup split into volumes %s was not completed\n", fname);
+        return NULL;
+    }
+
+    // Every volume is listed, and all but the last are full.
+    //
+    uint64_t total = 0;
+    for (size_t ix = 0; ix < volumes.size() && ok; ix++)
+    {
+        ok = volumes[ix].listed &&
+             (ix + 1 == volumes.size() || volumes[ix].length == volumeSize);
+        total += volumes[ix].length;
+    }
+    if (ok && (volumes.empty() || total != length))
+    {
+        ok = false;
+    }
+    if (!ok)
+    {
+        printf("The volume manifest is damaged: %s\n", fname);
+        return NULL;
+    }
+
+    for (size_t ix = 0; ix < volumes.size(); ix++)
+    {
+        struct stat st;
+        if (stat(volumes[ix].path.c_str(), &st) != 0)
+        {
+            printf("Failed to open volume %zu: %s\n", ix, volumes[ix].path.c_str());
+            return NULL;
+        }
+        if ((uint64_t)st.st_size != volumes[ix].length)
+        {
+            printf("Volume %zu (%s) holds %llu bytes, the manifest lists %llu\n", ix,
+                   volumes[ix].path.c_str(), (unsigned long long)st.st_size,
+                   (unsigned long long)volumes[ix].length);
+            return NULL;
+        }
+    }
+
+    BackupMedia* first = (directIO) ? openDirectMedia(volumes[0].path.c_str(), false,
+                                                      DIRECT_IO_ALIGNMENT)
+                                    : openFdMedia(volumes[0].path.c_str(), false);
+    if (first == NULL)
+    {
+        return NULL;
+    }
+    return new VolumeReadMedia(volumes, first, directIO);
+}
+
+BackupMedia* openVolumeMedia(
+    const char* fname,
+    int         backup,
+    uint64_t    volumeSize,
+    bool        directIO,
+    bool        preallocate,
+    uint64_t    writeback)
+{
+    return (backup) ? openVolumeBackup(fname, volumeSize, directIO, preallocate, writeback)
+                    : openVolumeRestore(fname, volumeSize, directIO);
+}
@@ -0,0 +1,193 @@
+/***********************************************************************
+   Copyright (c) Microsoft Corporation
+   All Rights Reserved.
+***********************************************************************/
+// This source code is an intended supplement to the Microsoft SQL
+// Server online references and related electronic documentation.
+//
+// This sample is for instructional purposes only.
+// Code contained herein is not intended to be used "as is" in real applications.
+//
+// vdiwriteback.cpp
+//
+// Progressive writeback of buffered backup files.
+//
+// Data written through the page cache stays dirty until the kernel decides
+// to write it, usually all at once when the dirty limits are reached or at
+// the final flush, stalling the backup and every other writer on the host
+// while it drains. Here the file is cut into windows of a fixed size: as
+// soon as a window has been written, its writeback is started with
+// sync_file_range(), and the window before it, whose writeback had time to
+// progress, is waited for and dropped from the page cache. At most two
+// windows are dirty or under writeback at a time, and the backup is
+// throttled smoothly by the device instead of by the flush.
+//
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "vdi.h"      // completion codes
+#include "vdimedia.h"
+
+using namespace std;
+
+//----------------------------------------------------------------------------
+// NAME: WritebackMedia
+//
+// PURPOSE:
+//
+// Write back the data written to 'target' one window of 'window' bytes
+// behind the write cursor, and drop it from the page cache once it is on
+// disk. 'fd' is a descriptor of the same file: sync_file_range() and
+// posix_fadvise() act on the page cache of the file, whatever descriptor
+// wrote the data.
+//
+class WritebackMedia : public BackupMedia
+{
+public:
+    WritebackMedia(BackupMedia* target, int fd, const char* fname, uint64_t window)
+        : target(target), fd(fd), fname(fname), window(window), written(0), started(0),
+          dropped(0), ranges(0), waitSeconds(0)
+    {
+    }
+
+    ~WritebackMedia()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        delete target;
+    }
+
+    int
+    Read(
+        uint8_t*  buffer,
+        uint32_t  size,
+        uint32_t* bytesTransferred)
+    {
+        *bytesTransferred = 0;
+        return ERROR_NOT_SUPPORTED;
+    }
+
+    int
+    Write(
+        const uint8_t* buffer,
+        uint32_t       size,
+        uint32_t*      bytesTransferred)
+    {
+        int completionCode = target->Write(buffer, size, bytesTransferred);
+        written += *bytesTransferred;
+
+        while (written - started >= window)
+        {
+            // Start the window just written, then finish the one before.
+            //
+            sync_file_range(fd, started, window, SYNC_FILE_RANGE_WRITE);
+            started += window;
+            ranges++;
+            Drop(started - window);
+        }
+        return completionCode;
+    }
+
+    int
+    Flush()
+    {
+        int completionCode = target->Flush();
+
+        // Everything written is on disk now.
+        //
+        if (completionCode == ERROR_SUCCESS)
+        {
+            posix_fadvise(fd, dropped, written - dropped, POSIX_FADV_DONTNEED);
+            dropped = started = written;
+        }
+        return completionCode;
+    }
+
+    int
+    Close();
+
+private:
+    // Wait for the writeback of the data before 'end' and drop it from the
+    // page cache.
+    //
+    void
+    Drop(
+        uint64_t end);
+
+    BackupMedia*    target;
+    int             fd;
+    string          fname;
+    uint64_t        window;
+    uint64_t        written;
+    uint64_t        started;        // writeback started up to here
+    uint64_t        dropped;        // written back and dropped up to here
+    uint64_t        ranges;
+    double          waitSeconds;    // spent waiting for writeback
+};
+
+void WritebackMedia::Drop(uint64_t end)
+{
+    if (end <= dropped)
+    {
+        return;
+    }
+
+    auto start = chrono::steady_clock::now();
+    sync_file_range(fd, dropped, end - dropped,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                    SYNC_FILE_RANGE_WAIT_AFTER);
+    waitSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    posix_fadvise(fd, dropped, end - dropped, POSIX_FADV_DONTNEED);
+    dropped = end;
+}
+
+int WritebackMedia::Close()
+{
+    // The target writes out what it still buffers, then the rest of the
+    // file is written back; a length of 0 reaches the end of the file.
+    //
+    int completionCode = target->Close();
+
+    auto start = chrono::steady_clock::now();
+    if (sync_file_range(fd, dropped, 0,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER) != 0)
+    {
+        printf("Failed to write back %s: %s\n", fname.c_str(), strerror(errno));
+    }
+    waitSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    posix_fadvise(fd, dropped, 0, POSIX_FADV_DONTNEED);
+
+    printf("Wrote back %s: %llu windows of %.1f MB, %.2f s waiting for the device\n",
+           fname.c_str(), (unsigned long long)ranges, window / 1048576.0, waitSeconds);
+
+    close(fd);
+    fd = -1;
+    return completionCode;
+}
+
+BackupMedia* openWritebackMedia(
+    BackupMedia* media,
+    const char*  fname,
+    uint64_t     window)
+{
+    int fd = open(fname, O_WRONLY);
+    if (fd < 0)
+    {
+        printf("Failed to open: %s\n", fname);
+        media->Close();
+        delete media;
+        return NULL;
+    }
+
+    return new WritebackMedia(media, fd, fname, window);
+}